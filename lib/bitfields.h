@@ -184,4 +184,24 @@ namespace Bit{
     p[0] = val & 0xFF;
   }
 
+  /// Appends val to out as a little-endian base 128 varint.
+  inline void putVarint(std::string &out, uint64_t val){
+    while (val >= 0x80){
+      out += (char)(0x80 | (val & 0x7F));
+      val >>= 7;
+    }
+    out += (char)val;
+  }
+
+  /// Reads a little-endian base 128 varint into val, advancing p. Returns false if the data ends first.
+  inline bool getVarint(const char *&p, const char *end, uint64_t &val){
+    val = 0;
+    for (unsigned int shift = 0; p < end && shift < 64; shift += 7){
+      uint8_t b = *(p++);
+      val |= (uint64_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)){return true;}
+    }
+    return false;
+  }
+
 }// namespace Bit
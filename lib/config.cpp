@@ -13,6 +13,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <vector>
 #include <dirent.h> //for getMyExec
 #include <errno.h>
 #include <fcntl.h>
@@ -580,6 +581,58 @@ bool Util::Config::serveCallbackSocket(std::function<void(Socket::Connection &,
   return true;
 }
 
+/// Like serveCallbackSocket, but first forks the given amount of acceptor processes that all accept
+/// connections on the same listening socket, spreading the accept load over multiple cores.
+/// The calling process does not accept connections itself, but restarts any acceptor that exits,
+/// until is_active becomes false. Falls back to serveCallbackSocket if acceptors is zero.
+/// Note: the callback is ran inside the acceptor processes, never in the calling process.
+/// This only saves the startup cost per connection: the callback is still expected to hand every
+/// connection to a process of its own, it does not multiplex connections within one process.
+bool Util::Config::servePreforkSocket(size_t acceptors, std::function<void(Socket::Connection &, Socket::Server &)> callback) {
+  if (!acceptors) { return serveCallbackSocket(callback); }
+  Socket::Server server_socket;
+  if (!setupServerSocket(server_socket)) { return false; }
+  std::vector<pid_t> pids(acceptors, 0);
+  while (is_active && server_socket.connected()) {
+    for (size_t i = 0; i < acceptors && is_active; ++i) {
+      if (pids[i] && Util::Procs::childRunning(pids[i])) { continue; }
+      if (pids[i]) { WARN_MSG("Acceptor %zu (PID %d) exited; restarting it", i, pids[i]); }
+      Util::Procs::fork_prepare();
+      pid_t pid = fork();
+      if (!pid) {
+        Util::Procs::fork_complete();
+        while (is_active && server_socket.connected()) {
+          Socket::Connection S = server_socket.accept();
+          if (S.connected()) {
+            callback(S, server_socket);
+          } else {
+            Util::sleep(10); // sleep 10ms
+          }
+        }
+        // Never shut down the listening socket here: the other acceptors are still using it
+        server_socket.drop();
+        exit(0);
+      }
+      Util::Procs::fork_complete();
+      if (pid < 0) {
+        FAIL_MSG("Could not fork acceptor process: %s", strerror(errno));
+        pids[i] = 0;
+        continue;
+      }
+      HIGH_MSG("Started acceptor %zu with PID %d", i, pid);
+      pids[i] = pid;
+    }
+    Util::sleep(1000);
+  }
+  for (size_t i = 0; i < acceptors; ++i) {
+    if (pids[i]) { Util::Procs::Stop(pids[i]); }
+  }
+  Util::Procs::socketList.erase(server_socket.getSocket());
+  if (!is_restarting) { server_socket.close(); }
+  serv_sock_fd = -1;
+  return true;
+}
+
 /// Activated the stored config. This will:
 /// - Drop permissions to the stored "username", if any.
 /// - Set is_active to true.
@@ -758,6 +811,13 @@ void Util::Config::addConnectorOptions(int port, JSON::Value &capabilities){
   capabilities["optional"]["interface"]["short"] = "i";
   capabilities["optional"]["interface"]["type"] = "str";
 
+  capabilities["optional"]["acceptors"]["name"] = "Pre-forked acceptors";
+  capabilities["optional"]["acceptors"]["help"] = "Amount of pre-forked processes that accept connections. Every connection still gets a process of its own, but it is forked from an already initialized acceptor instead of being started fresh, saving the startup cost per connection. Zero starts a fresh process for every connection.";
+  capabilities["optional"]["acceptors"]["type"] = "uint";
+  capabilities["optional"]["acceptors"]["short"] = "E";
+  capabilities["optional"]["acceptors"]["option"] = "--acceptors";
+  capabilities["optional"]["acceptors"]["default"] = (int64_t)0;
+
   addBasicConnectorOptions(capabilities);
 }// addConnectorOptions
 
@@ -64,6 +64,7 @@ namespace Util{
     bool setupServerSocket(Socket::Server & s);
     bool serveThreadedSocket(int (*callback)(Socket::Connection &));
     bool serveCallbackSocket(std::function<void(Socket::Connection &, Socket::Server &)> callback);
+    bool servePreforkSocket(size_t acceptors, std::function<void(Socket::Connection &, Socket::Server &)> callback);
     Socket::Address boundServer;
     void addOptionsFromCapabilities(const JSON::Value &capabilities);
     void addBasicConnectorOptions(JSON::Value &capabilities);
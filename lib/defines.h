@@ -177,8 +177,8 @@ static inline void show_stackframe(){}
 #define META_TRACK_OFFSET 148
 #define META_TRACK_RECORDSIZE 1897
 
-#define TRACK_TRACK_OFFSET 207
-#define TRACK_TRACK_RECORDSIZE 1049070
+#define TRACK_TRACK_OFFSET 217
+#define TRACK_TRACK_RECORDSIZE 1049074
 
 #define TRACK_FRAGMENT_OFFSET 68
 #define TRACK_FRAGMENT_RECORDSIZE 14
@@ -211,6 +211,10 @@ static inline void show_stackframe(){}
 #define SEM_USERS "/MstSemUser%s" //%s stream name
 
 #define SHM_TRACK_DATA "/MstData%s@%zu_%" PRIu32 //%s stream name, %zu track ID, %PRIu32 page #
+#define SHM_SEGMENT_CACHE "/MstSegC%s@%" PRIu64 "_%08" PRIx32 //%s stream name, %PRIu64 segment start, %PRIx32 key checksum
+#define SEGMENT_CACHE_MAXSIZE 64 * 1024 * 1024
+#define SHM_LIVE_SEQ "/MstLSeq%s" //%s stream name
+#define SHM_LIVE_SEQ_LEN 64
 // End new meta
 
 #define SHM_PROXY_LIST_NAME "/MstUDPProxy%s" //%s address info
@@ -242,6 +246,9 @@ static inline void show_stackframe(){}
 #define JWK_DFLT_STREAM "*"
 
 #define SHM_TRIGGER "/MstTRGR%s" //%s trigger name
+#define SHM_TRIGGER_CACHE "/MstTrgCache"
+#define SHM_TRIGGER_CACHE_LEN 512 * 1024
+#define SEM_TRIGGER_CACHE "/MstSemTrgCache"
 #define SEM_LIVE "/MstSemLIVE%s"   //%s stream name
 #define SEM_INPUT "/MstSemInpt%s"  //%s stream name
 #define SEM_TRACKLIST "/MstSemTRKS%s"  //%s stream name
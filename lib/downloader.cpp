@@ -4,9 +4,19 @@
 #include "encode.h"
 #include "ev.h"
 #include "timing.h"
+#include <poll.h>
 
 static const std::string emptyString;
 
+/// Waits up to the given amount of milliseconds for data to arrive on the connection.
+/// Returns as soon as it does, so a response is picked up without a fixed polling delay.
+static void waitForData(Socket::Connection &conn, int ms){
+  struct pollfd pfd;
+  pfd.fd = conn.getSocket();
+  pfd.events = POLLIN;
+  if (pfd.fd < 0 || poll(&pfd, 1, ms) < 0){Util::sleep(ms);}
+}
+
 namespace HTTP{
 
   Downloader::Downloader(){
@@ -199,7 +209,7 @@ namespace HTTP{
             clean();
             return false;
           }
-          Util::sleep(25);
+          waitForData(getSocket(), 25);
           continue;
         }
         // Data! Check if we can parse it...
@@ -552,7 +562,7 @@ namespace HTTP{
             s.close();
             return false;
           }
-          Util::sleep(25);
+          waitForData(s, 25);
           continue;
         }
         if (!preresponse){preresponse = Util::getMicros();}
@@ -15,16 +15,21 @@
 #include "util.h"
 
 #include <arpa/inet.h> //for htonl/ntohl
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace DTSC{
   char Magic_Header[] = "DTSC";
   char Magic_Packet[] = "DTPD";
   char Magic_Packet2[] = "DTP2";
   char Magic_Command[] = "DTCM";
+  char Magic_Image[] = "DTSM";
 
   /// If non-zero, this variable will override any live jitter value calculations with the set value
   uint64_t veryUglyJitterOverride = 0;
@@ -981,6 +986,76 @@ namespace DTSC{
     }
   }
 
+  /// Metadata images (.dtsm files) are a raw copy of the shared memory metadata pages, so they can
+  /// be loaded without any parsing. Layout, all values in host byte order:
+  ///   4 bytes "DTSM" magic
+  ///   4 bytes DTSH_VERSION
+  ///   4 bytes DTSM_VERSION
+  ///   4 bytes track list record count
+  ///   4 bytes track list records present (N)
+  ///   4 bytes inputLocalVars length (L)
+  ///   8 bytes stream page length
+  ///   N * 16 bytes: per track, 8 bytes track page offset and 8 bytes track page length (0 = absent)
+  ///   L bytes inputLocalVars in JSON format
+  /// This is followed by the stream page and all track pages, each aligned to DTSM_BLOCK bytes.
+  /// All-zero blocks are left as holes in the file: unused page space takes no disk space, is never
+  /// read back, and is only faulted in once something actually writes to it.
+#define DTSM_HEADER 32
+#define DTSM_BLOCK 4096
+#define DTSM_ALIGN(x) (((x) + DTSM_BLOCK - 1) & ~((uint64_t)DTSM_BLOCK - 1))
+
+  /// Writes len bytes from data to fd at the given offset, skipping all-zero blocks.
+  static bool writeImageData(int fd, const char *data, uint64_t len, uint64_t offset){
+    static const char zeroes[DTSM_BLOCK] = {0};
+    uint64_t pos = 0;
+    while (pos < len){
+      uint64_t blk = std::min((uint64_t)DTSM_BLOCK, len - pos);
+      if (!memcmp(data + pos, zeroes, blk)){
+        pos += blk;
+        continue;
+      }
+      // Find the end of this run of non-zero blocks, and write it in one go
+      uint64_t end = pos + blk;
+      while (end < len){
+        blk = std::min((uint64_t)DTSM_BLOCK, len - end);
+        if (!memcmp(data + end, zeroes, blk)){break;}
+        end += blk;
+      }
+      while (pos < end){
+        ssize_t r = pwrite(fd, data + pos, end - pos, offset + pos);
+        if (r < 0 && errno == EINTR){continue;}
+        if (r <= 0){return false;}
+        pos += r;
+      }
+    }
+    return true;
+  }
+
+  /// Reads len bytes from fd at the given offset into the zero-filled buffer dest.
+  /// Holes in the file are skipped, leaving the matching parts of dest untouched.
+  static bool readImageData(int fd, char *dest, uint64_t len, uint64_t offset){
+    uint64_t pos = offset, end = offset + len;
+    while (pos < end){
+      off_t dataStart = lseek(fd, pos, SEEK_DATA);
+      if (dataStart < 0){
+        // No more data means the rest is a hole; any other error means holes are not supported
+        if (errno == ENXIO){return true;}
+        dataStart = pos;
+      }
+      if ((uint64_t)dataStart >= end){return true;}
+      off_t dataEnd = lseek(fd, dataStart, SEEK_HOLE);
+      if (dataEnd < 0 || (uint64_t)dataEnd > end){dataEnd = end;}
+      pos = dataStart;
+      while (pos < (uint64_t)dataEnd){
+        ssize_t r = pread(fd, dest + (pos - offset), dataEnd - pos, pos);
+        if (r < 0 && errno == EINTR){continue;}
+        if (r <= 0){return false;}
+        pos += r;
+      }
+    }
+    return true;
+  }
+
   /// Initialize metadata from referenced DTSC::Scan object in master mode.
   Meta::Meta(const std::string &_streamName, const DTSC::Scan &src){
     ignoredPid = 0;
@@ -1106,6 +1181,111 @@ namespace DTSC{
     trackList.setReady();
   }
 
+  /// Calls clear(), then initializes from the given metadata image file in master mode.
+  /// Only shared memory backed metadata can be loaded this way. Returns false if the image is
+  /// missing or does not match the current metadata layout, leaving this object cleared.
+  bool Meta::fromImage(const std::string &_streamName, const std::string &fileName){
+    clear();
+    if (!_streamName.size()){return false;}
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1){return false;}
+    struct stat st;
+    bool ret = !fstat(fd, &st) && loadImage(_streamName, fd, st.st_size);
+    ::close(fd);
+    if (!ret){
+      // Make sure partially loaded pages get removed again
+      for (std::map<size_t, IPC::sharedPage>::iterator it = tM.begin(); it != tM.end(); ++it){
+        it->second.master = true;
+      }
+      clear();
+    }
+    return ret;
+  }
+
+  /// Internal function that does the actual work for fromImage().
+  /// Track pages are read straight into their shared memory pages. The (small) stream page is read
+  /// into a local buffer first, so it can be made ready in one go once all track pages exist.
+  bool Meta::loadImage(const std::string &_streamName, int fd, uint64_t fileSize){
+    char hdr[DTSM_HEADER];
+    if (pread(fd, hdr, DTSM_HEADER, 0) != DTSM_HEADER || memcmp(hdr, Magic_Image, 4)){return false;}
+    uint32_t hVersion, iVersion, tCount, tPresent, lVarLen;
+    uint64_t sLen;
+    memcpy(&hVersion, hdr + 4, 4);
+    memcpy(&iVersion, hdr + 8, 4);
+    memcpy(&tCount, hdr + 12, 4);
+    memcpy(&tPresent, hdr + 16, 4);
+    memcpy(&lVarLen, hdr + 20, 4);
+    memcpy(&sLen, hdr + 24, 8);
+    if (hVersion != DTSH_VERSION || iVersion != DTSM_VERSION){
+      INFO_MSG("Ignoring metadata image with version %" PRIu32 ".%" PRIu32 ", expected %d.%d", hVersion,
+               iVersion, DTSH_VERSION, DTSM_VERSION);
+      return false;
+    }
+    uint64_t hdrLen = DTSM_HEADER + tPresent * 16 + lVarLen;
+    if (tPresent > tCount || DTSM_ALIGN(hdrLen) + sLen > fileSize){return false;}
+    Util::ResizeablePointer table;
+    if (!table.allocate(hdrLen - DTSM_HEADER + 1)){return false;}
+    if (pread(fd, (char *)table, hdrLen - DTSM_HEADER, DTSM_HEADER) != (ssize_t)(hdrLen - DTSM_HEADER)){
+      return false;
+    }
+
+    Util::ResizeablePointer sBuf;
+    if (!sBuf.allocate(sLen)){return false;}
+    memset((char *)sBuf, 0, sLen);
+    if (!readImageData(fd, sBuf, sLen, DTSM_ALIGN(hdrLen))){return false;}
+    Util::RelAccX sImg(sBuf, false);
+    if (!sImg.isReady() || !sImg.hasField("tracks")){return false;}
+    Util::RelAccX tImg(sImg.getPointer("tracks"), false);
+    if (!tImg.isReady() || tImg.getRCount() != tCount || tImg.getPresent() != tPresent){return false;}
+
+    sBufShm(_streamName, tCount, true);
+    if (!streamPage.mapped || streamPage.len != sLen){return false;}
+
+    char pageName[NAME_BUFFER_SIZE];
+    for (size_t i = 0; i < tPresent; ++i){
+      if (!tImg.getInt("valid", i)){continue;}
+      uint64_t tOffset, tLen;
+      memcpy(&tOffset, (char *)table + i * 16, 8);
+      memcpy(&tLen, (char *)table + i * 16 + 8, 8);
+      if (!tLen){
+        tImg.setInt("valid", 0, i);
+        continue;
+      }
+      if (tOffset + tLen > fileSize){return false;}
+      snprintf(pageName, NAME_BUFFER_SIZE, SHM_STREAM_TM, streamName.c_str(), getpid(), i);
+      IPC::sharedPage &p = tM[i];
+      p.init(pageName, tLen, true);
+      p.master = false;
+      if (!p.mapped || !readImageData(fd, p.mapped, tLen, tOffset)){return false;}
+      tImg.setString("page", pageName, i);
+      tImg.setInt("pid", getpid(), i);
+    }
+
+    // Publish the stream page, writing the status byte last so readers never see it half-done
+    memcpy(streamPage.mapped + 1, (char *)sBuf + 1, sLen - 1);
+    __sync_synchronize();
+    streamPage.mapped[0] = *(char *)sBuf;
+    stream = Util::RelAccX(streamPage.mapped, false);
+    streamTracksField = stream.getFieldData("tracks");
+    refresh();
+    updateFieldDataReferences();
+
+    version = DTSH_VERSION;
+    if (lVarLen){inputLocalVars = JSON::fromString((char *)table + tPresent * 16, lVarLen);}
+    if (getUTCOffset()){
+      setBootMsOffset(getUTCOffset() - Util::unixMS() + Util::bootMS());
+    }else{
+      int64_t nowMs = 0;
+      for (std::map<size_t, Track>::iterator it = tracks.begin(); it != tracks.end(); it++){
+        if (it->second.track.getInt(it->second.trackNowmsField) > nowMs){
+          nowMs = it->second.track.getInt(it->second.trackNowmsField);
+        }
+      }
+      setBootMsOffset(Util::bootMS() - nowMs);
+    }
+    return true;
+  }
+
   void Meta::addTrackFrom(const DTSC::Scan &trak){
     char *fragStor = 0;
     char *keyStor = 0;
@@ -1460,6 +1640,7 @@ namespace DTSC{
       t.trackFpksField = t.track.getFieldData("fpks");
       t.trackEfpksField = t.track.getFieldData("efpks");
       t.trackMissedFragsField = t.track.getFieldData("missedFrags");
+      t.trackRevisionField = t.track.getFieldData("revision");
 
       if (t.track.hasField("frames")){
         t.parts = Util::RelAccX();
@@ -1578,6 +1759,7 @@ namespace DTSC{
         t.trackFpksField = t.track.getFieldData("fpks");
         t.trackEfpksField = t.track.getFieldData("efpks");
         t.trackMissedFragsField = t.track.getFieldData("missedFrags");
+        t.trackRevisionField = t.track.getFieldData("revision");
 
         if (t.track.hasField("frames")){
           t.parts = Util::RelAccX();
@@ -1812,6 +1994,9 @@ namespace DTSC{
     t.track.setInt(t.trackFpksField, origAccess.getInt("fpks"));
     t.track.setInt(t.trackEfpksField, origAccess.getInt("efpks"));
     t.track.setInt(t.trackMissedFragsField, origAccess.getInt("missedFrags"));
+    if (origAccess.hasField("revision")){
+      t.track.setInt(t.trackRevisionField, origAccess.getInt("revision"));
+    }
 
     if (frameSize){
       Util::RelAccX origFrames(origAccess.getPointer("frames"));
@@ -2129,6 +2314,7 @@ namespace DTSC{
     t.track.addField("fpks", RAX_16UINT);
     t.track.addField("efpks", RAX_16UINT);
     t.track.addField("missedFrags", RAX_32UINT);
+    t.track.addField("revision", RAX_32UINT);
     if (!frameSize){
       t.track.addField("parts", RAX_NESTED, TRACK_PART_OFFSET + (TRACK_PART_RECORDSIZE * partCount));
       t.track.addField("keys", RAX_NESTED, TRACK_KEY_OFFSET + (TRACK_KEY_RECORDSIZE * keyCount));
@@ -2163,6 +2349,7 @@ namespace DTSC{
     t.trackFpksField = t.track.getFieldData("fpks");
     t.trackEfpksField = t.track.getFieldData("efpks");
     t.trackMissedFragsField = t.track.getFieldData("missedFrags");
+    t.trackRevisionField = t.track.getFieldData("revision");
 
 
     if (frameSize){
@@ -2283,6 +2470,7 @@ namespace DTSC{
     char *_init = t.track.getPointer(t.trackInitField);
     Bit::htobs(_init, initLen);
     memcpy(_init + 2, init, initLen);
+    markChanged(trackIdx);
   }
 
   /// Retrieves the given track's init data as std::string.
@@ -2300,6 +2488,7 @@ namespace DTSC{
     trackList.setInt(trackIdField, id, trackIdx);
     DTSC::Track &t = tracks.at(trackIdx);
     t.track.setInt(t.trackIdField, id);
+    markChanged(trackIdx);
   }
   size_t Meta::getID(size_t trackIdx) const{return trackList.getInt(trackIdField, trackIdx);}
 
@@ -2326,9 +2515,26 @@ namespace DTSC{
     return ret;
   }
 
+  /// Increases the track's revision counter. Called by all setters for properties that describe how
+  /// to interpret the track's data (type, codec, init data, etc), but not for per-packet updates.
+  void Meta::markChanged(size_t trackIdx){
+    DTSC::Track &t = tracks.at(trackIdx);
+    if (!t.trackRevisionField){return;}
+    t.track.setInt(t.trackRevisionField, t.track.getInt(t.trackRevisionField) + 1);
+  }
+
+  /// Returns the track's revision counter, which changes whenever the track's description does.
+  /// Tracks from metadata that predates the counter always return zero.
+  uint32_t Meta::getRevision(size_t trackIdx) const{
+    const DTSC::Track &t = tracks.at(trackIdx);
+    if (!t.trackRevisionField){return 0;}
+    return t.track.getInt(t.trackRevisionField);
+  }
+
   void Meta::setChannels(size_t trackIdx, uint16_t channels){
     DTSC::Track &t = tracks.at(trackIdx);
     t.track.setInt(t.trackChannelsField, channels);
+    markChanged(trackIdx);
   }
   uint16_t Meta::getChannels(size_t trackIdx) const{
     const DTSC::Track &t = tracks.at(trackIdx);
@@ -2338,6 +2544,7 @@ namespace DTSC{
   void Meta::setWidth(size_t trackIdx, uint32_t width){
     DTSC::Track &t = tracks.at(trackIdx);
     t.track.setInt(t.trackWidthField, width);
+    markChanged(trackIdx);
   }
   uint32_t Meta::getWidth(size_t trackIdx) const{
     const DTSC::Track &t = tracks.at(trackIdx);
@@ -2347,6 +2554,7 @@ namespace DTSC{
   void Meta::setHeight(size_t trackIdx, uint32_t height){
     DTSC::Track &t = tracks.at(trackIdx);
     t.track.setInt(t.trackHeightField, height);
+    markChanged(trackIdx);
   }
   uint32_t Meta::getHeight(size_t trackIdx) const{
     const DTSC::Track &t = tracks.at(trackIdx);
@@ -2356,6 +2564,7 @@ namespace DTSC{
   void Meta::setRate(size_t trackIdx, uint32_t rate){
     DTSC::Track &t = tracks.at(trackIdx);
     t.track.setInt(t.trackRateField, rate);
+    markChanged(trackIdx);
   }
   uint32_t Meta::getRate(size_t trackIdx) const{
     const DTSC::Track &t = tracks.at(trackIdx);
@@ -2365,6 +2574,7 @@ namespace DTSC{
   void Meta::setSize(size_t trackIdx, uint16_t size){
     DTSC::Track &t = tracks.at(trackIdx);
     t.track.setInt(t.trackSizeField, size);
+    markChanged(trackIdx);
   }
   uint16_t Meta::getSize(size_t trackIdx) const{
     const DTSC::Track &t = tracks.at(trackIdx);
@@ -2375,6 +2585,7 @@ namespace DTSC{
     trackList.setString(trackTypeField, type, trackIdx);
     DTSC::Track &t = tracks.at(trackIdx);
     t.track.setString(t.trackTypeField, type);
+    markChanged(trackIdx);
   }
   std::string Meta::getType(size_t trackIdx) const{
     return trackList.getPointer(trackTypeField, trackIdx);
@@ -2384,6 +2595,7 @@ namespace DTSC{
     trackList.setString(trackCodecField, codec, trackIdx);
     DTSC::Track &t = tracks.at(trackIdx);
     t.track.setString(t.trackCodecField, codec);
+    markChanged(trackIdx);
   }
   std::string Meta::getCodec(size_t trackIdx) const{
     return trackList.getPointer(trackCodecField, trackIdx);
@@ -3434,6 +3646,66 @@ namespace DTSC{
     }
   }
 
+  /// Writes the current shared memory backed Meta object as a metadata image to the given local file.
+  /// The image is written to a temporary file that is renamed when done, so that readers never see a
+  /// partially written image. See fromImage() for the reading side.
+  bool Meta::toImage(const std::string &fileName) const{
+    if (isMemBuf || !streamPage.mapped){return false;}
+    std::string lVars;
+    if (inputLocalVars.size()){lVars = inputLocalVars.toString();}
+    uint32_t tCount = trackList.getRCount();
+    uint32_t tPresent = trackList.getPresent();
+    uint32_t lVarLen = lVars.size();
+    uint64_t sLen = streamPage.len;
+    uint64_t hdrLen = DTSM_HEADER + tPresent * 16 + lVarLen;
+
+    Util::ResizeablePointer hdr;
+    hdr.append(Magic_Image, 4);
+    uint32_t hVersion = DTSH_VERSION, iVersion = DTSM_VERSION;
+    hdr.append((char *)&hVersion, 4);
+    hdr.append((char *)&iVersion, 4);
+    hdr.append((char *)&tCount, 4);
+    hdr.append((char *)&tPresent, 4);
+    hdr.append((char *)&lVarLen, 4);
+    hdr.append((char *)&sLen, 8);
+    uint64_t fileLen = DTSM_ALIGN(DTSM_ALIGN(hdrLen) + sLen);
+    for (size_t i = 0; i < tPresent; ++i){
+      uint64_t tOffset = 0, tLen = 0;
+      std::map<size_t, IPC::sharedPage>::const_iterator it = tM.find(i);
+      if (trackList.getInt(trackValidField, i) && it != tM.end() && it->second.mapped){
+        tOffset = fileLen;
+        tLen = it->second.len;
+        fileLen = DTSM_ALIGN(fileLen + tLen);
+      }
+      hdr.append((char *)&tOffset, 8);
+      hdr.append((char *)&tLen, 8);
+    }
+    hdr.append(lVars.data(), lVarLen);
+
+    std::string tmpName = fileName + ".tmp";
+    int fd = open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1){
+      WARN_MSG("Could not create metadata image %s: %s", tmpName.c_str(), strerror(errno));
+      return false;
+    }
+    bool ret = writeImageData(fd, (char *)hdr, hdr.size(), 0) &&
+               writeImageData(fd, streamPage.mapped, sLen, DTSM_ALIGN(hdrLen));
+    for (size_t i = 0; ret && i < tPresent; ++i){
+      uint64_t tOffset, tLen;
+      memcpy(&tOffset, (char *)hdr + DTSM_HEADER + i * 16, 8);
+      memcpy(&tLen, (char *)hdr + DTSM_HEADER + i * 16 + 8, 8);
+      if (tLen){ret = writeImageData(fd, tM.at(i).mapped, tLen, tOffset);}
+    }
+    if (ret && ftruncate(fd, fileLen)){ret = false;}
+    ::close(fd);
+    if (!ret || rename(tmpName.c_str(), fileName.c_str())){
+      WARN_MSG("Could not write metadata image %s: %s", fileName.c_str(), strerror(errno));
+      unlink(tmpName.c_str());
+      return false;
+    }
+    return true;
+  }
+
   /// Sends the current Meta object through a socket in DTSH format
   void Meta::send(Socket::Connection &conn, bool skipDynamic, std::set<size_t> selectedTracks, bool reID) const{
     std::string lVars;
@@ -39,6 +39,10 @@
 //  Version 4: renamed bps to maxbps (peak bit rate) and added new value bps (average bit rate)
 #define DTSH_VERSION 4
 
+// Increase this value every time the shared memory metadata layout changes in an incompatible way,
+// so that stale metadata images (.dtsm files) are ignored instead of loaded.
+#define DTSM_VERSION 2
+
 namespace DTSC{
 
   extern uint64_t veryUglyJitterOverride;
@@ -59,6 +63,7 @@ namespace DTSC{
   extern char Magic_Packet[];  ///< The magic bytes for a DTSC packet
   extern char Magic_Packet2[]; ///< The magic bytes for a DTSC packet version 2
   extern char Magic_Command[]; ///< The magic bytes for a DTCM packet
+  extern char Magic_Image[];   ///< The magic bytes for a DTSM metadata image
 
   enum packType{DTSC_INVALID, DTSC_HEAD, DTSC_V1, DTSC_V2, DTCM};
 
@@ -244,6 +249,7 @@ namespace DTSC{
     Util::RelAccXFieldData trackFpksField;
     Util::RelAccXFieldData trackEfpksField;
     Util::RelAccXFieldData trackMissedFragsField;
+    Util::RelAccXFieldData trackRevisionField;
 
     Util::RelAccXFieldData partSizeField;
     Util::RelAccXFieldData partDurationField;
@@ -349,6 +355,7 @@ namespace DTSC{
     void reInit(const std::string &_streamName, bool master = true, bool autoBackOff = true);
     void reInit(const std::string &_streamName, const std::string &fileName);
     void reInit(const std::string &_streamName, const DTSC::Scan &src);
+    bool fromImage(const std::string &_streamName, const std::string &fileName);
     void addTrackFrom(const DTSC::Scan &src);
 
     void refresh();
@@ -407,6 +414,9 @@ namespace DTSC{
     uint64_t getLastUpdated(size_t trackIdx) const;
     uint64_t getLastUpdated() const;
 
+    void markChanged(size_t trackIdx);
+    uint32_t getRevision(size_t trackIdx) const;
+
     void setChannels(size_t trackIdx, uint16_t channels);
     uint16_t getChannels(size_t trackIdx) const;
 
@@ -557,6 +567,7 @@ namespace DTSC{
 
     uint64_t getSendLen(bool skipDynamic = false, std::set<size_t> selectedTracks = std::set<size_t>()) const;
     void toFile(const std::string &uri) const;
+    bool toImage(const std::string &fileName) const;
     void send(Socket::Connection &conn, bool skypDynamic = false,
               std::set<size_t> selectedTracks = std::set<size_t>(), bool reID = false) const;
     void toJSON(JSON::Value &res, bool skipDynamic = true, bool tracksOnly = false) const;
@@ -582,6 +593,7 @@ namespace DTSC{
     void updateFieldDataReferences();
     void resizeTrackList(size_t newTrackCount);
     void preloadTrackFields();
+    bool loadImage(const std::string &_streamName, int fd, uint64_t fileSize);
 
     std::function<void(size_t trkIdx)> trackInvalidateCallback;
 
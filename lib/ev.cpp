@@ -2,11 +2,23 @@
 #include <string.h>
 #include <sys/select.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#ifdef HASEPOLL
+#include <sys/epoll.h>
+#define EV_SEND_MASK EPOLLOUT
+#else
+#define EV_SEND_MASK 0
+#endif
 #include "timing.h"
 #include <signal.h>
 #include "procs.h"
 #include "defines.h"
 
+#define EV_SEQ_SLICE 100 // max ms to sleep on a live sequence counter in a single await
+#define EV_STALE_CHECK 1000 // ms between checks for file descriptors closed without calling remove()
+
 bool handlerSet = false;
 bool continued = false;
 bool childready = false;
@@ -23,6 +35,14 @@ namespace Event{
 
   Loop::Loop() {
     timerCount = 0;
+    seqWait = 0;
+    seqSeen = 0;
+    epollFd = -1;
+    lastStaleCheck = 0;
+#ifdef HASEPOLL
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1) { FAIL_MSG("Could not create epoll instance: %s", strerror(errno)); }
+#endif
   }
 
   void Loop::setup(){
@@ -48,7 +68,102 @@ namespace Event{
     }
   }
 
+  /// Makes the next await call sleep on the given live sequence counter instead of a plain timer.
+  /// The await returns as soon as the counter moves away from seen, or after at most EV_SEQ_SLICE
+  /// milliseconds; socket events are only picked up after the sleep ends.
+  void Loop::awaitSequence(IPC::liveSequence & seq, uint32_t seen){
+    if (!seq){return;}
+    seqWait = &seq;
+    seqSeen = seen;
+  }
+
   Loop::~Loop(){
+    if (epollFd != -1) { close(epollFd); }
+  }
+
+  /// Brings the epoll registration of the given socket in line with the installed handlers.
+  /// Interest in reading is derived from the presence of a receive handler, interest in writing
+  /// is passed in since it depends on the result of the send handler's check function.
+  /// Does nothing when built without epoll support.
+  void Loop::epollUpdate(int sock, bool wantSend){
+#ifdef HASEPOLL
+    uint32_t mask = 0;
+    if (recvSockets.count(sock)) { mask |= EPOLLIN; }
+    if (wantSend) { mask |= EPOLLOUT; }
+    uint32_t curr = 0;
+    auto it = epollMasks.find(sock);
+    if (it != epollMasks.end()) { curr = it->second; }
+    if (mask == curr) { return; }
+    if (!mask) {
+      epollMasks.erase(sock);
+      if (!unpollable.erase(sock)) { epoll_ctl(epollFd, EPOLL_CTL_DEL, sock, 0); }
+      return;
+    }
+    epollMasks[sock] = mask;
+    if (unpollable.count(sock)) { return; }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = mask;
+    ev.data.fd = sock;
+    int r = epoll_ctl(epollFd, curr ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, sock, &ev);
+    // The socket may have been closed and re-opened under the same number behind our back
+    if (r && curr && errno == ENOENT) { r = epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &ev); }
+    if (r && !curr && errno == EEXIST) { r = epoll_ctl(epollFd, EPOLL_CTL_MOD, sock, &ev); }
+    if (!r) { return; }
+    if (errno == EPERM) {
+      // Regular files and the like cannot be polled, but select() considers them always ready
+      unpollable.insert(sock);
+      return;
+    }
+    if (errno == EBADF) {
+      WARN_MSG("File descriptor %d became invalid; removing from list", sock);
+    } else {
+      WARN_MSG("Could not add file descriptor %d to event loop: %s", sock, strerror(errno));
+    }
+    epollMasks.erase(sock);
+    recvSockets.erase(sock);
+    sendSockets.erase(sock);
+#endif
+  }
+
+  /// Returns true if the given registered file descriptor was closed without calling remove().
+  /// With epoll, the kernel silently drops a registration when its file is closed, so that is
+  /// checked for as well: it catches descriptors that were closed and re-opened under the same number.
+  bool Loop::isStale(int sock){
+#ifdef HASEPOLL
+    auto it = epollMasks.find(sock);
+    if (it != epollMasks.end() && !unpollable.count(sock)) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = it->second;
+      ev.data.fd = sock;
+      return epoll_ctl(epollFd, EPOLL_CTL_MOD, sock, &ev) && (errno == ENOENT || errno == EBADF);
+    }
+#endif
+    return fcntl(sock, F_GETFD) < 0;
+  }
+
+  /// Removes all handlers for a file descriptor that was closed without calling remove().
+  void Loop::dropStale(int sock, const char *reason){
+    size_t retVal = 0;
+    if (recvSockets.count(sock)) { retVal = recvSockets[sock].retVal; }
+    WARN_MSG("File descriptor %d (returning %zu) %s; removing from list", sock, retVal, reason);
+    recvSockets.erase(sock);
+    sendSockets.erase(sock);
+    epollMasks.erase(sock);
+    unpollable.erase(sock);
+  }
+
+  /// Checks all registered file descriptors with isStale, and drops the ones that are.
+  void Loop::dropAllStale(){
+    std::set<int> toErase;
+    for (auto & S : recvSockets) {
+      if (isStale(S.first)) { toErase.insert(S.first); }
+    }
+    for (auto & S : sendSockets) {
+      if (!toErase.count(S.first) && isStale(S.first)) { toErase.insert(S.first); }
+    }
+    for (auto & i : toErase) { dropStale(i, "became invalid"); }
   }
 
   /// Waits for up to maxMs milliseconds for an event to occur, returning the event ID.
@@ -67,6 +182,9 @@ namespace Event{
       continued = false;
       return std::string::npos;
     }
+    // Sleeping on a live sequence counter only applies to a single await call
+    IPC::liveSequence *seq = seqWait;
+    seqWait = 0;
     uint64_t startTime = Util::bootMS();
     while (timerTimes.size() && timerTimes.begin()->first <= startTime) {
       auto it = timerTimes.begin();
@@ -89,6 +207,24 @@ namespace Event{
       auto it = timerTimes.begin();
       if (maxMs > it->first - startTime) { maxMs = it->first - startTime; }
     }
+    // Collect the ready sockets first, and execute the callbacks afterwards.
+    // This is needed because callbacks could alter the sockets list.
+    std::vector<int> recvReady, sendReady;
+#ifdef HASEPOLL
+    // epoll does not report closed file descriptors like select does, so look for them now and then
+    if (startTime >= lastStaleCheck + EV_STALE_CHECK) {
+      lastStaleCheck = startTime;
+      dropAllStale();
+    }
+    // Only the send sockets need updating every loop, receive sockets are registered when added
+    {
+      std::vector<std::pair<int, bool> > sendWants;
+      sendWants.reserve(sendSockets.size());
+      for (auto & S : sendSockets) { sendWants.push_back({S.first, S.second.checkFunc(S.second.cbArg)}); }
+      for (auto & W : sendWants) { epollUpdate(W.first, W.second); }
+    }
+    if (!epollMasks.size()) {
+#else
     struct timeval timeout;
     int maxPlusOne = 0;
     fd_set rList, sList;
@@ -107,7 +243,12 @@ namespace Event{
       }
     }
     if (!maxPlusOne) {
-      Util::sleep(maxMs);
+#endif
+      if (seq) {
+        seq->wait(seqSeen, maxMs < EV_SEQ_SLICE ? maxMs : EV_SEQ_SLICE);
+      } else {
+        Util::sleep(maxMs);
+      }
       if (continued) {
         continued = false;
         return std::string::npos;
@@ -135,11 +276,54 @@ namespace Event{
       }
       if (nextPace < maxMs){maxMs = nextPace;}
     }
+    // When sleeping on a live sequence counter, do so first and then only check the sockets
+    bool pollOnly = false;
+    if (seq) {
+      seq->wait(seqSeen, maxMs < EV_SEQ_SLICE ? maxMs : EV_SEQ_SLICE);
+      pollOnly = true;
+    }
     int r = 0;
+#ifdef HASEPOLL
+    struct epoll_event events[256];
     do {
       uint64_t waitTime = Util::bootMS();
-      if (waitTime >= startTime + maxMs){return 0;}
-      waitTime = (startTime + maxMs) - waitTime;
+      if (!pollOnly && waitTime >= startTime + maxMs){return 0;}
+      waitTime = pollOnly ? 0 : (startTime + maxMs) - waitTime;
+      // Unpollable file descriptors are always ready, so never block when we have any
+      if (unpollable.size()) { waitTime = 0; }
+      r = epoll_wait(epollFd, events, 256, waitTime);
+      if (r < 1 && continued){
+        continued = false;
+        return std::string::npos;
+      }
+      if (childready) {
+        Util::Procs::reap();
+        childready = false;
+      }
+    } while (r < 0 && (errno == EINTR || errno == EAGAIN));
+    if (r < 0){
+      WARN_MSG("Event loop error: %s", strerror(errno));
+      return 0;
+    }
+    for (int i = 0; i < r; ++i) {
+      int fd = events[i].data.fd;
+      uint32_t evs = events[i].events;
+      auto it = epollMasks.find(fd);
+      if (it == epollMasks.end()) { continue; }
+      // Errors and hangups are reported to the handlers, which will discover them on read/write
+      if ((it->second & EPOLLIN) && (evs & (EPOLLIN | EPOLLERR | EPOLLHUP))) { recvReady.push_back(fd); }
+      if ((it->second & EPOLLOUT) && (evs & (EPOLLOUT | EPOLLERR | EPOLLHUP))) { sendReady.push_back(fd); }
+    }
+    for (int fd : unpollable) {
+      uint32_t mask = epollMasks[fd];
+      if (mask & EPOLLIN) { recvReady.push_back(fd); }
+      if (mask & EPOLLOUT) { sendReady.push_back(fd); }
+    }
+#else
+    do {
+      uint64_t waitTime = Util::bootMS();
+      if (!pollOnly && waitTime >= startTime + maxMs){return 0;}
+      waitTime = pollOnly ? 0 : (startTime + maxMs) - waitTime;
       timeout.tv_sec = waitTime / 1000;
       timeout.tv_usec = (waitTime % 1000) * 1000;
       r = select(maxPlusOne, &rList, &sList, 0, &timeout);
@@ -153,65 +337,41 @@ namespace Event{
       }
     } while (r < 0 && (errno == EINTR || errno == EAGAIN));
     if (r < 0 && errno == EBADF){
-      std::set<int> toErase;
-      for (auto & S : recvSockets) {
-        if (S.first < 1024 && fcntl(S.first, F_GETFD) < 0) {
-          WARN_MSG("File descriptor %d (returning %zu) became invalid; removing from list", S.first, S.second.retVal);
-          toErase.insert(S.first);
-        }
-      }
-      for (auto & i : toErase) { recvSockets.erase(i); }
-      toErase.clear();
-      for (auto & S : sendSockets) {
-        if (S.first < 1024 && fcntl(S.first, F_GETFD) < 0) {
-          WARN_MSG("File descriptor %d (returning %zu) became invalid; removing from list", S.first, S.second.retVal);
-          toErase.insert(S.first);
-        }
-      }
-      for (auto & i : toErase) { sendSockets.erase(i); }
+      dropAllStale();
       return 0;
     }
     if (r < 0){
       WARN_MSG("Event loop error: %s", strerror(errno));
     }
     if (r > 0){
-      // Callbacks are collected all at once, then executed afterwards.
-      // This is needed because callbacks could alter the sockets list.
-      // Check ready for reading
-      std::set<int> toExec;
       for (auto & S : recvSockets) {
-        if (S.first < 1024 && FD_ISSET(S.first, &rList)) {
-          if (S.second.cbFunc) {
-            toExec.insert(S.first);
-          } else {
-            pending.insert(S.second.retVal);
-          }
-        }
+        if (S.first < 1024 && FD_ISSET(S.first, &rList)) { recvReady.push_back(S.first); }
       }
-      // We do another lookup for each callback in the list, since it's possible it
-      // was removed or overwritten by another callback.
-      for (auto & E : toExec) {
-        auto iter = recvSockets.find(E);
-        if (iter != recvSockets.end()) { iter->second.cbFunc(iter->second.cbArg); }
-      }
-
-      toExec.clear();
-
-      // Check ready for sending
       for (auto & S : sendSockets) {
-        if (S.first < 1024 && FD_ISSET(S.first, &sList)) {
-          if (S.second.cbFunc) {
-            toExec.insert(S.first);
-          } else {
-            pending.insert(S.second.retVal);
-          }
-        }
+        if (S.first < 1024 && FD_ISSET(S.first, &sList)) { sendReady.push_back(S.first); }
+      }
+    }
+#endif
+    // Check ready for reading
+    // We do another lookup for each callback in the list, since it's possible it
+    // was removed or overwritten by another callback.
+    for (auto & E : recvReady) {
+      auto iter = recvSockets.find(E);
+      if (iter == recvSockets.end()) { continue; }
+      if (iter->second.cbFunc) {
+        iter->second.cbFunc(iter->second.cbArg);
+      } else {
+        pending.insert(iter->second.retVal);
       }
-      // We do another lookup for each callback in the list, since it's possible it
-      // was removed or overwritten by another callback.
-      for (auto & E : toExec) {
-        auto iter = sendSockets.find(E);
-        if (iter != sendSockets.end()) { iter->second.cbFunc(iter->second.cbArg); }
+    }
+    // Check ready for sending
+    for (auto & E : sendReady) {
+      auto iter = sendSockets.find(E);
+      if (iter == sendSockets.end()) { continue; }
+      if (iter->second.cbFunc) {
+        iter->second.cbFunc(iter->second.cbArg);
+      } else {
+        pending.insert(iter->second.retVal);
       }
     }
     if (pending.size()){
@@ -224,24 +384,32 @@ namespace Event{
 
   /// Adds a socket (any kind) to the event loop
   void Loop::addSocket(size_t eId, int sock){
+    // The previous handler may belong to a file descriptor that was closed without calling remove()
+    if (recvSockets.count(sock) && isStale(sock)) { dropStale(sock, "was closed without removing it"); }
     if (recvSockets.count(sock)) {
       FAIL_MSG("Cannot add handler for socket %d: another handler is already installed!", sock);
       return;
     }
     recvSockets[sock].retVal = eId;
+    epollUpdate(sock, epollMasks.count(sock) && (epollMasks[sock] & EV_SEND_MASK));
   }
 
 
   void Loop::addSocket(int sock, std::function<void(void*)> cb, void* userPtr){
+    // The previous handler may belong to a file descriptor that was closed without calling remove()
+    if (recvSockets.count(sock) && isStale(sock)) { dropStale(sock, "was closed without removing it"); }
     if (recvSockets.count(sock)) {
       FAIL_MSG("Cannot add handler for socket %d: another handler is already installed!", sock);
       return;
     }
     recvSockets[sock].cbFunc = cb;
     recvSockets[sock].cbArg = userPtr;
+    epollUpdate(sock, epollMasks.count(sock) && (epollMasks[sock] & EV_SEND_MASK));
   }
 
   void Loop::addSendSocket(int sock, std::function<void(void *)> cb, std::function<bool(void *)> checker, void *userPtr) {
+    // The previous handler may belong to a file descriptor that was closed without calling remove()
+    if (sendSockets.count(sock) && isStale(sock)) { dropStale(sock, "was closed without removing it"); }
     if (sendSockets.count(sock)) {
       FAIL_MSG("Cannot add handler for socket %d: another handler is already installed!", sock);
       return;
@@ -256,9 +424,12 @@ namespace Event{
     sendQueues.insert(udpSock);
   }
 
+  /// Removes all handlers for the given file descriptor. Call this before closing it: closed
+  /// descriptors are only noticed (and warned about) once every EV_STALE_CHECK milliseconds.
   void Loop::remove(int sock){
     recvSockets.erase(sock);
     sendSockets.erase(sock);
+    epollUpdate(sock, false);
     for (auto it : sendQueues){
       if (it->getSock() == sock){
         Socket::UDPConnection * ptr = it;
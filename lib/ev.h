@@ -1,10 +1,12 @@
 /// Event loop library
 #pragma once
+#include "shared_memory.h"
 #include "socket.h"
 
 #include <functional>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -31,20 +33,35 @@ namespace Event{
     void removeInterval(size_t id);
     void rescheduleInterval(size_t id, size_t millis);
     void remove(int sock);
+    void awaitSequence(IPC::liveSequence & seq, uint32_t seen);
     void setup();
 
   private:
     std::set<Socket::UDPConnection *> sendQueues;
 
     // File descriptor related
-    std::map<int, Handler> recvSockets;
-    std::map<int, Handler> sendSockets;
+    std::unordered_map<int, Handler> recvSockets;
+    std::unordered_map<int, Handler> sendSockets;
     std::set<size_t> pending;
 
+    // epoll backend related (unused when built without HASEPOLL)
+    int epollFd; ///< The epoll instance, or -1 if none
+    std::unordered_map<int, uint32_t> epollMasks; ///< Currently registered event mask per file descriptor
+    std::set<int> unpollable; ///< File descriptors epoll refuses (e.g. regular files), always considered ready
+    void epollUpdate(int sock, bool wantSend);
+    uint64_t lastStaleCheck; ///< Last time all registered file descriptors were checked for validity
+    bool isStale(int sock);
+    void dropStale(int sock, const char *reason);
+    void dropAllStale();
+
     // Timer related
     std::multimap<uint64_t, size_t> timerTimes; ///< Holds next iteration time for timers
     std::map<size_t, std::function<size_t()>> timerFuncs; ///< Holds to-be-ran function for timers
     size_t timerCount; ///< Count of the timers ever set; numbers are not reused
+
+    // Live sequence related, see awaitSequence
+    IPC::liveSequence *seqWait; ///< Sequence counter to sleep on during the next await, if any
+    uint32_t seqSeen;           ///< Sequence number that was seen last
   };
 
 
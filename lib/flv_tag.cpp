@@ -548,7 +548,11 @@ FLV::Tag &FLV::Tag::operator=(const FLV::Tag &O){
   return *this;
 }// assignment operator
 
-bool FLV::Tag::DTSCLoader(DTSC::Packet &packData, const DTSC::Meta &M, size_t idx){
+/// Loads a media tag for the given packet.
+/// If copyData is false, the packet payload is not copied into the tag: everything but the bytes
+/// where the payload would go is filled in, so the tag header, the payload and the trailing tag
+/// size can be sent straight from their own buffers.
+bool FLV::Tag::DTSCLoader(DTSC::Packet &packData, const DTSC::Meta &M, size_t idx, bool copyData){
   std::string meta_str;
   len = 0;
   if (idx == INVALID_TRACK_ID){
@@ -565,10 +569,10 @@ bool FLV::Tag::DTSCLoader(DTSC::Packet &packData, const DTSC::Meta &M, size_t id
     if (codec == "H264"){len += 4;}
     if (!checkBufferSize()){return false;}
     if (codec == "H264"){
-      memcpy(data + 16, tmpData, len - 20);
+      if (copyData){memcpy(data + 16, tmpData, len - 20);}
       data[12] = 1;
       offset(packData.getInt("offset"));
-    }else{
+    }else if (copyData){
       memcpy(data + 12, tmpData, len - 16);
     }
     data[11] = 0;
@@ -594,9 +598,9 @@ bool FLV::Tag::DTSCLoader(DTSC::Packet &packData, const DTSC::Meta &M, size_t id
     if (codec == "AAC"){len++;}
     if (!checkBufferSize()){return false;}
     if (codec == "AAC"){
-      memcpy(data + 13, tmpData, len - 17);
+      if (copyData){memcpy(data + 13, tmpData, len - 17);}
       data[12] = 1; // raw AAC data, not sequence header
-    }else{
+    }else if (copyData){
       memcpy(data + 12, tmpData, len - 16);
     }
     unsigned int datarate = M.getRate(idx);
@@ -49,7 +49,7 @@ namespace FLV{
     ~Tag();                          ///< Generic destructor.
     // loader functions
     bool ChunkLoader(const RTMPStream::Chunk &O);
-    bool DTSCLoader(DTSC::Packet &packData, const DTSC::Meta &M, size_t idx);
+    bool DTSCLoader(DTSC::Packet &packData, const DTSC::Meta &M, size_t idx, bool copyData = true);
     bool DTSCVideoInit(const std::string & codec, const std::string & initData, int multiTrack = -1);
     bool DTSCAudioInit(const std::string & codec, unsigned int sampleRate, unsigned int sampleSize,
                        unsigned int channels, const std::string & initData, int multiTrack = -1);
@@ -10,7 +10,9 @@
 #include "util.h"
 #include "json.h"
 #include <iomanip>
+#include <string.h>
 #include <strings.h>
+#include <unistd.h>
 #include <sstream>
 
 /// This constructor creates an empty HTTP::Parser, ready for use for either reading or writing.
@@ -29,13 +31,18 @@ HTTP::Parser::Parser(){
 void HTTP::Parser::Clean(){
   CleanPreserveHeaders();
   headers.clear();
+  fields.clear();
+  head.clear();
 }
 
 /// Completely re-initializes the HTTP::Parser, leaving it ready for either reading or writing
 /// usage.
 void HTTP::Parser::CleanPreserveHeaders(){
+  // Fields of an incomplete head point into the receive buffer instead of into head
+  if (seenReq && !seenHeaders){fields.clear();}
   seenHeaders = false;
   seenReq = false;
+  headScanned = 0;
   possiblyComplete = false;
   getChunks = false;
   sendingChunks = false;
@@ -148,6 +155,7 @@ void HTTP::Parser::setCORSHeaders(){
 /// \return A string containing a valid HTTP 1.0 or 1.1 request, ready for sending.
 std::string &HTTP::Parser::BuildRequest(){
   /// \todo Include POST variable handling for vars?
+  fieldsToHeaders();
   std::map<std::string, std::string>::iterator it;
   if (protocol.size() < 5 || protocol[4] != '/'){protocol = "HTTP/1.0";}
   if (!(method == "POST" && GetHeader("Content-Type") == "application/x-www-form-urlencoded") && vars.size() && url.find('?') == std::string::npos){
@@ -174,6 +182,7 @@ void HTTP::Parser::SendRequest(Socket::Connection &conn, const std::string &reqb
 void HTTP::Parser::sendRequest(Socket::Connection &conn, const void *reqbody,
                                const size_t reqbodyLen, bool allAtOnce){
   /// \todo Include GET/POST variable parsing?
+  fieldsToHeaders();
   if (allAtOnce){
     /// \TODO Make this less duplicated / more pretty.
 
@@ -222,6 +231,7 @@ void HTTP::Parser::sendRequest(Socket::Connection &conn, const void *reqbody,
 /// \return A string containing a valid HTTP 1.0 or 1.1 response, ready for sending.
 std::string &HTTP::Parser::BuildResponse(std::string code, std::string message){
   /// \todo Include GET/POST variable parsing?
+  fieldsToHeaders();
   std::map<std::string, std::string>::iterator it;
   if (protocol.size() < 5 || protocol[4] != '/'){protocol = "HTTP/1.0";}
   builder = protocol + " " + code + " " + message + "\r\n";
@@ -254,6 +264,7 @@ std::string &HTTP::Parser::BuildResponse(){
 /// message. Usually you want "OK". \param conn The Socket::Connection to send the response over.
 void HTTP::Parser::SendResponse(std::string code, std::string message, Socket::Connection &conn){
   /// \todo Include GET/POST variable parsing?
+  fieldsToHeaders();
   std::map<std::string, std::string>::iterator it;
   if (protocol.size() < 5 || protocol[4] != '/'){protocol = "HTTP/1.0";}
   builder = protocol + " " + code + " " + message + "\r\n";
@@ -280,8 +291,9 @@ void HTTP::Parser::StartResponse(std::string code, std::string message, const HT
                                  Socket::Connection &conn, bool bufferAllChunks){
   std::string prot = request.protocol;
   bool willSendChunks =
-      (!bufferAllChunks && request.protocol == "HTTP/1.1" && request.GetHeader("Connection") != "close");
+      (!bufferAllChunks && request.protocol == "HTTP/1.1" && request.headerView("Connection") != "close");
   CleanPreserveHeaders();
+  fieldsToHeaders();
   sendingChunks = willSendChunks;
   protocol = prot;
   if (sendingChunks){
@@ -435,6 +447,8 @@ std::string HTTP::Parser::getUrl() const{
 
 /// Returns header i, if set.
 const std::string &HTTP::Parser::GetHeader(const std::string &i) const{
+  // Received fields are only copied into the header map once one of them is needed as a string
+  if (fields.size() && findField(i.data(), i.size()) != -1){fieldsToHeaders();}
   if (headers.count(i)){return headers.at(i);}
   for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it){
     if (it->first.length() != i.length()){continue;}
@@ -447,6 +461,7 @@ const std::string &HTTP::Parser::GetHeader(const std::string &i) const{
 
 /// Returns header i, if set.
 bool HTTP::Parser::hasHeader(const std::string &i) const{
+  if (findField(i.data(), i.size()) != -1){return true;}
   if (headers.count(i)){return true;}
   for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it){
     if (it->first.length() != i.length()){continue;}
@@ -455,6 +470,40 @@ bool HTTP::Parser::hasHeader(const std::string &i) const{
   return false;
 }
 
+/// Returns a view of header i, or an empty view if it is not set.
+/// Unlike GetHeader, this does not copy received headers into strings.
+HTTP::Span HTTP::Parser::headerView(const char *i) const{
+  int32_t f = findField(i, strlen(i));
+  if (f != -1){return Span(head.data() + fields[f].value, fields[f].valueLen);}
+  if (!headers.size()){return Span();}
+  const std::string &val = GetHeader(i);
+  return Span(val.data(), val.size());
+}
+
+/// Returns the index of the last received header field named name, or -1 if there is none.
+/// Like GetHeader, an exact match is preferred over one that only differs in case.
+int32_t HTTP::Parser::findField(const char *name, size_t len) const{
+  if (seenReq && !seenHeaders){return -1;}
+  const char *h = head.data();
+  for (int32_t i = fields.size() - 1; i >= 0; --i){
+    if (fields[i].nameLen == len && !memcmp(h + fields[i].name, name, len)){return i;}
+  }
+  for (int32_t i = fields.size() - 1; i >= 0; --i){
+    if (fields[i].nameLen == len && !strncasecmp(h + fields[i].name, name, len)){return i;}
+  }
+  return -1;
+}
+
+/// Copies all received header fields into the header map, so they can be changed or sent.
+void HTTP::Parser::fieldsToHeaders() const{
+  if (!fields.size() || (seenReq && !seenHeaders)){return;}
+  const char *h = head.data();
+  for (std::vector<Field>::const_iterator it = fields.begin(); it != fields.end(); ++it){
+    headers[std::string(h + it->name, it->nameLen)].assign(h + it->value, it->valueLen);
+  }
+  fields.clear();
+}
+
 /// Returns POST variable i, if set.
 const std::string &HTTP::Parser::GetVar(const std::string &i) const{
   if (vars.count(i)){
@@ -471,17 +520,20 @@ std::string HTTP::Parser::allVars() const{
 
 /// Sets header i to string value v.
 void HTTP::Parser::SetHeader(std::string i, std::string v){
+  fieldsToHeaders();
   Trim(i);
   Trim(v);
   headers[i] = v;
 }
 
 void HTTP::Parser::clearHeader(const std::string &i){
+  fieldsToHeaders();
   headers.erase(i);
 }
 
 /// Sets header i to integer value v.
 void HTTP::Parser::SetHeader(std::string i, long long v){
+  fieldsToHeaders();
   Trim(i);
   char val[23]; // ints are never bigger than 22 chars as decimal
   sprintf(val, "%lld", v);
@@ -506,8 +558,9 @@ bool HTTP::Parser::Read(Socket::Connection & conn, std::function<void(const char
     return parse(conn.Received().get(), onData) && (!possiblyComplete || !conn || !JSON::Value(url).asInt());
   }
   while (conn.Received().size()){
-    // Make sure the received data ends in a newline (\n).
-    while ((!seenHeaders || (getChunks && !doingChunk)) && conn.Received().get().size() &&
+    // Make sure the received data ends in a newline (\n) when reading a chunk size.
+    // Message heads are read in place, so those do not need this.
+    while (getChunks && !doingChunk && conn.Received().get().size() &&
            *(conn.Received().get().rbegin()) != '\n'){
       if (conn.Received().size() > 1){
         // make a copy of the first part
@@ -526,6 +579,11 @@ bool HTTP::Parser::Read(Socket::Connection & conn, std::function<void(const char
     if (parse(conn.Received().get(), onData) && (!possiblyComplete || !conn || !JSON::Value(url).asInt())) {
       return true;
     }
+    // An incomplete message head stays in the buffer; add everything after it, if there is more
+    if (!seenHeaders && conn.Received().get().size()){
+      if (conn.Received().size() < 2){return false;}
+      conn.Received().getAll();
+    }
   }
   return false;
 } // HTTPReader::Read
@@ -552,82 +610,24 @@ uint8_t HTTP::Parser::getPercentage() const{
 /// \return True on success, false otherwise.
 bool HTTP::Parser::parse(std::string & HTTPbuffer, std::function<void(const char *, size_t)> onData) {
   size_t f;
-  std::string tmpA, tmpB, tmpC;
-  /// \todo Make this not resize HTTPbuffer in parts, but read all at once and then remove the
-  /// entire request, like doxygen claims it does?
+  std::string tmpA;
   while (!HTTPbuffer.empty()){
     if (!seenHeaders){
-      f = HTTPbuffer.find('\n');
-      if (f == std::string::npos) return false;
-      tmpA = HTTPbuffer.substr(0, f);
-      if (f + 1 == HTTPbuffer.size()){
-        HTTPbuffer.clear();
-      }else{
-        HTTPbuffer.erase(0, f + 1);
+      if (!parseHead(HTTPbuffer)){return false;}
+      seenHeaders = true;
+      currentLength = 0;
+      body.clear();
+      knownLength = false;
+      // Both values are followed by a non-digit, either in head or in the header map
+      Span contentLength = headerView("Content-Length");
+      if (contentLength.size()){
+        length = atoi(contentLength.data());
+        if (!bodyCallback && !onData && body.capacity() < length) { body.reserve(length); }
+        knownLength = true;
       }
-      while (tmpA.find('\r') != std::string::npos){tmpA.erase(tmpA.find('\r'));}
-      if (!seenReq){
-        seenReq = true;
-        f = tmpA.find(' ');
-        if (f != std::string::npos){
-          if (tmpA.substr(0, 4) == "HTTP"){
-            protocol = tmpA.substr(0, f);
-            tmpA.erase(0, f + 1);
-            f = tmpA.find(' ');
-            if (f != std::string::npos){
-              url = tmpA.substr(0, f);
-              tmpA.erase(0, f + 1);
-              method = tmpA;
-              if (url.find('?') != std::string::npos){
-                parseVars(url.substr(url.find('?') + 1), vars); // parse GET variables
-                url.erase(url.find('?'));
-              }
-              url = Encodings::URL::decode(url);
-            }else{
-              seenReq = false;
-            }
-          }else{
-            method = tmpA.substr(0, f);
-            tmpA.erase(0, f + 1);
-            f = tmpA.find(' ');
-            if (f != std::string::npos){
-              url = tmpA.substr(0, f);
-              tmpA.erase(0, f + 1);
-              protocol = tmpA;
-              if (url.find('?') != std::string::npos){
-                parseVars(url.substr(url.find('?') + 1), vars); // parse GET variables
-                url.erase(url.find('?'));
-              }
-              url = Encodings::URL::decode(url);
-            }else{
-              seenReq = false;
-            }
-          }
-        }else{
-          seenReq = false;
-        }
-      }else{
-        if (tmpA.size() == 0){
-          seenHeaders = true;
-          currentLength = 0;
-          body.clear();
-          knownLength = false;
-          if (GetHeader("Content-Length") != ""){
-            length = atoi(GetHeader("Content-Length").c_str());
-            if (!bodyCallback && !onData && body.capacity() < length) { body.reserve(length); }
-            knownLength = true;
-          }
-          if (GetHeader("Transfer-Encoding") == "chunked"){
-            getChunks = true;
-            doingChunk = 0;
-          }
-        }else{
-          f = tmpA.find(':');
-          if (f == std::string::npos) continue;
-          tmpB = tmpA.substr(0, f);
-          tmpC = tmpA.substr(f + 1);
-          SetHeader(tmpB, tmpC);
-        }
+      if (headerView("Transfer-Encoding") == "chunked"){
+        getChunks = true;
+        doingChunk = 0;
       }
     }
     if (seenHeaders){
@@ -664,7 +664,7 @@ bool HTTP::Parser::parse(std::string & HTTPbuffer, std::function<void(const char
         }
         if (length == currentLength) {
           // parse POST body if the content type is URLEncoded
-          if (method == "POST" && GetHeader("Content-Type") == "application/x-www-form-urlencoded"){parseVars(body, vars);}
+          if (method == "POST" && headerView("Content-Type") == "application/x-www-form-urlencoded"){parseVars(body, vars);}
           return true;
         } else {
           return false;
@@ -715,6 +715,8 @@ bool HTTP::Parser::parse(std::string & HTTPbuffer, std::function<void(const char
           return false;
         }else{
           if (protocol.substr(0, 4) == "RTSP" || method.substr(0, 4) == "RTSP"){return true;}
+          // Requests without a length have no body; only responses are read until the connection closes
+          if (!url.size() || url[0] < '0' || url[0] > '9'){return true;}
           unsigned int toappend = HTTPbuffer.size();
           bool shouldAppend = true;
           if (bodyCallback){
@@ -740,6 +742,122 @@ bool HTTP::Parser::parse(std::string & HTTPbuffer, std::function<void(const char
   return possiblyComplete; // empty input
 } // HTTPReader::parse
 
+/// Trims spaces and tabs from both ends of the range [begin, end).
+static void trimRange(const char *&begin, const char *&end){
+  while (begin < end && (*begin == ' ' || *begin == '\t')){++begin;}
+  while (end > begin && (end[-1] == ' ' || end[-1] == '\t')){--end;}
+}
+
+/// Reads the request or status line and the header fields at the start of HTTPbuffer.
+/// Lines are read in place, continuing after those read by earlier calls, and header fields are
+/// only stored as offsets. Once the empty line ending the head has been received, the whole head
+/// is moved from HTTPbuffer into head at once and true is returned. Until then, nothing is
+/// removed from HTTPbuffer and false is returned.
+bool HTTP::Parser::parseHead(std::string &HTTPbuffer){
+  const char *data = HTTPbuffer.data();
+  size_t size = HTTPbuffer.size();
+  // The buffer was changed by someone else since the last call; start over
+  if (headScanned > size){
+    if (seenReq){fields.clear();}
+    seenReq = false;
+    headScanned = 0;
+  }
+  while (headScanned < size){
+    const char *line = data + headScanned;
+    const char *lineEnd = (const char *)memchr(line, '\n', size - headScanned);
+    if (!lineEnd){return false;}
+    size_t next = lineEnd + 1 - data;
+    // Anything from the first carriage return onwards is ignored
+    const char *cr = (const char *)memchr(line, '\r', lineEnd - line);
+    if (cr){lineEnd = cr;}
+    if (!seenReq){
+      const char *sp1 = (const char *)memchr(line, ' ', lineEnd - line);
+      const char *sp2 = sp1 ? (const char *)memchr(sp1 + 1, ' ', lineEnd - sp1 - 1) : 0;
+      // Lines that are not a valid request or status line are skipped
+      if (sp2){
+        // Fields of a previous message are kept as preserved headers
+        fieldsToHeaders();
+        seenReq = true;
+        if (lineEnd - line >= 4 && !memcmp(line, "HTTP", 4)){
+          protocol.assign(line, sp1 - line);
+          url.assign(sp1 + 1, sp2 - sp1 - 1);
+          method.assign(sp2 + 1, lineEnd - sp2 - 1);
+        }else{
+          method.assign(line, sp1 - line);
+          url.assign(sp1 + 1, sp2 - sp1 - 1);
+          protocol.assign(sp2 + 1, lineEnd - sp2 - 1);
+        }
+        size_t q = url.find('?');
+        if (q != std::string::npos){
+          parseVars(url.substr(q + 1), vars); // parse GET variables
+          url.erase(q);
+        }
+        url = Encodings::URL::decode(url);
+      }
+    }else if (lineEnd == line){
+      if (next == size){
+        head.swap(HTTPbuffer);
+        HTTPbuffer.clear();
+      }else{
+        head.assign(HTTPbuffer, 0, next);
+        HTTPbuffer.erase(0, next);
+      }
+      headScanned = 0;
+      return true;
+    }else{
+      const char *colon = (const char *)memchr(line, ':', lineEnd - line);
+      if (colon){
+        const char *name = line, *nameEnd = colon, *val = colon + 1, *valEnd = lineEnd;
+        trimRange(name, nameEnd);
+        trimRange(val, valEnd);
+        Field F;
+        F.name = name - data;
+        F.nameLen = nameEnd - name;
+        F.value = val - data;
+        F.valueLen = valEnd - val;
+        fields.push_back(F);
+      }
+    }
+    headScanned = next;
+  }
+  return false;
+}
+
+HTTP::Span::Span(){
+  ptr = 0;
+  len = 0;
+}
+
+HTTP::Span::Span(const char *data, size_t len){
+  ptr = data;
+  this->len = len;
+}
+
+const char *HTTP::Span::data() const{
+  return ptr;
+}
+
+size_t HTTP::Span::size() const{
+  return len;
+}
+
+bool HTTP::Span::operator==(const char *str) const{
+  return !strncmp(ptr ? ptr : "", str, len) && !str[len];
+}
+
+bool HTTP::Span::operator!=(const char *str) const{
+  return !(*this == str);
+}
+
+/// Compares with str, ignoring differences in case.
+bool HTTP::Span::equalsNoCase(const char *str) const{
+  return !strncasecmp(ptr ? ptr : "", str, len) && !str[len];
+}
+
+std::string HTTP::Span::str() const{
+  return std::string(ptr ? ptr : "", len);
+}
+
 /// HTTP variable parser to std::map<std::string, std::string> structure.
 /// Reads variables from data, decodes and stores them to storage.
 void HTTP::parseVars(const std::string &data, std::map<std::string, std::string> &storage, const std::string & separator, bool queryStr){
@@ -822,3 +940,36 @@ void HTTP::Parser::Chunkify(const char *data, unsigned int size, Socket::Connect
     }
   }
 }
+
+/// Like Chunkify, but sends size bytes read from file descriptor fd, starting at offset.
+/// Unless whole responses are being buffered, the data is sent without copying it through user
+/// space where the platform allows it. A size of zero does nothing; use Chunkify to end a response.
+void HTTP::Parser::ChunkifyFile(int fd, uint64_t offset, size_t size, Socket::Connection & conn) {
+  if (!size){return;}
+  if (bufferChunks){
+    size_t prevLen = body.size();
+    body.resize(prevLen + size);
+    if (pread(fd, &body[prevLen], size, offset) != (ssize_t)size){
+      FAIL_MSG("Could not read %zu bytes at position %" PRIu64 " for buffering", size, offset);
+      body.resize(prevLen);
+    }
+    return;
+  }
+  if (sendingChunks){conn.setChunkedMode(true);}
+  conn.SendFile(fd, offset, size);
+}
+
+/// Like Chunkify, but sends the given pieces of data as if they were concatenated.
+/// Unless whole responses are being buffered, the pieces are sent in a single gathering write
+/// where possible. Pieces adding up to zero bytes do nothing; use Chunkify to end a response.
+void HTTP::Parser::ChunkifyVec(const struct iovec *vec, size_t count, Socket::Connection & conn) {
+  size_t size = 0;
+  for (size_t i = 0; i < count; ++i){size += vec[i].iov_len;}
+  if (!size){return;}
+  if (bufferChunks){
+    for (size_t i = 0; i < count; ++i){body.append((const char *)vec[i].iov_base, vec[i].iov_len);}
+    return;
+  }
+  if (sendingChunks){conn.setChunkedMode(true);}
+  conn.sendv(vec, count);
+}
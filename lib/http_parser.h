@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <vector>
 
 /// Holds all HTTP processing related code.
 namespace HTTP{
@@ -20,6 +21,24 @@ namespace HTTP{
   /// Reads from vars and returns a properly encoded argument list string.
   std::string argStr(const std::map<std::string, std::string> & vars, bool withQuestionMark = true);
 
+  /// A read-only view of a part of a buffer, such as a header value of a received message.
+  /// Only valid for as long as the buffer it points into is not changed.
+  class Span{
+  public:
+    Span();
+    Span(const char *data, size_t len);
+    const char *data() const;
+    size_t size() const;
+    bool operator==(const char *str) const;
+    bool operator!=(const char *str) const;
+    bool equalsNoCase(const char *str) const;
+    std::string str() const;
+
+  private:
+    const char *ptr;
+    size_t len;
+  };
+
   /// Simple class for reading and writing HTTP 1.0 and 1.1.
   class Parser{
   public:
@@ -27,6 +46,7 @@ namespace HTTP{
     bool Read(Socket::Connection & conn, std::function<void(const char *, size_t)> onData = 0);
     bool Read(std::string &strbuf);
     const std::string &GetHeader(const std::string &i) const;
+    Span headerView(const char *i) const;
     bool hasHeader(const std::string &i) const;
     void clearHeader(const std::string &i);
     uint8_t getPercentage() const;
@@ -51,6 +71,8 @@ namespace HTTP{
     void StartResponse(Parser &request, Socket::Connection &conn, bool bufferAllChunks = false);
     void Chunkify(const std::string &bodypart, Socket::Connection &conn);
     void Chunkify(const char *data, unsigned int size, Socket::Connection &conn);
+    void ChunkifyFile(int fd, uint64_t offset, size_t size, Socket::Connection &conn);
+    void ChunkifyVec(const struct iovec *vec, size_t count, Socket::Connection &conn);
     void Proxy(Socket::Connection &from, Socket::Connection &to);
     void Clean();
     void CleanPreserveHeaders();
@@ -77,9 +99,22 @@ namespace HTTP{
     bool possiblyComplete;
     unsigned int doingChunk;
     bool parse(std::string & HTTPbuffer, std::function<void(const char *, size_t)> onData = 0);
+    bool parseHead(std::string &HTTPbuffer);
+    int32_t findField(const char *name, size_t len) const;
+    void fieldsToHeaders() const;
+    /// A received header field, as offsets into head. Names and values are trimmed.
+    struct Field{
+      uint32_t name;
+      uint32_t nameLen;
+      uint32_t value;
+      uint32_t valueLen;
+    };
     std::string builder;
     std::string read_buffer;
-    std::map<std::string, std::string> headers;
+    std::string head;                  ///< The received message head, which fields point into
+    mutable std::vector<Field> fields; ///< Received header fields not yet copied into headers
+    size_t headScanned;                ///< Bytes at the start of the buffer already read as head lines
+    mutable std::map<std::string, std::string> headers;
     std::map<std::string, std::string> vars;
     void Trim(std::string &s);
   };
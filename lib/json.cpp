@@ -166,8 +166,8 @@ static std::string UTF8(uint32_t c){
     r.append(1, 0x80 | (c & 0x3F));
     return r;
   }
-  if (c <= 0x7FF){
-    r.append(1, 0xC0 | (c >> 12));
+  if (c <= 0xFFFF){
+    r.append(1, 0xE0 | (c >> 12));
     r.append(1, 0x80 | ((c >> 6) & 0x3F));
     r.append(1, 0x80 | (c & 0x3F));
     return r;
@@ -0,0 +1,833 @@
+#include "json_doc.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+/// Amount of text a Writer with a sink collects before handing it over.
+#define JSON_WRITER_FLUSH 65536
+
+namespace JSON{
+
+  static inline bool isSpace(char c){return c == ' ' || c == '\n' || c == '\r' || c == '\t';}
+
+  /// Advances p past any whitespace. Returns false if the input ends first.
+  static inline bool skipSpace(const char *&p, const char *e){
+    while (p < e && isSpace(*p)){++p;}
+    return p < e;
+  }
+
+  /// Converts a hexadecimal digit to its value. Anything else counts as zero, like JSON::Value does.
+  static inline uint32_t hexVal(char c){
+    if (c >= '0' && c <= '9'){return c - '0';}
+    if (c >= 'a' && c <= 'f'){return c - 'a' + 10;}
+    if (c >= 'A' && c <= 'F'){return c - 'A' + 10;}
+    return 0;
+  }
+
+  static inline char hexChar(uint32_t c){return (c < 10) ? ('0' + c) : ('A' + (c - 10));}
+
+  /// Appends the UTF-8 encoding of the given code point to out.
+  static void appendUTF8(std::string &out, uint32_t c){
+    if (c <= 0x7F){
+      out += (char)c;
+    }else if (c <= 0x7FF){
+      out += (char)(0xC0 | (c >> 6));
+      out += (char)(0x80 | (c & 0x3F));
+    }else if (c <= 0xFFFF){
+      out += (char)(0xE0 | (c >> 12));
+      out += (char)(0x80 | ((c >> 6) & 0x3F));
+      out += (char)(0x80 | (c & 0x3F));
+    }else{
+      out += (char)(0xF0 | ((c >> 18) & 0x07));
+      out += (char)(0x80 | ((c >> 12) & 0x3F));
+      out += (char)(0x80 | ((c >> 6) & 0x3F));
+      out += (char)(0x80 | (c & 0x3F));
+    }
+  }
+
+  /// Appends a \\u escape for the given code point to out, as a surrogate pair if needed.
+  static void appendUTF16(std::string &out, uint32_t c){
+    if (c > 0xFFFF){
+      c -= 0x10000;
+      appendUTF16(out, 0xD800 + ((c >> 10) & 0x3FF));
+      appendUTF16(out, 0xDC00 + (c & 0x3FF));
+      return;
+    }
+    char esc[6] ={'\\', 'u', hexChar((c >> 12) & 0xF), hexChar((c >> 8) & 0xF), hexChar((c >> 4) & 0xF), hexChar(c & 0xF)};
+    out.append(esc, 6);
+  }
+
+  /// Reads a string from just after its opening quote up to and including the closing quote.
+  /// Strings without escapes are returned as a pointer into the input, others are decoded into
+  /// scratch the same way JSON::Value decodes them. Returns false if the input ends first.
+  static bool readString(const char *&p, const char *e, char quote, std::string &scratch, const char *&str, size_t &len){
+    const char *s = p;
+    while (p < e && *p != quote && *p != '\\'){++p;}
+    if (p >= e){return false;}
+    if (*p == quote){
+      str = s;
+      len = p - s;
+      ++p;
+      return true;
+    }
+    scratch.assign(s, p - s);
+    uint32_t high = 0; // A high surrogate waiting for its low surrogate
+    while (p < e){
+      char c = *(p++);
+      if (c != '\\'){
+        if (high){
+          appendUTF8(scratch, high);
+          high = 0;
+        }
+        if (c == quote){
+          str = scratch.data();
+          len = scratch.size();
+          return true;
+        }
+        scratch += c;
+        continue;
+      }
+      if (p >= e){return false;}
+      c = *(p++);
+      if (high && c != 'u'){
+        appendUTF8(scratch, high);
+        high = 0;
+      }
+      switch (c){
+      case 'b': scratch += '\b'; break;
+      case 'f': scratch += '\f'; break;
+      case 'n': scratch += '\n'; break;
+      case 'r': scratch += '\r'; break;
+      case 't': scratch += '\t'; break;
+      case 'x':
+        if (e - p < 2){return false;}
+        scratch += (char)((hexVal(p[0]) << 4) | hexVal(p[1]));
+        p += 2;
+        break;
+      case 'u':{
+        if (e - p < 4){return false;}
+        uint32_t u = (hexVal(p[0]) << 12) | (hexVal(p[1]) << 8) | (hexVal(p[2]) << 4) | hexVal(p[3]);
+        p += 4;
+        if (high){
+          if (u >= 0xDC00 && u <= 0xDFFF){
+            appendUTF8(scratch, 0x10000 + ((high & 0x3FF) << 10) + (u & 0x3FF));
+            high = 0;
+            break;
+          }
+          appendUTF8(scratch, high);
+          high = 0;
+        }
+        if (u >= 0xD800 && u <= 0xDBFF){
+          high = u;
+        }else{
+          appendUTF8(scratch, u);
+        }
+        break;
+      }
+      default: scratch += c; break;
+      }
+    }
+    return false;
+  }
+
+  /// Reads a number and passes it to the handler as an integer or a double.
+  static bool readNumber(const char *&p, const char *e, Handler &H){
+    const char *s = p;
+    bool negative = (*p == '-');
+    if (negative){++p;}
+    if (p >= e || *p < '0' || *p > '9'){return false;}
+    uint64_t intVal = 0;
+    while (p < e && *p >= '0' && *p <= '9'){intVal = intVal * 10 + (*(p++) - '0');}
+    if (p >= e || (*p != '.' && *p != 'e' && *p != 'E')){
+      return H.onInt(negative ? (int64_t)(0 - intVal) : (int64_t)intVal);
+    }
+    double dblVal = 0;
+    if (*p == '.'){
+      ++p;
+      // The same arithmetic as JSON::Value uses, so both end up with the exact same double
+      double dblDivider = negative ? -1 : 1;
+      dblVal = (double)(negative ? (int64_t)(0 - intVal) : (int64_t)intVal);
+      while (p < e && *p >= '0' && *p <= '9'){
+        dblDivider *= 10;
+        dblVal += (double)(*(p++) - '0') / dblDivider;
+      }
+    }
+    if (p < e && (*p == 'e' || *p == 'E')){
+      ++p;
+      if (p < e && (*p == '+' || *p == '-')){++p;}
+      while (p < e && *p >= '0' && *p <= '9'){++p;}
+      dblVal = strtod(std::string(s, p - s).c_str(), 0);
+    }
+    return H.onDouble(dblVal);
+  }
+
+  /// Reads an object key and the colon following it.
+  static bool readKey(const char *&p, const char *e, Handler &H, std::string &scratch){
+    if (!skipSpace(p, e) || (*p != '"' && *p != '\'')){return false;}
+    const char *str;
+    size_t len;
+    char quote = *(p++);
+    if (!readString(p, e, quote, scratch, str, len) || !H.onKey(str, len)){return false;}
+    if (!skipSpace(p, e) || *p != ':'){return false;}
+    ++p;
+    return true;
+  }
+
+  /// Parses a single JSON value from data, passing everything in it to H.
+  /// Besides standard JSON, single-quoted strings, \\x escapes and capitalised literals are
+  /// accepted, as JSON::Value accepts those too. Anything after the value is ignored; if parsed is
+  /// given, the amount of bytes up to the end of the value is written to it.
+  /// Returns false if the data is not valid JSON, ends early, or the handler aborted parsing.
+  bool parse(const char *data, size_t len, Handler &H, size_t *parsed){
+    const char *p = data;
+    const char *e = data + len;
+    std::string scratch;
+    std::string stack; // The open containers, as '{' or '['
+    while (true){
+      // A value is expected here
+      if (!skipSpace(p, e)){return false;}
+      char c = *p;
+      if (c == '{' || c == '['){
+        ++p;
+        char close = (c == '{') ? '}' : ']';
+        if (!(c == '{' ? H.onObjectStart() : H.onArrayStart())){return false;}
+        if (!skipSpace(p, e)){return false;}
+        if (*p != close){
+          stack += c;
+          if (c == '{' && !readKey(p, e, H, scratch)){return false;}
+          continue;
+        }
+        ++p;
+        if (!(c == '{' ? H.onObjectEnd() : H.onArrayEnd())){return false;}
+      }else if (c == '"' || c == '\''){
+        const char *str;
+        size_t strLen;
+        ++p;
+        if (!readString(p, e, c, scratch, str, strLen) || !H.onString(str, strLen)){return false;}
+      }else if (c == '-' || (c >= '0' && c <= '9')){
+        if (!readNumber(p, e, H)){return false;}
+      }else if (c == 't' || c == 'T' || c == 'f' || c == 'F' || c == 'n' || c == 'N'){
+        while (p < e && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))){++p;}
+        if (!((c == 'n' || c == 'N') ? H.onNull() : H.onBool(c == 't' || c == 'T'))){return false;}
+      }else{
+        return false;
+      }
+      // A value was read: close the containers it ends, up to the next comma or the end
+      while (true){
+        if (!stack.size()){
+          if (parsed){*parsed = p - data;}
+          return true;
+        }
+        if (!skipSpace(p, e)){return false;}
+        char top = stack[stack.size() - 1];
+        if (*p == ','){
+          ++p;
+          if (top == '{' && !readKey(p, e, H, scratch)){return false;}
+          break;
+        }
+        if (*p != (top == '{' ? '}' : ']')){return false;}
+        ++p;
+        stack.erase(stack.size() - 1);
+        if (!(top == '{' ? H.onObjectEnd() : H.onArrayEnd())){return false;}
+      }
+    }
+  }
+
+  bool parse(const std::string &data, Handler &H){return parse(data.data(), data.size(), H);}
+
+  /// Creates a Writer that collects all output, retrievable through str().
+  Writer::Writer(){
+    afterKey = false;
+  }
+
+  /// Creates a Writer that hands its output to the given sink whenever enough has collected,
+  /// and when flushed or destroyed.
+  Writer::Writer(std::function<void(const char *, size_t)> _sink) : sink(_sink){
+    afterKey = false;
+  }
+
+  Writer::~Writer(){flush();}
+
+  /// Writes a comma when needed, before the next value or key.
+  void Writer::separate(){
+    if (afterKey){
+      afterKey = false;
+    }else if (first.size()){
+      if (first.back()){
+        first.back() = false;
+      }else{
+        buf += ',';
+      }
+    }
+    if (sink && buf.size() >= JSON_WRITER_FLUSH){flush();}
+  }
+
+  bool Writer::onNull(){
+    separate();
+    buf.append("null", 4);
+    return true;
+  }
+
+  bool Writer::onBool(bool val){
+    separate();
+    if (val){
+      buf.append("true", 4);
+    }else{
+      buf.append("false", 5);
+    }
+    return true;
+  }
+
+  bool Writer::onInt(int64_t val){
+    separate();
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    uint64_t u = (val < 0) ? (0 - (uint64_t)val) : (uint64_t)val;
+    do{
+      *(--p) = '0' + (u % 10);
+      u /= 10;
+    }while (u);
+    if (val < 0){*(--p) = '-';}
+    buf.append(p, tmp + sizeof(tmp) - p);
+    return true;
+  }
+
+  /// Writes a double the same way JSON::Value does: with one digit less than needed to make it
+  /// round-trip exactly.
+  bool Writer::onDouble(double val){
+    separate();
+    char tmp[32];
+    int len = snprintf(tmp, sizeof(tmp), "%.16g", val);
+    buf.append(tmp, len);
+    return true;
+  }
+
+  /// Writes an escaped string. Printable ASCII is copied as-is; UTF-8 sequences and all other
+  /// bytes are escaped as UTF-16, the same way JSON::string_escape does.
+  bool Writer::onString(const char *str, size_t len){
+    separate();
+    const uint8_t *s = (const uint8_t *)str;
+    buf += '"';
+    size_t i = 0;
+    while (i < len){
+      size_t run = i;
+      while (run < len && s[run] >= 32 && s[run] <= 126 && s[run] != '"' && s[run] != '\\'){++run;}
+      buf.append(str + i, run - i);
+      if (run == len){break;}
+      i = run;
+      uint8_t c = s[i];
+      switch (c){
+      case '"': buf.append("\\\"", 2); break;
+      case '\\': buf.append("\\\\", 2); break;
+      case '\n': buf.append("\\n", 2); break;
+      case '\b': buf.append("\\b", 2); break;
+      case '\f': buf.append("\\f", 2); break;
+      case '\r': buf.append("\\r", 2); break;
+      case '\t': buf.append("\\t", 2); break;
+      default:
+        if ((c & 0xE0) == 0xC0 && i + 1 < len && (s[i + 1] & 0xC0) == 0x80){
+          appendUTF16(buf, ((c & 0x1F) << 6) | (s[i + 1] & 0x3F));
+          i += 2;
+          continue;
+        }
+        if ((c & 0xF0) == 0xE0 && i + 2 < len && (s[i + 1] & 0xC0) == 0x80 && (s[i + 2] & 0xC0) == 0x80){
+          appendUTF16(buf, ((c & 0x0F) << 12) | ((s[i + 1] & 0x3F) << 6) | (s[i + 2] & 0x3F));
+          i += 3;
+          continue;
+        }
+        if ((c & 0xF8) == 0xF0 && i + 3 < len && (s[i + 1] & 0xC0) == 0x80 && (s[i + 2] & 0xC0) == 0x80 &&
+            (s[i + 3] & 0xC0) == 0x80){
+          appendUTF16(buf, ((c & 0x07) << 18) | ((s[i + 1] & 0x3F) << 12) | ((s[i + 2] & 0x3F) << 6) | (s[i + 3] & 0x3F));
+          i += 4;
+          continue;
+        }
+        char esc[6] ={'\\', 'u', '0', '0', hexChar(c >> 4), hexChar(c & 0xF)};
+        buf.append(esc, 6);
+        break;
+      }
+      ++i;
+    }
+    buf += '"';
+    return true;
+  }
+
+  bool Writer::onString(const std::string &str){return onString(str.data(), str.size());}
+
+  bool Writer::onKey(const char *str, size_t len){
+    onString(str, len);
+    buf += ':';
+    afterKey = true;
+    return true;
+  }
+
+  bool Writer::onKey(const std::string &str){return onKey(str.data(), str.size());}
+
+  bool Writer::onObjectStart(){
+    separate();
+    buf += '{';
+    first.push_back(true);
+    return true;
+  }
+
+  bool Writer::onObjectEnd(){
+    buf += '}';
+    first.pop_back();
+    return true;
+  }
+
+  bool Writer::onArrayStart(){
+    separate();
+    buf += '[';
+    first.push_back(true);
+    return true;
+  }
+
+  bool Writer::onArrayEnd(){
+    buf += ']';
+    first.pop_back();
+    return true;
+  }
+
+  /// Writes a complete JSON::Value. Unset values are written as null.
+  void Writer::write(const Value &val){
+    if (val.isObject()){
+      onObjectStart();
+      jsonForEachConst(val, i){
+        onKey(i.key());
+        write(*i);
+      }
+      onObjectEnd();
+    }else if (val.isArray()){
+      onArrayStart();
+      jsonForEachConst(val, i){write(*i);}
+      onArrayEnd();
+    }else if (val.isString()){
+      onString(val.asStringRef());
+    }else if (val.isInt()){
+      onInt(val.asInt());
+    }else if (val.isDouble()){
+      onDouble(val.asDouble());
+    }else if (val.isBool()){
+      onBool(val.asBool());
+    }else{
+      onNull();
+    }
+  }
+
+  /// Returns the output collected so far. Always empty for a Writer with a sink after flush().
+  const std::string &Writer::str() const{return buf;}
+
+  /// Hands all collected output to the sink, if there is one.
+  void Writer::flush(){
+    if (!sink || !buf.size()){return;}
+    sink(buf.data(), buf.size());
+    buf.clear();
+  }
+
+  /// Discards all collected output and starts over, keeping the buffer allocated.
+  void Writer::clear(){
+    buf.clear();
+    first.clear();
+    afterKey = false;
+  }
+
+  Doc::Doc(){
+    keyOffset = 0;
+    keyLen = 0;
+  }
+
+  /// Parses a JSON document, replacing the previous contents. Nodes of the previous document are
+  /// no longer valid afterwards. Returns false and leaves the document empty if the data could
+  /// not be parsed.
+  bool Doc::parse(const char *data, size_t len){
+    clear();
+    if (JSON::parse(data, len, *this) && entries.size()){return true;}
+    clear();
+    return false;
+  }
+
+  bool Doc::parse(const std::string &data){return parse(data.data(), data.size());}
+
+  /// Empties the document, keeping all buffers allocated for the next parse.
+  void Doc::clear(){
+    entries.clear();
+    members.clear();
+    elements.clear();
+    chars.clear();
+    pending.clear();
+    open.clear();
+  }
+
+  /// Returns the top-level value, or a null node if the document is empty.
+  Node Doc::root() const{
+    if (!entries.size()){return Node();}
+    return Node(*this, 0);
+  }
+
+  /// Returns the amount of memory allocated for the document, in bytes.
+  size_t Doc::bytes() const{
+    return sizeof(Doc) + entries.capacity() * sizeof(Entry) + (members.capacity() + pending.capacity()) * sizeof(Member) +
+           (elements.capacity() + open.capacity()) * sizeof(uint32_t) + chars.capacity();
+  }
+
+  /// Adds a node, and registers it as child of the innermost open container, if any.
+  uint32_t Doc::add(uint8_t type){
+    uint32_t idx = entries.size();
+    entries.resize(idx + 1);
+    entries[idx].type = type;
+    entries[idx].size = 0;
+    entries[idx].i = 0;
+    if (open.size()){
+      Member M;
+      M.keyOffset = keyOffset;
+      M.keyLen = keyLen;
+      M.node = idx;
+      pending.push_back(M);
+    }
+    return idx;
+  }
+
+  /// Copies a string into chars, followed by a zero byte. Returns its offset.
+  uint32_t Doc::addString(const char *str, size_t len){
+    uint32_t offset = chars.size();
+    chars.append(str, len);
+    chars += '\0';
+    return offset;
+  }
+
+  bool Doc::onNull(){
+    add(EMPTY);
+    return true;
+  }
+
+  bool Doc::onBool(bool val){
+    entries[add(BOOL)].i = val;
+    return true;
+  }
+
+  bool Doc::onInt(int64_t val){
+    entries[add(INTEGER)].i = val;
+    return true;
+  }
+
+  bool Doc::onDouble(double val){
+    entries[add(DOUBLE)].d = val;
+    return true;
+  }
+
+  bool Doc::onString(const char *str, size_t len){
+    uint32_t idx = add(STRING);
+    entries[idx].size = len;
+    entries[idx].offset = addString(str, len);
+    return true;
+  }
+
+  bool Doc::onKey(const char *str, size_t len){
+    keyOffset = addString(str, len);
+    keyLen = len;
+    return true;
+  }
+
+  bool Doc::onObjectStart(){
+    open.push_back(add(OBJECT));
+    open.push_back(pending.size());
+    return true;
+  }
+
+  bool Doc::onArrayStart(){
+    open.push_back(add(ARRAY));
+    open.push_back(pending.size());
+    return true;
+  }
+
+  bool Doc::onObjectEnd(){return close(OBJECT);}
+
+  bool Doc::onArrayEnd(){return close(ARRAY);}
+
+  /// Orders members by key the same way a std::map<std::string> does, and members with the same
+  /// key in document order.
+  struct Doc::MemberOrder{
+    const char *chars;
+    bool operator()(const Member &a, const Member &b) const;
+  };
+
+  /// Moves the children of the innermost open container from pending into its own slice of
+  /// members or elements. Object members are sorted by key; of duplicate keys the last one wins.
+  bool Doc::close(uint8_t type){
+    size_t start = open.back();
+    Entry &E = entries[open[open.size() - 2]];
+    open.resize(open.size() - 2);
+    std::vector<Member>::iterator first = pending.begin() + start;
+    if (type == OBJECT){
+      std::sort(first, pending.end(), MemberOrder{chars.data()});
+      E.offset = members.size();
+      for (std::vector<Member>::iterator it = first; it != pending.end(); ++it){
+        std::vector<Member>::iterator next = it + 1;
+        if (next != pending.end() && next->keyLen == it->keyLen &&
+            !memcmp(chars.data() + next->keyOffset, chars.data() + it->keyOffset, it->keyLen)){
+          continue;
+        }
+        members.push_back(*it);
+      }
+      E.size = members.size() - E.offset;
+    }else{
+      E.offset = elements.size();
+      for (std::vector<Member>::iterator it = first; it != pending.end(); ++it){elements.push_back(it->node);}
+      E.size = elements.size() - E.offset;
+    }
+    pending.erase(first, pending.end());
+    return true;
+  }
+
+  /// Compares two keys byte by byte, shorter keys first when one is a prefix of the other.
+  static inline int keyCompare(const char *a, size_t aLen, const char *b, size_t bLen){
+    int r = memcmp(a, b, std::min(aLen, bLen));
+    if (r){return r;}
+    return (aLen < bLen) ? -1 : (aLen > bLen ? 1 : 0);
+  }
+
+  bool Doc::MemberOrder::operator()(const Member &a, const Doc::Member &b) const{
+    int r = keyCompare(chars + a.keyOffset, a.keyLen, chars + b.keyOffset, b.keyLen);
+    return r ? (r < 0) : (a.node < b.node);
+  }
+
+  /// Creates a null node that is not part of any document.
+  Node::Node(){
+    D = 0;
+    idx = 0;
+  }
+
+  Node::Node(const Doc &_D, uint32_t _idx){
+    D = &_D;
+    idx = _idx;
+  }
+
+  bool Node::isInt() const{return D && D->entries[idx].type == INTEGER;}
+  bool Node::isDouble() const{return D && D->entries[idx].type == DOUBLE;}
+  bool Node::isString() const{return D && D->entries[idx].type == STRING;}
+  bool Node::isBool() const{return D && D->entries[idx].type == BOOL;}
+  bool Node::isObject() const{return D && D->entries[idx].type == OBJECT;}
+  bool Node::isArray() const{return D && D->entries[idx].type == ARRAY;}
+  bool Node::isNull() const{return !D || D->entries[idx].type == EMPTY;}
+
+  /// True if there is anything meaningful stored in this node, like for a JSON::Value.
+  Node::operator bool() const{
+    if (!D){return false;}
+    const Doc::Entry &E = D->entries[idx];
+    switch (E.type){
+    case STRING:
+    case OBJECT:
+    case ARRAY: return E.size > 0;
+    case DOUBLE: return E.d != 0;
+    case INTEGER:
+    case BOOL: return E.i != 0;
+    default: return false;
+    }
+  }
+
+  /// Returns the raw string for string nodes, nothing for null nodes, and JSON text otherwise.
+  std::string Node::asString() const{
+    if (isString()){return std::string(c_str(), strSize());}
+    if (isNull()){return "";}
+    return toString();
+  }
+
+  /// Returns the value as an integer. Strings are converted, anything else that is not a number
+  /// (booleans included) returns zero, like for a JSON::Value.
+  int64_t Node::asInt() const{
+    if (!D){return 0;}
+    const Doc::Entry &E = D->entries[idx];
+    if (E.type == INTEGER){return E.i;}
+    if (E.type == DOUBLE){return (long long int)E.d;}
+    if (E.type == STRING){return atoll(c_str());}
+    return 0;
+  }
+
+  double Node::asDouble() const{
+    if (!D){return 0;}
+    const Doc::Entry &E = D->entries[idx];
+    if (E.type == INTEGER){return (double)E.i;}
+    if (E.type == DOUBLE){return E.d;}
+    if (E.type == STRING){return atof(c_str());}
+    return 0;
+  }
+
+  bool Node::asBool() const{return (bool)*this;}
+
+  /// Returns the string for string nodes, an empty string otherwise.
+  /// Valid for as long as the document is not parsed into again.
+  const char *Node::c_str() const{
+    if (!isString()){return "";}
+    return D->chars.data() + D->entries[idx].offset;
+  }
+
+  /// Returns the length of the string for string nodes, zero otherwise.
+  size_t Node::strSize() const{return isString() ? D->entries[idx].size : 0;}
+
+  /// Returns the amount of members or elements, or zero for anything that is not a container.
+  size_t Node::size() const{
+    if (!isObject() && !isArray()){return 0;}
+    return D->entries[idx].size;
+  }
+
+  /// Returns the index in members of the member with the given key, or -1 if there is none.
+  int32_t Node::find(const char *name, size_t len) const{
+    if (!isObject()){return -1;}
+    const Doc::Entry &E = D->entries[idx];
+    const char *chars = D->chars.data();
+    size_t lo = E.offset, hi = E.offset + E.size;
+    while (lo < hi){
+      size_t mid = (lo + hi) / 2;
+      const Doc::Member &M = D->members[mid];
+      int r = keyCompare(chars + M.keyOffset, M.keyLen, name, len);
+      if (!r){return mid;}
+      if (r < 0){
+        lo = mid + 1;
+      }else{
+        hi = mid;
+      }
+    }
+    return -1;
+  }
+
+  bool Node::isMember(const std::string &name) const{return find(name.data(), name.size()) >= 0;}
+
+  bool Node::isMember(const char *name, size_t len) const{return find(name, len) >= 0;}
+
+  Node Node::operator[](const std::string &name) const{
+    int32_t m = find(name.data(), name.size());
+    if (m < 0){return Node();}
+    return Node(*D, D->members[m].node);
+  }
+
+  Node Node::operator[](const char *name) const{
+    int32_t m = find(name, strlen(name));
+    if (m < 0){return Node();}
+    return Node(*D, D->members[m].node);
+  }
+
+  Node Node::operator[](uint32_t i) const{
+    if (!isArray() || i >= D->entries[idx].size){return Node();}
+    return Node(*D, D->elements[D->entries[idx].offset + i]);
+  }
+
+  /// Converts this node to JSON text, the same as JSON::Value::toString would.
+  std::string Node::toString() const{
+    if (!D){return "";}
+    Writer W;
+    writeTo(W);
+    return W.str();
+  }
+
+  /// Passes this node and everything in it to a handler, as JSON::parse would.
+  void Node::writeTo(Handler &H) const{
+    if (!D){
+      H.onNull();
+      return;
+    }
+    const Doc::Entry &E = D->entries[idx];
+    switch (E.type){
+    case OBJECT:
+      H.onObjectStart();
+      for (uint32_t i = E.offset; i < E.offset + E.size; ++i){
+        const Doc::Member &M = D->members[i];
+        H.onKey(D->chars.data() + M.keyOffset, M.keyLen);
+        Node(*D, M.node).writeTo(H);
+      }
+      H.onObjectEnd();
+      break;
+    case ARRAY:
+      H.onArrayStart();
+      for (uint32_t i = E.offset; i < E.offset + E.size; ++i){Node(*D, D->elements[i]).writeTo(H);}
+      H.onArrayEnd();
+      break;
+    case STRING: H.onString(D->chars.data() + E.offset, E.size); break;
+    case INTEGER: H.onInt(E.i); break;
+    case DOUBLE: H.onDouble(E.d); break;
+    case BOOL: H.onBool(E.i); break;
+    default: H.onNull(); break;
+    }
+  }
+
+  /// Makes a JSON::Value copy of this node, for code that needs to change it or keep it around.
+  Value Node::toValue() const{
+    Value ret;
+    if (D){copyTo(ret);}
+    return ret;
+  }
+
+  /// Stores a copy of this node into ret, which must be a null value.
+  void Node::copyTo(Value &ret) const{
+    const Doc::Entry &E = D->entries[idx];
+    switch (E.type){
+    case OBJECT:
+      // Turns ret into an empty object first, for objects without members
+      ret[""];
+      ret.shrink(0);
+      for (uint32_t i = E.offset; i < E.offset + E.size; ++i){
+        const Doc::Member &M = D->members[i];
+        Node(*D, M.node).copyTo(ret[std::string(D->chars.data() + M.keyOffset, M.keyLen)]);
+      }
+      break;
+    case ARRAY:
+      ret.append();
+      ret.shrink(0);
+      for (uint32_t i = E.offset; i < E.offset + E.size; ++i){Node(*D, D->elements[i]).copyTo(ret.append());}
+      break;
+    case STRING: ret = std::string(c_str(), strSize()); break;
+    case INTEGER: ret = (int64_t)E.i; break;
+    case DOUBLE: ret = E.d; break;
+    case BOOL: ret = (bool)E.i; break;
+    default: ret.null(); break;
+    }
+  }
+
+  DocIter::DocIter(const Node &root){
+    D = root.D;
+    parent = root.idx;
+    i = 0;
+    load();
+  }
+
+  /// Points cur at the current child, if any.
+  void DocIter::load(){
+    if (!*this){return;}
+    const Doc::Entry &E = D->entries[parent];
+    cur = Node(*D, (E.type == OBJECT) ? D->members[E.offset + i].node : D->elements[E.offset + i]);
+  }
+
+  const Node &DocIter::operator*() const{return cur;}
+
+  const Node *DocIter::operator->() const{return &cur;}
+
+  /// True while there are children left.
+  DocIter::operator bool() const{
+    if (!D){return false;}
+    const Doc::Entry &E = D->entries[parent];
+    return (E.type == OBJECT || E.type == ARRAY) && i < E.size;
+  }
+
+  DocIter &DocIter::operator++(){
+    ++i;
+    load();
+    return *this;
+  }
+
+  /// Returns the key of the current member, or an empty string when iterating over an array.
+  std::string DocIter::key() const{
+    if (!*this || D->entries[parent].type != OBJECT){return "";}
+    const Doc::Member &M = D->members[D->entries[parent].offset + i];
+    return std::string(D->chars.data() + M.keyOffset, M.keyLen);
+  }
+
+  /// Returns the key of the current member as a zero-terminated string, valid for as long as the
+  /// document is not parsed into again.
+  const char *DocIter::keyData() const{
+    if (!*this || D->entries[parent].type != OBJECT){return "";}
+    return D->chars.data() + D->members[D->entries[parent].offset + i].keyOffset;
+  }
+
+  /// Returns the index of the current child.
+  uint32_t DocIter::num() const{return i;}
+
+}// namespace JSON
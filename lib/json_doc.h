@@ -0,0 +1,193 @@
+/// \file json_doc.h
+/// Streaming JSON parsing and serialising, and a read-only JSON document that lives in a few
+/// contiguous buffers.
+///
+/// JSON::parse reads JSON text and reports what it finds to a JSON::Handler, SAX-style, without
+/// building anything itself. Strings without escapes are passed straight from the input.
+/// JSON::Writer is a Handler that serialises whatever it is given, so it can both build JSON text
+/// directly and re-serialise parsed input. Its output is identical to JSON::Value::toString.
+/// JSON::Doc is a Handler that stores a parsed document in a handful of vectors: one entry per
+/// node, one contiguous slice of children per array and one slice of members per object, sorted by
+/// key. All strings share a single character buffer. Parsing into a Doc that was used before does
+/// not allocate at all once its buffers have grown large enough. JSON::Node is a handle to a node
+/// in a Doc with the same read API as a const JSON::Value; only asStringRef is replaced by c_str
+/// and strSize, as strings are not stored as std::string.
+#pragma once
+#include "json.h"
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/// Iterates over the children of a JSON::Node, like jsonForEachConst does for a JSON::Value.
+#define docForEach(val, i) for (JSON::DocIter i(val); i; ++i)
+
+namespace JSON{
+
+  /// Receives the contents of a JSON document from JSON::parse, in document order.
+  /// Every function may return false to abort parsing.
+  class Handler{
+  public:
+    virtual ~Handler(){}
+    virtual bool onNull() = 0;
+    virtual bool onBool(bool val) = 0;
+    virtual bool onInt(int64_t val) = 0;
+    virtual bool onDouble(double val) = 0;
+    virtual bool onString(const char *str, size_t len) = 0;
+    virtual bool onKey(const char *str, size_t len) = 0;
+    virtual bool onObjectStart() = 0;
+    virtual bool onObjectEnd() = 0;
+    virtual bool onArrayStart() = 0;
+    virtual bool onArrayEnd() = 0;
+  };
+
+  bool parse(const char *data, size_t len, Handler &H, size_t *parsed = 0);
+  bool parse(const std::string &data, Handler &H);
+
+  /// Serialises the calls made to it as compact JSON text.
+  /// Either collects everything in a buffer, or hands the text to a sink in pieces of about 64KiB.
+  class Writer : public Handler{
+  public:
+    Writer();
+    Writer(std::function<void(const char *, size_t)> sink);
+    ~Writer();
+    bool onNull();
+    bool onBool(bool val);
+    bool onInt(int64_t val);
+    bool onDouble(double val);
+    bool onString(const char *str, size_t len);
+    bool onString(const std::string &str);
+    bool onKey(const char *str, size_t len);
+    bool onKey(const std::string &str);
+    bool onObjectStart();
+    bool onObjectEnd();
+    bool onArrayStart();
+    bool onArrayEnd();
+    void write(const Value &val);
+    const std::string &str() const;
+    void flush();
+    void clear();
+
+  private:
+    void separate();
+    std::function<void(const char *, size_t)> sink;
+    std::string buf;
+    std::vector<bool> first; ///< Per open container: set until its first child was written
+    bool afterKey;
+  };
+
+  class Doc;
+
+  /// A handle to a node in a JSON::Doc, valid for as long as the Doc is not parsed into again.
+  /// Reading a member or element that does not exist returns a null node, like a const Value does.
+  class Node{
+  public:
+    Node();
+    Node(const Doc &D, uint32_t idx);
+    bool isInt() const;
+    bool isDouble() const;
+    bool isString() const;
+    bool isBool() const;
+    bool isObject() const;
+    bool isArray() const;
+    bool isNull() const;
+    operator bool() const;
+    std::string asString() const;
+    int64_t asInt() const;
+    double asDouble() const;
+    bool asBool() const;
+    const char *c_str() const;
+    size_t strSize() const;
+    size_t size() const;
+    bool isMember(const std::string &name) const;
+    bool isMember(const char *name, size_t len) const;
+    Node operator[](const std::string &name) const;
+    Node operator[](const char *name) const;
+    Node operator[](uint32_t i) const;
+    std::string toString() const;
+    Value toValue() const;
+    void writeTo(Handler &H) const;
+
+  private:
+    friend class DocIter;
+    int32_t find(const char *name, size_t len) const;
+    void copyTo(Value &ret) const;
+    const Doc *D;
+    uint32_t idx;
+  };
+
+  /// Read-only JSON document, parsed into a few contiguous buffers that are reused between parses.
+  class Doc : public Handler{
+  public:
+    Doc();
+    bool parse(const char *data, size_t len);
+    bool parse(const std::string &data);
+    void clear();
+    Node root() const;
+    size_t bytes() const;
+    bool onNull();
+    bool onBool(bool val);
+    bool onInt(int64_t val);
+    bool onDouble(double val);
+    bool onString(const char *str, size_t len);
+    bool onKey(const char *str, size_t len);
+    bool onObjectStart();
+    bool onObjectEnd();
+    bool onArrayStart();
+    bool onArrayEnd();
+
+  private:
+    friend class Node;
+    friend class DocIter;
+    /// A single node. Containers point at a slice of members or elements, strings at chars.
+    struct Entry{
+      uint8_t type; ///< A JSON::ValueType
+      uint32_t size; ///< Amount of children, or the string length
+      union{
+        int64_t i;
+        double d;
+        uint32_t offset; ///< Start of the string in chars, or of the children in members/elements
+      };
+    };
+    /// An object member: a key in chars and the index of its value in entries.
+    struct Member{
+      uint32_t keyOffset;
+      uint32_t keyLen;
+      uint32_t node;
+    };
+    struct MemberOrder;
+    uint32_t add(uint8_t type);
+    uint32_t addString(const char *str, size_t len);
+    bool close(uint8_t type);
+    std::vector<Entry> entries;
+    std::vector<Member> members;   ///< Sorted slices of object members
+    std::vector<uint32_t> elements; ///< Slices of array elements
+    std::string chars;              ///< All strings and keys, each followed by a zero byte
+    std::vector<Member> pending;    ///< Children of all open containers, in document order
+    std::vector<uint32_t> open;     ///< Per open container: its entry and its first pending child
+    uint32_t keyOffset;
+    uint32_t keyLen;
+  };
+
+  /// Iterates over the elements of an array node or the members of an object node, in the same
+  /// order as JSON::ConstIter does for the equivalent JSON::Value.
+  class DocIter{
+  public:
+    DocIter(const Node &root);
+    const Node &operator*() const;
+    const Node *operator->() const;
+    operator bool() const;
+    DocIter &operator++();
+    std::string key() const;
+    const char *keyData() const;
+    uint32_t num() const;
+
+  private:
+    void load();
+    const Doc *D;
+    uint32_t parent;
+    uint32_t i;
+    Node cur;
+  };
+
+}// namespace JSON
@@ -0,0 +1,168 @@
+#include "load_push.h"
+#include "bitfields.h"
+#include "defines.h"
+
+#define LOADPUSH_DEFINE 1
+#define LOADPUSH_SET 2
+#define LOADPUSH_TEXT 3
+#define LOADPUSH_DEL 4
+
+/// Frames larger than this are considered a protocol error
+#define LOADPUSH_MAX_FRAME (16 * 1024 * 1024)
+
+namespace LoadPush{
+
+  const char *contentType = "application/vnd.mist.loadpush";
+
+  static void putString(std::string &out, const std::string &str){
+    Bit::putVarint(out, str.size());
+    out += str;
+  }
+
+  static bool getString(const char *&p, const char *end, std::string &str){
+    uint64_t len;
+    if (!Bit::getVarint(p, end, len) || len > (uint64_t)(end - p)){return false;}
+    str.assign(p, len);
+    p += len;
+    return true;
+  }
+
+  void State::clear(){
+    counters.clear();
+    texts.clear();
+  }
+
+  Encoder::Encoder(){nextId = 0;}
+
+  /// Returns the id for the given name, appending a DEFINE record to the payload if it is new.
+  uint64_t Encoder::getId(const std::string &name, std::string &payload){
+    std::map<std::string, uint64_t>::iterator it = ids.find(name);
+    if (it != ids.end()){return it->second;}
+    uint64_t id = nextId++;
+    ids[name] = id;
+    payload += (char)LOADPUSH_DEFINE;
+    Bit::putVarint(payload, id);
+    putString(payload, name);
+    return id;
+  }
+
+  /// Appends a frame with all differences between S and the previously encoded state to out.
+  /// Returns false and appends nothing if there are no differences.
+  bool Encoder::encode(const State &S, std::string &out){
+    std::string payload;
+    for (std::map<std::string, uint64_t>::const_iterator it = S.counters.begin(); it != S.counters.end(); ++it){
+      std::map<std::string, uint64_t>::iterator prev = sent.counters.find(it->first);
+      if (prev != sent.counters.end() && prev->second == it->second){continue;}
+      uint64_t id = getId(it->first, payload);
+      payload += (char)LOADPUSH_SET;
+      Bit::putVarint(payload, id);
+      Bit::putVarint(payload, it->second);
+      sent.counters[it->first] = it->second;
+      sent.texts.erase(it->first);
+    }
+    for (std::map<std::string, std::string>::const_iterator it = S.texts.begin(); it != S.texts.end(); ++it){
+      std::map<std::string, std::string>::iterator prev = sent.texts.find(it->first);
+      if (prev != sent.texts.end() && prev->second == it->second){continue;}
+      uint64_t id = getId(it->first, payload);
+      payload += (char)LOADPUSH_TEXT;
+      Bit::putVarint(payload, id);
+      putString(payload, it->second);
+      sent.texts[it->first] = it->second;
+      sent.counters.erase(it->first);
+    }
+    // Removed values are deleted, and their ids forgotten on both sides
+    std::set<std::string> gone;
+    for (std::map<std::string, uint64_t>::iterator it = sent.counters.begin(); it != sent.counters.end(); ++it){
+      if (!S.counters.count(it->first)){gone.insert(it->first);}
+    }
+    for (std::map<std::string, std::string>::iterator it = sent.texts.begin(); it != sent.texts.end(); ++it){
+      if (!S.texts.count(it->first)){gone.insert(it->first);}
+    }
+    for (std::set<std::string>::iterator it = gone.begin(); it != gone.end(); ++it){
+      payload += (char)LOADPUSH_DEL;
+      Bit::putVarint(payload, ids[*it]);
+      ids.erase(*it);
+      sent.counters.erase(*it);
+      sent.texts.erase(*it);
+    }
+    if (!payload.size()){return false;}
+    Bit::putVarint(out, payload.size());
+    out += payload;
+    return true;
+  }
+
+  /// Appends an empty frame to out, which lets the receiver know the connection is still alive.
+  void Encoder::heartbeat(std::string &out){Bit::putVarint(out, 0);}
+
+  Decoder::Decoder(){
+    frames = 0;
+    failed = false;
+  }
+
+  /// Returns true if a protocol error was encountered. No further data can be parsed after that.
+  bool Decoder::error() const{return failed;}
+
+  /// Applies all complete frames in the given data to the state.
+  /// Returns the amount of bytes used; the remainder is an incomplete frame that should be passed
+  /// again once more data has arrived.
+  size_t Decoder::parse(const char *data, size_t len){
+    const char *p = data;
+    const char *end = data + len;
+    while (!failed && p < end){
+      const char *frame = p;
+      uint64_t frameLen;
+      if (!Bit::getVarint(frame, end, frameLen)){
+        if (end - p > 10){failed = true;}
+        break;
+      }
+      if (frameLen > LOADPUSH_MAX_FRAME){
+        FAIL_MSG("Load telemetry frame of %" PRIu64 " bytes is too large", frameLen);
+        failed = true;
+        break;
+      }
+      if (frameLen > (uint64_t)(end - frame)){break;}
+      if (!applyFrame(frame, frame + frameLen)){
+        FAIL_MSG("Could not parse load telemetry frame");
+        failed = true;
+        break;
+      }
+      ++frames;
+      p = frame + frameLen;
+    }
+    return p - data;
+  }
+
+  bool Decoder::applyFrame(const char *p, const char *end){
+    while (p < end){
+      uint8_t type = *(p++);
+      uint64_t id, val;
+      if (!Bit::getVarint(p, end, id)){return false;}
+      if (type == LOADPUSH_DEFINE){
+        if (!getString(p, end, names[id])){return false;}
+        continue;
+      }
+      std::map<uint64_t, std::string>::iterator name = names.find(id);
+      if (name == names.end()){return false;}
+      switch (type){
+      case LOADPUSH_SET:
+        if (!Bit::getVarint(p, end, val)){return false;}
+        state.counters[name->second] = val;
+        state.texts.erase(name->second);
+        break;
+      case LOADPUSH_TEXT:
+        if (!getString(p, end, state.texts[name->second])){return false;}
+        state.counters.erase(name->second);
+        break;
+      case LOADPUSH_DEL:
+        state.counters.erase(name->second);
+        state.texts.erase(name->second);
+        break;
+      default: return false;
+      }
+      changed.insert(name->second);
+      if (type == LOADPUSH_DEL){names.erase(name);}
+    }
+    return true;
+  }
+
+}// namespace LoadPush
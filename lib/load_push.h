@@ -0,0 +1,62 @@
+/// \file load_push.h
+/// Compact binary protocol for pushing server load telemetry from MistController to MistUtilLoad.
+///
+/// After a "GET /<passphrase>.push" request, the controller replies with a normal HTTP header
+/// (content type LoadPush::contentType), and then keeps the connection open and sends a stream of
+/// frames. Every frame is a varint payload length followed by a list of records:
+///  - DEFINE: varint id, varint length, name. Assigns a numeric id to a value name.
+///  - SET: varint id, varint value. Sets a counter.
+///  - TEXT: varint id, varint length, text. Sets a text value.
+///  - DEL: varint id. Removes a value.
+/// Only values that changed since the previous frame are sent; an empty frame is a heartbeat.
+/// A receiver should consider the state consistent after every complete frame.
+#pragma once
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <string>
+
+namespace LoadPush{
+
+  extern const char *contentType;
+
+  /// Full set of named values describing a server's load at a point in time.
+  /// Per-stream values are named "<field>:<stream name>", server-wide values have no colon.
+  class State{
+  public:
+    std::map<std::string, uint64_t> counters;
+    std::map<std::string, std::string> texts;
+    void clear();
+  };
+
+  /// Encodes State snapshots as frames containing only the differences with the previous snapshot.
+  class Encoder{
+  public:
+    Encoder();
+    bool encode(const State &S, std::string &out);
+    void heartbeat(std::string &out);
+
+  private:
+    uint64_t getId(const std::string &name, std::string &payload);
+    std::map<std::string, uint64_t> ids; ///< Ids of all names defined so far
+    uint64_t nextId;
+    State sent; ///< State as the receiver knows it
+  };
+
+  /// Decodes frames and applies them to its state, keeping track of which values changed.
+  class Decoder{
+  public:
+    Decoder();
+    size_t parse(const char *data, size_t len);
+    bool error() const;
+    State state;
+    std::set<std::string> changed; ///< Names of values that changed or were removed since last cleared
+    uint64_t frames;                ///< Count of complete frames applied
+
+  private:
+    bool applyFrame(const char *p, const char *end);
+    std::map<uint64_t, std::string> names;
+    bool failed;
+  };
+
+}// namespace LoadPush
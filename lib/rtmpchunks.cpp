@@ -363,11 +363,12 @@ bool RTMPStream::Chunk::Parse(Socket::Buffer &buffer){
     gettimeofday(&RTMPStream::lastrec, 0);
     unsigned int i = 0;
 
-    inData.truncate(0);
-    size_t rBytes = buffer.copy(inData, 18); // Maximum possible header size is 18 bytes, incl extended timestamp
+    size_t rBytes = buffer.bytes(18); // Maximum possible header size is 18 bytes, incl extended timestamp
 
     // we want at least 3 bytes to read the chunk ID
     if (rBytes < 3) { return false; }
+    // Read the header in place, it is only removed from the buffer once the whole chunk is there
+    const char *inData = buffer.view(rBytes);
     unsigned char chunktype = inData[i++];
     // read the chunkstream ID properly
     switch (chunktype & 0x3F) {
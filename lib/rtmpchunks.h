@@ -64,7 +64,6 @@ namespace RTMPStream{
 
     Chunk();
     bool Parse(Socket::Buffer &data);
-    Util::ResizeablePointer inData;
     std::string &Pack();
     void assignWithoutData(const Chunk & rhs);
   };
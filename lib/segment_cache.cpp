@@ -0,0 +1,171 @@
+#include "segment_cache.h"
+#include "checksum.h"
+#include "defines.h"
+#include "stream.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/// Size of the fixed header in front of every cached segment: 8 bytes payload length, 4 bytes key length.
+#define SEGCACHE_HEADER 12
+
+namespace Util{
+
+  SegmentCache::SegmentCache(){
+    hitData = 0;
+    hitSize = 0;
+    recording = false;
+  }
+
+  SegmentCache::~SegmentCache(){close();}
+
+  /// Returns the page name for a given stream, key and segment start time.
+  /// The key itself is stored inside the page as well, so checksum collisions are detected on lookup.
+  std::string SegmentCache::pageName(const std::string &streamName, const std::string &key, uint64_t from){
+    char name[NAME_BUFFER_SIZE];
+    snprintf(name, NAME_BUFFER_SIZE, SHM_SEGMENT_CACHE, streamName.c_str(), from,
+             (uint32_t)checksum::crc32(0, key.data(), key.size()));
+    return name;
+  }
+
+  /// Attempts to open a completed cached segment.
+  /// On success, returns true and makes the payload available through data() and size().
+  /// The payload stays valid until the next call to find() or close().
+  bool SegmentCache::find(const std::string &streamName, const std::string &key, uint64_t from){
+    close();
+    page.init(pageName(streamName, key, from), 0, false, false);
+    if (!page.mapped || page.len < SEGCACHE_HEADER){
+      page.close();
+      return false;
+    }
+    uint64_t dataLen = *(volatile uint64_t *)page.mapped;
+    __sync_synchronize();
+    uint32_t keyLen;
+    memcpy(&keyLen, page.mapped + 8, 4);
+    // A length of zero means the writer has not finished yet; a mismatch means something is off
+    if (!dataLen || SEGCACHE_HEADER + keyLen + dataLen != page.len || keyLen != key.size() ||
+        memcmp(page.mapped + SEGCACHE_HEADER, key.data(), keyLen)){
+      page.close();
+      return false;
+    }
+    hitData = page.mapped + SEGCACHE_HEADER + keyLen;
+    hitSize = dataLen;
+    return true;
+  }
+
+  const char *SegmentCache::data() const{return hitData;}
+
+  size_t SegmentCache::size() const{return hitSize;}
+
+  /// Releases the currently opened cached segment, if any.
+  void SegmentCache::close(){
+    hitData = 0;
+    hitSize = 0;
+    page.close();
+  }
+
+  /// Starts recording a new segment. Data passed to append() is collected until store() or abandon().
+  void SegmentCache::start(const std::string &streamName, const std::string &key, uint64_t from){
+    recName = pageName(streamName, key, from);
+    recKey = key;
+    recBuf.truncate(0);
+    recording = true;
+  }
+
+  /// Adds data to the segment being recorded. Oversized segments are silently abandoned.
+  void SegmentCache::append(const char *ptr, size_t len){
+    if (!recording){return;}
+    if (recBuf.size() + len > SEGMENT_CACHE_MAXSIZE){
+      MEDIUM_MSG("Segment %s exceeds cache size limit, not caching it", recName.c_str());
+      abandon();
+      return;
+    }
+    if (!recBuf.append(ptr, len)){abandon();}
+  }
+
+  bool SegmentCache::isRecording() const{return recording;}
+
+  /// Writes the recorded segment to shared memory, making it available to all other processes.
+  /// If another process stored the same segment first, nothing is written.
+  /// The page is not removed when this object is destroyed; see evict().
+  bool SegmentCache::store(){
+    if (!recording){return false;}
+    recording = false;
+    if (!recBuf.size()){return false;}
+    uint64_t pageLen = SEGCACHE_HEADER + recKey.size() + recBuf.size();
+#ifdef SHM_ENABLED
+    int fd = shm_open(recName.c_str(), O_CREAT | O_EXCL | O_RDWR, ACCESSPERMS);
+#else
+    int fd = open(std::string(Util::getTmpFolder() + recName).c_str(), O_CREAT | O_EXCL | O_RDWR, ACCESSPERMS);
+#endif
+    if (fd == -1){
+      if (errno != EEXIST){WARN_MSG("Could not create cached segment %s: %s", recName.c_str(), strerror(errno));}
+      recBuf.truncate(0);
+      return false;
+    }
+    if (ftruncate(fd, pageLen) < 0){
+      WARN_MSG("Could not size cached segment %s: %s", recName.c_str(), strerror(errno));
+      ::close(fd);
+      recBuf.truncate(0);
+      return false;
+    }
+    char *mapped = (char *)mmap(0, pageLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED){
+      WARN_MSG("Could not map cached segment %s: %s", recName.c_str(), strerror(errno));
+      recBuf.truncate(0);
+      return false;
+    }
+    uint32_t keyLen = recKey.size();
+    memcpy(mapped + 8, &keyLen, 4);
+    memcpy(mapped + SEGCACHE_HEADER, recKey.data(), keyLen);
+    memcpy(mapped + SEGCACHE_HEADER + keyLen, (const char *)recBuf, recBuf.size());
+    // Payload must be visible before the length marks the segment as complete
+    __sync_synchronize();
+    *(volatile uint64_t *)mapped = recBuf.size();
+    munmap(mapped, pageLen);
+    HIGH_MSG("Cached segment %s (%zu bytes)", recName.c_str(), recBuf.size());
+    recBuf.truncate(0);
+    return true;
+  }
+
+  /// Discards the segment being recorded, if any.
+  void SegmentCache::abandon(){
+    recording = false;
+    recBuf.truncate(0);
+  }
+
+  /// Removes all cached segments for the given stream that start before beforeMs.
+  /// Without a beforeMs argument, all cached segments for the stream are removed.
+  void SegmentCache::evict(const std::string &streamName, uint64_t beforeMs){
+#ifdef SHM_ENABLED
+    std::string folder = "/dev/shm/";
+#else
+    std::string folder = Util::getTmpFolder();
+#endif
+    // Must match the SHM_SEGMENT_CACHE page name format
+    std::string prefix = "MstSegC" + streamName + "@";
+    DIR *d = opendir(folder.c_str());
+    if (!d){return;}
+    size_t deleted = 0;
+    struct dirent *dp;
+    while ((dp = readdir(d))){
+      if (strncmp(dp->d_name, prefix.data(), prefix.size())){continue;}
+      uint64_t from = strtoull(dp->d_name + prefix.size(), 0, 10);
+      if (from >= beforeMs){continue;}
+#ifdef SHM_ENABLED
+      if (!shm_unlink((std::string("/") + dp->d_name).c_str())){++deleted;}
+#else
+      if (!unlink((folder + dp->d_name).c_str())){++deleted;}
+#endif
+    }
+    closedir(d);
+    if (deleted){HIGH_MSG("Evicted %zu cached segment(s) for stream %s", deleted, streamName.c_str());}
+  }
+
+}// namespace Util
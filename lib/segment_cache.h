@@ -0,0 +1,40 @@
+#pragma once
+#include "shared_memory.h"
+#include "util.h"
+#include <string>
+
+namespace Util{
+
+  /// Stores fully generated media segments in shared memory, so that identical segment requests
+  /// coming in through any output process are only muxed once.
+  /// Each segment is a single page containing its own length, key and payload.
+  /// The length field is written last and doubles as the "segment is complete" marker.
+  class SegmentCache{
+  public:
+    SegmentCache();
+    ~SegmentCache();
+    bool find(const std::string &streamName, const std::string &key, uint64_t from);
+    const char *data() const;
+    size_t size() const;
+    void close();
+
+    void start(const std::string &streamName, const std::string &key, uint64_t from);
+    void append(const char *ptr, size_t len);
+    bool isRecording() const;
+    bool store();
+    void abandon();
+
+    static void evict(const std::string &streamName, uint64_t beforeMs = 0xFFFFFFFFFFFFFFFFull);
+
+  private:
+    static std::string pageName(const std::string &streamName, const std::string &key, uint64_t from);
+    IPC::sharedPage page;         ///< Currently opened cached segment, if any
+    const char *hitData;          ///< Pointer to the payload inside the opened page
+    size_t hitSize;               ///< Size of the payload inside the opened page
+    bool recording;               ///< True while collecting data for a new segment
+    std::string recName;          ///< Page name of the segment being recorded
+    std::string recKey;           ///< Key of the segment being recorded
+    Util::ResizeablePointer recBuf; ///< Segment data being recorded
+  };
+
+}// namespace Util
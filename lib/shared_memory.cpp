@@ -10,9 +10,73 @@
 #include <sys/mman.h>
 #include <sys/sem.h>
 #include <unistd.h>
+#ifdef HASFUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <climits>
+#endif
+#ifdef HASMEMPOLICY
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
 
 namespace IPC{
 
+  /// Returns true if large pages should be backed by transparent hugepages.
+  /// Enabled by setting the MIST_SHM_HUGEPAGES environment variable to anything but 0.
+  /// Requires /sys/kernel/mm/transparent_hugepage/shmem_enabled to be "advise" (or "always").
+  static bool shmHugePages(){
+    static int hugePages = -1;
+    if (hugePages == -1){
+      const char *env = getenv("MIST_SHM_HUGEPAGES");
+      hugePages = (env && *env && strcmp(env, "0")) ? 1 : 0;
+    }
+    return hugePages;
+  }
+
+  /// Returns the NUMA node newly created large pages should prefer, or -1 for no preference.
+  /// Enabled by the MIST_SHM_NUMA environment variable: either a node number, or "local" to use
+  /// the node the creating process (usually the input of the stream) is running on.
+  static int shmNumaNode(){
+    static int envNode = -2;
+    if (envNode == -2){
+      const char *env = getenv("MIST_SHM_NUMA");
+      envNode = -1;
+      if (env && !strcmp(env, "local")){
+        envNode = -3;
+      }else if (env && *env >= '0' && *env <= '9'){
+        envNode = atoi(env);
+      }
+    }
+    if (envNode != -3){return envNode;}
+#if defined(HASMEMPOLICY) && defined(SYS_getcpu)
+    unsigned int cpu = 0, node = 0;
+    if (!syscall(SYS_getcpu, &cpu, &node, 0)){return node;}
+#endif
+    return -1;
+  }
+
+  /// Applies the hugepage and NUMA settings to a freshly made mapping of a page.
+  /// Only pages of at least 2MiB (data and metadata pages) are affected.
+  /// The NUMA policy is only set by the creator of a page, before any of it is touched.
+  static void tuneMapping(char *mapped, uint64_t len, bool master, const std::string &name){
+    if (len < 2 * 1024 * 1024){return;}
+#ifdef MADV_HUGEPAGE
+    if (shmHugePages() && madvise(mapped, len, MADV_HUGEPAGE)){
+      HIGH_MSG("Could not enable hugepages for page %s: %s", name.c_str(), strerror(errno));
+    }
+#endif
+#ifdef HASMEMPOLICY
+    if (!master){return;}
+    int node = shmNumaNode();
+    if (node < 0 || node >= (int)(sizeof(unsigned long) * 8)){return;}
+    unsigned long nodeMask = 1ul << node;
+    if (syscall(SYS_mbind, mapped, len, MPOL_PREFERRED, &nodeMask, sizeof(nodeMask) * 8 + 1, 0)){
+      HIGH_MSG("Could not bind page %s to NUMA node %d: %s", name.c_str(), node, strerror(errno));
+    }
+#endif
+  }
+
   ///\brief Empty semaphore constructor, clears all values
   semaphore::semaphore(){
     mySem = SEM_FAILED;
@@ -373,6 +437,7 @@ namespace IPC{
         mapped = 0;
         return;
       }
+      tuneMapping(mapped, len, master, name);
     }
   }
 
@@ -488,12 +553,80 @@ namespace IPC{
         mapped = 0;
         return;
       }
+      tuneMapping(mapped, len, master, name);
     }
   }
 
   ///\brief Default destructor
   sharedFile::~sharedFile(){close();}
 
+  liveSequence::liveSequence(){}
+
+  /// Opens the sequence counter for the given stream.
+  /// The master (the live buffer) creates it, and removes it again when closed or destroyed.
+  /// Everyone else only opens it if it already exists, without waiting for it to appear.
+  void liveSequence::init(const std::string &streamName, bool master){
+    char pageName[NAME_BUFFER_SIZE];
+    snprintf(pageName, NAME_BUFFER_SIZE, SHM_LIVE_SEQ, streamName.c_str());
+    page.init(pageName, master ? SHM_LIVE_SEQ_LEN : 0, master, false);
+  }
+
+  liveSequence::operator bool() const{return page.mapped;}
+
+  void liveSequence::close(){page.close();}
+
+  /// Returns a pointer to the counter, or null if not available.
+  volatile uint32_t *liveSequence::counter() const{
+    if (!page.mapped || page.len < sizeof(uint32_t)){return 0;}
+    return (volatile uint32_t *)page.mapped;
+  }
+
+  /// Returns the current sequence number.
+  /// Read this before checking for new data, and pass it to wait() if there was none.
+  uint32_t liveSequence::get() const{
+    volatile uint32_t *c = counter();
+    if (!c){return 0;}
+    return __atomic_load_n(c, __ATOMIC_ACQUIRE) & ~1u;
+  }
+
+  /// Signals that new data is available, waking up all waiting readers.
+  /// Must only be called after the data itself is fully written.
+  void liveSequence::bump(){
+    volatile uint32_t *c = counter();
+    if (!c){return;}
+    uint32_t prev = __atomic_fetch_add(c, 2, __ATOMIC_SEQ_CST);
+    if (!(prev & 1)){return;}
+    __atomic_fetch_and(c, ~1u, __ATOMIC_SEQ_CST);
+#ifdef HASFUTEX
+    syscall(SYS_futex, c, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+#endif
+  }
+
+  /// Sleeps until the sequence number differs from seen, or maxMs passes.
+  /// Returns true if new data is available, false on timeout or if interrupted by a signal.
+  bool liveSequence::wait(uint32_t seen, uint64_t maxMs){
+    volatile uint32_t *c = counter();
+    if (!c){
+      Util::sleep(maxMs);
+      return false;
+    }
+    // Announce ourselves as sleeper; if the writer got there first, there's no need to sleep
+    uint32_t curr = __atomic_fetch_or(c, 1, __ATOMIC_SEQ_CST);
+    if ((curr & ~1u) != seen){return true;}
+    if (!maxMs){return false;}
+#ifdef HASFUTEX
+    struct timespec ts;
+    ts.tv_sec = maxMs / 1000;
+    ts.tv_nsec = (maxMs % 1000) * 1000000;
+    syscall(SYS_futex, c, FUTEX_WAIT, seen | 1, &ts, 0, 0);
+#else
+    // Without futexes, poll for the change in short steps
+    uint64_t stop = Util::bootMS() + maxMs;
+    while (get() == seen && Util::bootMS() < stop){Util::sleep(5);}
+#endif
+    return get() != seen;
+  }
+
   ///\brief Creates a semaphore guard, locks the semaphore on call
   semGuard::semGuard(semaphore *thisSemaphore) : mySemaphore(thisSemaphore){mySemaphore->wait();}
 
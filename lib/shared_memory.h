@@ -114,4 +114,23 @@ namespace IPC{
     ~sharedPage();
   };
 #endif
+
+  ///\brief A sequence counter for a live stream, in shared memory.
+  /// Live data writers bump the counter after every packet, so readers can sleep until new data
+  /// lands instead of polling the data pages on a timer.
+  /// Bit 0 of the counter flags sleeping readers, so writers only make a system call when needed.
+  class liveSequence{
+  public:
+    liveSequence();
+    void init(const std::string &streamName, bool master = false);
+    operator bool() const;
+    uint32_t get() const;
+    void bump();
+    bool wait(uint32_t seen, uint64_t maxMs);
+    void close();
+
+  private:
+    volatile uint32_t *counter() const;
+    sharedPage page;
+  };
 }// namespace IPC
@@ -31,8 +31,16 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#ifdef HASSENDFILE
+#include <sys/sendfile.h>
+#endif
+#ifdef HASSENDMMSG
+#include <netinet/udp.h>
+#endif
 
 #define BUFFER_BLOCKSIZE 4096 // set buffer blocksize to 4KiB
+#define BUFFER_MAXREAD 65536 // read at most 64KiB at once into a buffer
+#define IOV_BATCH 64 // max pieces passed to a single writev call
 
 #ifdef __CYGWIN__
 #define SOCKETSIZE 8092ul
@@ -40,6 +48,10 @@
 #define SOCKETSIZE 51200ul
 #endif
 
+#define UDP_BATCH_MAX 64 // max datagrams queued by UDPConnection::batchSend before flushing
+#define UDP_GSO_MAXSIZE 65000 // max total bytes handed to a single UDP segmentation offload send
+#define UDP_PACE_BURST 8 // max paced datagrams sent at once when catching up
+
 bool WS_STARTED = false;
 
 /// Local-scope only helper function that prints address families
@@ -645,285 +657,226 @@ std::string uint2string(unsigned int i){
 
 Socket::Buffer::Buffer(){
   splitter = "\n";
+  slabStart = 0;
+  readSize = BUFFER_BLOCKSIZE;
 }
 
-/// Returns the amount of elements in the internal std::deque of std::string objects.
-/// The back is popped as long as it is empty, first - this way this function is
-/// guaranteed to return 0 if the buffer is empty.
+/// Returns the amount of bytes in the slab, excluding those handed out by get().
+size_t Socket::Buffer::slabBytes() const{
+  return slab.size() - slabStart;
+}
+
+/// Returns the amount of parts in the buffer: the part handed out by get() if it is not empty,
+/// plus a single part for everything after it.
+/// This function is guaranteed to return 0 if the buffer is empty.
 unsigned int Socket::Buffer::size(){
-  while (data.size() && data.back().empty()) { data.pop_back(); }
-  return data.size();
+  return (front.size() ? 1 : 0) + (slabBytes() ? 1 : 0);
 }
 
 /// Returns either the amount of total bytes available in the buffer or max, whichever is smaller.
 unsigned int Socket::Buffer::bytes(unsigned int max) const {
-  unsigned int i = 0;
-  for (std::deque<std::string>::const_iterator it = data.begin(); it != data.end(); ++it) {
-    i += (*it).size();
-    if (i >= max){return max;}
-  }
-  return i;
+  size_t i = front.size() + slabBytes();
+  return (i < max) ? i : max;
 }
 
-/// Returns how many bytes to read until the next splitter, or 0 if none found.
+/// Returns how many bytes to read until the end of the next splitter, or 0 if none found.
+/// If the splitter is empty, returns the size of the first part instead.
 unsigned int Socket::Buffer::bytesToSplit() const {
-  unsigned int i = 0;
-  for (std::deque<std::string>::const_reverse_iterator it = data.rbegin(); it != data.rend(); ++it) {
-    i += (*it).size();
-    if ((*it).size() >= splitter.size() && (*it).substr((*it).size() - splitter.size()) == splitter){
-      return i;
+  const char *s = (const char *)slab + slabStart;
+  size_t sLen = slabBytes();
+  if (!splitter.size()){return front.size() ? front.size() : sLen;}
+  size_t f = front.find(splitter);
+  if (f != std::string::npos){return f + splitter.size();}
+  // The splitter may start at the end of the front part and continue in the slab
+  for (size_t i = 1; i < splitter.size() && i <= front.size(); ++i){
+    if (splitter.size() - i <= sLen && !front.compare(front.size() - i, i, splitter, 0, i) &&
+        !memcmp(s, splitter.data() + i, splitter.size() - i)){
+      return front.size() + splitter.size() - i;
     }
   }
-  return 0;
+  const char *m = (const char *)memmem(s, sLen, splitter.data(), splitter.size());
+  if (!m){return 0;}
+  return front.size() + (m - s) + splitter.size();
 }
 
-/// Appends this string to the internal std::deque of std::string objects.
-/// It is automatically split every BUFFER_BLOCKSIZE bytes and when the splitter string is
-/// encountered.
+/// Appends this string to the end of the buffer.
 void Socket::Buffer::append(const std::string &newdata){
   append(newdata.data(), newdata.size());
 }
 
-/// Helper function that does a short-circuiting string compare
-inline bool string_compare(const char *a, const char *b, const size_t len){
-  for (size_t i = 0; i < len; ++i){
-    if (a[i] != b[i]){return false;}
-  }
-  return true;
+/// Appends this data block to the end of the buffer.
+void Socket::Buffer::append(const char *newdata, const unsigned int newdatasize){
+  if (!newdatasize){return;}
+  char *dest = space(newdatasize);
+  if (!dest){return;}
+  memcpy(dest, newdata, newdatasize);
+  slab.append(0, newdatasize);
 }
 
-/// Appends this data block to the internal std::deque of std::string objects.
-/// It is automatically split every BUFFER_BLOCKSIZE bytes and when the splitter string is
-/// encountered.
-void Socket::Buffer::append(const char *newdata, const unsigned int newdatasize){
-  uint32_t i = 0;
-  while (i < newdatasize){
-    uint32_t j = 0;
-    if (!splitter.size()){
-      if (newdatasize - i > BUFFER_BLOCKSIZE){
-        j = BUFFER_BLOCKSIZE;
-      }else{
-        j = newdatasize - i;
-      }
-    }else{
-      while (j + i < newdatasize && j < BUFFER_BLOCKSIZE){
-        j++;
-        if (j >= splitter.size()){
-          if (string_compare(newdata + i + j - splitter.size(), splitter.data(), splitter.size())){
-            break;
-          }
-        }
-      }
-    }
-    if (j){
-      data.push_front("");
-      data.front().assign(newdata + i, (size_t)j);
-      i += j;
-    }else{
-      FAIL_MSG("Appended an empty string to buffer: aborting!");
-      break;
-    }
+/// Prepends this data block to the buffer, as a part of its own.
+void Socket::Buffer::prepend(const std::string &newdata){
+  prepend(newdata.data(), newdata.size());
+}
+
+/// Prepends this data block to the buffer, as a part of its own.
+void Socket::Buffer::prepend(const char *newdata, const unsigned int newdatasize){
+  unget();
+  front.assign(newdata, newdatasize);
+}
+
+/// Makes sure count more bytes fit at the end of the slab, and returns where they should go.
+/// Returns a null pointer if the memory could not be allocated.
+char *Socket::Buffer::space(size_t count){
+  // Reclaim the space of removed data once it makes up at least half of the slab
+  if (slabStart && slabStart >= slab.size() / 2){
+    slab.shift(slabStart);
+    slabStart = 0;
   }
-  if (data.size() > 5000){
-    WARN_MSG("Warning: After %d new bytes, buffer has %d parts containing over %u bytes!",
-             newdatasize, (int)data.size(), bytes(9000));
+  if (slab.size() + count > slab.rsize()){
+    size_t want = slab.rsize() * 2;
+    if (want < slab.size() + count){want = slab.size() + count;}
+    if (!slab.allocate(want)){return 0;}
   }
+  return (char *)slab + slab.size();
 }
 
-/// Prepends this data block to the internal std::deque of std::string objects.
-/// It is _not_ automatically split every BUFFER_BLOCKSIZE bytes.
-void Socket::Buffer::prepend(const std::string &newdata){
-  data.push_back(newdata);
+/// Moves the part handed out by get() back into the slab, in front of the rest of the data.
+void Socket::Buffer::unget(){
+  if (!front.size()){return;}
+  if (slabStart < front.size()){
+    size_t rest = slabBytes();
+    if (!slab.allocate(front.size() + rest)){return;}
+    memmove((char *)slab + front.size(), (char *)slab + slabStart, rest);
+    slab.truncate(0);
+    slab.append(0, front.size() + rest);
+    slabStart = front.size();
+  }
+  slabStart -= front.size();
+  memcpy((char *)slab + slabStart, front.data(), front.size());
+  front.clear();
 }
 
-/// Prepends this data block to the internal std::deque of std::string objects.
-/// It is _not_ automatically split every BUFFER_BLOCKSIZE bytes.
-void Socket::Buffer::prepend(const char *newdata, const unsigned int newdatasize){
-  data.push_back(std::string(newdata, (size_t)newdatasize));
+/// Removes count bytes from the front of the slab, which must hold at least that many.
+void Socket::Buffer::consume(size_t count){
+  slabStart += count;
+  if (slabStart == slab.size()){
+    slabStart = 0;
+    slab.truncate(0);
+  }
 }
 
 /// Returns true if at least count bytes are available in this buffer.
 bool Socket::Buffer::available(unsigned int count){
-  size();
-  unsigned int i = 0;
-  for (std::deque<std::string>::iterator it = data.begin(); it != data.end(); ++it){
-    i += (*it).size();
-    if (i >= count){return true;}
-  }
-  return false;
+  return front.size() + slabBytes() >= count;
 }
 
 /// Returns true if at least count bytes are available in this buffer.
 bool Socket::Buffer::available(unsigned int count) const{
-  unsigned int i = 0;
-  for (std::deque<std::string>::const_iterator it = data.begin(); it != data.end(); ++it){
-    i += (*it).size();
-    if (i >= count){return true;}
-  }
-  return false;
+  return front.size() + slabBytes() >= count;
 }
 
 /// Removes count bytes from the buffer, erasing them.
 void Socket::Buffer::skip(size_t count) {
-  size_t i = 0;
-  while (data.size()) {
-    if (i + data.back().size() <= count) {
-      i += data.back().size();
-      data.pop_back();
-    } else {
-      data.back().erase(0, count - i);
-      return;
-    }
+  if (count < front.size()){
+    front.erase(0, count);
+    return;
   }
+  count -= front.size();
+  front.clear();
+  consume(count < slabBytes() ? count : slabBytes());
 }
 
 /// Removes count bytes from the buffer, returning them by value.
 /// Returns an empty string if not all count bytes are available.
 std::string Socket::Buffer::remove(size_t count) {
-  size();
-  if (!available(count)){return "";}
-  size_t i = 0;
-  std::string ret;
-  ret.reserve(count);
-  for (std::deque<std::string>::reverse_iterator it = data.rbegin(); it != data.rend(); ++it){
-    if (i + (*it).size() < count){
-      ret.append(*it);
-      i += (*it).size();
-      (*it).clear();
-    }else{
-      ret.append(*it, 0, count - i);
-      (*it).erase(0, count - i);
-      break;
-    }
-  }
+  std::string ret = copy(count);
+  if (ret.size()){skip(count);}
   return ret;
 }
 
 /// Removes count bytes from the buffer, appending them to the given ptr.
 /// Does nothing if not all count bytes are available.
 void Socket::Buffer::remove(Util::ResizeablePointer & ptr, size_t count) {
-  size();
   if (!available(count)){return;}
-  unsigned int i = 0;
-  for (std::deque<std::string>::reverse_iterator it = data.rbegin(); it != data.rend(); ++it){
-    if (i + (*it).size() < count){
-      ptr.append(*it);
-      i += (*it).size();
-      (*it).clear();
-    }else{
-      ptr.append(it->data(), count - i);
-      (*it).erase(0, count - i);
-      break;
-    }
-  }
+  copy(ptr, count);
+  skip(count);
 }
 
 /// Copies count bytes from the buffer, returning them by value.
 /// Returns an empty string if not all count bytes are available.
 std::string Socket::Buffer::copy(size_t count) {
-  size();
   if (!available(count)){return "";}
-  unsigned int i = 0;
   std::string ret;
   ret.reserve(count);
-  for (std::deque<std::string>::const_reverse_iterator it = data.rbegin(); it != data.rend(); ++it) {
-    if (i + (*it).size() < count){
-      ret.append(*it);
-      i += (*it).size();
-    }else{
-      ret.append(*it, 0, count - i);
-      break;
-    }
-  }
+  size_t fromFront = count < front.size() ? count : front.size();
+  ret.append(front, 0, fromFront);
+  if (count > fromFront){ret.append((const char *)slab + slabStart, count - fromFront);}
   return ret;
 }
 
 /// Copies up to count bytes from the buffer, appending them to the given ptr.
 /// Returns actual data copied, which may be a short count.
 size_t Socket::Buffer::copy(Util::ResizeablePointer & ptr, size_t count) {
-  size_t i = 0;
+  count = bytes(count);
+  size_t fromFront = count < front.size() ? count : front.size();
   ptr.allocate(ptr.size() + count);
-  for (std::deque<std::string>::reverse_iterator it = data.rbegin(); it != data.rend(); ++it) {
-    size_t toAppend = it->size();
-    if (i + toAppend > count) { toAppend = count - i; }
-    ptr.append(it->data(), toAppend);
-    i += toAppend;
-    if (i >= count) { return i; }
-  }
-  return i;
+  ptr.append(front.data(), fromFront);
+  ptr.append((const char *)slab + slabStart, count - fromFront);
+  return count;
 }
 
-/// Copies count bytes from the buffer, returning them by value.
-/// Returns an empty string if not all count bytes are available.
-/// Gets a reference to the back of the internal std::deque of std::string objects.
+/// Returns a reference to the first part of the buffer: everything up to and including the first
+/// occurrence of the splitter string, or all data if there is none or the splitter is empty.
+/// The part may be changed in place; once it is cleared, the next call returns the next part.
 std::string &Socket::Buffer::get(){
-  size();
-  static std::string empty;
-  if (data.size() > 0){
-    return data.back();
-  }else{
-    return empty;
+  size_t len = slabBytes();
+  if (front.size() || !len){return front;}
+  const char *s = (const char *)slab + slabStart;
+  if (splitter.size()){
+    const char *m = (const char *)memmem(s, len, splitter.data(), splitter.size());
+    if (m){len = m - s + splitter.size();}
   }
+  front.assign(s, len);
+  consume(len);
+  return front;
+}
+
+/// Like get(), but joins all data in the buffer into a single part first.
+std::string &Socket::Buffer::getAll(){
+  if (!slabBytes()){return front;}
+  front.append((const char *)slab + slabStart, slabBytes());
+  consume(slabBytes());
+  return front;
+}
+
+/// Returns a pointer to the first count bytes of the buffer, in contiguous memory, without
+/// copying them anywhere. Returns a null pointer if not all count bytes are available.
+/// The pointer is valid until the buffer is next changed.
+const char *Socket::Buffer::view(size_t count){
+  if (!available(count)){return 0;}
+  if (count > front.size()){unget();}
+  if (front.size()){return front.data();}
+  return (const char *)slab + slabStart;
 }
 
 /// Completely empties the buffer
 void Socket::Buffer::clear(){
-  data.clear();
+  front.clear();
+  slab.truncate(0);
+  slabStart = 0;
 }
 
+/// Reclaims the space of all data that was removed from the buffer.
+/// Returns false if the buffer holds more than 256MiB of data, which is too much to keep.
 bool Socket::Buffer::compact(){
-  size_t preSize = size();
-  size_t preBytes = bytes(0xFFFFFFFFull);
-
-  size_t compactSize = 4096; // 4k chunks
-  if (preBytes > 4194304){ // more than 4MiB of data
-    compactSize = 8192; // 8k chunks
-    if (preBytes > 16777216){ // more than 16MiB of data
-      compactSize = 16384; // 16k chunks
-      if (preBytes > 33554432){ // more than 32MiB of data
-        compactSize = 32768; // 32k chunks
-        if (preBytes > 268435456){ // more than 256MiB of data
-          FAIL_MSG("Disconnecting socket with buffer containing more than 256MiB of data!");
-          return false; // Abort!
-        }
-      }
-    }
-  }
-
-
-  bool changed = false;
-  for (std::deque<std::string>::reverse_iterator it = data.rbegin(); it != data.rend(); ++it){
-    if (it->size() < compactSize){
-      it->reserve(compactSize);
-      std::deque<std::string>::reverse_iterator currIt = it;
-      ++it;
-      while (currIt->size() < compactSize && it != data.rend()){
-        changed = true;
-        currIt->append(*it);
-        it->clear();
-        if (currIt->size() >= compactSize){break;}
-        ++it;
-      }
-      if (it == data.rend()){break;}
-    }
-  }
-  if (!changed){
-    FAIL_MSG("Disconnecting socket due to socket buffer compacting failure");
+  if (bytes(0xFFFFFFFFul) > 268435456){
+    FAIL_MSG("Disconnecting socket with buffer containing more than 256MiB of data!");
     return false;
   }
-  while (changed){
-    changed = false;
-    for (std::deque<std::string>::iterator it = data.begin(); it != data.end(); ++it){
-      if (!it->size()){
-        data.erase(it);
-        changed = true;
-        break;
-      }
-    }
+  if (slabStart){
+    slab.shift(slabStart);
+    slabStart = 0;
   }
-
-  size_t postSize = size();
-  WARN_MSG("Compacted a %zub socket buffer of %zu parts into %zu parts", preBytes, preSize, postSize);
   return true;
 }
 
@@ -1460,15 +1413,11 @@ uint64_t Socket::Connection::dataDown(){
 /// Returns true if new data was received, false otherwise.
 bool Socket::Connection::spool(bool strictMode){
   /// \todo Provide better mechanism to prevent overbuffering.
-  if (!strictMode && downbuffer.size() > 5000){
-    if (!downbuffer.compact()){
-      close();
-      return false;
-    }
-    return true;
-  }else{
-    return iread(downbuffer);
+  if (!strictMode && downbuffer.bytes(0xFFFFFFFFul) > 268435456 && !downbuffer.compact()){
+    close();
+    return false;
   }
+  return iread(downbuffer);
 }
 
 bool Socket::Connection::peek(){
@@ -1497,10 +1446,10 @@ void Socket::Connection::send(const char *data, size_t len) {
   if (!blocking) {
     // If we already have data in the buffer, attempt to write it first
     while (upBuffer.size() && connected()) {
-      std::string & B = upBuffer.get();
-      size_t written = iwrite(B.data(), B.size());
+      size_t pending = upBuffer.bytes(0xFFFFFFFFul);
+      size_t written = iwrite(upBuffer.view(pending), pending);
       if (!written) { break; }
-      B.erase(0, written);
+      upBuffer.skip(written);
     }
     // Abort if the connection isn't open (anymore), or we have nothing to write
     if (!connected() || !len) { return; }
@@ -1529,6 +1478,111 @@ void Socket::Connection::send(const char *data, size_t len) {
   } while (i < len && connected());
 }
 
+/// Sends the given pieces of (raw) data in order, as if they were concatenated and passed to send().
+/// Where possible, the pieces are handed to the kernel together in a single writev() call, so
+/// headers and payloads go out in one system call without copying the payloads first.
+/// SSL connections and connections skipping bytes instead gather the pieces through a buffer.
+void Socket::Connection::sendGather(const struct iovec *vec, size_t count) {
+  size_t len = 0;
+  for (size_t i = 0; i < count; ++i) { len += vec[i].iov_len; }
+  if (!blocking) {
+    // If we already have data in the buffer, attempt to write it first
+    while (upBuffer.size() && connected()) {
+      size_t pending = upBuffer.bytes(0xFFFFFFFFul);
+      size_t written = iwrite(upBuffer.view(pending), pending);
+      if (!written) { break; }
+      upBuffer.skip(written);
+    }
+    // Abort if the connection isn't open (anymore), or we have nothing to write
+    if (!connected() || !len) { return; }
+    if (upBuffer.size()) {
+      INFO_MSG("%zu bytes left in buffer, buffering %zu more", (size_t)upBuffer.bytes(0xFFFFFFFFull), len);
+      upBuffer.splitter.clear();
+      for (size_t i = 0; i < count; ++i) { upBuffer.append((const char *)vec[i].iov_base, vec[i].iov_len); }
+      return;
+    }
+  }
+
+  // Let's not write nothing, shall we?
+  if (!len) { return; }
+
+  bool copyMode = skipCount;
+#ifdef SSL
+  if (sslConnected) { copyMode = true; }
+#endif
+  if (copyMode) {
+    // Gather the pieces into full-sized writes, so small headers don't end up in records of their own
+    char buf[SOCKETSIZE];
+    size_t bufLen = 0;
+    for (size_t i = 0; i < count && connected(); ++i) {
+      const char *data = (const char *)vec[i].iov_base;
+      size_t left = vec[i].iov_len;
+      while (left) {
+        size_t toCopy = std::min(left, SOCKETSIZE - bufLen);
+        memcpy(buf + bufLen, data, toCopy);
+        bufLen += toCopy;
+        data += toCopy;
+        left -= toCopy;
+        if (bufLen == SOCKETSIZE) {
+          send(buf, bufLen);
+          bufLen = 0;
+        }
+      }
+    }
+    if (bufLen) { send(buf, bufLen); }
+    return;
+  }
+
+  // Attempt to send the (new) data immediately without buffering
+  struct iovec batch[IOV_BATCH];
+  size_t piece = 0;  // first piece that is not completely written yet
+  size_t offset = 0; // bytes of that piece that are already written
+  while (len && connected()) {
+    int n = 0;
+    for (size_t i = piece; i < count && n < IOV_BATCH; ++i) {
+      size_t skip = (i == piece) ? offset : 0;
+      if (vec[i].iov_len == skip) { continue; }
+      batch[n].iov_base = (char *)vec[i].iov_base + skip;
+      batch[n].iov_len = vec[i].iov_len - skip;
+      ++n;
+    }
+    size_t written = iwritev(batch, n);
+    if (!written && !blocking) {
+      // Socket full? Buffer the rest, if non-blocking
+      INFO_MSG("Socket full - buffering %zu bytes", len);
+      for (size_t i = piece; i < count; ++i) {
+        size_t skip = (i == piece) ? offset : 0;
+        upBuffer.append((const char *)vec[i].iov_base + skip, vec[i].iov_len - skip);
+      }
+      break;
+    }
+    len -= written;
+    written += offset;
+    while (piece < count && written >= vec[piece].iov_len) { written -= vec[piece++].iov_len; }
+    offset = written;
+  }
+}
+
+/// Writes the chunked transfer encoding header for a chunk of the given (non-zero) length into
+/// lenChars, which must be at least 10 bytes long. Returns the offset the header starts at.
+static size_t chunkHeader(char *lenChars, size_t len) {
+  size_t offset = 8;
+  memcpy(lenChars, "00000000\r\n", 10);
+  while (len && offset < 9) {
+    lenChars[--offset] = "0123456789abcdef"[len & 0xf];
+    len >>= 4;
+  }
+  return offset;
+}
+
+/// Sends the chunked transfer encoding header for a chunk of the given (non-zero) length.
+void Socket::Connection::sendChunkHeader(size_t len) {
+  char lenChars[10];
+  size_t offset = chunkHeader(lenChars, len);
+  // Send the string we generated with the hex length and newline
+  send(lenChars + offset, 10 - offset);
+}
+
 /// Sends (potentially chunked) data immediately if blocking, buffers it for later (if needed) when non-blocking.
 void Socket::Connection::SendNow(const char *data, size_t len) {
   if (chunkedMode) {
@@ -1539,15 +1593,7 @@ void Socket::Connection::SendNow(const char *data, size_t len) {
       return;
     }
     // Non-zero length -> prepend the length in hex format
-    size_t offset = 8;
-    size_t t_size = len;
-    char lenChars[] = "00000000\r\n";
-    while (t_size && offset < 9) {
-      lenChars[--offset] = "0123456789abcdef"[t_size & 0xf];
-      t_size >>= 4;
-    }
-    // Send the string we generated with the hex length and newline
-    send(lenChars + offset, 10 - offset);
+    sendChunkHeader(len);
   }
   // Send the actual data (both chunked and non-chunked mode)
   send(data, len);
@@ -1555,6 +1601,39 @@ void Socket::Connection::SendNow(const char *data, size_t len) {
   if (chunkedMode) { send("\r\n", 2); }
 }
 
+/// Sends the given pieces of data as if they were concatenated and passed to SendNow.
+/// In chunked mode, all pieces together become a single chunk.
+void Socket::Connection::sendv(const struct iovec *vec, size_t count) {
+  if (!chunkedMode) {
+    sendGather(vec, count);
+    return;
+  }
+  size_t len = 0;
+  for (size_t i = 0; i < count; ++i) { len += vec[i].iov_len; }
+  // No length? Send end-of-chunked-mode, and exit chunked mode
+  if (!len) {
+    send("0\r\n\r\n", 5);
+    chunkedMode = false;
+    return;
+  }
+  char lenChars[10];
+  size_t offset = chunkHeader(lenChars, len);
+  if (count > 14) {
+    send(lenChars + offset, 10 - offset);
+    sendGather(vec, count);
+    send("\r\n", 2);
+    return;
+  }
+  // Wrap the pieces in the chunk header and trailing newline, and send it all in one go
+  struct iovec all[16];
+  all[0].iov_base = lenChars + offset;
+  all[0].iov_len = 10 - offset;
+  memcpy(all + 1, vec, count * sizeof(struct iovec));
+  all[count + 1].iov_base = (void *)"\r\n";
+  all[count + 1].iov_len = 2;
+  sendGather(all, count + 2);
+}
+
 /// Sends (potentially chunked) data immediately if blocking, buffers it for later (if needed) when non-blocking.
 void Socket::Connection::SendNow(const char *data) {
   SendNow(data, strlen(data));
@@ -1565,6 +1644,58 @@ void Socket::Connection::SendNow(const std::string & data) {
   SendNow(data.data(), data.size());
 }
 
+/// Sends len bytes from file descriptor fd, starting at offset, as if they were passed to SendNow.
+/// Where possible, uses sendfile() so the data is never copied through user space.
+/// Falls back to reading the data into memory for SSL connections, when bytes are being skipped,
+/// when earlier data is still buffered, or when the kernel does not support the descriptor types.
+/// Returns false (and closes the connection) if the file could not be read completely.
+bool Socket::Connection::SendFile(int fd, uint64_t offset, size_t len) {
+  if (!len) { return true; }
+  if (chunkedMode) { sendChunkHeader(len); }
+  bool copyMode = skipCount || (!blocking && upBuffer.size());
+#ifdef SSL
+  if (sslConnected) { copyMode = true; }
+#endif
+#ifdef HASSENDFILE
+  while (!copyMode && len && connected()) {
+    off_t off = offset;
+    ssize_t r = sendfile(sSend, fd, &off, len);
+    if (r < 0) {
+      if (errno == EINTR) { continue; }
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINVAL && errno != ENOSYS) {
+        Error = true;
+        lastErr = strerror(errno);
+        INSANE_MSG("Could not sendfile data! Error: %s", lastErr.c_str());
+        close();
+        return false;
+      }
+      // Socket full (non-blocking) or unsupported descriptors: continue through the buffer
+      copyMode = true;
+      break;
+    }
+    if (!r) { break; }
+    up += r;
+    offset += r;
+    len -= r;
+  }
+#endif
+  char buf[SOCKETSIZE];
+  while (len && connected()) {
+    ssize_t r = pread(fd, buf, std::min(len, (size_t)SOCKETSIZE), offset);
+    if (r < 0 && errno == EINTR) { continue; }
+    if (r <= 0) {
+      FAIL_MSG("Could not read %zu bytes at position %" PRIu64 " for sending: %s", len, offset, r ? strerror(errno) : "end of file");
+      close();
+      return false;
+    }
+    send(buf, r);
+    offset += r;
+    len -= r;
+  }
+  if (chunkedMode) { send("\r\n", 2); }
+  return true;
+}
+
 void Socket::Connection::skipBytes(uint32_t byteCount){
   INFO_MSG("Skipping first %" PRIu32 " bytes going to socket", byteCount);
   skipCount = byteCount;
@@ -1645,6 +1776,36 @@ unsigned int Socket::Connection::iwrite(const void *buffer, int len){
   return r;
 }// Socket::Connection::iwrite
 
+/// Incremental gathering write call. This function tries to write all given pieces to the socket
+/// in a single system call, returning the amount of bytes it actually wrote.
+/// Does not support SSL connections or skipping bytes; send() takes care of those.
+/// \param vec The pieces to write, in order.
+/// \param count Amount of pieces.
+/// \returns The amount of bytes actually written.
+unsigned int Socket::Connection::iwritev(const struct iovec *vec, int count){
+  if (!connected() || count < 1){return 0;}
+  ssize_t r = ::writev(sSend, vec, count);
+  if (r < 0){
+    switch (errno){
+    case EWOULDBLOCK: return 0; break;
+    case EINTR: return 0; break;
+    default:
+      Error = true;
+      lastErr = strerror(errno);
+      INSANE_MSG("Could not iwritev data! Error: %s", lastErr.c_str());
+      close();
+      return 0;
+      break;
+    }
+  }
+  if (r == 0 && (sSend >= 0)){
+    DONTEVEN_MSG("Socket closed by remote");
+    close();
+  }
+  up += r;
+  return r;
+}// Socket::Connection::iwritev
+
 /// Incremental read call. This function tries to read len bytes to the buffer from the socket,
 /// returning the amount of bytes it actually read.
 /// \param buffer Location of the buffer to read to.
@@ -1723,10 +1884,13 @@ int Socket::Connection::iread(void *buffer, int len, int flags){
 /// \param flags Flags to use in the recv call. Ignored on fake sockets.
 /// \return True if new data arrived, false otherwise.
 bool Socket::Connection::iread(Buffer &buffer, int flags){
-  char cbuffer[BUFFER_BLOCKSIZE];
-  int num = iread(cbuffer, BUFFER_BLOCKSIZE, flags);
+  char *dest = buffer.space(buffer.readSize);
+  if (!dest){return false;}
+  int num = iread(dest, buffer.readSize, flags);
   if (num < 1){return false;}
-  buffer.append(cbuffer, num);
+  buffer.slab.append(0, num);
+  // Read more at once next time if this read filled all the space it was given
+  if ((size_t)num == buffer.readSize && buffer.readSize < BUFFER_MAXREAD){buffer.readSize *= 2;}
   return true;
 }// iread
 
@@ -2213,6 +2377,8 @@ void Socket::UDPConnection::init(bool _nonblock, int _family){
 #endif
 
   lastPace = 0;
+  batchGSO = true;
+  recvSlot = 2048;
   family = _family;
   hasDTLS = false;
   isConnected = false;
@@ -2531,6 +2697,7 @@ Socket::UDPConnection::UDPConnection(const UDPConnection &o){
 
 /// Close the UDP socket
 void Socket::UDPConnection::close(){
+  flushBatch();
   if (sock != -1){
     errno = EINTR;
     while (::close(sock) != 0 && errno == EINTR){}
@@ -2698,6 +2865,41 @@ void Socket::UDPConnection::SendNow(const char *sdata, size_t len){
 /// Sends a UDP datagram using the buffer sdata of length len.
 /// Does not do anything if len < 1.
 /// Prints an DLVL_FAIL level debug message if sending failed.
+#ifdef HASPKTINFO
+/// Fills cmsg with a pktinfo control message that makes a datagram leave from the given local
+/// address and interface, so replies come from the address the request was sent to.
+/// Returns the amount of control buffer space used, which is zero for unknown address families.
+static size_t setPktInfo(CMSGHDR *cmsg, int family, const Socket::Address &local, int iface){
+  if (family == AF_INET){
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+
+    struct in_pktinfo in_pktinfo;
+#if defined(_WIN32) || defined(__CYGWIN__)
+    memcpy(&(in_pktinfo.ipi_addr), local.ipPtr(), sizeof(in_pktinfo.ipi_addr));
+#else
+    memcpy(&(in_pktinfo.ipi_spec_dst), local.ipPtr(), sizeof(in_pktinfo.ipi_spec_dst));
+#endif
+    in_pktinfo.ipi_ifindex = iface;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+    *(struct in_pktinfo*)CMSG_DATA(cmsg) = in_pktinfo;
+    return CMSG_SPACE(sizeof(in_pktinfo));
+  }
+  if (family == AF_INET6){
+    cmsg->cmsg_level = IPPROTO_IPV6;
+    cmsg->cmsg_type = IPV6_PKTINFO;
+
+    struct in6_pktinfo in6_pktinfo;
+    memcpy(&(in6_pktinfo.ipi6_addr), local.ipPtr(), sizeof(in6_pktinfo.ipi6_addr));
+    in6_pktinfo.ipi6_ifindex = iface;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(in6_pktinfo));
+    *(struct in6_pktinfo*)CMSG_DATA(cmsg) = in6_pktinfo;
+    return CMSG_SPACE(sizeof(in6_pktinfo));
+  }
+  return 0;
+}
+#endif
+
 void Socket::UDPConnection::SendNow(const char *sdata, size_t len, sockaddr * dAddr, size_t dAddrLen){
   if (len < 1 || sock == -1){return;}
   if (isConnected){
@@ -2751,33 +2953,7 @@ void Socket::UDPConnection::SendNow(const char *sdata, size_t len, sockaddr * dA
     mHdr.msg_flags = 0;
 #endif
 
-    int cmsg_space = 0;
-    CMSGHDR *cmsg = CMSG_FIRSTHDR(&mHdr);
-    if (family == AF_INET){
-      cmsg->cmsg_level = IPPROTO_IP;
-      cmsg->cmsg_type = IP_PKTINFO;
-
-      struct in_pktinfo in_pktinfo;
-#if defined(_WIN32) || defined(__CYGWIN__)
-      memcpy(&(in_pktinfo.ipi_addr), recvAddr.ipPtr(), sizeof(in_pktinfo.ipi_addr));
-#else
-      memcpy(&(in_pktinfo.ipi_spec_dst), recvAddr.ipPtr(), sizeof(in_pktinfo.ipi_spec_dst));
-#endif
-      in_pktinfo.ipi_ifindex = recvInterface;
-      cmsg->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
-      *(struct in_pktinfo*)CMSG_DATA(cmsg) = in_pktinfo;
-      cmsg_space += CMSG_SPACE(sizeof(in_pktinfo));
-    }else if (family == AF_INET6){
-      cmsg->cmsg_level = IPPROTO_IPV6;
-      cmsg->cmsg_type = IPV6_PKTINFO;
-
-      struct in6_pktinfo in6_pktinfo;
-      memcpy(&(in6_pktinfo.ipi6_addr), recvAddr.ipPtr(), sizeof(in6_pktinfo.ipi6_addr));
-      in6_pktinfo.ipi6_ifindex = recvInterface;
-      cmsg->cmsg_len = CMSG_LEN(sizeof(in6_pktinfo));
-      *(struct in6_pktinfo*)CMSG_DATA(cmsg) = in6_pktinfo;
-      cmsg_space += CMSG_SPACE(sizeof(in6_pktinfo));
-    }
+    int cmsg_space = setPktInfo(CMSG_FIRSTHDR(&mHdr), family, recvAddr, recvInterface);
 
 #if defined(_WIN32) // || defined(__CYGWIN__)
     wsa_control.len = c_msg_space;
@@ -2817,6 +2993,161 @@ void Socket::UDPConnection::SendNow(const char *sdata, size_t len, sockaddr * dA
 #endif
 }
 
+/// Queues a UDP datagram for sending, without sending it yet.
+/// Queued datagrams are sent together on the next flushBatch() call, or as soon as UDP_BATCH_MAX
+/// datagrams are queued, using as few system calls as the platform allows.
+/// Datagrams are always sent in the order they were queued.
+void Socket::UDPConnection::batchSend(const char *sdata, size_t len){
+  if (len < 1 || sock == -1){return;}
+  if (!batchData.append(sdata, len)){
+    // Out of memory; fall back to sending right away
+    flushBatch();
+    SendNow(sdata, len);
+    return;
+  }
+  batchSizes.push_back(len);
+  if (batchSizes.size() >= UDP_BATCH_MAX){flushBatch();}
+}
+
+/// Sends all datagrams queued with batchSend().
+void Socket::UDPConnection::flushBatch(){
+  if (!batchSizes.size()){return;}
+  // Empty the queue before sending, so a close() triggered by a send error does not recurse
+  std::vector<size_t> sizes;
+  sizes.swap(batchSizes);
+  sendBatch(batchData, sizes.data(), sizes.size());
+  batchData.truncate(0);
+  // Hand the allocation back for the next batch
+  sizes.clear();
+  sizes.swap(batchSizes);
+}
+
+/// Sends count datagrams stored back to back in sdata, with their sizes in sizes.
+/// Uses UDP segmentation offload for runs of equally-sized datagrams and sendmmsg for the rest,
+/// where available, including for replies that go out through the pktinfo path.
+/// Falls back to one SendNow call per datagram otherwise.
+void Socket::UDPConnection::sendBatch(const char *sdata, const size_t *sizes, size_t count){
+#ifdef HASSENDMMSG
+  // Replies that need a specific source address carry it as a pktinfo control message
+  char pktInfo[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+  size_t pktInfoLen = 0;
+#ifdef HASPKTINFO
+  if (!isConnected && hasReceiveData && recvAddr.size()){
+    memset(pktInfo, 0, sizeof(pktInfo));
+    msghdr tmpHdr;
+    memset(&tmpHdr, 0, sizeof(tmpHdr));
+    tmpHdr.msg_control = pktInfo;
+    tmpHdr.msg_controllen = sizeof(pktInfo);
+    pktInfoLen = setPktInfo(CMSG_FIRSTHDR(&tmpHdr), family, recvAddr, recvInterface);
+  }
+#endif
+  while (count && sock != -1){
+#ifdef UDP_SEGMENT
+    if (batchGSO && count > 1){
+      // Find the longest run of equally-sized datagrams, of which only the last may be shorter
+      size_t segSize = sizes[0];
+      size_t segs = 1, total = segSize;
+      while (segs < count && segs < UDP_BATCH_MAX && sizes[segs] <= segSize && total + sizes[segs] <= UDP_GSO_MAXSIZE){
+        total += sizes[segs];
+        if (sizes[segs++] < segSize){break;}
+      }
+      if (segs > 1){
+        iovec iov;
+        iov.iov_base = (void *)sdata;
+        iov.iov_len = total;
+        char control[sizeof(pktInfo) + CMSG_SPACE(sizeof(uint16_t))];
+        memset(control, 0, sizeof(control));
+        if (pktInfoLen){memcpy(control, pktInfo, pktInfoLen);}
+        msghdr mHdr;
+        memset(&mHdr, 0, sizeof(mHdr));
+        if (!isConnected){
+          mHdr.msg_name = (sockaddr *)destAddr;
+          mHdr.msg_namelen = destAddr.size();
+        }
+        mHdr.msg_iov = &iov;
+        mHdr.msg_iovlen = 1;
+        mHdr.msg_control = control;
+        mHdr.msg_controllen = pktInfoLen + CMSG_SPACE(sizeof(uint16_t));
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&mHdr);
+        if (pktInfoLen){cmsg = CMSG_NXTHDR(&mHdr, cmsg);}
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t gsoSize = segSize;
+        memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(gsoSize));
+        int r = sendmsg(sock, &mHdr, 0);
+        if (r > 0){
+          up += r;
+          sdata += total;
+          sizes += segs;
+          count -= segs;
+          continue;
+        }
+        if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP){
+          // Kernel or network device can't do it; stop trying and use sendmmsg from now on
+          HIGH_MSG("UDP segmentation offload not available on socket %d: %s", sock, strerror(errno));
+          batchGSO = false;
+          continue;
+        }
+        // Any other error is handled by the sendmmsg attempt below
+      }
+    }
+#endif
+    mmsghdr msgs[UDP_BATCH_MAX];
+    iovec iovs[UDP_BATCH_MAX];
+    size_t num = count < UDP_BATCH_MAX ? count : UDP_BATCH_MAX;
+    const char *ptr = sdata;
+    for (size_t i = 0; i < num; ++i){
+      iovs[i].iov_base = (void *)ptr;
+      iovs[i].iov_len = sizes[i];
+      ptr += sizes[i];
+      memset(&msgs[i], 0, sizeof(mmsghdr));
+      if (!isConnected){
+        msgs[i].msg_hdr.msg_name = (sockaddr *)destAddr;
+        msgs[i].msg_hdr.msg_namelen = destAddr.size();
+      }
+      msgs[i].msg_hdr.msg_iov = iovs + i;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      if (pktInfoLen){
+        msgs[i].msg_hdr.msg_control = pktInfo;
+        msgs[i].msg_hdr.msg_controllen = pktInfoLen;
+      }
+    }
+    int r = sendmmsg(sock, msgs, num, 0);
+    if (r > 0){
+      for (int i = 0; i < r; ++i){
+        up += msgs[i].msg_len;
+        sdata += sizes[i];
+      }
+      sizes += r;
+      count -= r;
+      continue;
+    }
+    if (errno == ENOSYS){break;}
+    // Drop the datagram that failed, same as SendNow would, and carry on with the rest
+    sdata += sizes[0];
+    ++sizes;
+    --count;
+    if (ignoreSendErrors){continue;}
+    if (isConnected && errno == EDESTADDRREQ){
+      close();
+      return;
+    }
+#if defined(ENOKEY)
+    if (isConnected && errno == ENOKEY){
+      close();
+      return;
+    }
+#endif
+    if (errno != ENETUNREACH){FAIL_MSG("Could not send UDP data through %d: %s", sock, strerror(errno));}
+  }
+#endif
+  for (size_t i = 0; i < count; ++i){
+    SendNow(sdata, sizes[i]);
+    sdata += sizes[i];
+  }
+}
+
 /// Queues sdata, len for sending over this socket.
 /// If there has been enough time since the last packet, sends immediately.
 /// Warning: never call sendPaced for the same socket from a different thread!
@@ -2846,17 +3177,24 @@ void Socket::UDPConnection::sendPaced(const char *sdata, size_t len, bool encryp
 #endif
 }
 
+/// Returns the target time in microseconds between two paced packets, based on the current queue size.
+uint64_t Socket::UDPConnection::paceInterval() const{
+  size_t qSize = paceQueue.size();
+  if (!qSize){return 5000;}
+  // Target clearing the queue in 25ms at most.
+  uint64_t targetTime = 25000 / qSize;
+  // If this slows us to below 1 packet per 5ms, go that speed instead.
+  if (targetTime > 5000){targetTime = 5000;}
+  return targetTime;
+}
+
 // Gets time in microseconds until next sendPaced call would send something
 size_t Socket::UDPConnection::timeToNextPace(uint64_t uTime){
   size_t qSize = paceQueue.size();
   if (!qSize){return std::string::npos;} // No queue? No time. Return highest possible value.
   if (!uTime){uTime = Util::getMicros();}
   uint64_t paceWait = uTime - lastPace; // Time we've waited so far already
-
-  // Target clearing the queue in 25ms at most.
-  uint64_t targetTime = 25000 / qSize;
-  // If this slows us to below 1 packet per 5ms, go that speed instead.
-  if (targetTime > 5000){targetTime = 5000;}
+  uint64_t targetTime = paceInterval();
   // If the wait is over, send now.
   if (paceWait >= targetTime){return 0;}
   // Return remaining wait time
@@ -2875,8 +3213,17 @@ void Socket::UDPConnection::sendPaced(uint64_t uSendWindow){
 
     // Not sleeping? Send now!
     if (!sleepTime){
-      SendNow(*paceQueue.begin(), paceQueue.begin()->size());
-      paceQueue.pop_front();
+      // Send everything that became due since the last paced send in one go
+      size_t due = 1;
+      if (lastPace && uTime > lastPace){due = (uTime - lastPace) / paceInterval();}
+      if (due < 1){due = 1;}
+      if (due > paceQueue.size()){due = paceQueue.size();}
+      if (due > UDP_PACE_BURST){due = UDP_PACE_BURST;}
+      for (size_t i = 0; i < due; ++i){
+        batchSend(*paceQueue.begin(), paceQueue.begin()->size());
+        paceQueue.pop_front();
+      }
+      flushBatch();
       lastPace = uTime;
       continue;
     }
@@ -3143,6 +3490,127 @@ bool Socket::UDPConnection::connect(){
 }
 
 
+/// Receives as many datagrams as are waiting on the socket, up to UDP_BATCH_MAX, in a single call.
+/// The datagrams are placed back to back in data, with their individual sizes in receivedSizes().
+/// Returns the amount of datagrams received, zero if none were waiting.
+/// The remote and local addresses are updated to those of the last datagram received.
+/// Sockets with dTLS enabled receive a single datagram at a time, exactly like Receive() does.
+size_t Socket::UDPConnection::batchReceive(){
+  recvSizes.clear();
+#ifdef HASRECVMMSG
+  if (!hasDTLS && !pretendReceive){
+    if (sock == -1){return 0;}
+    if (!data.allocate(recvSlot * UDP_BATCH_MAX)){return 0;}
+    data.truncate(0);
+    mmsghdr msgs[UDP_BATCH_MAX];
+    iovec iovs[UDP_BATCH_MAX];
+    sockaddr_in6 addrs[UDP_BATCH_MAX];
+    char ctrls[UDP_BATCH_MAX][0x80];
+    bool wantInfo = !isConnected && recvAddr.size();
+    for (size_t i = 0; i < UDP_BATCH_MAX; ++i){
+      iovs[i].iov_base = (char *)data + i * recvSlot;
+      iovs[i].iov_len = recvSlot;
+      memset(&msgs[i], 0, sizeof(mmsghdr));
+      if (!isConnected){
+        msgs[i].msg_hdr.msg_name = addrs + i;
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in6);
+      }
+      if (wantInfo){
+        msgs[i].msg_hdr.msg_control = ctrls[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(ctrls[i]);
+      }
+      msgs[i].msg_hdr.msg_iov = iovs + i;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int r = recvmmsg(sock, msgs, UDP_BATCH_MAX, MSG_DONTWAIT, 0);
+    if (r == -1){
+      if (errno == ECONNREFUSED && isConnected){
+        close();
+        return 0;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK){INFO_MSG("UDP receive: %d (%s)", errno, strerror(errno));}
+      return 0;
+    }
+    // Move all datagrams together, so they form one contiguous block
+    size_t total = 0;
+    bool truncated = false;
+    for (int i = 0; i < r; ++i){
+      size_t len = msgs[i].msg_len;
+      if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC){truncated = true;}
+      if (total != i * recvSlot){memmove((char *)data + total, (char *)data + i * recvSlot, len);}
+      total += len;
+      recvSizes.push_back(len);
+    }
+    data.append(0, total);
+    down += total;
+    if (r > 0 && !isConnected){
+      msghdr &last = msgs[r - 1].msg_hdr;
+      if (destAddr.size() && last.msg_namelen){destAddr.assign(last.msg_name, last.msg_namelen);}
+      if (wantInfo){parsePktInfo(last);}
+    }
+    // Handle UDP packets that are too large
+    if (truncated){
+      INFO_MSG("Doubling UDP batch receive slots from %zu to %zu bytes", recvSlot, recvSlot * 2);
+      recvSlot *= 2;
+    }
+    return r;
+  }
+#endif
+  if (!Receive()){return 0;}
+  recvSizes.push_back(data.size());
+  return 1;
+}
+
+/// Returns the sizes of the datagrams received by the last batchReceive() call, in order.
+const std::vector<size_t> &Socket::UDPConnection::receivedSizes() const{
+  return recvSizes;
+}
+
+/// Updates the local address and interface from the packet info control messages in mHdr, if any.
+void Socket::UDPConnection::parsePktInfo(msghdr &mHdr){
+#ifdef HASPKTINFO
+  if (recvAddr.size()){
+    for (struct CMSGHDR *cmsg = CMSG_FIRSTHDR(&mHdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&mHdr, cmsg)) {
+      if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO){
+        struct in_pktinfo* pi = (in_pktinfo*)CMSG_DATA(cmsg);
+        if (family == AF_INET6){
+          struct sockaddr_in6 *recvCast = (sockaddr_in6 *)(sockaddr *)recvAddr;
+          recvCast->sin6_port = htons(bindAddr.port());
+          recvCast->sin6_family = AF_INET6;
+#if defined(_WIN32) || defined(__CYGWIN__)
+          memcpy(((char *)&(recvCast->sin6_addr)) + 12, &(pi->ipi_addr), sizeof(pi->ipi_addr));
+#else
+          memcpy(((char*)&(recvCast->sin6_addr)) + 12, &(pi->ipi_spec_dst), sizeof(pi->ipi_spec_dst));
+#endif
+          memset((void*)&(recvCast->sin6_addr), 0, 10);
+          memset((char*)&(recvCast->sin6_addr) + 10, 255, 2);
+        }else{
+          struct sockaddr_in *recvCast = (sockaddr_in *)(sockaddr *)recvAddr;
+          recvCast->sin_port = htons(bindAddr.port());
+          recvCast->sin_family = AF_INET;
+#if defined(_WIN32) || defined(__CYGWIN__)
+          memcpy(((char *)&(recvCast->sin_addr)), &(pi->ipi_addr), sizeof(pi->ipi_addr));
+#else
+          memcpy(((char *)&(recvCast->sin_addr)), &(pi->ipi_spec_dst), sizeof(pi->ipi_spec_dst));
+#endif
+        }
+        recvInterface = pi->ipi_ifindex;
+        hasReceiveData = true;
+      }
+      if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO){
+        struct in6_pktinfo* pi = (in6_pktinfo*)CMSG_DATA(cmsg);
+        struct sockaddr_in6 *recvCast = (sockaddr_in6 *)(sockaddr *)recvAddr;
+        recvCast->sin6_family = AF_INET6;
+        recvCast->sin6_port = htons(bindAddr.port());
+        memcpy(&(recvCast->sin6_addr), &(pi->ipi6_addr), sizeof(pi->ipi6_addr));
+        recvInterface = pi->ipi6_ifindex;
+        hasReceiveData = true;
+      }
+    }
+  }
+#endif
+}
+
 /// Attempt to receive a UDP packet.
 /// This will automatically allocate or resize the internal data buffer if needed.
 /// If a packet is received, it will be placed in the "data" member, with it's length in "data_len".
@@ -3199,47 +3667,7 @@ bool Socket::UDPConnection::Receive(){
     return false;
   }
   if (destAddr.size() && destsize){destAddr.assign(&addr, destsize);}
-#ifdef HASPKTINFO
-  if (recvAddr.size()){
-    for (struct CMSGHDR *cmsg = CMSG_FIRSTHDR(&mHdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&mHdr, cmsg)) {
-      if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO){
-        struct in_pktinfo* pi = (in_pktinfo*)CMSG_DATA(cmsg);
-        if (family == AF_INET6){
-          struct sockaddr_in6 *recvCast = (sockaddr_in6 *)(sockaddr *)recvAddr;
-          recvCast->sin6_port = htons(bindAddr.port());
-          recvCast->sin6_family = AF_INET6;
-#if defined(_WIN32) || defined(__CYGWIN__)
-          memcpy(((char *)&(recvCast->sin6_addr)) + 12, &(pi->ipi_addr), sizeof(pi->ipi_addr));
-#else
-          memcpy(((char*)&(recvCast->sin6_addr)) + 12, &(pi->ipi_spec_dst), sizeof(pi->ipi_spec_dst));
-#endif
-          memset((void*)&(recvCast->sin6_addr), 0, 10);
-          memset((char*)&(recvCast->sin6_addr) + 10, 255, 2);
-        }else{
-          struct sockaddr_in *recvCast = (sockaddr_in *)(sockaddr *)recvAddr;
-          recvCast->sin_port = htons(bindAddr.port());
-          recvCast->sin_family = AF_INET;
-#if defined(_WIN32) || defined(__CYGWIN__)
-          memcpy(((char *)&(recvCast->sin_addr)), &(pi->ipi_addr), sizeof(pi->ipi_addr));
-#else
-          memcpy(((char *)&(recvCast->sin_addr)), &(pi->ipi_spec_dst), sizeof(pi->ipi_spec_dst));
-#endif
-        }
-        recvInterface = pi->ipi_ifindex;
-        hasReceiveData = true;
-      }
-      if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO){
-        struct in6_pktinfo* pi = (in6_pktinfo*)CMSG_DATA(cmsg);
-        struct sockaddr_in6 *recvCast = (sockaddr_in6 *)(sockaddr *)recvAddr;
-        recvCast->sin6_family = AF_INET6;
-        recvCast->sin6_port = htons(bindAddr.port());
-        memcpy(&(recvCast->sin6_addr), &(pi->ipi6_addr), sizeof(pi->ipi6_addr));
-        recvInterface = pi->ipi6_ifindex;
-        hasReceiveData = true;
-      }
-    }
-  }
-#endif
+  parsePktInfo(mHdr);
   data.append(0, r);
   down += r;
   //Handle UDP packets that are too large
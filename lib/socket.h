@@ -15,8 +15,10 @@
 #include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include <vector>
 
 #ifdef SSL
 #include <mbedtls/ctr_drbg.h>
@@ -104,13 +106,26 @@ namespace Socket{
   bool getPeerName(int fd, std::string &host, uint32_t &port);
   bool getPeerName(int fd, std::string &host, uint32_t &port, sockaddr * tmpaddr, socklen_t * addrlen);
 
-  /// A buffer made out of std::string objects that can be efficiently read from and written to.
+  /// A buffer that can be efficiently read from and written to.
+  /// All data is kept in a single contiguous slab of memory: new data is appended at its end, and
+  /// data is removed from its front by advancing an offset. The space freed up this way is only
+  /// reclaimed once it makes up at least half of the slab, so removing data does not move anything.
+  /// For code that reads the buffer in parts (by default, lines ending in the splitter string),
+  /// get() hands out the first part as a std::string that can be freely changed in place.
   class Buffer{
   private:
-    std::deque<std::string> data;
+    friend class Connection;
+    std::string front;            ///< The part handed out by get(); comes before the slab data
+    Util::ResizeablePointer slab; ///< Buffered data, starting at slabStart
+    size_t slabStart;
+    size_t readSize;              ///< Amount of bytes to ask for in the next read into this buffer
+    size_t slabBytes() const;
+    void unget();
+    void consume(size_t count);
+    char *space(size_t count);
 
   public:
-    std::string splitter; ///< String to automatically split on if encountered. \n by default
+    std::string splitter; ///< String to split parts on if encountered. \n by default
     Buffer();
     unsigned int size();
     unsigned int bytes(unsigned int max) const;
@@ -120,6 +135,8 @@ namespace Socket{
     void prepend(const std::string &newdata);
     void prepend(const char *newdata, const unsigned int newdatasize);
     std::string &get();
+    std::string &getAll();
+    const char *view(size_t count);
     bool available(unsigned int count);
     bool available(unsigned int count) const;
     void skip(size_t count);
@@ -153,6 +170,9 @@ namespace Socket{
     int iread(void *buffer, int len, int flags = 0);  ///< Incremental read call.
     bool iread(Buffer &buffer, int flags = 0); ///< Incremental write call that is compatible with Socket::Buffer.
     void setBoundAddr();
+    void sendChunkHeader(size_t len);
+    void sendGather(const struct iovec *vec, size_t count);
+    unsigned int iwritev(const struct iovec *vec, int count); ///< Incremental gathering write call.
     std::string lastErr; ///< Stores last error, if any.
     bool isLocked;
     bool chunkedMode;
@@ -220,6 +240,8 @@ namespace Socket{
     void SendNow(const std::string & data);
     void SendNow(const char *data);
     void SendNow(const char *data, size_t len);
+    void sendv(const struct iovec *vec, size_t count);
+    bool SendFile(int fd, uint64_t offset, size_t len);
     void skipBytes(uint32_t byteCount);
     uint32_t skipCount;
     // unbuffered i/o methods
@@ -279,6 +301,14 @@ namespace Socket{
     void checkRecvBuf();
     std::deque<Util::ResizeablePointer> paceQueue;
     uint64_t lastPace;
+    uint64_t paceInterval() const;
+    Util::ResizeablePointer batchData; ///< Queued datagrams, back to back
+    std::vector<size_t> batchSizes;    ///< Sizes of the datagrams in batchData
+    bool batchGSO;                     ///< False if the kernel refused UDP segmentation offload on this socket
+    void sendBatch(const char *sdata, const size_t *sizes, size_t count);
+    std::vector<size_t> recvSizes; ///< Sizes of the datagrams in data after batchReceive
+    size_t recvSlot;               ///< Space reserved per datagram by batchReceive
+    void parsePktInfo(msghdr &mHdr);
     int recvInterface;
     bool hasReceiveData;
     bool isBlocking;
@@ -340,10 +370,14 @@ namespace Socket{
     const Socket::Address & getLocalAddr() const;
     const Socket::Address & getBoundAddr() const;
     bool Receive();
+    size_t batchReceive();
+    const std::vector<size_t> &receivedSizes() const;
     void SendNow(const std::string &data);
     void SendNow(const char *data);
     void SendNow(const char *data, size_t len);
     void SendNow(const char *sdata, size_t len, sockaddr * dAddr, size_t dAddrLen);
+    void batchSend(const char *sdata, size_t len);
+    void flushBatch();
     void sendPaced(const char * data, size_t len, bool encrypt = true);
     void sendPaced(uint64_t uSendWindow);
     size_t timeToNextPace(uint64_t uTime = 0);
@@ -18,8 +18,11 @@
 #include "triggers.h"
 #include "url.h"
 
+#include <algorithm>
+#include <dirent.h>
 #include <semaphore.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -240,6 +243,30 @@ std::string Util::getTmpFolder(){
   return dir + "/";
 }
 
+/// Removes the cached progressive MP4 headers stored next to the given source file by the MP4
+/// output: files named after the source, followed by an 8-digit hexadecimal track selection hash and
+/// ".mp4h", and any temporary files left behind while generating them.
+/// Returns the amount of files removed.
+size_t Util::removeHeaderCaches(const std::string &source){
+  size_t slash = source.rfind('/');
+  std::string dir = (slash == std::string::npos) ? "./" : source.substr(0, slash + 1);
+  std::string prefix = source.substr(slash == std::string::npos ? 0 : slash + 1) + ".";
+  DIR *d = opendir(dir.c_str());
+  if (!d){return 0;}
+  size_t removed = 0;
+  while (struct dirent *ent = readdir(d)){
+    std::string name = ent->d_name;
+    if (name.size() < prefix.size() + 13 || name.compare(0, prefix.size(), prefix)){continue;}
+    // The hash must be followed by ".mp4h", optionally with a temporary file suffix
+    if (name.find_first_not_of("0123456789abcdef", prefix.size()) != prefix.size() + 8){continue;}
+    if (name.compare(prefix.size() + 8, 5, ".mp4h")){continue;}
+    if (name.size() > prefix.size() + 13 && name.compare(name.size() - 4, 4, ".tmp")){continue;}
+    if (!unlink((dir + name).c_str())){++removed;}
+  }
+  closedir(d);
+  return removed;
+}
+
 /// Filters the streamname, removing invalid characters and converting all
 /// letters to lowercase. If a '?' character is found, everything following
 /// that character is deleted. The original string is modified. If a '+' or space
@@ -286,11 +313,11 @@ void Util::packetSorter::setSyncMode(bool synced){
       }
       dequeBuffer.clear();
     }else{
-      //we've switched away from set
-      for (std::set<Util::sortedPageInfo>::iterator it = setBuffer.begin(); it != setBuffer.end(); ++it){
+      //we've switched away from sorted mode
+      for (std::vector<Util::sortedPageInfo>::iterator it = sortedBuffer.begin(); it != sortedBuffer.end(); ++it){
         insert(*it);
       }
-      setBuffer.clear();
+      sortedBuffer.clear();
     }
   }
 }
@@ -300,13 +327,13 @@ bool Util::packetSorter::getSyncMode() const{return !dequeMode;}
 
 /// Returns the amount of packets currently in the sorter.
 size_t Util::packetSorter::size() const{
-  if (dequeMode){return dequeBuffer.size();}else{return setBuffer.size();}
+  if (dequeMode){return dequeBuffer.size();}else{return sortedBuffer.size();}
 }
 
 /// Clears all packets from the sorter; does not reset mode.
 void Util::packetSorter::clear(){
   dequeBuffer.clear();
-  setBuffer.clear();
+  sortedBuffer.clear();
 }
 
 /// Returns a pointer to the first packet in the sorter.
@@ -314,7 +341,7 @@ const Util::sortedPageInfo * Util::packetSorter::begin() const{
   if (dequeMode){
     return &*dequeBuffer.begin();
   }else{
-    return &*setBuffer.begin();
+    return sortedBuffer.data();
   }
 }
 
@@ -326,7 +353,7 @@ uint64_t Util::packetSorter::nonGhost() const{
     }
     return 0;
   }else{
-    for (std::set<sortedPageInfo>::const_iterator it = setBuffer.begin(); it != setBuffer.end(); ++it){
+    for (std::vector<sortedPageInfo>::const_iterator it = sortedBuffer.begin(); it != sortedBuffer.end(); ++it){
       if (!it->ghostPacket && !it->unavailable){return it->time;}
     }
     return 0;
@@ -338,8 +365,24 @@ void Util::packetSorter::insert(const sortedPageInfo &pInfo){
   if (dequeMode){
     dequeBuffer.push_back(pInfo);
   }else{
-    setBuffer.insert(pInfo);
+    sortedBuffer.push_back(pInfo);
+    sortedInsert();
+  }
+}
+
+/// Moves the packet at the back of sortedBuffer into its sorted position.
+/// Duplicate entries (same time and track) are dropped, like a std::set would.
+void Util::packetSorter::sortedInsert(){
+  sortedPageInfo pInfo = sortedBuffer.back();
+  std::vector<sortedPageInfo>::iterator last = sortedBuffer.end() - 1;
+  std::vector<sortedPageInfo>::iterator it = std::lower_bound(sortedBuffer.begin(), last, pInfo);
+  if (it == last){return;}
+  if (!(pInfo < *it)){
+    sortedBuffer.pop_back();
+    return;
   }
+  memmove(&*it + 1, &*it, (last - it) * sizeof(sortedPageInfo));
+  *it = pInfo;
 }
 
 /// Removes the given track ID packet from the sorter. Removes at most one packet, make sure to prevent duplicates elsewhere!
@@ -352,9 +395,9 @@ void Util::packetSorter::dropTrack(size_t tid){
       }
     }
   }else{
-    for (std::set<Util::sortedPageInfo>::iterator it = setBuffer.begin(); it != setBuffer.end(); ++it){
+    for (std::vector<Util::sortedPageInfo>::iterator it = sortedBuffer.begin(); it != sortedBuffer.end(); ++it){
       if (it->tid == tid){
-        setBuffer.erase(it);
+        sortedBuffer.erase(it);
         return;
       }
     }
@@ -369,8 +412,21 @@ void Util::packetSorter::replaceFirst(const sortedPageInfo &pInfo){
     dequeBuffer.pop_front();
     dequeBuffer.push_back(pInfo);
   }else{
-    setBuffer.erase(setBuffer.begin());
-    setBuffer.insert(pInfo);
+    if (!sortedBuffer.size()){
+      sortedBuffer.push_back(pInfo);
+      return;
+    }
+    //Shift every entry that sorts before the new packet one position down, over the old first
+    //entry, then store the new packet in the gap. No reallocation ever happens here.
+    std::vector<sortedPageInfo>::iterator it = std::lower_bound(sortedBuffer.begin() + 1, sortedBuffer.end(), pInfo);
+    if (it != sortedBuffer.end() && !(pInfo < *it)){
+      //Duplicate entry; a std::set would have dropped it
+      sortedBuffer.erase(sortedBuffer.begin());
+      return;
+    }
+    --it;
+    memmove(sortedBuffer.data(), sortedBuffer.data() + 1, (it - sortedBuffer.begin()) * sizeof(sortedPageInfo));
+    *it = pInfo;
   }
 }
 
@@ -391,7 +447,7 @@ bool Util::packetSorter::hasEntry(size_t tid) const{
       if (it->tid == tid){return true;}
     }
   }else{
-    for (std::set<Util::sortedPageInfo>::const_iterator it = setBuffer.begin(); it != setBuffer.end(); ++it){
+    for (std::vector<Util::sortedPageInfo>::const_iterator it = sortedBuffer.begin(); it != sortedBuffer.end(); ++it){
       if (it->tid == tid){return true;}
     }
   }
@@ -406,7 +462,7 @@ void Util::packetSorter::getTrackList(std::set<size_t> &toFill) const{
       toFill.insert(it->tid);
     }
   }else{
-    for (std::set<Util::sortedPageInfo>::const_iterator it = setBuffer.begin(); it != setBuffer.end(); ++it){
+    for (std::vector<Util::sortedPageInfo>::const_iterator it = sortedBuffer.begin(); it != sortedBuffer.end(); ++it){
       toFill.insert(it->tid);
     }
   }
@@ -420,7 +476,7 @@ void Util::packetSorter::getTrackList(std::map<size_t, uint64_t> &toFill) const{
       toFill[it->tid] = it->time;
     }
   }else{
-    for (std::set<Util::sortedPageInfo>::const_iterator it = setBuffer.begin(); it != setBuffer.end(); ++it){
+    for (std::vector<Util::sortedPageInfo>::const_iterator it = sortedBuffer.begin(); it != sortedBuffer.end(); ++it){
       toFill[it->tid] = it->time;
     }
   }
@@ -864,6 +920,64 @@ void Util::sendUDPApi(JSON::Value & cmd){
   uSock.SendNow(cmd.toString());
 }
 
+/// Upper bounds of the buckets of latency histograms, in milliseconds.
+const uint64_t Util::latencyBounds[LATENCY_BUCKETS - 1] = {5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000};
+
+Util::LatencyHistogram::LatencyHistogram(){
+  memset(buckets, 0, sizeof(buckets));
+  count = 0;
+  sum = 0;
+}
+
+/// Counts a single duration in milliseconds.
+void Util::LatencyHistogram::add(uint64_t ms){
+  size_t i = 0;
+  while (i < LATENCY_BUCKETS - 1 && ms > latencyBounds[i]){++i;}
+  ++buckets[i];
+  ++count;
+  sum += ms;
+}
+
+/// Adds all counts of a histogram in the format returned by toJSON.
+void Util::LatencyHistogram::add(const JSON::Value &hist){
+  if (!hist.isMember("buckets") || !hist["buckets"].isArray() || hist["buckets"].size() != LATENCY_BUCKETS){return;}
+  for (size_t i = 0; i < LATENCY_BUCKETS; ++i){
+    buckets[i] += hist["buckets"][i].asInt();
+    count += hist["buckets"][i].asInt();
+  }
+  sum += hist["sum"].asInt();
+}
+
+JSON::Value Util::LatencyHistogram::toJSON() const{
+  JSON::Value ret;
+  for (size_t i = 0; i < LATENCY_BUCKETS; ++i){ret["buckets"].append(buckets[i]);}
+  ret["sum"] = sum;
+  return ret;
+}
+
+static std::map<std::string, Util::LatencyHistogram> pendingLatency;
+static uint64_t lastLatencyFlush = 0;
+
+/// Counts a request of the given type that took ms milliseconds to handle.
+/// Counts are collected locally and sent to the controller at most every 5 seconds.
+void Util::reportLatency(const std::string &name, uint64_t ms){
+  pendingLatency[name].add(ms);
+  if (!lastLatencyFlush){lastLatencyFlush = Util::bootMS();}
+  if (Util::bootMS() - lastLatencyFlush >= 5000){flushLatency();}
+}
+
+/// Sends all latency counts collected so far to the controller.
+void Util::flushLatency(){
+  lastLatencyFlush = Util::bootMS();
+  if (!pendingLatency.size()){return;}
+  JSON::Value cmd;
+  for (std::map<std::string, LatencyHistogram>::iterator it = pendingLatency.begin(); it != pendingLatency.end(); ++it){
+    cmd["latency_stat"][it->first] = it->second.toJSON();
+  }
+  pendingLatency.clear();
+  sendUDPApi(cmd);
+}
+
 /// Attempt to start a push for streamname to target.
 /// streamname MUST be pre-sanitized
 /// target gets variables replaced and may be altered by the PUSH_OUT_START trigger response.
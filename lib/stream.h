@@ -9,13 +9,18 @@
 #include "util.h"
 #include <string>
 #include <list>
+#include <vector>
 
 const JSON::Value empty;
 
+/// Amount of buckets in a Util::LatencyHistogram; the last one holds everything above the highest bound.
+#define LATENCY_BUCKETS 12
+
 namespace Util{
   size_t streamCustomVariables(std::string &str);
   size_t streamVariables(std::string &str, const std::string &streamname, const std::string &source = "", uint8_t depth = 0);
   std::string getTmpFolder();
+  size_t removeHeaderCaches(const std::string &source);
   void sanitizeName(std::string &streamname);
   bool streamAlive(std::string &streamname);
   std::set<std::string> streamTags(const std::string &streamname);
@@ -31,6 +36,22 @@ namespace Util{
   void optionsToArguments(const JSON::Value conf, const JSON::Value & capa, std::deque<std::string> & args,
                           const std::map<std::string, std::string> & overrides = {});
   void sendUDPApi(JSON::Value & cmd);
+
+  extern const uint64_t latencyBounds[LATENCY_BUCKETS - 1];
+
+  /// Counts of durations in milliseconds, in buckets with the upper bounds in latencyBounds.
+  class LatencyHistogram{
+  public:
+    LatencyHistogram();
+    void add(uint64_t ms);
+    void add(const JSON::Value &hist);
+    JSON::Value toJSON() const;
+    uint64_t buckets[LATENCY_BUCKETS]; ///< Counts per bucket, not cumulative
+    uint64_t count;
+    uint64_t sum; ///< Sum of all durations, in milliseconds
+  };
+  void reportLatency(const std::string &name, uint64_t ms);
+  void flushLatency();
   uint8_t getStreamStatus(const std::string &streamname);
   uint8_t getStreamStatusPercentage(const std::string &streamname);
   bool checkException(const JSON::Value &ex, const std::string &useragent);
@@ -71,7 +92,9 @@ namespace Util{
     bool unavailable;
   };
 
-  /// Packet sorter used to determine which packet should be output next
+  /// Packet sorter used to determine which packet should be output next.
+  /// In sync mode, packets are kept in a flat array sorted in playback order; there is usually only
+  /// one entry per track, so this is faster than a tree and does not allocate once warmed up.
   class packetSorter{
     public:
       packetSorter();
@@ -89,9 +112,10 @@ namespace Util{
       void setSyncMode(bool synced);
       bool getSyncMode() const;
     private:
+      void sortedInsert();
       bool dequeMode;
       std::deque<sortedPageInfo> dequeBuffer;
-      std::set<sortedPageInfo> setBuffer;
+      std::vector<sortedPageInfo> sortedBuffer;
   };
 
 
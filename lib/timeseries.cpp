@@ -0,0 +1,210 @@
+#include "timeseries.h"
+#include "bitfields.h"
+#include <algorithm>
+
+/// Amount of samples per encoded block; this is also the granularity at which old data is dropped.
+#define SERIES_BLOCK_SAMPLES 32
+
+namespace TimeSeries{
+
+  /// Maps a (wrapping) difference to an unsigned value that is small when the difference is small
+  /// in either direction, so counters that reset still encode compactly.
+  static inline uint64_t zigzag(uint64_t diff){return (diff << 1) ^ (uint64_t)((int64_t)diff >> 63);}
+  static inline uint64_t unzigzag(uint64_t val){return (val >> 1) ^ (~(val & 1) + 1);}
+
+  Series::Series(size_t columns){
+    cols = columns;
+    samples = 0;
+    tail.resize(cols, 0);
+    tailTime = 0;
+    prevTime = 0;
+  }
+
+  /// Adds a sample of columns() values at the given time.
+  /// A sample with the same time as the most recent one replaces it.
+  /// Returns false and does nothing if the time is older than the most recent sample.
+  bool Series::append(uint64_t time, const uint64_t *values){
+    if (samples){
+      if (time < tailTime){return false;}
+      if (time > tailTime){
+        flushTail();
+        ++samples;
+      }
+    }else{
+      samples = 1;
+    }
+    tailTime = time;
+    tail.assign(values, values + cols);
+    return true;
+  }
+
+  /// Encodes the most recent sample into the last block, starting a new block if needed.
+  void Series::flushTail(){
+    if (!blocks.size() || blocks.back().count >= SERIES_BLOCK_SAMPLES){
+      if (blocks.size()){blocks.back().data.shrink_to_fit();}
+      blocks.push_back(Block());
+      blocks.back().first = tailTime;
+      blocks.back().count = 0;
+      prevTime = tailTime;
+      prev.assign(cols, 0);
+    }
+    Block &B = blocks.back();
+    Bit::putVarint(B.data, tailTime - prevTime);
+    for (size_t i = 0; i < cols; ++i){Bit::putVarint(B.data, zigzag(tail[i] - prev[i]));}
+    B.last = tailTime;
+    ++B.count;
+    prevTime = tailTime;
+    prev = tail;
+  }
+
+  /// Drops blocks of samples that are all older than the given time.
+  /// Some samples older than that time may remain, if they share a block with newer ones.
+  void Series::trim(uint64_t before){
+    while (blocks.size() && blocks.front().last < before){
+      samples -= blocks.front().count;
+      blocks.pop_front();
+    }
+    if (!blocks.size() && samples && tailTime < before){samples = 0;}
+  }
+
+  /// Removes all samples.
+  void Series::clear(){
+    blocks.clear();
+    samples = 0;
+  }
+
+  /// Writes the values of the most recent sample at or before the given time to values, which
+  /// must have room for columns() values. Returns false if there is no such sample.
+  bool Series::get(uint64_t time, uint64_t *values) const{
+    if (!samples || time < firstTime()){return false;}
+    if (time >= tailTime){
+      std::copy(tail.begin(), tail.end(), values);
+      return true;
+    }
+    // Find the last block that starts at or before the wanted time, and decode from there
+    size_t lo = 0, hi = blocks.size();
+    while (lo < hi){
+      size_t mid = (lo + hi) / 2;
+      if (blocks[mid].first <= time){
+        lo = mid + 1;
+      }else{
+        hi = mid;
+      }
+    }
+    bool found = false;
+    for (Cursor C(*this, blocks[lo - 1].first, time); C; C.next()){
+      std::copy(C.values(), C.values() + cols, values);
+      found = true;
+    }
+    return found;
+  }
+
+  bool Series::empty() const{return !samples;}
+
+  /// Returns the amount of samples stored.
+  size_t Series::size() const{return samples;}
+
+  /// Returns the approximate amount of memory used by the samples, in bytes.
+  size_t Series::bytes() const{
+    size_t ret = sizeof(Series) + (tail.capacity() + prev.capacity()) * sizeof(uint64_t);
+    for (std::deque<Block>::const_iterator it = blocks.begin(); it != blocks.end(); ++it){
+      ret += sizeof(Block) + it->data.capacity();
+    }
+    return ret;
+  }
+
+  size_t Series::columns() const{return cols;}
+
+  /// Returns the time of the oldest sample, or zero if there are none.
+  uint64_t Series::firstTime() const{
+    if (!samples){return 0;}
+    return blocks.size() ? blocks.front().first : tailTime;
+  }
+
+  /// Returns the time of the most recent sample, or zero if there are none.
+  uint64_t Series::lastTime() const{return samples ? tailTime : 0;}
+
+  /// Returns the values of the most recent sample, or a null pointer if there are none.
+  const uint64_t *Series::last() const{return samples ? tail.data() : 0;}
+
+  Cursor::Cursor(const Series &_S, uint64_t start, uint64_t _end) : S(_S), cur(_S.cols, 0){
+    end = _end;
+    block = 0;
+    consumed = 0;
+    p = e = 0;
+    valid = false;
+    curTime = 0;
+    if (!S.samples){
+      block = S.blocks.size() + 1;
+      return;
+    }
+    // Skip all blocks that end before the start of the range
+    size_t hi = S.blocks.size();
+    while (block < hi){
+      size_t mid = (block + hi) / 2;
+      if (S.blocks[mid].last < start){
+        block = mid + 1;
+      }else{
+        hi = mid;
+      }
+    }
+    if (block < S.blocks.size()){openBlock();}
+    next();
+    while (valid && curTime < start){next();}
+  }
+
+  /// True while the cursor points at a sample within the range.
+  Cursor::operator bool() const{return valid;}
+
+  uint64_t Cursor::time() const{return curTime;}
+
+  /// Returns the values of the current sample. Only valid until the next call to next().
+  const uint64_t *Cursor::values() const{return cur.data();}
+
+  /// Advances to the next sample, if any.
+  void Cursor::next(){
+    valid = false;
+    while (block < S.blocks.size()){
+      if (consumed < S.blocks[block].count){
+        if (!decode()){
+          block = S.blocks.size() + 1;
+          return;
+        }
+        ++consumed;
+        valid = (curTime <= end);
+        return;
+      }
+      if (++block < S.blocks.size()){openBlock();}
+    }
+    // The most recent sample comes after all blocks
+    if (block == S.blocks.size()){
+      ++block;
+      curTime = S.tailTime;
+      cur = S.tail;
+      valid = (curTime <= end);
+    }
+  }
+
+  /// Prepares for decoding the samples in the current block.
+  void Cursor::openBlock(){
+    const Series::Block &B = S.blocks[block];
+    p = B.data.data();
+    e = p + B.data.size();
+    consumed = 0;
+    curTime = B.first;
+    cur.assign(S.cols, 0);
+  }
+
+  /// Decodes the next sample of the current block. Returns false if the data is incomplete.
+  bool Cursor::decode(){
+    uint64_t val;
+    if (!Bit::getVarint(p, e, val)){return false;}
+    curTime += val;
+    for (size_t i = 0; i < S.cols; ++i){
+      if (!Bit::getVarint(p, e, val)){return false;}
+      cur[i] += unzigzag(val);
+    }
+    return true;
+  }
+
+}// namespace TimeSeries
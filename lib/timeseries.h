@@ -0,0 +1,79 @@
+/// \file timeseries.h
+/// Compact in-memory storage for histories of counters, such as per-second statistics.
+///
+/// A Series holds samples of a fixed amount of 64-bit values, indexed by a timestamp that only
+/// ever increases. The most recent sample is kept as-is; older samples are stored in blocks, as
+/// varint-encoded differences with the previous sample of the same block. Counters that grow
+/// slowly or not at all thus take only one or two bytes per value per sample. Old blocks are
+/// dropped from the front as a whole, so the storage acts as a ring buffer.
+#pragma once
+#include <deque>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace TimeSeries{
+
+  class Cursor;
+
+  /// History of samples of a fixed amount of values, indexed by an increasing timestamp.
+  class Series{
+  public:
+    Series(size_t columns = 1);
+    bool append(uint64_t time, const uint64_t *values);
+    void trim(uint64_t before);
+    void clear();
+    bool get(uint64_t time, uint64_t *values) const;
+    bool empty() const;
+    size_t size() const;
+    size_t bytes() const;
+    size_t columns() const;
+    uint64_t firstTime() const;
+    uint64_t lastTime() const;
+    const uint64_t *last() const;
+
+  private:
+    friend class Cursor;
+    /// Up to blockSamples samples, each encoded as differences with the previous one.
+    /// The first sample in the block is encoded relative to the block start time and zero values.
+    struct Block{
+      uint64_t first; ///< Time of the first sample in the block
+      uint64_t last;  ///< Time of the last sample in the block
+      uint32_t count; ///< Amount of samples in the block
+      std::string data;
+    };
+    void flushTail();
+    size_t cols;
+    size_t samples;
+    std::deque<Block> blocks;
+    std::vector<uint64_t> tail; ///< Values of the most recent sample, not yet encoded
+    uint64_t tailTime;
+    std::vector<uint64_t> prev; ///< Values of the last sample encoded into the last block
+    uint64_t prevTime;
+  };
+
+  /// Iterates over the samples of a Series with a timestamp in the range [start, end].
+  /// Samples are decoded one at a time; the Series must not be changed while a Cursor exists.
+  class Cursor{
+  public:
+    Cursor(const Series &S, uint64_t start, uint64_t end);
+    operator bool() const;
+    uint64_t time() const;
+    const uint64_t *values() const;
+    void next();
+
+  private:
+    void openBlock();
+    bool decode();
+    const Series &S;
+    uint64_t end;
+    size_t block;    ///< Index of the block being decoded, or the amount of blocks when at the tail
+    size_t consumed; ///< Samples of the current block decoded so far
+    const char *p;
+    const char *e;
+    bool valid;
+    uint64_t curTime;
+    std::vector<uint64_t> cur;
+  };
+
+}// namespace TimeSeries
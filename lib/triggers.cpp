@@ -12,12 +12,19 @@
 /// body. If handled by an executable, it's started with the trigger name as its only argument, and
 /// the payload is piped into the executable over standard input.
 ///
-/// Currently, all triggers are handled asynchronously and responses (if any) are completely
-/// ignored. In the future this may change.
+/// Blocking triggers wait for the response and use it; non-blocking triggers ignore it. Non-blocking
+/// triggers to an URL are sent from background threads, at most `triggerConcurrency` (default 4)
+/// at the same time per process, over keep-alive connections that are reused between triggers.
+///
+/// Responses of a URL handler to the blocking `USER_NEW`, `CONN_OPEN` and `CONN_PLAY` triggers are
+/// cached server-wide when the handler sends a `Cache-Control: max-age=N` header: for N seconds, the
+/// same trigger with the same payload to the same handler gets the same response without a request.
+/// Changing the trigger configuration empties this cache.
 ///
 
 #include "triggers.h"
 
+#include "auth.h" //for sha256bin
 #include "bitfields.h" //for strToBool
 #include "defines.h" //for FAIL_MSG and INFO_MSG
 #include "downloader.h" //for sending http request
@@ -29,7 +36,18 @@
 #include "timing.h"
 #include "util.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <string.h> //for strncmp
+#include <thread>
+#include <vector>
 
 namespace Triggers{
 
@@ -41,14 +59,218 @@ namespace Triggers{
     Util::sendUDPApi(j);
   }
 
+  /// Maximum amount of idle keep-alive connections kept open per trigger destination.
+#define TRIGGER_POOL_IDLE 4
+  /// Default maximum amount of asynchronous HTTP triggers running at the same time, per process.
+#define TRIGGER_CONCURRENCY 4
+  /// Maximum amount of asynchronous HTTP triggers waiting for a free slot; more are dropped.
+#define TRIGGER_QUEUE_MAX 1024
+  /// Maximum time in milliseconds spent waiting for asynchronous triggers when the process exits.
+#define TRIGGER_EXIT_WAIT 5000
+
+  /// An asynchronous HTTP trigger waiting to be sent, with all headers already filled in.
+  struct asyncTrigger{
+    std::string trigger;
+    std::string url;
+    std::string payload;
+    std::map<std::string, std::string> headers;
+    uint64_t startMs;
+  };
+
+  /// State shared by the HTTP trigger client and its worker threads.
+  /// This is allocated once and lives until the process ends; clientExit stops and joins the worker
+  /// threads when the process exits, and a forked child resets it in place.
+  struct clientState{
+    std::mutex lock;
+    std::condition_variable wake; ///< Signalled when async triggers are queued or finished, or on stop
+    std::map<std::string, std::deque<HTTP::Downloader *> > idle; ///< Keep-alive connections per destination
+    std::deque<asyncTrigger> queue;
+    std::vector<std::thread> threads; ///< Worker threads, running until stop is set
+    std::atomic<bool> stop; ///< Set when the process exits; aborts running requests
+    size_t busy; ///< Amount of workers currently sending a trigger
+    size_t limit; ///< Maximum amount of workers, from the triggerConcurrency setting
+    clientState() : stop(false), busy(0), limit(0){}
+  };
+  static clientState *client = 0;
+
+  /// Called by the child after a fork: the pooled connections, queue and worker threads belong to
+  /// the parent. The lock may be held by a thread that does not exist in the child, so the lock and
+  /// condition variable are constructed anew. The inherited sockets are dropped without shutting
+  /// them down, so the parent can keep using them.
+  static void clientForked(){
+    clientState &C = *client;
+    new (&C.lock) std::mutex();
+    new (&C.wake) std::condition_variable();
+    for (std::map<std::string, std::deque<HTTP::Downloader *> >::iterator it = C.idle.begin(); it != C.idle.end(); ++it){
+      for (std::deque<HTTP::Downloader *>::iterator D = it->second.begin(); D != it->second.end(); ++D){
+        (*D)->getSocket().drop();
+        delete *D;
+      }
+    }
+    C.idle.clear();
+    C.queue.clear();
+    // The threads only exist in the parent; let go of their handles without joining them
+    for (std::vector<std::thread>::iterator it = C.threads.begin(); it != C.threads.end(); ++it){it->detach();}
+    C.threads.clear();
+    C.stop = false;
+    C.busy = 0;
+    C.limit = 0;
+  }
+
+  /// Waits a short while for queued and running asynchronous triggers when the process exits, then
+  /// stops the worker threads and waits for them to finish.
+  static void clientExit(){
+    std::unique_lock<std::mutex> guard(client->lock);
+    uint64_t until = Util::bootMS() + TRIGGER_EXIT_WAIT;
+    while ((client->queue.size() || client->busy) && Util::bootMS() < until){
+      client->wake.wait_for(guard, std::chrono::milliseconds(100));
+    }
+    if (client->queue.size() || client->busy){
+      WARN_MSG("Exiting with %zu asynchronous trigger(s) not sent", client->queue.size() + client->busy);
+      client->queue.clear();
+    }
+    client->stop = true;
+    client->wake.notify_all();
+    std::vector<std::thread> threads;
+    threads.swap(client->threads);
+    guard.unlock();
+    for (std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it){it->join();}
+  }
+
+  /// Sets up the shared client state on first use.
+  static clientState &getClient(){
+    static std::once_flag once;
+    std::call_once(once, [](){
+      client = new clientState();
+      pthread_atfork(0, 0, clientForked);
+      atexit(clientExit);
+    });
+    return *client;
+  }
+
+  /// Returns the key under which connections to the given URL are pooled.
+  static std::string poolKey(const HTTP::URL &url){
+    return url.protocol + "://" + url.host + ":" + JSON::Value(url.getPort()).asString();
+  }
+
+  /// Returns the max-age of a Cache-Control header in seconds, or zero if it may not be cached.
+  static uint64_t getMaxAge(std::string cacheControl){
+    std::transform(cacheControl.begin(), cacheControl.end(), cacheControl.begin(), ::tolower);
+    if (cacheControl.find("no-store") != std::string::npos || cacheControl.find("no-cache") != std::string::npos){
+      return 0;
+    }
+    size_t pos = cacheControl.find("max-age=");
+    if (pos == std::string::npos){return 0;}
+    return strtoull(cacheControl.c_str() + pos + 8, 0, 10);
+  }
+
+  /// Sends a trigger as a blocking POST request, reusing an idle keep-alive connection to the same
+  /// destination if there is one. The connection is returned to the pool afterwards if the
+  /// destination kept it open. Returns true if the request succeeded, setting response to the body
+  /// and maxAge to the amount of seconds the destination allows the response to be cached.
+  static bool postTrigger(const HTTP::URL &url, const std::string &payload,
+                          const std::map<std::string, std::string> &headers, std::string &response,
+                          std::string &error, uint64_t &maxAge){
+    clientState &C = getClient();
+    std::string key = poolKey(url);
+    HTTP::Downloader *DL = 0;
+    {
+      std::lock_guard<std::mutex> guard(C.lock);
+      std::deque<HTTP::Downloader *> &idle = C.idle[key];
+      if (idle.size()){
+        DL = idle.back();
+        idle.pop_back();
+      }
+    }
+    if (!DL){
+      DL = new HTTP::Downloader();
+      DL->progressCallback = [&C](){return !C.stop;};
+    }
+    DL->clearHeaders();
+    for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it){
+      DL->setHeader(it->first, it->second);
+    }
+    bool ok = DL->post(url, payload, true) && DL->isOk();
+    if (DL->getSocket()){
+      // Requests are written as separate header and body; without this, a reused connection waits
+      // for the delayed ACK of the header before the body is sent.
+      int one = 1;
+      setsockopt(DL->getSocket().getSocket(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (ok){
+      response = DL->data();
+      maxAge = getMaxAge(DL->getHeader("Cache-Control"));
+    }else{
+      error = DL->getStatusText();
+    }
+    if (DL->getSocket() && DL->getHeader("Connection") != "close"){
+      std::lock_guard<std::mutex> guard(C.lock);
+      std::deque<HTTP::Downloader *> &idle = C.idle[key];
+      if (idle.size() < TRIGGER_POOL_IDLE){
+        idle.push_back(DL);
+        DL = 0;
+      }
+    }
+    delete DL;
+    return ok;
+  }
+
+  /// Worker thread body: sends queued asynchronous triggers, waiting for more when the queue is
+  /// empty, until the process exits.
+  static void asyncWorker(){
+    clientState &C = getClient();
+    std::unique_lock<std::mutex> guard(C.lock);
+    while (!C.stop){
+      if (!C.queue.size()){
+        C.wake.wait(guard);
+        continue;
+      }
+      asyncTrigger T = C.queue.front();
+      C.queue.pop_front();
+      ++C.busy;
+      guard.unlock();
+      std::string response, error;
+      uint64_t maxAge = 0;
+      bool ok = postTrigger(HTTP::URL(T.url), T.payload, T.headers, response, error, maxAge);
+      if (!ok){FAIL_MSG("Asynchronous %s trigger failed to execute (%s)", T.trigger.c_str(), error.c_str());}
+      submitTriggerStat(T.trigger, T.startMs, ok);
+      guard.lock();
+      --C.busy;
+      C.wake.notify_all();
+    }
+  }
+
+  /// Queues an asynchronous HTTP trigger, starting a worker thread for it if all workers are busy
+  /// and the concurrency limit allows. Returns false if the queue is full and the trigger was dropped.
+  static bool queueTrigger(asyncTrigger &T){
+    clientState &C = getClient();
+    std::lock_guard<std::mutex> guard(C.lock);
+    if (C.stop){return false;}
+    if (!C.limit){
+      C.limit = Util::getGlobalConfig("triggerConcurrency").asInt();
+      if (!C.limit){C.limit = TRIGGER_CONCURRENCY;}
+    }
+    if (C.queue.size() >= TRIGGER_QUEUE_MAX){return false;}
+    C.queue.push_back(asyncTrigger());
+    std::swap(C.queue.back(), T);
+    if (C.threads.size() < C.limit && C.threads.size() - C.busy < C.queue.size()){
+      C.threads.push_back(std::thread(asyncWorker));
+    }
+    C.wake.notify_all();
+    return true;
+  }
+
   ///\brief Handles a trigger by sending a payload to a destination.
   ///\param trigger Trigger event type.
   ///\param value Destination. This can be an (HTTP)URL, or an absolute path to a binary/script
   ///\param payload This data will be sent to the destionation URL/program
   ///\param sync If true, handler is executed blocking and uses the response data.
   ///\returns String, false if further processing should be aborted.
-  std::string handleTrigger(const std::string &trigger, const std::string &value,
-                            const std::string &payload, int sync, const std::string &defaultResponse){
+  ///\param maxAge Set to the amount of seconds the response may be cached, if the handler allows it.
+  /// HTTP destinations are sent over pooled keep-alive connections. Asynchronous HTTP triggers are
+  /// queued and sent by background threads, so they return the default response immediately.
+  static std::string runTrigger(const std::string &trigger, const std::string &value, const std::string &payload,
+                                int sync, const std::string &defaultResponse, uint64_t &maxAge){
     uint64_t tStartMs = Util::bootMS();
     if (!value.size()){
       INFO_MSG("Blank %s trigger, responding: %s", trigger.c_str(), defaultResponse.c_str());
@@ -56,29 +278,41 @@ namespace Triggers{
     }
     INFO_MSG("Executing %s trigger: %s (%s)", trigger.c_str(), value.c_str(), sync ? "blocking" : "asynchronous");
     if (value.substr(0, 7) == "http://" || value.substr(0, 8) == "https://"){// interpret as url
-      HTTP::Downloader DL;
-      DL.setHeader("X-Trigger", trigger);
+      std::map<std::string, std::string> headers;
+      headers["X-Trigger"] = trigger;
       std::string iid = Util::getGlobalConfig("iid").asString();
       if (iid.size()){
-        DL.setHeader("X-Instance", iid);
+        headers["X-Instance"] = iid;
       }
       std::string hrn = Util::getGlobalConfig("hrn").asString();
       if (hrn.size()){
-        DL.setHeader("X-Name", hrn);
+        headers["X-Name"] = hrn;
+      }
+      headers["X-PID"] = JSON::Value(getpid()).toString();
+      if (getenv("MIST_TUUID")){headers["X-Trigger-UUID"] = getenv("MIST_TUUID");}
+      if (getenv("MIST_TIME")){headers["X-Trigger-UnixMillis"] = getenv("MIST_TIME");}
+      if (getenv("MIST_DATE")){headers["Date"] = getenv("MIST_DATE");}
+      headers["Content-Type"] = "text/plain";
+      if (!sync){
+        asyncTrigger T;
+        T.trigger = trigger;
+        T.url = value;
+        T.payload = payload;
+        T.headers.swap(headers);
+        T.startMs = tStartMs;
+        if (!queueTrigger(T)){
+          FAIL_MSG("Too many %s triggers waiting to be sent, dropping this one", trigger.c_str());
+          submitTriggerStat(trigger, tStartMs, false);
+        }
+        return defaultResponse;
       }
-      DL.setHeader("X-PID", JSON::Value(getpid()).toString());
-      DL.setHeader("X-Trigger-UUID", getenv("MIST_TUUID"));
-      DL.setHeader("X-Trigger-UnixMillis", getenv("MIST_TIME"));
-      DL.setHeader("Date", getenv("MIST_DATE"));
-      DL.setHeader("Content-Type", "text/plain");
-      HTTP::URL url(value);
-      if (DL.post(url, payload, sync) && (!sync || DL.isOk())){
+      std::string response, error;
+      if (postTrigger(HTTP::URL(value), payload, headers, response, error, maxAge)){
         submitTriggerStat(trigger, tStartMs, true);
-        if (!sync){return defaultResponse;}
-        return DL.data();
+        return response;
       }
       FAIL_MSG("Trigger failed to execute (%s), using default response: %s",
-               DL.getStatusText().c_str(), defaultResponse.c_str());
+               error.c_str(), defaultResponse.c_str());
       submitTriggerStat(trigger, tStartMs, false);
       return defaultResponse;
     }else{// send payload to stdin of newly forked process
@@ -156,6 +390,136 @@ namespace Triggers{
     }
   }
 
+  ///\brief Handles a trigger by sending a payload to a destination.
+  ///\param trigger Trigger event type.
+  ///\param value Destination. This can be an (HTTP)URL, or an absolute path to a binary/script
+  ///\param payload This data will be sent to the destionation URL/program
+  ///\param sync If true, handler is executed blocking and uses the response data.
+  ///\returns String, false if further processing should be aborted.
+  std::string handleTrigger(const std::string &trigger, const std::string &value,
+                            const std::string &payload, int sync, const std::string &defaultResponse){
+    uint64_t maxAge = 0;
+    return runTrigger(trigger, value, payload, sync, defaultResponse, maxAge);
+  }
+
+  /// Returns true if responses of the given trigger type may be cached. Only triggers that decide
+  /// whether a connection is allowed qualify, since their response depends on nothing but the payload.
+  static bool isCacheable(const std::string &type){
+    return type == "USER_NEW" || type == "CONN_OPEN" || type == "CONN_PLAY";
+  }
+
+  /// Key under which the response of a handler to a payload is stored in the trigger response cache.
+  struct cacheKey{
+    uint64_t hash; ///< 64-bit FNV-1a hash, only used to pick the slot; zero is reserved for empty slots
+    char digest[32]; ///< SHA-256 of the full key, compared on every hit
+  };
+
+  /// Returns the key under which the response of the given handler to the given payload is cached.
+  static cacheKey makeCacheKey(const std::string &type, const std::string &handler, const std::string &payload){
+    cacheKey K;
+    K.hash = 0xcbf29ce484222325ull;
+    std::string parts[3] = {type, handler, payload};
+    for (size_t i = 0; i < 3; ++i){
+      for (size_t j = 0; j < parts[i].size(); ++j){
+        K.hash = (K.hash ^ (uint8_t)parts[i][j]) * 0x100000001b3ull;
+      }
+      // Separate the parts, so moving bytes from one to the next changes the hash
+      K.hash = (K.hash ^ 0xFF) * 0x100000001b3ull;
+    }
+    if (!K.hash){K.hash = 1;}
+    // Type and handler never contain a null byte, so this cannot be ambiguous
+    std::string full = type + '\0' + handler + '\0' + payload;
+    Secure::sha256bin(full.data(), full.size(), K.digest);
+    return K;
+  }
+
+  /// Amount of consecutive slots searched for a key in the trigger response cache.
+#define TRIGGER_CACHE_PROBES 8
+
+  /// Per-process handles to the shared trigger response cache, kept open between lookups.
+  /// Allocated once and never freed, like clientState.
+  struct cacheState{
+    std::mutex lock;
+    IPC::sharedPage page;
+    Util::RelAccX cache;
+    IPC::semaphore sem;
+  };
+
+  /// Returns the cache state with the page and semaphore opened, or null if the cache is unavailable.
+  /// Both are reopened when the controller recreated the page; it replaces the semaphore before
+  /// creating the new page, so once the new page is ready, reopening gets the new semaphore too.
+  /// Must be called with the state lock held.
+  static cacheState *openCache(cacheState &C){
+    if (C.page.mapped && C.cache.isReady() && !C.cache.isReload()){return &C;}
+    C.sem.close();
+    C.cache = Util::RelAccX();
+    C.page.init(SHM_TRIGGER_CACHE, SHM_TRIGGER_CACHE_LEN, false, false);
+    if (!C.page.mapped){return 0;}
+    C.cache = Util::RelAccX(C.page.mapped, false);
+    if (!C.cache.isReady() || C.cache.isReload() || !C.cache.getRCount()){return 0;}
+    C.sem.open(SEM_TRIGGER_CACHE, O_CREAT | O_RDWR, ACCESSPERMS, 1);
+    if (!C.sem){return 0;}
+    return &C;
+  }
+
+  /// Looks up or stores a trigger response in the shared trigger response cache page, which is
+  /// created by the controller and wiped whenever the trigger configuration changes.
+  /// If maxAge is zero, sets response to the cached response for key and returns true if there is
+  /// one that has not expired yet. Otherwise, stores the response for maxAge seconds.
+  /// Gives up (returning false) rather than wait long on a busy cache; it is only an optimization.
+  static bool accessCache(const cacheKey &key, std::string &response, uint64_t maxAge){
+    static cacheState *state = new cacheState();
+    std::lock_guard<std::mutex> guard(state->lock);
+    cacheState *C = openCache(*state);
+    if (!C){return false;}
+    Util::RelAccX &cache = C->cache;
+    Util::RelAccXFieldData keyField = cache.getFieldData("key");
+    Util::RelAccXFieldData digestField = cache.getFieldData("digest");
+    Util::RelAccXFieldData expireField = cache.getFieldData("expire");
+    Util::RelAccXFieldData responseField = cache.getFieldData("response");
+    if (digestField.size != sizeof(key.digest) || !responseField.size){return false;}
+    if (maxAge && response.size() >= responseField.size){return false;}
+
+    size_t attempts = 0;
+    while (!C->sem.tryWait()){
+      if (++attempts > 10){return false;}
+      Util::sleep(1);
+    }
+    uint64_t now = Util::bootMS();
+    uint64_t slots = cache.getRCount();
+    size_t useSlot = key.hash % slots;
+    uint64_t useExpire = 0xFFFFFFFFFFFFFFFFull;
+    for (size_t i = 0; i < TRIGGER_CACHE_PROBES; ++i){
+      size_t slot = (key.hash + i) % slots;
+      uint64_t expire = cache.getInt(expireField, slot);
+      // The hash only picks the slot; an entry is only a hit if the full key matches too
+      if (cache.getInt(keyField, slot) == key.hash &&
+          !memcmp(cache.getPointer(digestField, slot), key.digest, sizeof(key.digest))){
+        if (!maxAge){
+          bool found = (expire > now);
+          if (found){response = cache.getPointer(responseField, slot);}
+          C->sem.post();
+          return found;
+        }
+        useSlot = slot;
+        break;
+      }
+      // When storing, replace the entry that expires first
+      if (expire < useExpire){
+        useSlot = slot;
+        useExpire = expire;
+      }
+    }
+    if (maxAge){
+      cache.setInt(keyField, key.hash, useSlot);
+      cache.setString(digestField, std::string(key.digest, sizeof(key.digest)), useSlot);
+      cache.setInt(expireField, now + maxAge * 1000, useSlot);
+      cache.setString(responseField, response, useSlot);
+    }
+    C->sem.post();
+    return maxAge;
+  }
+
   /// Returns true if a trigger of the specified type should be handled for a specified stream (or entire server)
   /// Calls doTrigger with dryRun set to true
   /// \param type Trigger event type.
@@ -285,7 +649,17 @@ namespace Triggers{
         std::string defaultResponse = trigs.getPointer("default", i);
         if (!defaultResponse.size()) { defaultResponse = "true"; }
         if (sync){
-          response = handleTrigger(type, uri, payload, sync, defaultResponse); // do it.
+          // Decisions on new connections may be cached, if the handler said for how long
+          bool cacheable = isCacheable(type);
+          cacheKey key;
+          if (cacheable){key = makeCacheKey(type, uri, payload);}
+          if (cacheable && accessCache(key, response, 0)){
+            HIGH_MSG("Using cached %s trigger response: %s", type.c_str(), response.c_str());
+          }else{
+            uint64_t maxAge = 0;
+            response = runTrigger(type, uri, payload, sync, defaultResponse, maxAge); // do it.
+            if (cacheable && maxAge){accessCache(key, response, maxAge);}
+          }
           retVal &= Util::stringToBool(response);
         }else{
           std::string unused_response = handleTrigger(type, uri, payload, sync, defaultResponse); // do it.
@@ -451,8 +451,10 @@ int main_loop(int argc, char **argv){
   Controller::externalWritersToShm();
 
   Controller::E.addInterval(Controller::jwkUriCheck, 1000);
-  Controller::E.addInterval(Controller::runStats, 1000);
+  Controller::startStats();
+  Controller::E.addInterval(Controller::runStats, 250);
   Controller::E.addInterval(Controller::updateLoad, 1000);
+  Controller::E.addInterval(Controller::callLoad, 250);
   Controller::variableTimer = Controller::E.addInterval(Controller::variableRun, 750);
   Controller::E.addInterval(Controller::runPushCheck, 1000);
   Controller::E.addInterval(statusMonitor, 3000);
@@ -30,6 +30,7 @@
 std::set<APIConn *> reggedLoggers;
 std::set<APIConn *> reggedAccess;
 std::set<APIConn *> reggedStreams;
+std::set<APIConn *> reggedLoad;
 
 void Controller::registerLogger(APIConn *aConn) {
   reggedLoggers.insert(aConn);
@@ -43,10 +44,15 @@ void Controller::registerStreams(APIConn *aConn) {
   reggedStreams.insert(aConn);
 }
 
+void Controller::registerLoad(APIConn *aConn) {
+  reggedLoad.insert(aConn);
+}
+
 void Controller::deregister(APIConn *aConn) {
   reggedLoggers.erase(aConn);
   reggedAccess.erase(aConn);
   reggedStreams.erase(aConn);
+  reggedLoad.erase(aConn);
 }
 
 void Controller::callLogger(uint64_t time, const std::string & kind, const std::string & message, const std::string & stream,
@@ -79,6 +85,21 @@ void Controller::callStreams(const std::string & stream, uint8_t status, uint64_
   for (auto A : toDel) { delete A; }
 }
 
+/// Pushes changes in server load to all subscribed load balancers.
+/// Called on an interval; the state is only collected if anyone is listening.
+size_t Controller::callLoad() {
+  if (!reggedLoad.size()) { return 250; }
+  LoadPush::State S;
+  fillLoadState(S);
+  std::set<APIConn *> toDel;
+  for (auto A : reggedLoad) {
+    A->load(S);
+    if (!A->C) { toDel.insert(A); }
+  }
+  for (auto A : toDel) { delete A; }
+  return 250;
+}
+
 APIConn::APIConn(Event::Loop & evLp, Socket::Server & srv) : E(evLp) {
   authorized = false;
   attempts = 0;
@@ -86,6 +107,7 @@ APIConn::APIConn(Event::Loop & evLp, Socket::Server & srv) : E(evLp) {
   isWebSocket = false;
   W = 0;
   authTime = 0;
+  lastLoadPush = 0;
   C = srv.accept(true);
 
   sock = C.getSocket();
@@ -315,6 +337,21 @@ void APIConn::stream(const std::string & stream, uint8_t status, uint64_t viewer
   W->sendFrame(tmp.toString());
 }
 
+void APIConn::load(const LoadPush::State & S) {
+  // Skip updates for slow receivers; the next frame will contain all changes anyway
+  if (C.sendingBlocked(10000)) { return; }
+
+  std::string frame;
+  uint64_t now = Util::bootMS();
+  if (!loadPush.encode(S, frame)) {
+    // Nothing changed; send a heartbeat every 5 seconds so the receiver knows we're alive
+    if (now < lastLoadPush + 5000) { return; }
+    loadPush.heartbeat(frame);
+  }
+  lastLoadPush = now;
+  C.SendNow(frame);
+}
+
 void Controller::handleWebSocket(APIConn *aConn) {
   // Not a websocket yet? Set it up!
   if (!aConn->isWebSocket) {
@@ -535,6 +572,17 @@ bool Controller::handleAPIConnection(APIConn *aConn) {
         aConn->H.Clean();
         continue;
       }
+      if (aConn->H.url == "/" + Controller::prometheus + ".push") {
+        // Keep the connection open, and push load changes over it from now on
+        aConn->H.Clean();
+        aConn->H.SetHeader("Content-Type", LoadPush::contentType);
+        aConn->H.SetHeader("Server", APPIDENT);
+        aConn->H.SetHeader("Connection", "close");
+        aConn->H.SendResponse("200", "OK", aConn->C);
+        aConn->H.Clean();
+        registerLoad(aConn);
+        return aConn->C;
+      }
       if (aConn->H.url.substr(0, Controller::prometheus.size() + 6) == "/" + Controller::prometheus + ".json") {
         handlePrometheus(aConn->H, aConn->C, PROMETHEUS_JSON);
         aConn->H.Clean();
@@ -642,10 +690,15 @@ void Controller::handleAPICommands(JSON::Value &Request, JSON::Value &Response){
       Controller::triggerLog &tLog = Controller::triggerStats[tStat["name"].asStringRef()];
       tLog.totalCount++;
       tLog.ms += tStat["ms"].asInt();
+      tLog.latency.add(tStat["ms"].asInt());
       if (!tStat.isMember("ok") || !tStat["ok"].asBool()){tLog.failCount++;}
     }
     return;
   }
+  if (Request.isMember("latency_stat")){
+    jsonForEach(Request["latency_stat"], it){Controller::requestLatency[it.key()].add(*it);}
+    return;
+  }
   if (Request.isMember("trigger_fail")){
     Controller::triggerStats[Request["trigger_fail"].asStringRef()].failCount++;
     return;
@@ -740,6 +793,7 @@ void Controller::handleAPICommands(JSON::Value &Request, JSON::Value &Response){
     if (in.isMember("sessionUnspecifiedMode")){out["sessionUnspecifiedMode"] = in["sessionUnspecifiedMode"];}
     if (in.isMember("sessionStreamInfoMode")){out["sessionStreamInfoMode"] = in["sessionStreamInfoMode"];}
     if (in.isMember("tknMode")){out["tknMode"] = in["tknMode"];}
+    if (in.isMember("triggerConcurrency")){out["triggerConcurrency"] = in["triggerConcurrency"].asInt();}
     if (in.isMember("defaultStream")){out["defaultStream"] = in["defaultStream"];}
     if (in.isMember("location") && in["location"].isObject()){
       out["location"]["lat"] = in["location"]["lat"].asDouble();
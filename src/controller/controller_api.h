@@ -1,6 +1,7 @@
 #include <mist/ev.h>
 #include <mist/http_parser.h>
 #include <mist/json.h>
+#include <mist/load_push.h>
 #include <mist/socket.h>
 #include <mist/websocket.h>
 
@@ -22,12 +23,17 @@ class APIConn {
     std::string strmsArg;
     uint64_t authTime;
 
+    // Load telemetry push related
+    LoadPush::Encoder loadPush;
+    uint64_t lastLoadPush;
+
     void log(uint64_t time, const std::string & kind, const std::string & message, const std::string & stream,
              uint64_t progPid, const std::string & exe, const std::string & line);
     void access(uint64_t time, const std::string & session, const std::string & stream, const std::string & connector,
                 const std::string & host, uint64_t duration, uint64_t up, uint64_t down, const std::string & tags);
     void stream(const std::string & stream, uint8_t status, uint64_t viewers, uint64_t inputs, uint64_t outputs,
                 const std::string & tags);
+    void load(const LoadPush::State & S);
 
     APIConn(Event::Loop & evLp, Socket::Server & srv);
     ~APIConn();
@@ -41,6 +47,7 @@ namespace Controller{
   void registerLogger(APIConn *aConn);
   void registerAccess(APIConn *aConn);
   void registerStreams(APIConn *aConn);
+  void registerLoad(APIConn *aConn);
   void deregister(APIConn *aConn);
 
   void callLogger(uint64_t time, const std::string & kind, const std::string & message, const std::string & stream,
@@ -49,6 +56,7 @@ namespace Controller{
                   const std::string & host, uint64_t duration, uint64_t up, uint64_t down, const std::string & tags);
   void callStreams(const std::string & stream, uint8_t status, uint64_t viewers, uint64_t inputs, uint64_t outputs,
                    const std::string & tags);
+  size_t callLoad();
 
   bool authorize(JSON::Value &Request, JSON::Value &Response, Socket::Connection &conn);
   bool handleAPIConnection(APIConn *aConn);
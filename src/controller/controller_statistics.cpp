@@ -14,11 +14,16 @@
 #include <mist/triggers.h>
 #include <mist/url.h>
 
+#include <atomic>
 #include <cstdio>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <memory>
 #include <signal.h>
 #include <sstream>
 #include <sys/statvfs.h> //for fstatvfs
+#include <thread>
 
 #ifndef KILL_ON_EXIT
 #define KILL_ON_EXIT false
@@ -53,6 +58,7 @@
 std::map<std::string, Controller::statSession> sessions;
 
 std::map<std::string, Controller::triggerLog> Controller::triggerStats; ///< Holds prometheus stats for trigger executions
+std::map<std::string, Util::LatencyHistogram> Controller::requestLatency; ///< Holds prometheus stats for request handling times in outputs
 bool Controller::killOnExit = KILL_ON_EXIT;
 std::recursive_mutex statsMutex;
 uint64_t Controller::statDropoff = 0;
@@ -153,6 +159,255 @@ static void createEmptyStatsIfNeeded(const std::string & streamName){
   sT.packRetrans = 0;
 }
 
+/// Columns of the per-second totals in totalsRollups, in the order they are stored in.
+enum totalsColumn{
+  TOT_COL_CLIENTS,
+  TOT_COL_INPUTS,
+  TOT_COL_OUTPUTS,
+  TOT_COL_UNSPECIFIED,
+  TOT_COL_BPS_DOWN,
+  TOT_COL_BPS_UP,
+  TOT_COL_PKTCOUNT,
+  TOT_COL_PKTLOST,
+  TOT_COL_PKTRETRANSMIT,
+  TOT_COL_COUNT
+};
+
+// Per-second totals of all active sessions, per combination of stream name and connectors.
+// Keys are the stream name and connectors separated by a newline. Used to answer "totals" requests.
+static std::map<std::string, TimeSeries::Series> totalsRollups;
+
+/// Running sum of what all counted sessions add to a single totals rollup.
+struct rollupSum{
+  size_t sessions;
+  uint64_t vals[TOT_COL_COUNT];
+};
+static std::map<std::string, rollupSum> rollupSums;
+
+/// What a single session currently adds to the aggregated statistics.
+/// Kept per session, so a session is only looked at again once its record changes,
+/// or once enough time passed for its contribution to change by itself.
+struct sessionCount{
+  Controller::sessType type;
+  std::string stream; ///< Stream the session counts towards, if any
+  bool current; ///< True if counted as a current viewer, input, output or unspecified session
+  uint64_t connTime; ///< Connected time of a viewer session, added to servSeconds every pass
+  std::string rollup; ///< Key of the totals rollup the session adds to, if any
+  uint64_t vals[TOT_COL_COUNT]; ///< What the session adds to that rollup
+  uint64_t recheck; ///< When the contribution may change even if the session does not
+};
+static std::map<std::string, sessionCount> sessionCounts;
+// Sessions to count again once their recheck time is reached, ordered by that time
+static std::set<std::pair<uint64_t, std::string> > sessionRechecks;
+// Sessions that changed or disconnected since the previous pass
+static std::set<std::string> changedSessions;
+// Sum of the connected time of all counted viewer sessions
+static uint64_t viewerConnTime = 0;
+
+/// Last seen state of a record in statComm, indexed by record number.
+/// Records that did not change since the previous pass are not parsed again.
+struct recordState{
+  uint64_t now;
+  uint64_t down;
+  uint64_t up;
+};
+static std::vector<recordState> recordSeen;
+
+/// Takes what a session added to the aggregated statistics back out again.
+static void uncountSession(const sessionCount &C){
+  if (C.stream.size()){
+    std::map<std::string, struct streamTotals>::iterator S = streamStats.find(C.stream);
+    if (S != streamStats.end()){
+      --S->second.currSessions;
+      if (C.current){
+        switch (C.type){
+          case Controller::SESS_VIEWER: --S->second.currViews; break;
+          case Controller::SESS_INPUT: --S->second.currIns; break;
+          case Controller::SESS_OUTPUT: --S->second.currOuts; break;
+          case Controller::SESS_UNSPECIFIED: --S->second.currUnspecified; break;
+          default: break;
+        }
+      }
+    }
+    viewerConnTime -= C.connTime;
+  }
+  if (C.rollup.size()){
+    std::map<std::string, rollupSum>::iterator R = rollupSums.find(C.rollup);
+    if (R != rollupSums.end()){
+      for (size_t i = 0; i < TOT_COL_COUNT; ++i){R->second.vals[i] -= C.vals[i];}
+      if (!--R->second.sessions){rollupSums.erase(R);}
+    }
+  }
+}
+
+/// Adds what a session contributes at bootsecs time t to the aggregated statistics, and sets when
+/// that may next change without the session itself changing: once it has been around long enough to
+/// count as current, while its bit rates are still settling, and once it is old enough to be wiped.
+static void countSession(Controller::statSession &S, sessionCount &C, uint64_t t, uint64_t tOut, uint64_t tIn){
+  C.type = S.getSessType();
+  C.stream = S.getStreamName();
+  C.current = false;
+  C.connTime = 0;
+  C.rollup.clear();
+  C.recheck = S.getEnd() + STAT_CUTOFF + 1;
+  if (C.stream.size()){
+    streamTotals &sT = streamStats[C.stream];
+    ++sT.currSessions;
+    switch (C.type){
+      case Controller::SESS_UNSET: break;
+      case Controller::SESS_VIEWER:
+        C.current = S.hasDataFor(tOut);
+        if (C.current){++sT.currViews;}
+        C.connTime = S.getConnTime();
+        viewerConnTime += C.connTime;
+        break;
+      case Controller::SESS_INPUT:
+        C.current = S.hasDataFor(tIn);
+        if (C.current){++sT.currIns;}
+        break;
+      case Controller::SESS_OUTPUT:
+        C.current = S.hasDataFor(tOut);
+        if (C.current){++sT.currOuts;}
+        break;
+      case Controller::SESS_UNSPECIFIED:
+        C.current = S.hasDataFor(tOut);
+        if (C.current){++sT.currUnspecified;}
+        break;
+    }
+    if (!C.current && C.type != Controller::SESS_UNSET){
+      uint64_t since = S.getStart() + (C.type == Controller::SESS_INPUT ? STATS_INPUT_DELAY : STATS_DELAY);
+      C.recheck = std::min(C.recheck, std::max(since, t + 1));
+    }
+  }
+  if (S.hasDataFor(t) && notEmpty(S.curData.getDataFor(t))){
+    C.rollup = S.getStreamName(t) + "\n" + S.getConnectors(t);
+    memset(C.vals, 0, sizeof(C.vals));
+    switch (C.type){
+      case Controller::SESS_VIEWER: ++C.vals[TOT_COL_CLIENTS]; break;
+      case Controller::SESS_INPUT: ++C.vals[TOT_COL_INPUTS]; break;
+      case Controller::SESS_OUTPUT: ++C.vals[TOT_COL_OUTPUTS]; break;
+      case Controller::SESS_UNSPECIFIED: ++C.vals[TOT_COL_UNSPECIFIED]; break;
+      default: break;
+    }
+    C.vals[TOT_COL_PKTCOUNT] = S.getPktCount(t);
+    C.vals[TOT_COL_PKTLOST] = S.getPktLost(t);
+    C.vals[TOT_COL_PKTRETRANSMIT] = S.getPktRetransmit(t);
+    C.vals[TOT_COL_BPS_DOWN] = S.getBpsDown(t);
+    C.vals[TOT_COL_BPS_UP] = S.getBpsUp(t);
+    rollupSum &R = rollupSums[C.rollup];
+    ++R.sessions;
+    for (size_t i = 0; i < TOT_COL_COUNT; ++i){R.vals[i] += C.vals[i];}
+  }
+  // Bit rates are averaged over the last 5 seconds, so they keep changing for a while after the last update
+  if (t < S.getEnd() + 5){C.recheck = std::min(C.recheck, t + 1);}
+}
+
+/// Adds a datapoint at bootsecs time t to the totals rollups, from the running sums of all counted sessions.
+/// Drops rollups that have no data left within STAT_CUTOFF seconds.
+static void rollupTotals(uint64_t t){
+  for (auto & it : rollupSums){
+    std::map<std::string, TimeSeries::Series>::iterator R = totalsRollups.find(it.first);
+    if (R == totalsRollups.end()){
+      R = totalsRollups.insert(std::make_pair(it.first, TimeSeries::Series(TOT_COL_COUNT))).first;
+    }
+    R->second.append(t, it.second.vals);
+  }
+  uint64_t cutOffPoint = (t > STAT_CUTOFF) ? t - STAT_CUTOFF : 0;
+  for (std::map<std::string, TimeSeries::Series>::iterator it = totalsRollups.begin(); it != totalsRollups.end();){
+    it->second.trim(cutOffPoint);
+    if (it->second.empty()){
+      totalsRollups.erase(it++);
+    }else{
+      ++it;
+    }
+  }
+}
+
+// Per-stream totals as published in a snapshot; entries are immutable so snapshots can share them
+typedef std::map<std::string, std::shared_ptr<const streamTotals> > streamTotalsMap;
+
+/// Immutable copy of the aggregated statistics, published after every pass of the statistics thread.
+/// Readers only load the pointer, so they never wait for aggregation to finish.
+struct statsSnapshot{
+  uint64_t upBytes;
+  uint64_t downBytes;
+  uint64_t upOtherBytes;
+  uint64_t downOtherBytes;
+  uint64_t inputs;
+  uint64_t outputs;
+  uint64_t viewers;
+  uint64_t unspecified;
+  uint64_t viewSeconds;
+  uint64_t packSent;
+  uint64_t packLoss;
+  uint64_t packRetrans;
+  uint64_t cachedSessions;
+  std::shared_ptr<const streamTotalsMap> streams; ///< Shared with the previous snapshot where unchanged
+};
+static std::shared_ptr<const statsSnapshot> statsSnap;
+
+/// Returns the most recently published statistics, or all zeroes if none were published yet.
+static std::shared_ptr<const statsSnapshot> getStatsSnapshot(){
+  std::shared_ptr<const statsSnapshot> snap = std::atomic_load(&statsSnap);
+  if (!snap){
+    std::shared_ptr<statsSnapshot> empty(new statsSnapshot());
+    empty->streams.reset(new streamTotalsMap());
+    snap = empty;
+  }
+  return snap;
+}
+
+/// Returns true if both stream totals hold the same values.
+static bool sameTotals(const streamTotals &a, const streamTotals &b){
+  return a.upBytes == b.upBytes && a.downBytes == b.downBytes && a.inputs == b.inputs && a.outputs == b.outputs &&
+         a.viewers == b.viewers && a.unspecified == b.unspecified && a.currIns == b.currIns &&
+         a.currOuts == b.currOuts && a.currViews == b.currViews && a.currUnspecified == b.currUnspecified &&
+         a.currSessions == b.currSessions && a.status == b.status && a.viewSeconds == b.viewSeconds &&
+         a.packSent == b.packSent && a.packLoss == b.packLoss && a.packRetrans == b.packRetrans && a.tags == b.tags;
+}
+
+/// Returns the per-stream totals for the next snapshot. Only streams that changed since the
+/// previous snapshot are copied; the others share their entry with it, or the whole map if none changed.
+static std::shared_ptr<const streamTotalsMap> snapshotStreams(const std::shared_ptr<const streamTotalsMap> &prev){
+  bool changed = (prev->size() != streamStats.size());
+  if (!changed){
+    streamTotalsMap::const_iterator P = prev->begin();
+    for (auto & it : streamStats){
+      if (P->first != it.first || !sameTotals(*P->second, it.second)){
+        changed = true;
+        break;
+      }
+      ++P;
+    }
+  }
+  if (!changed){return prev;}
+  std::shared_ptr<streamTotalsMap> ret(new streamTotalsMap());
+  streamTotalsMap::const_iterator P = prev->begin();
+  for (auto & it : streamStats){
+    while (P != prev->end() && P->first < it.first){++P;}
+    if (P != prev->end() && P->first == it.first && sameTotals(*P->second, it.second)){
+      ret->insert(ret->end(), *P);
+    }else{
+      ret->insert(ret->end(), std::make_pair(it.first, std::shared_ptr<const streamTotals>(new streamTotals(it.second))));
+    }
+  }
+  return ret;
+}
+
+// Work queued by the statistics thread that must run on the main thread, such as API callbacks and triggers
+static std::mutex statEventMutex;
+static std::deque<std::function<void()> > statEvents;
+static void queueStatEvent(const std::function<void()> &event){
+  std::lock_guard<std::mutex> guard(statEventMutex);
+  statEvents.push_back(event);
+}
+
+static std::thread statsThread;
+static std::atomic<bool> statsThreadActive(false);
+// Sessions that disconnected during the current pass, checked for leftovers once statsMutex is released
+static std::set<std::string> disconnectedSessions;
+static void cleanupSession(const std::string &thisSessionId);
+
 /// Convert bandwidth config into memory format
 void Controller::updateBandwidthConfig(){
   size_t offset = 0;
@@ -176,6 +431,9 @@ void Controller::updateBandwidthConfig(){
 void Controller::streamStarted(std::string stream){
   INFO_MSG("Stream %s became active", stream.c_str());
   {
+    std::lock_guard<std::recursive_mutex> guard(statsMutex);
+    // Called from the main thread, so the stream may have been cleaned up in the meantime
+    if (!streamStats.count(stream)){return;}
     streamTotals & sT = streamStats[stream];
     JSON::Value strCnf = Util::getStreamConfig(stream);
     if (strCnf.isMember("tags")){
@@ -392,9 +650,15 @@ void Controller::initStats() {
   statCommActive = true;
   shiftWrites = true;
   firstRun = true;
+  recordSeen.clear();
 }
 
 void Controller::deinitStats() {
+  if (statsThreadActive){
+    statsThreadActive = false;
+    statsThread.join();
+  }
+  runStats();
   statCommActive = false;
   if (Util::Config::is_restarting) {
     statComm.setMaster(false);
@@ -406,17 +670,18 @@ void Controller::deinitStats() {
   }
 }
 
-/// This function runs as a thread and roughly once per second retrieves
-/// statistics from all connected clients, as well as wipes
-/// old statistics that have disconnected over 10 minutes ago.
-size_t Controller::runStats() {
+/// Retrieves statistics from all connected clients, wipes old statistics that have disconnected
+/// over 10 minutes ago, and publishes the results as a new snapshot.
+/// Runs on the statistics thread; anything that touches API connections, the configuration or
+/// triggers is queued for the main thread instead.
+static void aggregateStats() {
   {
-    std::lock_guard<std::mutex> guard(Controller::configMutex);
-    std::lock_guard<std::recursive_mutex> guard2(statsMutex);
+    std::lock_guard<std::recursive_mutex> guard(statsMutex);
+    std::shared_ptr<const statsSnapshot> prev = getStatsSnapshot();
     // parse current users
-    statLeadIn();
-    COMM_LOOP(statComm, statOnActive(id), statOnDisconnect(id));
-    statLeadOut();
+    Controller::statLeadIn();
+    COMM_LOOP(statComm, Controller::statOnActive(id), Controller::statOnDisconnect(id));
+    Controller::statLeadOut();
 
     if (firstRun) {
       firstRun = false;
@@ -436,7 +701,7 @@ size_t Controller::runStats() {
         it->second.packLoss = 0;
         it->second.packRetrans = 0;
       }
-      Util::RelAccX *strmStats = streamsAccessor();
+      Util::RelAccX *strmStats = Controller::streamsAccessor();
       if (!strmStats || !strmStats->isReady()) { strmStats = 0; }
       if (strmStats) {
         uint64_t startPos = strmStats->getDeleted();
@@ -463,65 +728,44 @@ size_t Controller::runStats() {
         }
       }
     }
-    unsigned int tOut = Util::bootSecs() - STATS_DELAY;
-    unsigned int tIn = Util::bootSecs() - STATS_INPUT_DELAY;
-    auto oldStreamStats = streamStats;
-    if (streamStats.size()) {
-      for (auto & it : streamStats) {
-        it.second.currViews = 0;
-        it.second.currIns = 0;
-        it.second.currOuts = 0;
-        it.second.currUnspecified = 0;
-        it.second.currSessions = 0;
-      }
+    uint64_t now = Util::bootSecs();
+    unsigned int tOut = now - STATS_DELAY;
+    unsigned int tIn = now - STATS_INPUT_DELAY;
+    // Ensure cutOffPoint is either time of boot or 10 minutes ago, whichever is closer.
+    // Prevents wrapping around to high values close to system boot time.
+    uint64_t cutOffPoint = (now > STAT_CUTOFF) ? now - STAT_CUTOFF : 0;
+    // Sessions whose contribution may have changed by itself are counted again as well
+    while (sessionRechecks.size() && sessionRechecks.begin()->first <= now) {
+      changedSessions.insert(sessionRechecks.begin()->second);
+      sessionRechecks.erase(sessionRechecks.begin());
     }
-    // wipe old statistics and set session type counters
-    if (sessions.size()) {
-      std::list<std::string> mustWipe;
-      // Ensure cutOffPoint is either time of boot or 10 minutes ago, whichever is closer.
-      // Prevents wrapping around to high values close to system boot time.
-      uint64_t cutOffPoint = Util::bootSecs();
-      if (cutOffPoint > STAT_CUTOFF) {
-        cutOffPoint -= STAT_CUTOFF;
-      } else {
-        cutOffPoint = 0;
+    // Recount changed sessions and wipe old statistics; all other sessions keep their previous counts
+    for (const std::string & sessId : changedSessions) {
+      std::map<std::string, sessionCount>::iterator C = sessionCounts.find(sessId);
+      if (C != sessionCounts.end()) {
+        uncountSession(C->second);
+        sessionRechecks.erase(std::make_pair(C->second.recheck, sessId));
       }
-      for (auto & it : sessions) {
-        std::string strm = it.second.getStreamName();
-        if (strm.size()) { streamStats[strm].currSessions++; }
-        // This part handles ending sessions, keeping them in cache for now
-        if (it.second.getEnd() < cutOffPoint) {
-          viewSecondsTotal += it.second.getConnTime();
-          mustWipe.push_back(it.first);
-          // Don't count this session as a viewer
-          continue;
-        }
-        if (strm.size()) {
-          // Recount input, output and viewer type sessions
-          switch (it.second.getSessType()) {
-            case SESS_UNSET: break;
-            case SESS_VIEWER:
-              if (it.second.hasDataFor(tOut)) { streamStats[it.second.getStreamName()].currViews++; }
-              servSeconds += it.second.getConnTime();
-              break;
-            case SESS_INPUT:
-              if (it.second.hasDataFor(tIn)) { streamStats[it.second.getStreamName()].currIns++; }
-              break;
-            case SESS_OUTPUT:
-              if (it.second.hasDataFor(tOut)) { streamStats[it.second.getStreamName()].currOuts++; }
-              break;
-            case SESS_UNSPECIFIED:
-              if (it.second.hasDataFor(tOut)) { streamStats[it.second.getStreamName()].currUnspecified++; }
-              break;
-          }
-        }
+      std::map<std::string, Controller::statSession>::iterator S = sessions.find(sessId);
+      if (S == sessions.end()) {
+        if (C != sessionCounts.end()) { sessionCounts.erase(C); }
+        continue;
       }
-      while (mustWipe.size()) {
-        sessions.erase(mustWipe.front());
-        mustWipe.pop_front();
+      // This part handles ending sessions, keeping them in cache for now
+      if (S->second.getEnd() < cutOffPoint) {
+        viewSecondsTotal += S->second.getConnTime();
+        sessions.erase(S);
+        if (C != sessionCounts.end()) { sessionCounts.erase(C); }
+        continue;
       }
+      if (C == sessionCounts.end()) { C = sessionCounts.insert(std::make_pair(sessId, sessionCount())).first; }
+      countSession(S->second, C->second, now, tOut, tIn);
+      sessionRechecks.insert(std::make_pair(C->second.recheck, sessId));
     }
-    Util::RelAccX *strmStats = streamsAccessor();
+    changedSessions.clear();
+    servSeconds += viewerConnTime;
+    rollupTotals(now);
+    Util::RelAccX *strmStats = Controller::streamsAccessor();
     if (!strmStats || !strmStats->isReady()) { strmStats = 0; }
     uint64_t strmPos = 0;
     if (strmStats) {
@@ -541,10 +785,13 @@ size_t Controller::runStats() {
           uint8_t oldState = it.second.status;
           if (newState != oldState) {
             it.second.status = newState;
+            std::string strm = it.first;
             if (newState == STRMSTAT_READY) {
-              streamStarted(it.first);
+              queueStatEvent([strm]() { Controller::streamStarted(strm); });
             } else {
-              if (oldState == STRMSTAT_READY) { streamStopped(it.first); }
+              if (oldState == STRMSTAT_READY) {
+                queueStatEvent([strm]() { Controller::streamStopped(strm); });
+              }
             }
           }
           // No active sessions? Mark it as inactive for cleanup.
@@ -567,16 +814,18 @@ size_t Controller::runStats() {
           strmStats->setString("tags", tags, strmPos);
           ++strmPos;
         }
-        // If stats haven't changed, don't callStreams
-        if (oldStreamStats.count(it.first)) {
-          streamTotals & O = oldStreamStats[it.first];
-          if (O.status == it.second.status && O.currViews == it.second.currViews && O.currIns == it.second.currIns &&
-              O.currOuts == it.second.currOuts) {
-            continue;
-          }
+        // If stats haven't changed since the previous snapshot, don't callStreams
+        streamTotalsMap::const_iterator O = prev->streams->find(it.first);
+        if (O != prev->streams->end() ? (O->second->status == it.second.status && O->second->currViews == it.second.currViews &&
+                                          O->second->currIns == it.second.currIns && O->second->currOuts == it.second.currOuts)
+                                      : (!it.second.status && !it.second.currViews && !it.second.currIns && !it.second.currOuts)) {
+          continue;
         }
         // Otherwise, do callStreams
-        callStreams(it.first, it.second.status, it.second.currViews, it.second.currIns, it.second.currOuts, tags);
+        std::string strm = it.first;
+        uint8_t status = it.second.status;
+        uint64_t views = it.second.currViews, ins = it.second.currIns, outs = it.second.currOuts;
+        queueStatEvent([=]() { Controller::callStreams(strm, status, views, ins, outs, tags); });
       }
     }
     if (tagQueue.size()) {
@@ -603,23 +852,70 @@ size_t Controller::runStats() {
     while (inactiveStreams.size()) {
       const std::string & streamName = *inactiveStreams.begin();
       const streamTotals & stats = streamStats.at(streamName);
-      if (Triggers::shouldTrigger("STREAM_END", streamName)) {
-        std::stringstream payload;
-        payload << streamName + "\n"
-                << stats.downBytes << "\n"
-                << stats.upBytes << "\n"
-                << stats.viewers << "\n"
-                << stats.inputs << "\n"
-                << stats.outputs << "\n"
-                << stats.viewSeconds;
-        Triggers::doTrigger("STREAM_END", payload.str(), streamName);
-      }
+      // The trigger configuration is only safe to read from the main thread, so check it there
+      std::stringstream payload;
+      payload << streamName + "\n"
+              << stats.downBytes << "\n"
+              << stats.upBytes << "\n"
+              << stats.viewers << "\n"
+              << stats.inputs << "\n"
+              << stats.outputs << "\n"
+              << stats.viewSeconds;
+      std::string strm = streamName, pl = payload.str();
+      queueStatEvent([strm, pl]() {
+        if (Triggers::shouldTrigger("STREAM_END", strm)) { Triggers::doTrigger("STREAM_END", pl, strm); }
+      });
       streamStats.erase(streamName);
       inactiveStreams.erase(inactiveStreams.begin());
       shiftWrites = true;
     }
+
+    std::shared_ptr<statsSnapshot> snap(new statsSnapshot());
+    snap->upBytes = servUpBytes;
+    snap->downBytes = servDownBytes;
+    snap->upOtherBytes = servUpOtherBytes;
+    snap->downOtherBytes = servDownOtherBytes;
+    snap->inputs = servInputs;
+    snap->outputs = servOutputs;
+    snap->viewers = servViewers;
+    snap->unspecified = servUnspecified;
+    snap->viewSeconds = servSeconds + viewSecondsTotal;
+    snap->packSent = servPackSent;
+    snap->packLoss = servPackLoss;
+    snap->packRetrans = servPackRetrans;
+    snap->cachedSessions = sessions.size();
+    snap->streams = snapshotStreams(prev->streams);
+    std::atomic_store(&statsSnap, std::shared_ptr<const statsSnapshot>(snap));
+  }
+  while (disconnectedSessions.size()) {
+    cleanupSession(*disconnectedSessions.begin());
+    disconnectedSessions.erase(disconnectedSessions.begin());
+  }
+}
+
+/// Body of the statistics thread: aggregates statistics roughly once per second.
+void Controller::statsLoop() {
+  while (statsThreadActive) {
+    uint64_t start = Util::bootMS();
+    aggregateStats();
+    while (statsThreadActive && Util::bootMS() < start + 1000) { Util::sleep(50); }
+  }
+}
+
+/// Runs the work queued by the statistics thread that must happen on the main thread.
+size_t Controller::runStats() {
+  std::deque<std::function<void()> > events;
+  {
+    std::lock_guard<std::mutex> guard(statEventMutex);
+    events.swap(statEvents);
+  }
+  if (!events.size()) { return 250; }
+  std::lock_guard<std::mutex> guard(Controller::configMutex);
+  while (events.size()) {
+    events.front()();
+    events.pop_front();
   }
-  return 1000;
+  return 250;
 }
 
 /// Gets a complete list of all streams currently in active state, with optional stream matching
@@ -680,7 +976,7 @@ void Controller::statSession::update(uint64_t index, Comms::Sessions &statComm){
     }
   }
 
-  uint64_t prevNow = curData.log.size() ? curData.log.rbegin()->first : 0;
+  uint64_t prevNow = curData.getEnd();
   // only parse last received data, if newer
   if (prevNow > statComm.getNow(index)){return;};
   long long prevDown = getDown();
@@ -711,7 +1007,7 @@ void Controller::statSession::update(uint64_t index, Comms::Sessions &statComm){
   uint64_t currPktRetrans = getPktRetransmit();
   if (currUp - prevUp < 0 || currDown - prevDown < 0){
     INFO_MSG("Negative data usage! %lldu/%lldd (u%lld->%lld) in %s over %s, #%" PRIu64, currUp - prevUp,
-             currDown - prevDown, prevUp, currUp, streamName.c_str(), curData.log.rbegin()->second.connectors.c_str(), index);
+             currDown - prevDown, prevUp, currUp, streamName.c_str(), curData.getLast().connectors.c_str(), index);
   }else{
     if (!noBWCount){
       size_t bwMatchOffset = 0;
@@ -781,7 +1077,49 @@ Controller::sessType Controller::statSession::getSessType(){
   return sessionType;
 }
 
+/// Writes an access log entry for a session that ended to the configured access log.
+/// Reads Controller::accesslog, so must only be called while holding configMutex.
+static void writeAccessLog(const std::string &sessId, const std::string &streamName, const std::string &connector,
+                           const std::string &host, uint64_t duration, uint64_t up, uint64_t down, const std::string &tags){
+  if (!Controller::accesslog.size()){return;}
+  if (Controller::accesslog == "LOG"){
+    std::stringstream accessStr;
+    accessStr << "Session <" << sessId << "> " << streamName << " (" << connector
+              << ") from " << host << " ended after " << duration << "s, avg "
+              << up / duration / 1024 << "KB/s up " << down / duration / 1024 << "KB/s down.";
+    if (tags.size()){accessStr << " Tags: " << tags;}
+    LOG_MSG("ACCS", "%s", accessStr.str().c_str());
+    return;
+  }
+  static std::ofstream accLogFile;
+  static std::string accLogFileName;
+  if (accLogFileName != Controller::accesslog || !accLogFile.good()){
+    accLogFile.close();
+    accLogFile.open(Controller::accesslog.c_str(), std::ios_base::app);
+    if (!accLogFile.good()){
+      FAIL_MSG("Could not open access log file '%s': %s", Controller::accesslog.c_str(), strerror(errno));
+    }else{
+      accLogFileName = Controller::accesslog;
+    }
+  }
+  if (accLogFile.good()){
+    time_t rawtime;
+    struct tm *timeinfo;
+    struct tm tmptime;
+    char buffer[100];
+    time(&rawtime);
+    timeinfo = localtime_r(&rawtime, &tmptime);
+    strftime(buffer, 100, "%F %H:%M:%S", timeinfo);
+    accLogFile << buffer << ", " << sessId << ", " << streamName << ", "
+               << connector << ", " << host << ", " << duration << ", "
+               << up / duration / 1024 << ", " << down / duration / 1024 << ", ";
+    if (tags.size()){accLogFile << tags;}
+    accLogFile << std::endl;
+  }
+}
+
 /// Ends the currently active session by inserting a null datapoint one second after the last datapoint
+/// The access log entries are written from the main thread, as they depend on the configuration.
 void Controller::statSession::finish(){
   if (!getFirstActive()){return;}
   uint64_t duration = getEnd() - getFirstActive();
@@ -792,50 +1130,15 @@ void Controller::statSession::finish(){
       tagStream << "[" << *it << "]";
     }
   }
-  const std::string& streamName = getStreamName();
-  const std::string& curConnector = getConnectors();
-  const std::string& host = getStrHost();
-  Controller::logAccess(sessId, streamName, curConnector, host, duration, getUp(),
-                        getDown(), tagStream.str());
-  if (Controller::accesslog.size()){
-    if (Controller::accesslog == "LOG"){
-      std::stringstream accessStr;
-      accessStr << "Session <" << sessId << "> " << streamName << " (" << curConnector
-                << ") from " << host << " ended after " << duration << "s, avg "
-                << getUp() / duration / 1024 << "KB/s up " << getDown() / duration / 1024 << "KB/s down.";
-      if (tags.size()){accessStr << " Tags: " << tagStream.str();}
-      LOG_MSG("ACCS", "%s", accessStr.str().c_str());
-    }else{
-      static std::ofstream accLogFile;
-      static std::string accLogFileName;
-      if (accLogFileName != Controller::accesslog || !accLogFile.good()){
-        accLogFile.close();
-        accLogFile.open(Controller::accesslog.c_str(), std::ios_base::app);
-        if (!accLogFile.good()){
-          FAIL_MSG("Could not open access log file '%s': %s", Controller::accesslog.c_str(), strerror(errno));
-        }else{
-          accLogFileName = Controller::accesslog;
-        }
-      }
-      if (accLogFile.good()){
-        time_t rawtime;
-        struct tm *timeinfo;
-        struct tm tmptime;
-        char buffer[100];
-        time(&rawtime);
-        timeinfo = localtime_r(&rawtime, &tmptime);
-        strftime(buffer, 100, "%F %H:%M:%S", timeinfo);
-        accLogFile << buffer << ", " << sessId << ", " << streamName << ", "
-                   << curConnector << ", " << host << ", " << duration << ", "
-                   << getUp() / duration / 1024 << ", " << getDown() / duration / 1024 << ", ";
-        if (tags.size()){accLogFile << tagStream.str();}
-        accLogFile << std::endl;
-      }
-    }
-  }
+  std::string sessIdCopy = sessId, tagStr = tagStream.str();
+  std::string streamName = getStreamName(), curConnector = getConnectors(), host = getStrHost();
+  uint64_t up = getUp(), down = getDown();
+  queueStatEvent([=](){
+    Controller::logAccess(sessIdCopy, streamName, curConnector, host, duration, up, down, tagStr);
+    writeAccessLog(sessIdCopy, streamName, curConnector, host, duration, up, down, tagStr);
+  });
   tags.clear();
-  // Insert null datapoint
-  curData.log[curData.log.rbegin()->first + 1] = emptyLogEntry;
+  curData.finish();
 }
 
 /// Constructs an empty session
@@ -847,14 +1150,12 @@ Controller::statSession::statSession(){
 
 /// Returns the first measured timestamp in this session.
 uint64_t Controller::statSession::getStart(){
-  if (!curData.log.size()){return 0;}
-  return curData.log.begin()->first;
+  return curData.getStart();
 }
 
 /// Returns the last measured timestamp in this session.
 uint64_t Controller::statSession::getEnd(){
-  if (!curData.log.size()){return 0;}
-  return curData.log.rbegin()->first;
+  return curData.getEnd();
 }
 
 /// Returns true if there is data for this session at timestamp t.
@@ -868,10 +1169,7 @@ const std::string& Controller::statSession::getSessId(){
 }
 
 uint64_t Controller::statSession::getFirstActive(){
-  if (curData.log.size()){
-    return curData.log.rbegin()->second.firstActive;
-  }
-  return 0;
+  return curData.getLast().firstActive;
 }
 
 const std::string& Controller::statSession::getStreamName(uint64_t t){
@@ -882,10 +1180,7 @@ const std::string& Controller::statSession::getStreamName(uint64_t t){
 }
 
 const std::string& Controller::statSession::getStreamName(){
-  if (curData.log.size()){
-    return curData.log.rbegin()->second.streamName;
-  }
-  return emptyLogEntry.streamName;
+  return curData.getLast().streamName;
 }
 
 std::string Controller::statSession::getStrHost(uint64_t t){
@@ -908,10 +1203,7 @@ const std::string& Controller::statSession::getHost(uint64_t t){
 }
 
 const std::string& Controller::statSession::getHost(){
-  if (curData.log.size()){
-    return curData.log.rbegin()->second.host;
-  }
-  return emptyLogEntry.host;
+  return curData.getLast().host;
 }
 
 const std::string& Controller::statSession::getConnectors(uint64_t t){
@@ -922,10 +1214,7 @@ const std::string& Controller::statSession::getConnectors(uint64_t t){
 }
 
 const std::string& Controller::statSession::getConnectors(){
-  if (curData.log.size()){
-    return curData.log.rbegin()->second.connectors;
-  }
-  return emptyLogEntry.connectors;
+  return curData.getLast().connectors;
 }
 
 /// Returns the cumulative connected time for this session at timestamp t.
@@ -938,10 +1227,7 @@ uint64_t Controller::statSession::getConnTime(uint64_t t){
 
 /// Returns the cumulative connected time for this session.
 uint64_t Controller::statSession::getConnTime(){
-  if (curData.log.size()){
-    return curData.log.rbegin()->second.time;
-  }
-  return 0;
+  return curData.getLast().time;
 }
 
 /// Returns the last requested media timestamp for this session at timestamp t.
@@ -970,18 +1256,12 @@ uint64_t Controller::statSession::getUp(uint64_t t){
 
 /// Returns the cumulative downloaded bytes for this session at timestamp t.
 uint64_t Controller::statSession::getDown(){
-  if (curData.log.size()){
-    return curData.log.rbegin()->second.down;
-  }
-  return 0;
+  return curData.getLast().down;
 }
 
 /// Returns the cumulative uploaded bytes for this session at timestamp t.
 uint64_t Controller::statSession::getUp(){
-  if (curData.log.size()){
-    return curData.log.rbegin()->second.up;
-  }
-  return 0;
+  return curData.getLast().up;
 }
 
 uint64_t Controller::statSession::getPktCount(uint64_t t){
@@ -993,10 +1273,7 @@ uint64_t Controller::statSession::getPktCount(uint64_t t){
 
 /// Returns the cumulative uploaded bytes for this session at timestamp t.
 uint64_t Controller::statSession::getPktCount(){
-  if (curData.log.size()){
-    return curData.log.rbegin()->second.pktCount;
-  }
-  return 0;
+  return curData.getLast().pktCount;
 }
 
 uint64_t Controller::statSession::getPktLost(uint64_t t){
@@ -1008,10 +1285,7 @@ uint64_t Controller::statSession::getPktLost(uint64_t t){
 
 /// Returns the cumulative uploaded bytes for this session at timestamp t.
 uint64_t Controller::statSession::getPktLost(){
-  if (curData.log.size()){
-    return curData.log.rbegin()->second.pktLost;
-  }
-  return 0;
+  return curData.getLast().pktLost;
 }
 
 uint64_t Controller::statSession::getPktRetransmit(uint64_t t){
@@ -1023,16 +1297,13 @@ uint64_t Controller::statSession::getPktRetransmit(uint64_t t){
 
 /// Returns the cumulative uploaded bytes for this session at timestamp t.
 uint64_t Controller::statSession::getPktRetransmit(){
-  if (curData.log.size()){
-    return curData.log.rbegin()->second.pktRetransmit;
-  }
-  return 0;
+  return curData.getLast().pktRetransmit;
 }
 
 /// Returns the cumulative downloaded bytes per second for this session at timestamp t.
 uint64_t Controller::statSession::getBpsDown(uint64_t t){
   uint64_t aTime = t - 5;
-  if (aTime < curData.log.begin()->first){aTime = curData.log.begin()->first;}
+  if (aTime < curData.getStart()){aTime = curData.getStart();}
   if (t <= aTime){return 0;}
   uint64_t valA = getDown(aTime);
   uint64_t valB = getDown(t);
@@ -1042,39 +1313,110 @@ uint64_t Controller::statSession::getBpsDown(uint64_t t){
 /// Returns the cumulative uploaded bytes per second for this session at timestamp t.
 uint64_t Controller::statSession::getBpsUp(uint64_t t){
   uint64_t aTime = t - 5;
-  if (aTime < curData.log.begin()->first){aTime = curData.log.begin()->first;}
+  if (aTime < curData.getStart()){aTime = curData.getStart();}
   if (t <= aTime){return 0;}
   uint64_t valA = getUp(aTime);
   uint64_t valB = getUp(t);
   return (valB - valA) / (t - aTime);
 }
 
+/// Columns of the counters in statStorage::log, in the order they are stored in.
+enum statColumn{
+  STAT_COL_TIME,
+  STAT_COL_FIRSTACTIVE,
+  STAT_COL_LASTSECOND,
+  STAT_COL_DOWN,
+  STAT_COL_UP,
+  STAT_COL_PKTCOUNT,
+  STAT_COL_PKTLOST,
+  STAT_COL_PKTRETRANSMIT,
+  STAT_COL_COUNT
+};
+
+Controller::statStorage::statStorage() : log(STAT_COL_COUNT){
+  last = emptyLogEntry;
+  lookupTime = 0;
+}
+
+/// Returns the first timestamp there is data for, or zero if there is none.
+uint64_t Controller::statStorage::getStart(){
+  return log.firstTime();
+}
+
+/// Returns the most recent timestamp there is data for, or zero if there is none.
+uint64_t Controller::statStorage::getEnd(){
+  return log.lastTime();
+}
+
 /// Returns true if there is data available for timestamp t.
-bool Controller::statStorage::hasDataFor(unsigned long long t){
-  if (!log.size()){return false;}
-  return (t >= log.begin()->first);
+bool Controller::statStorage::hasDataFor(uint64_t t){
+  if (log.empty()){return false;}
+  return (t >= log.firstTime());
+}
+
+/// Returns the most recent datapoint.
+const Controller::statLog &Controller::statStorage::getLast(){
+  return last;
 }
 
 /// Returns a reference to the most current data available at timestamp t.
-Controller::statLog &Controller::statStorage::getDataFor(unsigned long long t){
-  if (!log.size()){
-    return emptyLogEntry;
+/// The reference is valid until the next call to getDataFor or update.
+const Controller::statLog &Controller::statStorage::getDataFor(uint64_t t){
+  if (log.empty()){return emptyLogEntry;}
+  if (t >= log.lastTime()){return last;}
+  if (lookupTime && lookupTime == t){return lookup;}
+  uint64_t vals[STAT_COL_COUNT];
+  if (!log.get(t, vals)){return emptyLogEntry;}
+  lookup.time = vals[STAT_COL_TIME];
+  lookup.firstActive = vals[STAT_COL_FIRSTACTIVE];
+  lookup.lastSecond = vals[STAT_COL_LASTSECOND];
+  lookup.down = vals[STAT_COL_DOWN];
+  lookup.up = vals[STAT_COL_UP];
+  lookup.pktCount = vals[STAT_COL_PKTCOUNT];
+  lookup.pktLost = vals[STAT_COL_PKTLOST];
+  lookup.pktRetransmit = vals[STAT_COL_PKTRETRANSMIT];
+  std::deque<statText>::reverse_iterator txt = texts.rbegin();
+  while (txt != texts.rend() && txt->time > t){++txt;}
+  if (txt == texts.rend()){
+    lookup.streamName.clear();
+    lookup.host = emptyLogEntry.host;
+    lookup.connectors.clear();
+  }else{
+    lookup.streamName = txt->streamName;
+    lookup.host = txt->host;
+    lookup.connectors = txt->connectors;
+  }
+  lookupTime = t;
+  return lookup;
+}
+
+/// Stores the text fields as of timestamp t, if they differ from the current ones.
+void Controller::statStorage::setText(uint64_t t, const std::string &streamName, const std::string &host, const std::string &connectors){
+  if (texts.size()){
+    statText &prev = texts.back();
+    if (prev.streamName == streamName && prev.host == host && prev.connectors == connectors){return;}
+    if (prev.time == t){
+      prev.streamName = streamName;
+      prev.host = host;
+      prev.connectors = connectors;
+      return;
+    }
   }
-  std::map<unsigned long long, statLog>::iterator it = log.upper_bound(t);
-  if (it != log.begin()){it--;}
-  return it->second;
+  texts.push_back(statText());
+  statText &txt = texts.back();
+  txt.time = t;
+  txt.streamName = streamName;
+  txt.host = host;
+  txt.connectors = connectors;
 }
 
 /// This function is called by parseStatistics.
 /// It updates the internally saved statistics data.
 void Controller::statStorage::update(Comms::Sessions &statComm, size_t index){
-  statLog tmp;
+  uint64_t now = statComm.getNow(index);
+  statLog &tmp = last;
   tmp.time = statComm.getTime(index);
-  if (!log.size() || !log.rbegin()->second.firstActive){
-    tmp.firstActive = statComm.getNow(index);
-  } else{
-    tmp.firstActive = log.rbegin()->second.firstActive;
-  }
+  if (log.empty() || !tmp.firstActive){tmp.firstActive = now;}
   tmp.lastSecond = statComm.getLastSecond(index);
   tmp.down = statComm.getDown(index);
   tmp.up = statComm.getUp(index);
@@ -1084,7 +1426,11 @@ void Controller::statStorage::update(Comms::Sessions &statComm, size_t index){
   tmp.connectors = statComm.getConnector(index);
   tmp.streamName = statComm.getStream(index);
   tmp.host = statComm.getHost(index);
-  log[statComm.getNow(index)] = tmp;
+  uint64_t vals[STAT_COL_COUNT] = {tmp.time, tmp.firstActive, tmp.lastSecond, tmp.down,
+                                   tmp.up, tmp.pktCount, tmp.pktLost, tmp.pktRetransmit};
+  log.append(now, vals);
+  setText(now, tmp.streamName, tmp.host, tmp.connectors);
+  lookupTime = 0;
   // wipe data older than STAT_CUTOFF seconds
   // Ensure cutOffPoint is either time of boot or 10 minutes ago, whichever is closer.
   // Prevents wrapping around to high values close to system boot time.
@@ -1094,7 +1440,19 @@ void Controller::statStorage::update(Comms::Sessions &statComm, size_t index){
   }else{
     cutOffPoint = 0;
   }
-  while (log.size() && log.begin()->first < cutOffPoint){log.erase(log.begin());}
+  log.trim(cutOffPoint);
+  while (texts.size() > 1 && texts[1].time <= log.firstTime()){texts.pop_front();}
+}
+
+/// Inserts a null datapoint one second after the last datapoint.
+void Controller::statStorage::finish(){
+  if (log.empty()){return;}
+  uint64_t t = log.lastTime() + 1;
+  uint64_t vals[STAT_COL_COUNT] = {0, 0, 0, 0, 0, 0, 0, 0};
+  log.append(t, vals);
+  setText(t, emptyLogEntry.streamName, emptyLogEntry.host, emptyLogEntry.connectors);
+  last = emptyLogEntry;
+  lookupTime = 0;
 }
 
 void Controller::statLeadIn(){
@@ -1102,16 +1460,36 @@ void Controller::statLeadIn(){
 }
 
 void Controller::statOnActive(size_t id){
-  if (statComm.getNow(id) >= statDropoff){
-    // update the session with the latest data
-    sessions[statComm.getSessId(id)].update(id, statComm);
+  uint64_t now = statComm.getNow(id);
+  if (now < statDropoff){return;}
+  if (recordSeen.size() <= id){recordSeen.resize(id + 1, recordState{0, 0, 0});}
+  recordState &seen = recordSeen[id];
+  uint64_t down = statComm.getDown(id), up = statComm.getUp(id);
+  // Records that did not change since the previous pass have nothing new to parse
+  if (seen.now == now && seen.down == down && seen.up == up && !(statComm.getStatus(id) & COMM_STATUS_DISCONNECT)){
+    return;
   }
+  seen.now = now;
+  seen.down = down;
+  seen.up = up;
+  // update the session with the latest data
+  const std::string thisSessionId = statComm.getSessId(id);
+  sessions[thisSessionId].update(id, statComm);
+  changedSessions.insert(thisSessionId);
 }
 
 void Controller::statOnDisconnect(size_t id){
-  // Check to see if cleanup is required (when a Session binary fails)
   const std::string thisSessionId = statComm.getSessId(id);
   sessions[thisSessionId].finish();
+  disconnectedSessions.insert(thisSessionId);
+  changedSessions.insert(thisSessionId);
+  // The record is free for reuse by a new session
+  if (id < recordSeen.size()){recordSeen[id] = recordState{0, 0, 0};}
+}
+
+/// Checks to see if cleanup is required after the given session disconnected (when a Session binary fails).
+/// May block for up to a second, so must not be called while holding statsMutex.
+static void cleanupSession(const std::string &thisSessionId){
   // Try to lock to see if the session crashed during boot
   IPC::semaphore sessionLock;
   char semName[NAME_BUFFER_SIZE];
@@ -1138,6 +1516,12 @@ void Controller::statOnDisconnect(size_t id){
 
 void Controller::statLeadOut(){}
 
+/// Starts the statistics thread.
+void Controller::startStats(){
+  statsThreadActive = true;
+  statsThread = std::thread(statsLoop);
+}
+
 /// Returns true if this stream has at least one connected client.
 bool Controller::hasViewers(std::string streamName){
   if (sessions.size()){
@@ -1443,8 +1827,8 @@ void Controller::fillActive(JSON::Value &req, JSON::Value &rep){
   }
   DTSC::Meta M;
   {
-    std::lock_guard<std::recursive_mutex> guard(statsMutex);
-    for (std::map<std::string, struct streamTotals>::iterator it = streamStats.begin(); it != streamStats.end(); ++it){
+    std::shared_ptr<const statsSnapshot> snap = getStatsSnapshot();
+    for (streamTotalsMap::const_iterator it = snap->streams->begin(); it != snap->streams->end(); ++it){
       //If specific streams were requested, match and skip non-matching
       if (streams.size()){
         bool match = false;
@@ -1466,31 +1850,31 @@ void Controller::fillActive(JSON::Value &req, JSON::Value &rep){
       jsonForEachConst(fields, j){
         JSON::Value & F = longForm ? (S[j->asStringRef()]) : (S.append());
         if (j->asStringRef() == "clients"){
-          F = it->second.currViews+it->second.currIns+it->second.currOuts;
+          F = it->second->currViews+it->second->currIns+it->second->currOuts;
         }else if (j->asStringRef() == "viewers"){
-          F = it->second.currViews;
+          F = it->second->currViews;
         }else if (j->asStringRef() == "inputs"){
-          F = it->second.currIns;
+          F = it->second->currIns;
         }else if (j->asStringRef() == "outputs"){
-          F = it->second.currOuts;
+          F = it->second->currOuts;
         } else if (j->asStringRef() == "tags") {
-          for (const std::string & t : it->second.tags) { F.append(t); }
+          for (const std::string & t : it->second->tags) { F.append(t); }
         } else if (j->asStringRef() == "unspecified") {
-          F = it->second.currUnspecified;
+          F = it->second->currUnspecified;
         } else if (j->asStringRef() == "views") {
-          F = it->second.viewers;
+          F = it->second->viewers;
         } else if (j->asStringRef() == "viewseconds") {
-          F = it->second.viewSeconds;
+          F = it->second->viewSeconds;
         } else if (j->asStringRef() == "upbytes") {
-          F = it->second.upBytes;
+          F = it->second->upBytes;
         } else if (j->asStringRef() == "downbytes") {
-          F = it->second.downBytes;
+          F = it->second->downBytes;
         } else if (j->asStringRef() == "packsent") {
-          F = it->second.packSent;
+          F = it->second->packSent;
         } else if (j->asStringRef() == "packloss") {
-          F = it->second.packLoss;
+          F = it->second->packLoss;
         } else if (j->asStringRef() == "packretrans") {
-          F = it->second.packRetrans;
+          F = it->second->packRetrans;
         } else if (j->asStringRef() == "firstms") {
           if (!M || M.getStreamName() != it->first){M.reInit(it->first, false, false);}
           if (M){
@@ -1583,19 +1967,17 @@ public:
     pktLost = 0;
     pktRetransmit = 0;
   }
-  void add(uint64_t down, uint64_t up, Controller::sessType sT, uint64_t pCount, uint64_t pLost, uint64_t pRetransmit){
-    switch (sT){
-    case Controller::SESS_VIEWER: clients++; break;
-    case Controller::SESS_INPUT: inputs++; break;
-    case Controller::SESS_OUTPUT: outputs++; break;
-    case Controller::SESS_UNSPECIFIED: unspecified++; break;
-    default: break;
-    }
-    downbps += down;
-    upbps += up;
-    pktCount += pCount;
-    pktLost += pLost;
-    pktRetransmit += pRetransmit;
+  /// Adds a datapoint of a totals rollup, with TOT_COL_COUNT values in totalsColumn order.
+  void add(const uint64_t *v){
+    clients += v[TOT_COL_CLIENTS];
+    inputs += v[TOT_COL_INPUTS];
+    outputs += v[TOT_COL_OUTPUTS];
+    unspecified += v[TOT_COL_UNSPECIFIED];
+    downbps += v[TOT_COL_BPS_DOWN];
+    upbps += v[TOT_COL_BPS_UP];
+    pktCount += v[TOT_COL_PKTCOUNT];
+    pktLost += v[TOT_COL_PKTLOST];
+    pktRetransmit += v[TOT_COL_PKTRETRANSMIT];
   }
   uint64_t clients;
   uint64_t inputs;
@@ -1675,22 +2057,14 @@ void Controller::fillTotals(JSON::Value &req, JSON::Value &rep){
   if (fields & STAT_TOT_PERCRETRANS){rep["fields"].append("perc_retrans");}
   // start data collection
   std::map<uint64_t, totalsData> totalsCount;
-  // loop over all sessions
+  // loop over all rollups of wanted streams and protocols
   /// \todo Make the interval configurable instead of 1 second
-  if (sessions.size()){
-    for (std::map<std::string, statSession>::iterator it = sessions.begin(); it != sessions.end(); it++){
-      // data present and wanted? insert it!
-      if ((it->second.getEnd() >= (unsigned long long)reqStart ||
-           it->second.getStart() <= (unsigned long long)reqEnd) &&
-           hasEntry(streams, it->second.getStreamName(), '+') &&
-           hasEntry(protos, it->second.getConnectors(), ':')){
-        for (unsigned long long i = reqStart; i <= reqEnd; ++i){
-          if (it->second.hasDataFor(i)){
-            totalsCount[i].add(it->second.getBpsDown(i), it->second.getBpsUp(i), it->second.getSessType(), it->second.getPktCount(), it->second.getPktLost(), it->second.getPktRetransmit());
-          }
-        }
-      }
+  for (std::map<std::string, TimeSeries::Series>::iterator it = totalsRollups.begin(); it != totalsRollups.end(); ++it){
+    size_t split = it->first.find('\n');
+    if (!hasEntry(streams, it->first.substr(0, split), '+') || !hasEntry(protos, it->first.substr(split + 1), ':')){
+      continue;
     }
+    for (TimeSeries::Cursor C(it->second, reqStart, reqEnd); C; C.next()){totalsCount[C.time()].add(C.values());}
   }
   // output the data itself
   if (!totalsCount.size()){
@@ -1753,6 +2127,212 @@ void Controller::fillTotals(JSON::Value &req, JSON::Value &rep){
   // all done! return is by reference, so no need to return anything here.
 }
 
+/// Fills the given JSON object with the public URL of every online connector that has a listening port.
+/// Assumes the configMutex is held by the caller.
+static void fillOutputUrls(JSON::Value &outputs){
+  const JSON::Value &caps = Controller::capabilities["connectors"];
+  jsonForEachConst(Controller::Storage["config"]["protocols"], prtcl){
+    if (!(*prtcl).isMember("connector")){continue;}
+    const std::string &cName = (*prtcl)["connector"].asStringRef();
+    if (!(*prtcl).isMember("online") || (*prtcl)["online"].asInt() != 1){continue;}
+    if (!caps.isMember(cName)){continue;}
+    const JSON::Value &capa = caps[cName];
+    if (!capa.isMember("optional") || !capa["optional"].isMember("port")){continue;}
+    // We now know it's configured, online and has a listening port
+    HTTP::URL outURL("HOST");
+    // get the default port if none is set
+    if (prtcl->isMember("port")){outURL.port = (*prtcl)["port"].asString();}
+    if (!outURL.port.size()){outURL.port = capa["optional"]["port"]["default"].asString();}
+    // set the protocol
+    if (capa.isMember("protocol")){
+      outURL.protocol = capa["protocol"].asString();
+    }else{
+      if (capa.isMember("methods") && capa["methods"][0u].isMember("handler")){
+        outURL.protocol = capa["methods"][0u]["handler"].asStringRef();
+      }
+    }
+    if (outURL.protocol.find(':') != std::string::npos){
+      outURL.protocol.erase(outURL.protocol.find(':'));
+    }
+    // set the public access, if needed
+    if (prtcl->isMember("pubaddr") && (*prtcl)["pubaddr"].asString().size()){
+      HTTP::URL altURL((*prtcl)["pubaddr"].asString());
+      outURL.protocol = altURL.protocol;
+      if (altURL.host.size()){outURL.host = altURL.host;}
+      outURL.port = altURL.port;
+      outURL.path = altURL.path;
+    }
+    // Add the URL, if present
+    if (capa.isMember("url_rel")){
+      outputs[cName] = outURL.link("./" + capa["url_rel"].asStringRef()).getUrl();
+    }
+
+    // if this connector can be depended upon by other connectors, loop over the rest
+    if (capa.isMember("provides")){
+      const std::string &cProv = capa["provides"].asStringRef();
+      jsonForEachConst(Controller::Storage["config"]["protocols"], chld){
+        const std::string &child = (*chld)["connector"].asStringRef();
+        if (!caps.isMember(child) || !caps[child].isMember("deps")){continue;}
+        if (caps[child].isMember("deps") && caps[child]["deps"].asStringRef() == cProv &&
+            caps[child].isMember("url_rel")){
+          outputs[child] = outURL.link("./" + caps[child]["url_rel"].asStringRef()).getUrl();
+        }
+      }
+    }
+  }
+}
+
+/// Fills the given state with the current server load, for pushing to load balancers.
+/// Per-stream values are only included for streams that currently have any sessions.
+void Controller::fillLoadState(LoadPush::State &S){
+  S.clear();
+  S.counters["cpu"] = getCpuUse();
+  S.counters["mem_total"] = getMemTotal() * 1024;
+  S.counters["mem_used"] = getMemUsed() * 1024;
+#if !defined(__CYGWIN__) && !defined(_WIN32) && !defined(__APPLE__)
+  S.counters["shm_total"] = getShmTotal() * 1024;
+  S.counters["shm_used"] = getShmUsed() * 1024;
+#endif
+  std::shared_ptr<const statsSnapshot> snap = getStatsSnapshot();
+  S.counters["up"] = snap->upBytes;
+  S.counters["down"] = snap->downBytes;
+  S.counters["bwlimit"] = bwLimit;
+  {
+    uint64_t totViewers = 0;
+    for (streamTotalsMap::const_iterator it = snap->streams->begin(); it != snap->streams->end(); ++it){
+      const streamTotals &sT = *it->second;
+      if (!sT.currViews && !sT.currIns && !sT.currOuts){continue;}
+      totViewers += sT.currViews;
+      S.counters["viewers:" + it->first] = sT.currViews;
+      S.counters["inputs:" + it->first] = sT.currIns;
+      S.counters["outputs:" + it->first] = sT.currOuts;
+      S.counters["up:" + it->first] = sT.upBytes;
+      S.counters["down:" + it->first] = sT.downBytes;
+      if (sT.tags.count("replicated")){S.counters["rep:" + it->first] = 1;}
+    }
+    S.counters["viewers"] = totViewers;
+  }
+  std::lock_guard<std::mutex> guard(Controller::configMutex);
+  if (Storage["config"].isMember("location") && Storage["config"]["location"].isMember("lat") &&
+      Storage["config"]["location"].isMember("lon")){
+    const JSON::Value &loc = Storage["config"]["location"];
+    S.texts["lat"] = JSON::Value(loc["lat"].asDouble()).asString();
+    S.texts["lon"] = JSON::Value(loc["lon"].asDouble()).asString();
+    if (loc.isMember("name")){S.texts["loc"] = loc["name"].asStringRef();}
+  }
+  if (Storage.isMember("tags") && Storage["tags"].isArray() && Storage["tags"].size()){
+    std::string &tags = S.texts["tags"];
+    jsonForEachConst(Storage["tags"], it){
+      if (tags.size()){tags += '\n';}
+      tags += it->asString();
+    }
+  }
+  std::string &confStreams = S.texts["conf_streams"];
+  jsonForEachConst(Storage["streams"], it){
+    if (confStreams.size()){confStreams += '\n';}
+    confStreams += it.key();
+  }
+  JSON::Value outputs;
+  fillOutputUrls(outputs);
+  jsonForEachConst(outputs, it){S.texts["out:" + it.key()] = it->asStringRef();}
+}
+
+/// Marks a string for promWriter to write as an escaped label value.
+struct promLabel{
+  explicit promLabel(const std::string &_val) : val(_val){}
+  const std::string &val;
+};
+
+/// Writes Prometheus text exposition output straight to a connection as HTTP chunks.
+/// Output is collected in a fixed buffer that is sent whenever it fills up, so a scrape never
+/// holds more than one buffer worth of output in memory, regardless of the amount of streams.
+class promWriter{
+public:
+  promWriter(HTTP::Parser &_H, Socket::Connection &_conn) : H(_H), conn(_conn){len = 0;}
+  ~promWriter(){flush();}
+  promWriter &operator<<(const char *str){
+    append(str, strlen(str));
+    return *this;
+  }
+  promWriter &operator<<(const std::string &str){
+    append(str.data(), str.size());
+    return *this;
+  }
+  promWriter &operator<<(uint64_t val){
+    char num[24];
+    char *p = num + sizeof(num);
+    do{
+      *(--p) = '0' + (val % 10);
+      val /= 10;
+    }while (val);
+    append(p, num + sizeof(num) - p);
+    return *this;
+  }
+  promWriter &operator<<(uint32_t val){return *this << (uint64_t)val;}
+  promWriter &operator<<(const promLabel &l){
+    label(l.val);
+    return *this;
+  }
+  /// Writes a label value, escaped as the exposition format requires.
+  void label(const std::string &str){
+    for (size_t i = 0; i < str.size(); ++i){
+      if (len + 2 > sizeof(buf)){flush();}
+      switch (str[i]){
+      case '\\': buf[len++] = '\\'; buf[len++] = '\\'; break;
+      case '"': buf[len++] = '\\'; buf[len++] = '"'; break;
+      case '\n': buf[len++] = '\\'; buf[len++] = 'n'; break;
+      default: buf[len++] = str[i];
+      }
+    }
+  }
+  /// Writes a duration in milliseconds as a decimal amount of seconds.
+  void seconds(uint64_t ms){
+    char frac[5] = {'.', (char)('0' + (ms / 100) % 10), (char)('0' + (ms / 10) % 10), (char)('0' + ms % 10), 0};
+    *this << ms / 1000 << frac;
+  }
+  /// Writes all samples of a histogram with a single label, such as stream or trigger name.
+  void histogram(const char *name, const char *labelName, const std::string &labelVal, const Util::LatencyHistogram &hist){
+    static const char *bounds[LATENCY_BUCKETS] = {"0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1", "2.5", "5", "10", "+Inf"};
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i){
+      cumulative += hist.buckets[i];
+      *this << name << "_bucket{" << labelName << "=\"";
+      label(labelVal);
+      *this << "\",le=\"" << bounds[i] << "\"} " << cumulative << "\n";
+    }
+    *this << name << "_sum{" << labelName << "=\"";
+    label(labelVal);
+    *this << "\"} ";
+    seconds(hist.sum);
+    *this << "\n" << name << "_count{" << labelName << "=\"";
+    label(labelVal);
+    *this << "\"} " << hist.count << "\n";
+  }
+  /// Sends everything written so far.
+  void flush(){
+    if (!len){return;}
+    H.Chunkify(buf, len, conn);
+    len = 0;
+  }
+
+private:
+  void append(const char *data, size_t size){
+    if (len + size > sizeof(buf)){
+      flush();
+      if (size > sizeof(buf)){
+        H.Chunkify(data, size, conn);
+        return;
+      }
+    }
+    memcpy(buf + len, data, size);
+    len += size;
+  }
+  HTTP::Parser &H;
+  Socket::Connection &conn;
+  char buf[16384];
+  size_t len;
+};
+
 void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int mode){
   std::string jsonp;
   switch (mode){
@@ -1766,6 +2346,7 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
   }
   H.SetHeader("Server", APPIDENT);
   H.StartResponse("200", "OK", H, conn, true);
+  std::shared_ptr<const statsSnapshot> snap = getStatsSnapshot();
 
   // Counters of current active viewers, inputs and outputs of the Session stats cache
   std::map<std::string, uint32_t> outputs;
@@ -1809,7 +2390,7 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
   }
 
   if (mode == PROMETHEUS_TEXT){
-    std::stringstream response;
+    promWriter response(H, conn);
     response << "# HELP mist_logs Count of log messages since server start.\n";
     response << "# TYPE mist_logs counter\n";
     response << "mist_logs " << Controller::logCounter << "\n\n";
@@ -1834,52 +2415,49 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
 
     response << "# HELP mist_viewseconds_total Number of seconds any media was received by a viewer.\n";
     response << "# TYPE mist_viewseconds_total counter\n";
-    response << "mist_viewseconds_total " << servSeconds + viewSecondsTotal << "\n";
+    response << "mist_viewseconds_total " << snap->viewSeconds << "\n";
 
     response << "\n# HELP mist_sessions_count Counts of unique sessions by type since server "
                 "start.\n";
     response << "# TYPE mist_sessions_count counter\n";
-    response << "mist_sessions_count{sessType=\"viewers\"}" << servViewers << "\n";
-    response << "mist_sessions_count{sessType=\"incoming\"}" << servInputs << "\n";
-    response << "mist_sessions_count{sessType=\"unspecified\"}" << servUnspecified << "\n";
-    response << "mist_sessions_count{sessType=\"outgoing\"}" << servOutputs << "\n\n";
+    response << "mist_sessions_count{sessType=\"viewers\"} " << snap->viewers << "\n";
+    response << "mist_sessions_count{sessType=\"incoming\"} " << snap->inputs << "\n";
+    response << "mist_sessions_count{sessType=\"unspecified\"} " << snap->unspecified << "\n";
+    response << "mist_sessions_count{sessType=\"outgoing\"} " << snap->outputs << "\n\n";
 
     response << "# HELP mist_bw_total Count of bytes handled since server start, by direction.\n";
     response << "# TYPE mist_bw_total counter\n";
-    response << "stat_bw_total{direction=\"up\"}" << bw_up_total << "\n";
-    response << "stat_bw_total{direction=\"down\"}" << bw_down_total << "\n\n";
-    response << "mist_bw_total{direction=\"up\"}" << servUpBytes << "\n";
-    response << "mist_bw_total{direction=\"down\"}" << servDownBytes << "\n\n";
-    response << "mist_bw_other{direction=\"up\"}" << servUpOtherBytes << "\n";
-    response << "mist_bw_other{direction=\"down\"}" << servDownOtherBytes << "\n\n";
+    response << "stat_bw_total{direction=\"up\"} " << bw_up_total << "\n";
+    response << "stat_bw_total{direction=\"down\"} " << bw_down_total << "\n\n";
+    response << "mist_bw_total{direction=\"up\"} " << snap->upBytes << "\n";
+    response << "mist_bw_total{direction=\"down\"} " << snap->downBytes << "\n\n";
+    response << "mist_bw_other{direction=\"up\"} " << snap->upOtherBytes << "\n";
+    response << "mist_bw_other{direction=\"down\"} " << snap->downOtherBytes << "\n\n";
     response << "mist_bw_limit " << bwLimit << "\n\n";
 
     response << "# HELP mist_packets_total Total number of packets sent/received/lost over lossy protocols, server-wide.\n";
     response << "# TYPE mist_packets_total counter\n";
-    response << "mist_packets_total{pkttype=\"sent\"}" << servPackSent << "\n";
-    response << "mist_packets_total{pkttype=\"lost\"}" << servPackLoss << "\n";
-    response << "mist_packets_total{pkttype=\"retrans\"}" << servPackRetrans << "\n";
+    response << "mist_packets_total{pkttype=\"sent\"} " << snap->packSent << "\n";
+    response << "mist_packets_total{pkttype=\"lost\"} " << snap->packLoss << "\n";
+    response << "mist_packets_total{pkttype=\"retrans\"} " << snap->packRetrans << "\n";
 
     if (outputs.size()){
       response << "# HELP mist_outputs Number of viewers active right now, server-wide, by output type.\n";
       response << "# TYPE mist_outputs gauge\n";
       for (std::map<std::string, uint32_t>::iterator it = outputs.begin(); it != outputs.end(); ++it){
-        response << "mist_outputs{output=\"" << it->first << "\"}" << it->second << "\n";
+        response << "mist_outputs{output=\"" << promLabel(it->first) << "\"} " << it->second << "\n";
       }
       response << "\n";
     }
 
-    {// Scope for shortest possible blocking of statsMutex
-      std::lock_guard<std::recursive_mutex> guard(statsMutex);
-      if (!Controller::conf.is_active){return;}
-
+    if (Controller::conf.is_active){
       response << "# HELP mist_sessions_total Number of sessions active right now, server-wide, by type.\n";
       response << "# TYPE mist_sessions_total gauge\n";
-      response << "mist_sessions_total{sessType=\"viewers\"}" << totViewers << "\n";
-      response << "mist_sessions_total{sessType=\"incoming\"}" << totInputs << "\n";
-      response << "mist_sessions_total{sessType=\"outgoing\"}" << totOutputs << "\n";
-      response << "mist_sessions_total{sessType=\"unspecified\"}" << totUnspecified << "\n";
-      response << "mist_sessions_total{sessType=\"cached\"}" << sessions.size() << "\n";
+      response << "mist_sessions_total{sessType=\"viewers\"} " << totViewers << "\n";
+      response << "mist_sessions_total{sessType=\"incoming\"} " << totInputs << "\n";
+      response << "mist_sessions_total{sessType=\"outgoing\"} " << totOutputs << "\n";
+      response << "mist_sessions_total{sessType=\"unspecified\"} " << totUnspecified << "\n";
+      response << "mist_sessions_total{sessType=\"cached\"} " << snap->cachedSessions << "\n";
 
       response << "\n# HELP mist_viewcount Count of unique viewer sessions since stream start, per "
                   "stream.\n";
@@ -1890,23 +2468,20 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
       response << "# TYPE mist_bw counter\n";
       response << "# HELP mist_packets Total number of packets sent/received/lost over lossy protocols.\n";
       response << "# TYPE mist_packets counter\n";
-      for (std::map<std::string, struct streamTotals>::iterator it = streamStats.begin();
-            it != streamStats.end(); ++it){
-        response << "mist_sessions{stream=\"" << it->first << "\",sessType=\"viewers\"}"
-                  << it->second.currViews << "\n";
-        response << "mist_sessions{stream=\"" << it->first << "\",sessType=\"incoming\"}"
-                  << it->second.currIns << "\n";
-        response << "mist_sessions{stream=\"" << it->first << "\",sessType=\"outgoing\"}"
-                  << it->second.currOuts << "\n";
-        response << "mist_sessions{stream=\"" << it->first << "\",sessType=\"unspecified\"}"
-                  << it->second.currUnspecified << "\n";
-        response << "mist_viewcount{stream=\"" << it->first << "\"}" << it->second.viewers << "\n";
-        response << "mist_viewseconds{stream=\"" << it->first << "\"} " << it->second.viewSeconds << "\n";
-        response << "mist_bw{stream=\"" << it->first << "\",direction=\"up\"}" << it->second.upBytes << "\n";
-        response << "mist_bw{stream=\"" << it->first << "\",direction=\"down\"}" << it->second.downBytes << "\n";
-        response << "mist_packets{stream=\"" << it->first << "\",pkttype=\"sent\"}" << it->second.packSent << "\n";
-        response << "mist_packets{stream=\"" << it->first << "\",pkttype=\"lost\"}" << it->second.packLoss << "\n";
-        response << "mist_packets{stream=\"" << it->first << "\",pkttype=\"retrans\"}" << it->second.packRetrans << "\n";
+      for (streamTotalsMap::const_iterator it = snap->streams->begin();
+            it != snap->streams->end(); ++it){
+        const promLabel strm(it->first);
+        response << "mist_sessions{stream=\"" << strm << "\",sessType=\"viewers\"} " << it->second->currViews << "\n";
+        response << "mist_sessions{stream=\"" << strm << "\",sessType=\"incoming\"} " << it->second->currIns << "\n";
+        response << "mist_sessions{stream=\"" << strm << "\",sessType=\"outgoing\"} " << it->second->currOuts << "\n";
+        response << "mist_sessions{stream=\"" << strm << "\",sessType=\"unspecified\"} " << it->second->currUnspecified << "\n";
+        response << "mist_viewcount{stream=\"" << strm << "\"} " << it->second->viewers << "\n";
+        response << "mist_viewseconds{stream=\"" << strm << "\"} " << it->second->viewSeconds << "\n";
+        response << "mist_bw{stream=\"" << strm << "\",direction=\"up\"} " << it->second->upBytes << "\n";
+        response << "mist_bw{stream=\"" << strm << "\",direction=\"down\"} " << it->second->downBytes << "\n";
+        response << "mist_packets{stream=\"" << strm << "\",pkttype=\"sent\"} " << it->second->packSent << "\n";
+        response << "mist_packets{stream=\"" << strm << "\",pkttype=\"lost\"} " << it->second->packLoss << "\n";
+        response << "mist_packets{stream=\"" << strm << "\",pkttype=\"retrans\"} " << it->second->packRetrans << "\n";
       }
 
       if (Controller::triggerStats.size()){
@@ -1915,14 +2490,29 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
         response << "# HELP mist_trigger_fails Total failed executions for the given trigger\n";
         for (std::map<std::string, Controller::triggerLog>::iterator it = Controller::triggerStats.begin();
             it != Controller::triggerStats.end(); it++){
-          response << "mist_trigger_count{trigger=\"" << it->first << "\"}" << it->second.totalCount << "\n";
-          response << "mist_trigger_time{trigger=\"" << it->first << "\"}" << it->second.ms << "\n";
-          response << "mist_trigger_fails{trigger=\"" << it->first << "\"}" << it->second.failCount << "\n";
+          response << "mist_trigger_count{trigger=\"" << promLabel(it->first) << "\"} " << it->second.totalCount << "\n";
+          response << "mist_trigger_time{trigger=\"" << promLabel(it->first) << "\"} " << it->second.ms << "\n";
+          response << "mist_trigger_fails{trigger=\"" << promLabel(it->first) << "\"} " << it->second.failCount << "\n";
+        }
+        response << "\n# HELP mist_trigger_duration_seconds Execution time of triggers.\n";
+        response << "# TYPE mist_trigger_duration_seconds histogram\n";
+        for (std::map<std::string, Controller::triggerLog>::iterator it = Controller::triggerStats.begin();
+            it != Controller::triggerStats.end(); it++){
+          response.histogram("mist_trigger_duration_seconds", "trigger", it->first, it->second.latency);
+        }
+        response << "\n";
+      }
+
+      if (Controller::requestLatency.size()){
+        response << "# HELP mist_request_duration_seconds Time taken by outputs to handle requests, by request type.\n";
+        response << "# TYPE mist_request_duration_seconds histogram\n";
+        for (std::map<std::string, Util::LatencyHistogram>::iterator it = Controller::requestLatency.begin();
+             it != Controller::requestLatency.end(); ++it){
+          response.histogram("mist_request_duration_seconds", "type", it->first, it->second);
         }
         response << "\n";
       }
     }
-    H.Chunkify(response.str(), conn);
   }
   if (mode == PROMETHEUS_JSON){
     JSON::Value resp;
@@ -1938,22 +2528,21 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
     resp["curr"].append(totInputs);
     resp["curr"].append(totOutputs);
     resp["curr"].append(totUnspecified);
-    resp["tot"].append(servViewers);
-    resp["tot"].append(servInputs);
-    resp["tot"].append(servOutputs);
-    resp["tot"].append(servUnspecified);
+    resp["tot"].append(snap->viewers);
+    resp["tot"].append(snap->inputs);
+    resp["tot"].append(snap->outputs);
+    resp["tot"].append(snap->unspecified);
     resp["st"].append(bw_up_total);
     resp["st"].append(bw_down_total);
-    resp["bw"].append(servUpBytes);
-    resp["bw"].append(servDownBytes);
-    resp["pkts"].append(servPackSent);
-    resp["pkts"].append(servPackLoss);
-    resp["pkts"].append(servPackRetrans);
+    resp["bw"].append(snap->upBytes);
+    resp["bw"].append(snap->downBytes);
+    resp["pkts"].append(snap->packSent);
+    resp["pkts"].append(snap->packLoss);
+    resp["pkts"].append(snap->packRetrans);
     resp["bwlimit"] = bwLimit;
-    {// Scope for shortest possible blocking of statsMutex
-      std::lock_guard<std::recursive_mutex> guard(statsMutex);
+    {
       if (!Controller::conf.is_active){return;}
-      resp["curr"].append((uint64_t)sessions.size());
+      resp["curr"].append(snap->cachedSessions);
 
       if (Controller::triggerStats.size()){
         for (std::map<std::string, Controller::triggerLog>::iterator it = Controller::triggerStats.begin();
@@ -1971,26 +2560,26 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
           resp["loc"]["name"] = Storage["config"]["location"]["name"].asStringRef();
         }
       }
-      resp["obw"].append(servUpOtherBytes);
-      resp["obw"].append(servDownOtherBytes);
+      resp["obw"].append(snap->upOtherBytes);
+      resp["obw"].append(snap->downOtherBytes);
 
-      for (std::map<std::string, struct streamTotals>::iterator it = streamStats.begin();
-           it != streamStats.end(); ++it){
+      for (streamTotalsMap::const_iterator it = snap->streams->begin();
+           it != snap->streams->end(); ++it){
         JSON::Value & strm = resp["streams"][it->first];
         uint8_t strmStat = Util::getStreamStatus(it->first);
-        strm["tot"].append(it->second.viewers);
-        strm["tot"].append(strmStat == STRMSTAT_READY ? it->second.inputs : 0);
-        strm["tot"].append(it->second.outputs);
-        strm["bw"].append(it->second.upBytes);
-        strm["bw"].append(it->second.downBytes);
-        strm["curr"].append(it->second.currViews);
-        strm["curr"].append(it->second.currIns);
-        strm["curr"].append(it->second.currOuts);
-        strm["curr"].append(it->second.currUnspecified);
-        strm["pkts"].append(it->second.packSent);
-        strm["pkts"].append(it->second.packLoss);
-        strm["pkts"].append(it->second.packRetrans);
-        if (it->second.tags.count("replicated")) { strm["rep"] = true; }
+        strm["tot"].append(it->second->viewers);
+        strm["tot"].append(strmStat == STRMSTAT_READY ? it->second->inputs : 0);
+        strm["tot"].append(it->second->outputs);
+        strm["bw"].append(it->second->upBytes);
+        strm["bw"].append(it->second->downBytes);
+        strm["curr"].append(it->second->currViews);
+        strm["curr"].append(it->second->currIns);
+        strm["curr"].append(it->second->currOuts);
+        strm["curr"].append(it->second->currUnspecified);
+        strm["pkts"].append(it->second->packSent);
+        strm["pkts"].append(it->second->packLoss);
+        strm["pkts"].append(it->second->packRetrans);
+        if (it->second->tags.count("replicated")) { strm["rep"] = true; }
       }
       for (std::map<std::string, uint32_t>::iterator it = outputs.begin(); it != outputs.end(); ++it){
         resp["output_counts"][it->first] = it->second;
@@ -2004,57 +2593,7 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
       if (!Controller::conf.is_active){return;}
       // add tags, if any
       if (Storage.isMember("tags") && Storage["tags"].isArray() && Storage["tags"].size()){resp["tags"] = Storage["tags"];}
-      // Loop over connectors
-      const JSON::Value &caps = capabilities["connectors"];
-      jsonForEachConst(Storage["config"]["protocols"], prtcl){
-        if (!(*prtcl).isMember("connector")){continue;}
-        const std::string &cName = (*prtcl)["connector"].asStringRef();
-        if (!(*prtcl).isMember("online") || (*prtcl)["online"].asInt() != 1){continue;}
-        if (!caps.isMember(cName)){continue;}
-        const JSON::Value &capa = caps[cName];
-        if (!capa.isMember("optional") || !capa["optional"].isMember("port")){continue;}
-        // We now know it's configured, online and has a listening port
-        HTTP::URL outURL("HOST");
-        // get the default port if none is set
-        if (prtcl->isMember("port")){outURL.port = (*prtcl)["port"].asString();}
-        if (!outURL.port.size()){outURL.port = capa["optional"]["port"]["default"].asString();}
-        // set the protocol
-        if (capa.isMember("protocol")){
-          outURL.protocol = capa["protocol"].asString();
-        }else{
-          if (capa.isMember("methods") && capa["methods"][0u].isMember("handler")){
-            outURL.protocol = capa["methods"][0u]["handler"].asStringRef();
-          }
-        }
-        if (outURL.protocol.find(':') != std::string::npos){
-          outURL.protocol.erase(outURL.protocol.find(':'));
-        }
-        // set the public access, if needed
-        if (prtcl->isMember("pubaddr") && (*prtcl)["pubaddr"].asString().size()){
-          HTTP::URL altURL((*prtcl)["pubaddr"].asString());
-          outURL.protocol = altURL.protocol;
-          if (altURL.host.size()){outURL.host = altURL.host;}
-          outURL.port = altURL.port;
-          outURL.path = altURL.path;
-        }
-        // Add the URL, if present
-        if (capa.isMember("url_rel")){
-          resp["outputs"][cName] = outURL.link("./" + capa["url_rel"].asStringRef()).getUrl();
-        }
-
-        // if this connector can be depended upon by other connectors, loop over the rest
-        if (capa.isMember("provides")){
-          const std::string &cProv = capa["provides"].asStringRef();
-          jsonForEachConst(Storage["config"]["protocols"], chld){
-            const std::string &child = (*chld)["connector"].asStringRef();
-            if (!caps.isMember(child) || !caps[child].isMember("deps")){continue;}
-            if (caps[child].isMember("deps") && caps[child]["deps"].asStringRef() == cProv &&
-                caps[child].isMember("url_rel")){
-              resp["outputs"][child] = outURL.link("./" + caps[child]["url_rel"].asStringRef()).getUrl();
-            }
-          }
-        }
-      }
+      fillOutputUrls(resp["outputs"]);
     }
 
     if (jsonp.size()){H.Chunkify(jsonp + "(", conn);}
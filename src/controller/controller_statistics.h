@@ -1,11 +1,15 @@
 #pragma once
+#include <deque>
 #include <map>
 #include <mist/comms.h>
 #include <mist/defines.h>
 #include <mist/http_parser.h>
 #include <mist/json.h>
+#include <mist/load_push.h>
 #include <mist/shared_memory.h>
 #include <mist/socket.h>
+#include <mist/stream.h>
+#include <mist/timeseries.h>
 #include <mist/timing.h>
 #include <mist/config.h>
 #include <string>
@@ -42,12 +46,32 @@ namespace Controller{
 
   enum sessType{SESS_UNSET = 0, SESS_INPUT, SESS_OUTPUT, SESS_VIEWER, SESS_UNSPECIFIED};
 
+  /// Per-second history of a single session.
+  /// The counters are kept in a TimeSeries::Series; the text fields are only stored when they change.
   class statStorage{
   public:
+    statStorage();
     void update(Comms::Sessions &statComm, size_t index);
-    bool hasDataFor(unsigned long long);
-    statLog &getDataFor(unsigned long long);
-    std::map<unsigned long long, statLog> log;
+    void finish();
+    uint64_t getStart();
+    uint64_t getEnd();
+    bool hasDataFor(uint64_t t);
+    const statLog &getDataFor(uint64_t t);
+    const statLog &getLast();
+
+  private:
+    struct statText{
+      uint64_t time;
+      std::string streamName;
+      std::string host;
+      std::string connectors;
+    };
+    void setText(uint64_t t, const std::string &streamName, const std::string &host, const std::string &connectors);
+    TimeSeries::Series log;
+    std::deque<statText> texts; ///< Text fields, each valid from its time until the next entry
+    statLog last;               ///< Most recent datapoint
+    statLog lookup;             ///< Datapoint most recently decoded by getDataFor
+    uint64_t lookupTime;        ///< Time lookup was decoded for, or zero if it is not valid
   };
 
   /// A session class that keeps track of both current and archived connections.
@@ -103,9 +127,11 @@ namespace Controller{
     uint64_t totalCount;
     uint64_t failCount;
     uint64_t ms;
+    Util::LatencyHistogram latency;
   };
 
   extern std::map<std::string, triggerLog> triggerStats;
+  extern std::map<std::string, Util::LatencyHistogram> requestLatency;
 
   void statLeadIn();
   void statOnActive(size_t id);
@@ -119,6 +145,8 @@ namespace Controller{
   void fillHasStats(JSON::Value &req, JSON::Value &rep);
   void fillTotals(JSON::Value &req, JSON::Value &rep);
   void initStats();
+  void startStats();
+  void statsLoop();
   void deinitStats();
   size_t runStats();
   void sessions_invalidate(const std::string &streamname);
@@ -139,4 +167,5 @@ namespace Controller{
 #define PROMETHEUS_TEXT 0
 #define PROMETHEUS_JSON 1
   void handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int mode);
+  void fillLoadState(LoadPush::State &S);
 }// namespace Controller
@@ -829,6 +829,7 @@ namespace Controller{
              || !globAccX.getFieldAccX("udpApi")
              || !globAccX.getFieldAccX("iid")
              || !globAccX.getFieldAccX("hrn")
+             || !globAccX.getFieldAccX("triggerConcurrency")
              ){
             globAccX.setReload();
             globCfg.master = true;
@@ -849,6 +850,7 @@ namespace Controller{
           globAccX.addField("udpApi", RAX_128STRING);
           globAccX.addField("iid", RAX_64STRING);
           globAccX.addField("hrn", RAX_128STRING);
+          globAccX.addField("triggerConcurrency", RAX_64UINT);
           globAccX.setRCount(1);
           globAccX.setEndPos(1);
           globAccX.setReady();
@@ -864,6 +866,7 @@ namespace Controller{
         globAccX.setInt("systemBoot", systemBoot);
         globAccX.setString("iid", instanceId);
         globAccX.setString("hrn", Storage["config"]["serverid"].asString());
+        globAccX.setInt("triggerConcurrency", Storage["config"]["triggerConcurrency"].asInt());
         globCfg.master = false; // leave the page after closing
         addShmPage(SHM_GLOBAL_CONF);
       }
@@ -994,6 +997,33 @@ namespace Controller{
           tPage.setEndPos(std::min(i, max));
         }
       }
+
+      // (Re)create the trigger response cache; cached responses may not apply to the new triggers
+      static IPC::sharedPage cachePage;
+      cachePage.init(SHM_TRIGGER_CACHE, SHM_TRIGGER_CACHE_LEN, false, false);
+      if (cachePage){
+        Util::RelAccX tmpA(cachePage.mapped, false);
+        if (tmpA.isReady()){tmpA.setReload();}
+        cachePage.master = true;
+        cachePage.close();
+      }
+      // Start the new page with a fresh lock, so one left held by a crashed process cannot block it
+      IPC::semaphore cacheLock(SEM_TRIGGER_CACHE, O_CREAT | O_RDWR, ACCESSPERMS, 1);
+      cacheLock.unlink();
+      cachePage.init(SHM_TRIGGER_CACHE, SHM_TRIGGER_CACHE_LEN, true, false);
+      if (cachePage){
+        Util::RelAccX cPage(cachePage.mapped, false);
+        cPage.addField("key", RAX_64UINT);
+        cPage.addField("digest", RAX_RAW, 32);
+        cPage.addField("expire", RAX_64UINT);
+        cPage.addField("response", RAX_128STRING);
+        uint32_t slots = (SHM_TRIGGER_CACHE_LEN - cPage.getOffset()) / cPage.getRSize();
+        cPage.setRCount(slots);
+        cPage.setEndPos(slots);
+        cPage.setReady();
+        cachePage.master = false;
+        addShmPage(SHM_TRIGGER_CACHE);
+      }
     }
 
     static bool serverStartTriggered;
@@ -389,6 +389,8 @@ namespace Controller{
             LOG_MSG("STRM", "Deleting source file for stream %s: %s", cleaned.c_str(), strmSource.c_str());
             // Delete dtsh, ignore failures
             if (!unlink((strmSource + ".dtsh").c_str())){++ret;}
+            if (!unlink((strmSource + ".dtsm").c_str())){++ret;}
+            ret += Util::removeHeaderCaches(strmSource);
           }
         }
       }
@@ -4,6 +4,7 @@
 #include <mist/defines.h>
 #include <mist/encode.h>
 #include <mist/procs.h>
+#include <mist/segment_cache.h>
 #include <mist/stream.h>
 #include <mist/triggers.h>
 #include <mist/urireader.h>
@@ -297,12 +298,16 @@ namespace Mist{
       if (bufHeader.st_mtime < bufStream.st_mtime + 15){
         INFO_MSG("Overwriting outdated DTSH header file: %s ", headerFile.c_str());
         remove(headerFile.c_str());
+        remove((f + ".dtsm").c_str());
+        Util::removeHeaderCaches(f);
       }
 
       // the same second is not enough - add a 15 second window where we consider it too old
       if (hasSrt && bufHeader.st_mtime < srtStream.st_mtime + 15){
         INFO_MSG("Overwriting outdated DTSH header file: %s ", headerFile.c_str());
         remove(headerFile.c_str());
+        remove((f + ".dtsm").c_str());
+        Util::removeHeaderCaches(f);
       }
     }
 
@@ -721,6 +726,8 @@ namespace Mist{
       INFO_MSG("Created header in %.3f ms (%zu tracks)", (double)timer/1000.0, M?M.trackCount():(size_t)0);
       //Write header to file for caching purposes
       M.toFile(config->getString("input") + ".dtsh");
+      std::string imageFile = headerImageFile();
+      if (imageFile.size()){M.toImage(imageFile);}
     }
     postHeader();
     if (config->getBool("headeronly")){return 0;}
@@ -882,6 +889,8 @@ namespace Mist{
 
     internalOnly = (config->getString("input").find("INTERNAL_ONLY") != std::string::npos);
     isBuffer = (capa["name"].asStringRef() == "Buffer");
+    // The live buffer owns the sequence counter that wakes up viewers when new data arrives
+    if (isBuffer){liveSeq.init(streamName, true);}
 
     /*LTS-START*/
     if (Triggers::shouldTrigger("STREAM_READY", config->getString("streamname"))){
@@ -1286,6 +1295,8 @@ namespace Mist{
   }
 
   void Input::finish(){
+    // Cached segments are only valid for as long as this input provides the stream
+    Util::SegmentCache::evict(streamName);
     if (!standAlone || config->getBool("realtime")){return;}
     for (std::map<size_t, std::map<uint32_t, uint64_t> >::iterator it = pageCounter.begin();
          it != pageCounter.end(); it++){
@@ -1771,6 +1782,15 @@ namespace Mist{
         }
       }
     }
+    // Try to load a metadata image, which needs no parsing at all
+    std::string imageFile = headerImageFile();
+    if (imageFile.size()){
+      uint64_t timer = Util::getMicros();
+      if (meta.fromImage(streamName, imageFile)){
+        INFO_MSG("Loaded metadata image in %.3f ms (%zu tracks)", (double)Util::getMicros(timer) / 1000.0, M.trackCount());
+        return true;
+      }
+    }
     // Try to read any existing DTSH file
     std::string fileName = config->getString("input") + ".dtsh";
     HIGH_MSG("Loading metadata for stream '%s' from file '%s'", streamName.c_str(), fileName.c_str());
@@ -1789,9 +1809,31 @@ namespace Mist{
       INFO_MSG("Updating wrong version header file from version %u to %u", meta.version, DTSH_VERSION);
       return false;
     }
+    // Write a metadata image as well, so the next load does not need to parse the header again
+    if (meta && imageFile.size()){meta.toImage(imageFile);}
     return meta;
   }
 
+  /// Returns the path of the metadata image (.dtsm file) that caches the metadata for this input.
+  /// Images are only used for local files that also have a DTSH header, and only if the image is not
+  /// older than that header. Returns an empty string if no image should be read or written.
+  std::string Input::headerImageFile(){
+    if (config->getBool("realtime") || !streamName.size()){return "";}
+    HTTP::URL inUrl = HTTP::localURIResolver().link(config->getString("input"));
+    if (!inUrl.isLocalPath()){return "";}
+    std::string imageFile = inUrl.getFilePath() + ".dtsm";
+    struct stat bufHeader, bufImage;
+    if (stat((inUrl.getFilePath() + ".dtsh").c_str(), &bufHeader) != 0){
+      remove(imageFile.c_str());
+      return "";
+    }
+    if (stat(imageFile.c_str(), &bufImage) == 0 && bufImage.st_mtime < bufHeader.st_mtime){
+      INFO_MSG("Removing outdated metadata image %s", imageFile.c_str());
+      remove(imageFile.c_str());
+    }
+    return imageFile;
+  }
+
   bool Input::keepAlive(){
     if (!userSelect.size()){return config->is_active;}
 
@@ -65,6 +65,7 @@ namespace Mist {
     virtual bool isThread(){return false;}
     virtual bool isSingular(){return !config->getBool("realtime");}
     virtual bool readExistingHeader();
+    std::string headerImageFile();
     virtual bool atKeyFrame();
     virtual void getNext(size_t idx = INVALID_TRACK_ID){}
     virtual void seek(uint64_t seekTime, size_t idx = INVALID_TRACK_ID){}
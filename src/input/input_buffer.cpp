@@ -4,6 +4,7 @@
 #include <mist/defines.h>
 #include <mist/langcodes.h>
 #include <mist/procs.h>
+#include <mist/segment_cache.h>
 #include <mist/stream.h>
 #include <mist/triggers.h>
 
@@ -36,6 +37,7 @@ namespace Mist{
 
     lastReTime = 0; /*LTS*/
     finalMillis = 0;
+    lastSegEvict = 0;
     capa["name"] = "Buffer";
     JSON::Value option;
     option["arg"] = "integer";
@@ -459,6 +461,15 @@ namespace Mist{
         bufferRemove(i, tPages.getInt(firstKeyEnt, j), j);
       }
     }
+    // Remove shared cached segments that start before the oldest data still in the buffer
+    if (Util::bootSecs() - lastSegEvict > 4){
+      lastSegEvict = Util::bootSecs();
+      uint64_t firstms = 0xFFFFFFFFFFFFFFFFull;
+      for (std::set<size_t>::iterator idx = tracks.begin(); idx != tracks.end(); idx++){
+        if (M.getFirstms(*idx) < firstms){firstms = M.getFirstms(*idx);}
+      }
+      if (firstms != 0xFFFFFFFFFFFFFFFFull){Util::SegmentCache::evict(streamName, firstms);}
+    }
     updateMeta();
   }
 
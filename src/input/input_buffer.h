@@ -19,6 +19,7 @@ namespace Mist{
     uint64_t lastProcTime; /*LTS*/
     uint64_t firstProcTime; /*LTS*/
     uint64_t finalMillis;
+    uint64_t lastSegEvict; ///< Last time (in seconds) cached segments were evicted
     bool hasPush;//Is a push currently being received?
     bool everHadPush;//Was there ever a push received?
     bool allProcsRunning;
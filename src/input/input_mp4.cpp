@@ -401,7 +401,7 @@ namespace Mist{
       } else {
         bool isKeyframe = (curPart.keyframe && meta.getType(curPart.trackID) == "video");
         thisPacket.genericFill(curPart.time, curPart.offset, curPart.trackID, readBuffer + (curPart.bpos - readPos),
-                               curPart.size, 0, isKeyframe);
+                               curPart.size, curPart.bpos, isKeyframe);
       }
       thisTime = curPart.time;
       thisIdx = curPart.trackID;
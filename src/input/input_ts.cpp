@@ -643,7 +643,7 @@ namespace Mist{
         }
       }else{
         bool received = false;
-        while (udpCon.Receive()){
+        while (udpCon.batchReceive()){
           readPos += udpCon.data.size();
           received = true;
           if (!gettingData){
@@ -9,6 +9,7 @@
 #include <mist/json.h>
 #include <mist/langcodes.h> //LTS
 #include <mist/stream.h>
+#include <mist/timing.h>
 
 #include <cstdlib>
 #include <signal.h>
@@ -22,6 +23,18 @@ namespace Mist{
     mainSelTrackCache = INVALID_TRACK_ID;
     thisData = 0;
     thisDataLen = 0;
+    liveSeqTry = 0;
+  }
+
+  /// Opens the live sequence counter for the current stream, if not already open.
+  /// It is created by the live buffer, so this retries at most once per second while it does not exist.
+  bool InOutBase::openLiveSequence(){
+    if (liveSeq){return true;}
+    uint64_t now = Util::bootMS();
+    if (liveSeqTry && now - liveSeqTry < 1000){return false;}
+    liveSeqTry = now;
+    liveSeq.init(streamName);
+    return liveSeq;
   }
 
   /// Returns the ID of the main selected track, or 0 if no tracks are selected.
@@ -514,6 +527,8 @@ namespace Mist{
     DONTEVEN_MSG("Buffering live packet (%zuB) @%" PRIu64 " ms on track %" PRIu32 " with offset %" PRIu64, packDataSize, packTime, packTrack, packOffset);
     bufferNext(packTime, packOffset, packTrack, packData, packDataSize, packBytePos, isKeyframe, livePage[packTrack], aMeta);
     aMeta.update(packTime, packOffset, packTrack, packDataSize, packBytePos, isKeyframe);
+    // Wake up any viewers waiting for new data
+    if (openLiveSequence()){liveSeq.bump();}
   }
 
   ///Handles updating track metadata from a new keyframe, if applicable
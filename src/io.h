@@ -51,6 +51,9 @@ namespace Mist{
 
     std::map<size_t, Comms::Users> userSelect;
 
+    IPC::liveSequence liveSeq; ///< Sequence counter of the live stream, if available
+    bool openLiveSequence();
+
     size_t getCurrentLivePage(uint32_t trackIdx){
       if (!curPageNum.count(trackIdx)){
         return INVALID_KEY_NUM;
@@ -62,6 +65,7 @@ namespace Mist{
     std::map<uint32_t, IPC::sharedPage> livePage;
     std::map<uint32_t, size_t> curPageNum;
     size_t mainSelTrackCache;
+    uint64_t liveSeqTry; ///< Last time (in ms) opening the live sequence counters was attempted
 
   };
 }// namespace Mist
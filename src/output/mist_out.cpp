@@ -69,18 +69,48 @@ int main(int argc, char *argv[]){
     sigaction(SIGUSR1, &new_action, NULL);
   }
 
-  mistOut::listener(conf, [&argc, &argv](Socket::Connection & S, Socket::Server &) {
-    int sock = S.getSocket();
-    int fdErr = STDERR_FILENO;
-    char *const *childArgs = (char *const *)malloc(sizeof(char *) * (argc + 3));
-    memcpy((void *)childArgs, argv, sizeof(char *) * argc);
-    std::string sockHost = S.getHost();
-    ((char **)childArgs)[argc] = (char *)"--connection_handler";
-    ((char **)childArgs)[argc + 1] = (char *)sockHost.c_str();
-    ((char **)childArgs)[argc + 2] = 0;
+  // With pre-forked acceptors, the listener callback runs inside an already initialized acceptor process.
+  // Instead of starting a fresh process, we fork it and run the connection handler directly.
+  // Every connection still gets a process of its own; this only saves the startup cost.
+  if (conf.hasOption("acceptors") && conf.getInteger("acceptors") > 0) {
+    mistOut::listener(conf, [&conf, &capa](Socket::Connection & S, Socket::Server & srv) {
+      Util::Procs::fork_prepare();
+      pid_t pid = fork();
+      if (!pid) {
+        Util::Procs::fork_complete();
+        // Drop (not close!) the listening socket, the acceptors are still accepting on it
+        Util::Procs::socketList.erase(srv.getSocket());
+        srv.drop();
+        Util::Config::setServerFD(-1);
+        struct sigaction new_action;
+        new_action.sa_handler = SIG_IGN;
+        sigemptyset(&new_action.sa_mask);
+        new_action.sa_flags = 0;
+        sigaction(SIGUSR1, &new_action, NULL);
+        int ret;
+        {
+          mistOut tmp(S, conf, capa);
+          ret = tmp.run();
+        }
+        exit(ret);
+      }
+      Util::Procs::fork_complete();
+      if (pid < 0) { FAIL_MSG("Could not fork connection handler: %s", strerror(errno)); }
+    });
+  } else {
+    mistOut::listener(conf, [&argc, &argv](Socket::Connection & S, Socket::Server &) {
+      int sock = S.getSocket();
+      int fdErr = STDERR_FILENO;
+      char *const *childArgs = (char *const *)malloc(sizeof(char *) * (argc + 3));
+      memcpy((void *)childArgs, argv, sizeof(char *) * argc);
+      std::string sockHost = S.getHost();
+      ((char **)childArgs)[argc] = (char *)"--connection_handler";
+      ((char **)childArgs)[argc + 1] = (char *)sockHost.c_str();
+      ((char **)childArgs)[argc + 2] = 0;
 
-    Util::Procs::StartPiped(childArgs, &sock, &sock, &fdErr);
-  });
+      Util::Procs::StartPiped(childArgs, &sock, &sock, &fdErr);
+    });
+  }
 
   if (conf.is_restarting && Socket::checkTrueSocket(0)) {
     INFO_MSG("Reloading input while re-using server socket");
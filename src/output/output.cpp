@@ -7,6 +7,7 @@
 #include <mist/http_parser.h>
 #include <mist/jwt.h>
 #include <mist/langcodes.h>
+#include <mist/mp4_generic.h>
 #include <mist/procs.h>
 #include <mist/stream.h>
 #include <mist/timing.h>
@@ -103,6 +104,8 @@ namespace Mist{
     lastPacketBootMs = thisBootMs;
     for (size_t i = 0; i < 10; ++i){interPacketTimes[i] = 50;}
     avgBetweenPackets = 50;
+    liveWait = false;
+    liveWaitSeen = 0;
     pushing = false;
     recursingSync = false;
     thisTime = 0;
@@ -175,6 +178,10 @@ namespace Mist{
   }
 
   void Output::listener(Util::Config & conf, std::function<void(Socket::Connection &, Socket::Server &)> callback) {
+    if (conf.hasOption("acceptors") && conf.getInteger("acceptors") > 0) {
+      conf.servePreforkSocket(conf.getInteger("acceptors"), callback);
+      return;
+    }
     conf.serveCallbackSocket(callback);
   }
 
@@ -426,7 +433,10 @@ namespace Mist{
     trackSelectionChanged();
 
     //Connect to stream metadata
-    meta.setTrackInvalidateCallback([this](size_t trkIdx) { invalidateTrackPage(trkIdx); });
+    meta.setTrackInvalidateCallback([this](size_t trkIdx){
+      trackDescs.erase(trkIdx);
+      invalidateTrackPage(trkIdx);
+    });
     meta.reInit(streamName, false);
     unsigned int attempts = 0;
     while (!meta && ++attempts < 20 && Util::streamAlive(streamName)){
@@ -467,6 +477,78 @@ namespace Mist{
     selectDefaultTracks();
   }
 
+  static TrackType trackTypeFromString(const std::string &type){
+    if (type == "video"){return TRACK_VIDEO;}
+    if (type == "audio"){return TRACK_AUDIO;}
+    if (type == "meta"){return TRACK_META;}
+    return TRACK_OTHER;
+  }
+
+  static TrackCodec trackCodecFromString(const std::string &codec){
+    if (codec == "H264"){return CODEC_H264;}
+    if (codec == "HEVC"){return CODEC_HEVC;}
+    if (codec == "AV1"){return CODEC_AV1;}
+    if (codec == "VP8"){return CODEC_VP8;}
+    if (codec == "VP9"){return CODEC_VP9;}
+    if (codec == "H263"){return CODEC_H263;}
+    if (codec == "MPEG2"){return CODEC_MPEG2;}
+    if (codec == "AAC"){return CODEC_AAC;}
+    if (codec == "MP3"){return CODEC_MP3;}
+    if (codec == "MP2"){return CODEC_MP2;}
+    if (codec == "AC3"){return CODEC_AC3;}
+    if (codec == "EAC-3"){return CODEC_EAC3;}
+    if (codec == "opus"){return CODEC_OPUS;}
+    if (codec == "FLAC"){return CODEC_FLAC;}
+    if (codec == "PCM"){return CODEC_PCM;}
+    if (codec == "ADPCM"){return CODEC_ADPCM;}
+    if (codec == "ALAW"){return CODEC_ALAW;}
+    if (codec == "ULAW"){return CODEC_ULAW;}
+    if (codec == "Speex"){return CODEC_SPEEX;}
+    if (codec == "Nellymoser"){return CODEC_NELLYMOSER;}
+    if (codec == "JSON"){return CODEC_JSON;}
+    if (codec == "subtitle"){return CODEC_SUBTITLE;}
+    if (codec == "ID3"){return CODEC_ID3;}
+    if (codec == "SCTE35"){return CODEC_SCTE35;}
+    if (codec == "rawts"){return CODEC_RAWTS;}
+    return CODEC_OTHER;
+  }
+
+  /// Returns the description of the given track, compiling it from the metadata if this is the first
+  /// time it is requested or if the track changed since the last time.
+  /// Intended for per-packet use: in the common case this costs a single integer read from the metadata.
+  const TrackDesc &Output::trackDesc(size_t idx){
+    uint32_t revision = M.getRevision(idx);
+    std::map<size_t, TrackDesc>::iterator it = trackDescs.find(idx);
+    if (it != trackDescs.end() && it->second.revision == revision){return it->second;}
+    TrackDesc &d = trackDescs[idx];
+    d.revision = revision;
+    d.typeName = M.getType(idx);
+    d.codecName = M.getCodec(idx);
+    d.type = trackTypeFromString(d.typeName);
+    d.codec = trackCodecFromString(d.codecName);
+    d.init = M.getInit(idx);
+    d.annexB.clear();
+    d.nalLenSize = 4;
+    if (d.codec == CODEC_H264){
+      MP4::AVCC avccbox;
+      avccbox.setPayload(d.init);
+      d.annexB = avccbox.asAnnexB();
+      if (d.init.size() > 4){d.nalLenSize = (d.init[4] & 3) + 1;}
+    }
+    if (d.codec == CODEC_HEVC){
+      MP4::HVCC hvccbox;
+      hvccbox.setPayload(d.init);
+      d.annexB = hvccbox.asAnnexB();
+    }
+    d.id = M.getID(idx);
+    d.rate = M.getRate(idx);
+    d.channels = M.getChannels(idx);
+    d.size = M.getSize(idx);
+    d.width = M.getWidth(idx);
+    d.height = M.getHeight(idx);
+    return d;
+  }
+
   std::set<size_t> Output::getSupportedTracks(const std::string &type) const{
     return Util::getSupportedTracks(M, capa, type);
   }
@@ -1922,8 +2004,15 @@ namespace Mist{
       if (suggestedWait){
         maxWait = suggestedWait;
         // If the suggested wait is 2000ms, we don't know when one could arrive.
-        // Use the average time between packets as a heuristic
-        if (maxWait == 2000 && parseData) { maxWait = avgBetweenPackets * 0.9; }
+        if (maxWait == 2000 && parseData) {
+          if (liveWait) {
+            // Sleep until the live input signals new data
+            evLp.awaitSequence(liveSeq, liveWaitSeen);
+          } else {
+            // Use the average time between packets as a heuristic
+            maxWait = avgBetweenPackets * 0.9;
+          }
+        }
       }else{
         maxWait = avgBetweenPackets * 0.9;
         // slow down processing, if real time speed is wanted
@@ -2208,6 +2297,7 @@ namespace Mist{
 
     disconnect();
     stats(true);
+    Util::flushLatency();
     userSelect.clear();
     trackSelectionChanged();
     if (myConn && myConn.isChunkedMode()) {
@@ -2362,6 +2452,7 @@ namespace Mist{
   /// \returns true if thisPacket was filled with the next packet.
   /// \returns 0 if a packet was filled, suggested wait time in milliseconds otherwise
   size_t Output::prepareNext(){
+    liveWait = false;
     size_t bufSize = buffer.size();
     if (!bufSize){
       thisPacket.null();
@@ -2408,6 +2499,9 @@ namespace Mist{
     for (; trackTries < buffer.size(); ++trackTries){
 
       nxt = *(buffer.begin());
+      // Remember the live sequence number before looking for data, so no wakeup can get lost
+      uint32_t seqSeen = 0;
+      if (M.getLive() && buffer.getSyncMode() && openLiveSequence()) { seqSeen = liveSeq.get(); }
 
       if (!M.trackLoaded(nxt.tid)){
         dropTrack(nxt.tid, "disappeared from metadata");
@@ -2538,6 +2632,9 @@ namespace Mist{
           // In non-sync mode, retry (replaceFirst already shuffled the packet order for us)
           if (!buffer.getSyncMode()) { continue; }
 
+          // A sequence number of zero means nothing is signalling new data (yet)
+          liveWait = seqSeen;
+          liveWaitSeen = seqSeen;
           return 2000;
         }
         if (nxt.offset >= curPage[nxt.tid].len){
@@ -2664,6 +2761,8 @@ namespace Mist{
       }
 
       //Fine! We didn't want a packet, anyway. Let's try again later.
+      liveWait = seqSeen;
+      liveWaitSeen = seqSeen;
       return 2000;
     }
 
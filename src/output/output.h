@@ -17,6 +17,33 @@
 
 namespace Mist{
 
+  enum TrackType{TRACK_OTHER, TRACK_VIDEO, TRACK_AUDIO, TRACK_META};
+  enum TrackCodec{
+    CODEC_OTHER, CODEC_H264, CODEC_HEVC, CODEC_AV1, CODEC_VP8, CODEC_VP9, CODEC_H263, CODEC_MPEG2,
+    CODEC_AAC, CODEC_MP3, CODEC_MP2, CODEC_AC3, CODEC_EAC3, CODEC_OPUS, CODEC_FLAC, CODEC_PCM,
+    CODEC_ADPCM, CODEC_ALAW, CODEC_ULAW, CODEC_SPEEX, CODEC_NELLYMOSER, CODEC_JSON, CODEC_SUBTITLE,
+    CODEC_ID3, CODEC_SCTE35, CODEC_RAWTS
+  };
+
+  /// Description of a track, compiled from the metadata once and then reused for every packet.
+  /// Rebuilt by Output::trackDesc whenever the track's revision in the metadata changes.
+  struct TrackDesc{
+    uint32_t revision;
+    TrackType type;
+    TrackCodec codec;
+    std::string typeName;
+    std::string codecName;
+    std::string init;    ///< Raw init data
+    std::string annexB;  ///< Init data converted to Annex B format, for H264 and HEVC only
+    size_t nalLenSize;   ///< Size of the NAL unit length prefix, for H264 and HEVC only
+    size_t id;
+    uint32_t rate;
+    uint16_t channels;
+    uint16_t size;
+    uint32_t width;
+    uint32_t height;
+  };
+
   /// The output class is intended to be inherited by MistOut process classes.
   /// It contains all generic code and logic, while the child classes implement
   /// anything specific to particular protocols or containers.
@@ -84,6 +111,7 @@ namespace Mist{
 
   private: // these *should* not be messed with in child classes.
     std::map<size_t, uint32_t> currentPage;
+    std::map<size_t, TrackDesc> trackDescs; ///< Cached track descriptions, see trackDesc()
     void loadPageForKey(size_t trackId, size_t keyNum);
     uint64_t pageNumForKey(size_t trackId, size_t keyNum);
     uint64_t pageNumMax(size_t trackId);
@@ -138,6 +166,8 @@ namespace Mist{
 
     std::set<size_t> getSupportedTracks(const std::string &type = "") const;
 
+    const TrackDesc &trackDesc(size_t idx);
+
     inline virtual bool keepGoing() { return Util::Config::is_active && myConn; }
 
     Comms::Connections statComm;
@@ -168,6 +198,8 @@ namespace Mist{
     uint64_t lastPacketBootMs;
     uint64_t interPacketTimes[10]; ///< Needed to calculate avgBetweenPackets
     uint64_t avgBetweenPackets; ///< Used to determine an appropriate wait time when unknown waiting is required.
+    bool liveWait; ///< True if prepareNext is waiting for new live data
+    uint32_t liveWaitSeen; ///< Live sequence number from before prepareNext found no new data
     uint64_t packetCounter;
     uint64_t thisBootMs;
 
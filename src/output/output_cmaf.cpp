@@ -204,6 +204,16 @@ namespace Mist{
     capa["optional"]["chunkpath"]["short"] = "e";
     capa["optional"]["chunkpath"]["default"] = "";
 
+    cfg->addOption("segmentcache",
+                   JSON::fromString("{\"short\":\"K\",\"long\":\"segmentcache\",\"help\":\"Share "
+                                    "generated segments between connections through shared memory.\"}"));
+    capa["optional"]["segmentcache"]["name"] = "Shared segment cache";
+    capa["optional"]["segmentcache"]["help"] =
+        "Keeps generated segments in shared memory, so that identical segment requests from "
+        "multiple viewers are only generated once. Uses extra memory proportional to the buffer "
+        "window of the stream.";
+    capa["optional"]["segmentcache"]["option"] = "--segmentcache";
+
     cfg->addStandardPushCapabilities(capa);
     capa["push_urls"].append("cmaf://*");
     capa["push_urls"].append("cmafs://*");
@@ -264,7 +274,8 @@ namespace Mist{
     // check for forced "no low latency" parameter
     bool noLLHLS = H.GetVar("llhls").size() ? H.GetVar("llhls") == "0" : false;
     // override if valid header forces "no low latency"
-    noLLHLS = H.GetHeader("X-Mist-LLHLS").size() ? H.GetHeader("X-Mist-LLHLS") == "0" : noLLHLS;
+    HTTP::Span llhlsHeader = H.headerView("X-Mist-LLHLS");
+    noLLHLS = llhlsHeader.size() ? llhlsHeader == "0" : noLLHLS;
 
     const HLS::TrackData trackData ={
         M.getLive(),
@@ -450,6 +461,22 @@ namespace Mist{
     Bit::htobl(mdatHeader, mdatSize);
 
     H.StartResponse(H, myConn, config->getBool("nonchunked"));
+    if (config->getBool("segmentcache")){
+      std::stringstream cacheKey;
+      cacheKey << "cmaf/" << idx << "/" << fragmentIndex << "/" << startTime << "_" << targetTime;
+      if (segCache.find(streamName, cacheKey.str(), startTime)){
+        H.Chunkify(segCache.data(), segCache.size(), myConn);
+        H.Chunkify("", 0, myConn);
+        segCache.close();
+        return;
+      }
+      // Only segments that are fully known in the metadata have a final header
+      if (M.getLastms(idx) >= targetTime){
+        segCache.start(streamName, cacheKey.str(), startTime);
+        segCache.append(headerData.data(), headerData.size());
+        segCache.append(mdatHeader, 8);
+      }
+    }
     H.Chunkify(headerData.c_str(), headerData.size(), myConn);
     H.Chunkify(mdatHeader, 8, myConn);
 
@@ -468,6 +495,7 @@ namespace Mist{
       HIGH_MSG("Finished playback to %" PRIu64, targetTime);
       wantRequest = true;
       parseData = false;
+      if (segCache.isRecording()){segCache.store();}
       H.Chunkify("", 0, myConn);
       return;
     }
@@ -475,6 +503,7 @@ namespace Mist{
     size_t dataLen;
     thisPacket.getString("data", data, dataLen);
     H.Chunkify(data, dataLen, myConn);
+    if (segCache.isRecording()){segCache.append(data, dataLen);}
   }
 
   /***************************************************************************************************/
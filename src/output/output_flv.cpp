@@ -77,8 +77,8 @@ namespace Mist{
         }
       }
     }
-    tag.DTSCLoader(thisPacket, M, thisIdx);
     if (M.getCodec(thisIdx) == "PCM" && M.getSize(thisIdx) == 16){
+      tag.DTSCLoader(thisPacket, M, thisIdx);
       char *ptr = tag.getData();
       uint32_t ptrSize = tag.getDataLen();
       for (uint32_t i = 0; i < ptrSize; i += 2){
@@ -86,8 +86,15 @@ namespace Mist{
         ptr[i] = ptr[i + 1];
         ptr[i + 1] = tmpchar;
       }
+      myConn.SendNow(tag.data, tag.len);
+    }else if (tag.DTSCLoader(thisPacket, M, thisIdx, false)){
+      // Send the tag header and size from the tag, and the payload straight from the packet
+      char *dataPointer = 0;
+      size_t len = 0;
+      thisPacket.getString("data", dataPointer, len);
+      struct iovec vec[3] = {{tag.data, tag.len - 4 - len}, {dataPointer, len}, {tag.data + tag.len - 4, 4}};
+      myConn.sendv(vec, 3);
     }
-    myConn.SendNow(tag.data, tag.len);
     if (config->getBool("keyframeonly")){config->is_active = false;}
   }
 
@@ -176,6 +176,7 @@ namespace Mist{
     uaDelay = 0;
     realTime = 0;
     until = 0xFFFFFFFFFFFFFFFFull;
+    coalesceTS = true;
     // If this connection is a socket and not already connected to stdio, connect it to stdio.
     if (myConn.getPureSocket() != -1 && myConn.getSocket() != STDIN_FILENO && myConn.getSocket() != STDOUT_FILENO){
       std::string host = getConnectedHost();
@@ -247,6 +248,27 @@ namespace Mist{
     capa["optional"]["chunkpath"]["option"] = "--chunkpath";
     capa["optional"]["chunkpath"]["short"] = "e";
     capa["optional"]["chunkpath"]["default"] = "";
+
+    cfg->addOption("segmentcache",
+                   JSON::fromString("{\"short\":\"K\",\"long\":\"segmentcache\",\"help\":\"Share "
+                                    "generated segments between connections through shared memory.\"}"));
+    capa["optional"]["segmentcache"]["name"] = "Shared segment cache";
+    capa["optional"]["segmentcache"]["help"] =
+        "Keeps generated segments in shared memory, so that identical segment requests from "
+        "multiple viewers are only generated once. Uses extra memory proportional to the buffer "
+        "window of the stream.";
+    capa["optional"]["segmentcache"]["option"] = "--segmentcache";
+  }
+
+  /// Returns the segment cache key for the currently selected tracks, starting at the given time.
+  std::string OutHLS::segmentCacheKey(uint64_t from){
+    std::stringstream key;
+    key << "ts";
+    for (std::map<size_t, Comms::Users>::iterator it = userSelect.begin(); it != userSelect.end(); it++){
+      key << "/" << it->first;
+    }
+    key << "/" << from << "_" << until;
+    return key.str();
   }
 
   void OutHLS::onHTTP(){
@@ -403,6 +425,21 @@ namespace Mist{
 
       H.StartResponse(H, myConn, VLCworkaround || config->getBool("nonchunked"));
       responded = true;
+      if (config->getBool("segmentcache")){
+        std::string cacheKey = segmentCacheKey(from);
+        if (segCache.find(streamName, cacheKey, from)){
+          H.Chunkify(segCache.data(), segCache.size(), myConn);
+          H.Chunkify("", 0, myConn);
+          H.Clean();
+          segCache.close();
+          Util::reportLatency("hls_segment", Util::bootMS() - requestStartMs);
+          return;
+        }
+        segCache.start(streamName, cacheKey, from);
+        // Counters are aligned to multiples of 16 at the end of every segment, so starting
+        // over from zero is equivalent on the wire but makes the segment bytes reproducible.
+        contCounters.clear();
+      }
       // we assume whole fragments - but timestamps may be altered at will
       uint32_t fragIndice = M.getFragmentIndexForTime(vidTrack, from);
       contPAT = fragIndice; // PAT continuity counter
@@ -450,6 +487,7 @@ namespace Mist{
       }
       H.SetBody(manifest);
       H.SendResponse("200", "OK", myConn);
+      Util::reportLatency("hls_playlist", Util::bootMS() - requestStartMs);
     }
   }
 
@@ -468,22 +506,29 @@ namespace Mist{
           packData.addStuffing();
           while (it->second % 16 != 0){
             packData.setContinuityCounter(++it->second);
-            sendTS(packData.checkAndGetBuffer());
+            queueTS(packData.checkAndGetBuffer());
           }
           packData.clear();
         }
       }
+      flushTS();
+
+      if (segCache.isRecording()){segCache.store();}
 
       // Signal end of data
       H.Chunkify("", 0, myConn);
       H.Clean();
+      Util::reportLatency("hls_segment", Util::bootMS() - requestStartMs);
       return;
     }
     // Invoke the generic TS output sendNext handler
     TSOutput::sendNext();
   }
 
-  void OutHLS::sendTS(const char *tsData, size_t len){H.Chunkify(tsData, len, myConn);}
+  void OutHLS::sendTS(const char *tsData, size_t len){
+    H.Chunkify(tsData, len, myConn);
+    if (segCache.isRecording()){segCache.append(tsData, len);}
+  }
 
   void OutHLS::onFail(const std::string &msg, bool critical){
     if (HTTP::URL(H.url).getExt().substr(0, 3) != "m3u"){
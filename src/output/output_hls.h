@@ -1,5 +1,6 @@
 #include "output_http.h"
 #include "output_ts_base.h"
+#include <mist/segment_cache.h>
 
 namespace Mist{
   class OutHLS : public TSOutput{
@@ -20,9 +21,12 @@ namespace Mist{
     std::string liveIndex();
     std::string liveIndex(size_t tid, const std::string &sessId, const std::string &urlPrefix = "");
 
+    std::string segmentCacheKey(uint64_t from);
+
     size_t vidTrack;
     size_t audTrack;
     uint64_t until;
+    Util::SegmentCache segCache; ///< Shared cache for generated segments, if enabled
   };
 }// namespace Mist
 
@@ -31,6 +31,7 @@ namespace Mist{
     idleInterval = 0;
     idleLast = 0;
     lastHTTPRequest = Util::bootSecs();
+    requestStartMs = Util::bootMS();
     if (config->getString("ip").size()){
       myConn.setHost(config->getString("ip"));
     }
@@ -308,6 +309,7 @@ namespace Mist{
     //Attempt to read a HTTP request, regardless of data being available
     while (H.Read(myConn)){
       lastHTTPRequest = Util::bootSecs();
+      requestStartMs = Util::bootMS();
       //First, figure out which handler we need to use
       std::string handler = getHandler();
       if (handler != capa["name"].asStringRef() || streamName != safenv("stream")) {
@@ -334,10 +336,12 @@ namespace Mist{
       fwdHostBin.clear();
       if (H.hasHeader("X-Real-IP") || H.hasHeader("X-Forwarded-For")){
         if (H.hasHeader("X-Real-IP")){
-          fwdHostStr = H.GetHeader("X-Real-IP");
+          HTTP::Span realIP = H.headerView("X-Real-IP");
+          fwdHostStr.assign(realIP.data(), realIP.size());
         }
         if (H.hasHeader("X-Forwarded-For")){
-          fwdHostStr = H.GetHeader("X-Forwarded-For");
+          HTTP::Span fwdFor = H.headerView("X-Forwarded-For");
+          fwdHostStr.assign(fwdFor.data(), fwdFor.size());
           if (fwdHostStr.find(',') != std::string::npos){fwdHostStr.erase(fwdHostStr.find(','));}
         }
         std::string trueHostStr = Output::getConnectedHost();
@@ -369,7 +373,7 @@ namespace Mist{
       if ((Comms::tknMode & 0x02) && !tkn.size()){
         // Get session token from the request cookie
         std::map<std::string, std::string> storage;
-        const std::string koekjes = H.GetHeader("Cookie");
+        const std::string koekjes = H.headerView("Cookie").str();
         HTTP::parseVars(koekjes, storage, "; ");
         if (storage.count("tkn")){
           tkn = storage.at("tkn");
@@ -377,10 +381,8 @@ namespace Mist{
         if (storage.count("jwt")) { tkn = storage.at("jwt"); }
       }
 
-      if (H.hasHeader("Authorization")) {
-        std::string auth = H.GetHeader("Authorization");
-        if (auth.size() > 7 && auth.substr(0, 7) == "Bearer ") { tkn = auth.substr(8); }
-      }
+      HTTP::Span auth = H.headerView("Authorization");
+      if (auth.size() > 7 && !memcmp(auth.data(), "Bearer ", 7)) { tkn.assign(auth.data() + 8, auth.size() - 8); }
       // Generate a session token if it is being sent as a cookie or url parameter and we couldn't read one
       if (!tkn.size() && Comms::tknMode > 3){
         const std::string newTkn = UA + JSON::Value(getpid()).asString();
@@ -406,13 +408,16 @@ namespace Mist{
 
       /*LTS-START*/
       {
-        HTTP::URL qUrl("http://"+H.GetHeader("Host")+"/"+H.url + H.allVars());
+        HTTP::URL qUrl("http://"+H.headerView("Host").str()+"/"+H.url + H.allVars());
         if (!qUrl.host.size()){qUrl.host = myConn.getBoundAddress();}
         if (!qUrl.port.size() && config->hasOption("port")){qUrl.port = config->getOption("port").asString();}
         reqUrl = qUrl.getUrl();
       }
       /*LTS-END*/
-      if (H.hasHeader("User-Agent")){UA = H.GetHeader("User-Agent");}
+      if (H.hasHeader("User-Agent")){
+        HTTP::Span userAgent = H.headerView("User-Agent");
+        UA.assign(userAgent.data(), userAgent.size());
+      }
 
 #define HTTP_CONVERT(var) if (H.GetVar(var) != ""){targetParams[var] = H.GetVar(var);}
 
@@ -447,8 +452,9 @@ namespace Mist{
           realTime = 0;
         }
       }
-      if (H.GetHeader("X-Mist-Rate") != ""){
-        long long int multiplier = JSON::Value(H.GetHeader("X-Mist-Rate")).asInt();
+      HTTP::Span rateHeader = H.headerView("X-Mist-Rate");
+      if (rateHeader.size()){
+        long long int multiplier = JSON::Value(rateHeader.str()).asInt();
         if (multiplier){
           realTime = 1000 / multiplier;
         }else{
@@ -457,9 +463,7 @@ namespace Mist{
       }
 
       // Handle upgrade to websocket if the output supports it
-      std::string upgradeHeader = H.GetHeader("Upgrade");
-      Util::stringToLower(upgradeHeader);
-      if (doesWebsockets() && upgradeHeader == "websocket"){
+      if (doesWebsockets() && H.headerView("Upgrade").equalsNoCase("websocket")){
         INFO_MSG("Switching to Websocket mode");
         preWebsocketConnect();
         HTTP::Parser req = H;
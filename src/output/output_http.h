@@ -53,6 +53,7 @@ namespace Mist{
     uint32_t idleInterval; ///< Interval for the onIdle handler in milliseconds
     uint64_t idleLast; ///< Last time the onIdle handler was ran in BootMs
     uint64_t lastHTTPRequest; ///< BootSecs time of last parsed HTTP request
+    uint64_t requestStartMs; ///< BootMS time the current HTTP request was parsed
     std::string getConnectedHost();
     std::string getConnectedBinHost();
     bool isTrustedProxy(const std::string & ip);
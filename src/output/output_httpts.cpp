@@ -15,6 +15,7 @@ namespace Mist{
   OutHTTPTS::OutHTTPTS(Socket::Connection & conn, Util::Config & _cfg, JSON::Value & _capa)
     : TSOutput(conn, _cfg, _capa) {
     sendRepeatingHeaders = 500; // PAT/PMT every 500ms (DVB spec)
+    coalesceTS = true;
     HTTP::URL target(config->getString("target"));
     // Detect youtube-style URL
     if (target.path == "http_upload_hls" && target.args.size() >= 5 && target.args.find("file=") == target.args.size() - 5) {
@@ -115,6 +116,12 @@ namespace Mist{
     }
   }
 
+  /// Sends all TS packets for a single frame out together
+  void OutHTTPTS::sendNext(){
+    TSOutput::sendNext();
+    flushTS();
+  }
+
   void OutHTTPTS::sendTS(const char *tsData, size_t len){
     if (isRecording()){
       myConn.SendNow(tsData, len);
@@ -8,6 +8,7 @@ namespace Mist{
     ~OutHTTPTS();
     static void init(Util::Config *cfg, JSON::Value & capa);
     void respondHTTP(const HTTP::Parser & req, bool headersOnly);
+    void sendNext();
     void sendTS(const char *tsData, size_t len = 188);
     void initialSeek(bool dryRun = false);
 
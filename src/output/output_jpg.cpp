@@ -39,12 +39,15 @@ namespace Mist{
     char *dataPointer = 0;
     size_t len = 0;
     thisPacket.getString("data", dataPointer, len);
-    myConn.SendNow(dataPointer, len);
     if (!motion){
+      myConn.SendNow(dataPointer, len);
       Util::logExitReason(ER_CLEAN_EOF, "end of single JPG frame");
       myConn.close();
     }else{
-      myConn.SendNow("\r\n--" + boundary + "\r\nContent-Type: image/jpeg\r\n\r\n");
+      // Send the frame and the boundary in front of the next one together
+      std::string next = "\r\n--" + boundary + "\r\nContent-Type: image/jpeg\r\n\r\n";
+      struct iovec vec[2] = {{dataPointer, len}, {(void *)next.data(), next.size()}};
+      myConn.sendv(vec, 2);
     }
   }
 
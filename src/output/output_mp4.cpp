@@ -11,7 +11,14 @@
 #include <mist/nal.h>
 #include <mist/stream.h> /* for `Util::codecString()` when streaming mp4 over websockets and playback using media source extensions. */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Version of the generated progressive MP4 headers; bump this to invalidate all cached headers.
+#define MP4_HEADER_CACHE_VERSION 1
 
 std::set<std::string> supportedAudio;
 std::set<std::string> supportedVideo;
@@ -88,7 +95,64 @@ namespace Mist{
     }
   }
 
+  HeaderWriter::HeaderWriter(std::function<void(const char *, size_t)> _sink, uint64_t _start, uint64_t _end){
+    sink = _sink;
+    start = _start;
+    end = _end;
+    pos = 0;
+  }
+
+  /// Appends data to the header, keeping only the part of it that falls within the window.
+  void HeaderWriter::append(const char *data, size_t len){
+    if (pos + len <= start || pos >= end){
+      pos += len;
+      return;
+    }
+    uint64_t skipped = (pos < start) ? start - pos : 0;
+    buf.append(data + skipped, std::min((uint64_t)len - skipped, end - pos - skipped));
+    pos += len;
+    if (buf.size() >= 65536){flush();}
+  }
 
+  /// Appends a box header with a 32-bit size.
+  void HeaderWriter::box(uint32_t size, const char *type){
+    char tmp[8];
+    Bit::htobl(tmp, size);
+    memcpy(tmp + 4, type, 4);
+    append(tmp, 8);
+  }
+
+  void HeaderWriter::u32(uint32_t val){
+    char tmp[4];
+    Bit::htobl(tmp, val);
+    append(tmp, 4);
+  }
+
+  void HeaderWriter::u64(uint64_t val){
+    char tmp[8];
+    Bit::htobll(tmp, val);
+    append(tmp, 8);
+  }
+
+  /// Returns true if any of the next len bytes fall within the window.
+  /// If not, they may be skipped instead of generated.
+  bool HeaderWriter::wants(uint64_t len) const{return pos + len > start && pos < end;}
+
+  /// Advances the position by len bytes without writing anything.
+  void HeaderWriter::skip(uint64_t len){pos += len;}
+
+  /// Returns true if the end of the window has been reached.
+  bool HeaderWriter::done() const{return pos >= end;}
+
+  /// Returns the amount of header bytes generated so far, including those outside the window.
+  uint64_t HeaderWriter::size() const{return pos;}
+
+  /// Passes all buffered bytes on to the sink.
+  void HeaderWriter::flush(){
+    if (!buf.size()){return;}
+    sink(buf, buf.size());
+    buf.truncate(0);
+  }
 
   std::string OutMP4::protectionHeader(size_t idx){
     std::string tmp = toUTF16(M.getPlayReady(idx));
@@ -114,8 +178,145 @@ namespace Mist{
     endTime = 0xffffffffffffffffull;
     realBaseOffset = 1;
     timeOffset = 0;
+    srcFd = -2;
+    hdrFd = -1;
+  }
+  OutMP4::~OutMP4(){
+    if (srcFd >= 0){close(srcFd);}
+    if (hdrFd != -1){close(hdrFd);}
+  }
+
+  /// Returns true if the current packet can be sent straight from the source file at the given byte
+  /// position, instead of copying it out of the data page. The source file is opened on first use.
+  /// The source file is only used if its DTSH header is newer than the file itself, using the same
+  /// margin the input uses to decide the header is outdated, so the byte positions in the metadata
+  /// describe the file as it is now. On top of that, the first packet of every track is compared
+  /// against the source file contents; any mismatch means the input does not store source byte
+  /// positions, and disables this for the connection.
+  bool OutMP4::canSendFromSource(const char *dataPointer, size_t len, uint64_t bpos){
+    if (!bpos || srcFd == -1){return false;}
+    if (srcFd == -2){
+      srcFd = -1;
+      std::string src = M.getSource();
+      struct stat st, dtshSt;
+      if (!src.size() || stat(src.c_str(), &st) || !S_ISREG(st.st_mode)){return false;}
+      if (stat((src + ".dtsh").c_str(), &dtshSt) || dtshSt.st_mtime < st.st_mtime + 15){
+        HIGH_MSG("Header of %s is missing or older than the file; sending from data pages", src.c_str());
+        return false;
+      }
+      srcFd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+      if (srcFd == -1){return false;}
+    }
+    if (!srcChecked.count(thisIdx)){
+      Util::ResizeablePointer cmp;
+      cmp.allocate(len);
+      if (pread(srcFd, (char *)cmp, len, bpos) != (ssize_t)len || memcmp((char *)cmp, dataPointer, len)){
+        INFO_MSG("Track %zu data does not match %s; sending from data pages instead", thisIdx, M.getSource().c_str());
+        close(srcFd);
+        srcFd = -1;
+        return false;
+      }
+      srcChecked.insert(thisIdx);
+    }
+    return true;
+  }
+
+  /// Returns the path of the file that caches the progressive MP4 header for the selected tracks,
+  /// or an empty string if the header should not be cached. Headers are only cached for VoD
+  /// streams from local files, and are stored next to the source file, like its .dtsh header.
+  /// Sets fingerprint to a checksum of everything the header depends on, which is stored in the
+  /// cache file so outdated caches can be recognised.
+  /// Util::removeHeaderCaches relies on this naming to clean up the caches of a source file.
+  std::string OutMP4::headerCacheFile(uint32_t &fingerprint){
+    if (M.getLive()){return "";}
+    std::string src = M.getSource();
+    struct stat srcStat, dtshStat;
+    if (!src.size() || stat(src.c_str(), &srcStat) || !S_ISREG(srcStat.st_mode)){return "";}
+    std::stringstream sel, meta;
+    sel << (sending3GP ? "3gp" : "mp4");
+    meta << MP4_HEADER_CACHE_VERSION << " " << srcStat.st_size << " " << srcStat.st_mtime;
+    if (!stat((src + ".dtsh").c_str(), &dtshStat)){meta << " " << dtshStat.st_size << " " << dtshStat.st_mtime;}
+    for (std::map<size_t, Comms::Users>::const_iterator it = userSelect.begin(); it != userSelect.end(); it++){
+      if (prevVidTrack != INVALID_TRACK_ID && it->first == prevVidTrack){continue;}
+      DTSC::Keys keys = M.getKeys(it->first);
+      sel << " " << it->first;
+      meta << " " << it->first << " " << M.getTrackIdentifier(it->first) << " " << M.getLang(it->first) << " "
+           << M.getFirstms(it->first) << " " << M.getLastms(it->first) << " " << keys.getFirstValid() << " "
+           << keys.getEndValid() << " " << keys.getTotalPartCount() << " " << M.getInit(it->first);
+    }
+    fingerprint = checksum::crc32(0, meta.str().data(), meta.str().size());
+    char hash[9];
+    snprintf(hash, 9, "%08x", checksum::crc32(0, sel.str().data(), sel.str().size()));
+    return src + "." + hash + ".mp4h";
+  }
+
+  /// Opens the cached progressive MP4 header for the selected tracks, generating it first if there
+  /// is none or it is outdated. The cache file holds the header, followed by the size of the
+  /// complete MP4 file and the fingerprint of the metadata it was generated from.
+  /// On success sets hdrFd, headerSize and fileSize, and returns true.
+  bool OutMP4::openHeaderCache(){
+    if (hdrFd != -1){
+      close(hdrFd);
+      hdrFd = -1;
+    }
+    uint32_t fingerprint = 0;
+    std::string cacheFile = headerCacheFile(fingerprint);
+    if (!cacheFile.size()){return false;}
+    char trailer[12];
+    for (size_t attempt = 0; attempt < 2; ++attempt){
+      int fd = open(cacheFile.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd != -1){
+        struct stat st;
+        if (!fstat(fd, &st) && st.st_size > 12 && pread(fd, trailer, 12, st.st_size - 12) == 12 &&
+            Bit::btohl(trailer + 8) == fingerprint){
+          hdrFd = fd;
+          headerSize = st.st_size - 12;
+          fileSize = Bit::btohll(trailer);
+          return true;
+        }
+        close(fd);
+      }
+      if (attempt){break;}
+
+      // Generate the header into a temporary file, and move it into place when complete
+      std::stringstream tmpStr;
+      tmpStr << cacheFile << "." << getpid() << ".tmp";
+      std::string tmpName = tmpStr.str();
+      fd = open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+      if (fd == -1){
+        HIGH_MSG("Not caching MP4 header, could not create %s: %s", tmpName.c_str(), strerror(errno));
+        return false;
+      }
+      uint64_t timer = Util::getMicros();
+      bool ok = true;
+      HeaderWriter W([&](const char *data, size_t len){
+        while (ok && len){
+          ssize_t r = write(fd, data, len);
+          if (r < 0 && errno == EINTR){continue;}
+          if (r <= 0){
+            ok = false;
+            break;
+          }
+          data += r;
+          len -= r;
+        }
+      });
+      uint64_t size = 0;
+      if (!vodHeader(W, size)){ok = false;}
+      Bit::htobll(trailer, size);
+      Bit::htobl(trailer + 8, fingerprint);
+      W.append(trailer, 12);
+      W.flush();
+      if (close(fd) || !ok || rename(tmpName.c_str(), cacheFile.c_str())){
+        WARN_MSG("Could not write MP4 header cache %s: %s", cacheFile.c_str(), strerror(errno));
+        unlink(tmpName.c_str());
+        return false;
+      }
+      INFO_MSG("Cached %" PRIu64 " byte MP4 header in %s in %.3f ms", W.size() - 12, cacheFile.c_str(),
+               Util::getMicros(timer) / 1000.0);
+    }
+    return false;
   }
-  OutMP4::~OutMP4(){}
 
   void OutMP4::init(Util::Config *cfg, JSON::Value & capa) {
     HTTPOutput::init(cfg, capa);
@@ -362,38 +563,422 @@ namespace Mist{
     return res;
   }
 
-  class trackLookup{
-    public:
-      trackLookup(){
-        parts = 0;
+  /// Everything about a single track of a progressive MP4 header that must be known before the
+  /// header can be written: the small boxes, and the amount of entries in each sample table.
+  struct vodTrack{
+    size_t idx;
+    size_t firstPart;
+    size_t partCount;
+    size_t firstKey;
+    size_t keyCount;
+    size_t sttsCount;
+    size_t cttsCount; ///< Zero if no CTTS box is needed
+    bool isVideo;
+    bool isMeta;
+    std::string trakHead; ///< TKHD and EDTS boxes
+    std::string mdiaHead; ///< MDHD and HDLR boxes
+    std::string minfHead; ///< Media header and DINF boxes
+    std::string stsd;
+    uint64_t stblSize;
+    uint64_t trakSize;
+  };
+
+  /// Walks through the parts of all selected tracks in the order they are stored in the mdat box
+  /// and returns the total size of that data. If W is set, the chunk offsets of the given track
+  /// are written to it, as the entries of its STCO or CO64 box.
+  uint64_t OutMP4::mdatOffsets(HeaderWriter *W, size_t trackIdx, uint64_t dataOffset, bool useLargeBoxes){
+    std::map<size_t, size_t> lookup;
+    std::deque<DTSC::Parts> parts;
+    std::deque<uint64_t> lastms;
+    std::deque<bool> isMeta;
+    SortSet sortSet;
+    for (std::map<size_t, Comms::Users>::const_iterator subIt = userSelect.begin();
+         subIt != userSelect.end(); subIt++){
+      if (prevVidTrack != INVALID_TRACK_ID && subIt->first == prevVidTrack){continue;}
+      lookup[subIt->first] = parts.size();
+      parts.push_back(DTSC::Parts(M.parts(subIt->first)));
+      lastms.push_back(M.getLastms(subIt->first));
+      isMeta.push_back(trackDesc(subIt->first).type == TRACK_META);
+      keyPart temp;
+      temp.trackID = subIt->first;
+      DTSC::Keys keys = M.getKeys(subIt->first);
+      temp.time = keys.getTime(keys.getFirstValid());
+      temp.index = keys.getFirstPart(keys.getFirstValid());
+      temp.firstIndex = temp.index;
+      sortSet.insert(temp);
+    }
+    size_t entries = 0;
+    size_t maxEntries = 0;
+    if (W){
+      DTSC::Keys keys = M.getKeys(trackIdx);
+      maxEntries = keys.getTotalPartCount();
+    }
+    uint64_t dataSize = 0;
+    while (!sortSet.empty()){
+      stats();
+      keyPart temp = sortSet.begin();
+      sortSet.erase();
+      size_t t = lookup[temp.trackID];
+      if (W && temp.trackID == trackIdx && entries < maxEntries){
+        if (useLargeBoxes){
+          W->u64(dataOffset + dataSize);
+        }else{
+          W->u32(dataOffset + dataSize);
+        }
+        ++entries;
       }
-      ~trackLookup(){
-        if (parts){delete parts;}
+      dataSize += parts[t].getSize(temp.index);
+      if (isMeta[t]){dataSize += 2;}
+      // add next keyPart to sortSet, if we have not yet reached the end time
+      if (temp.time + parts[t].getDuration(temp.index) < lastms[t]){
+        temp.time += parts[t].getDuration(temp.index);
+        ++temp.index;
+        sortSet.insert(temp);
       }
-      void init(const Util::RelAccX & relParts, MP4::STCO box){
-        parts = new DTSC::Parts(relParts);
-        stcoBox = box;
+    }
+    // Parts that are never reached keep an offset of zero
+    for (; entries < maxEntries; ++entries){
+      if (useLargeBoxes){
+        W->u64(0);
+      }else{
+        W->u32(0);
       }
-      void init(const Util::RelAccX & relParts, MP4::CO64 box){
-        parts = new DTSC::Parts(relParts);
-        co64Box = box;
+    }
+    return dataSize;
+  }
+
+  /// Generates the header of a progressive (non-fragmented) MP4 file into W.
+  /// The header is written in order without building it in memory: the sizes of all boxes are
+  /// calculated first, after which the sample tables are written straight from the metadata.
+  /// Tables that fall outside the window of W are skipped, and generation stops once the end
+  /// of the window is reached. Sets size to the size of the complete file.
+  bool OutMP4::vodHeader(HeaderWriter & W, uint64_t &size){
+    uint32_t mainTrack = M.mainTrack();
+    if (mainTrack == INVALID_TRACK_ID){return false;}
+    size = 0;
+    // Determines whether the outputfile is larger than 4GB, in which case we need to use 64-bit
+    // boxes for offsets
+    bool useLargeBoxes = (estimateFileSize() > 0xFFFFFFFFull);
+
+    // MP4 Files always start with an FTYP box. Constructor sets default values
+    MP4::FTYP ftypBox;
+    if (sending3GP){
+      ftypBox.setMajorBrand("3gp6");
+      ftypBox.setCompatibleBrands("3gp6", 3);
+    }
+
+    uint64_t firstms = 0xFFFFFFFFFFFFFFull;
+    // Construct with duration of -1, as this is the default for fragmented
+    MP4::MVHD mvhdBox(0);
+    // Then override it when we are not sending a VoD asset
+    if (!M.getLive()){
+      // calculating longest duration
+      uint64_t lastms = 0;
+      for (std::map<size_t, Comms::Users>::const_iterator it = userSelect.begin();
+           it != userSelect.end(); it++){
+        if (prevVidTrack != INVALID_TRACK_ID && it->first == prevVidTrack){continue;}
+        lastms = std::max(lastms, M.getLastms(it->first));
+        firstms = std::min(firstms, M.getFirstms(it->first));
       }
-      DTSC::Parts * parts;
-      MP4::STCO stcoBox;
-      MP4::CO64 co64Box;
-  };
+      mvhdBox.setDuration(lastms - firstms);
+    }
+    // Set the trackid for the first "empty" track within the file.
+    mvhdBox.setTrackID(userSelect.size() + 1);
+    uint64_t moovSize = 8 + mvhdBox.boxedSize();
+
+    // First pass: build the small boxes and count the entries of the sample tables
+    std::deque<vodTrack> tracks;
+    for (std::map<size_t, Comms::Users>::const_iterator it = userSelect.begin(); it != userSelect.end(); it++){
+      if (prevVidTrack != INVALID_TRACK_ID && it->first == prevVidTrack){continue;}
+      tracks.push_back(vodTrack());
+      vodTrack & T = tracks.back();
+      DTSC::Parts parts(M.parts(it->first));
+      DTSC::Keys keys = M.getKeys(it->first);
+      uint64_t tDuration = M.getLastms(it->first) - M.getFirstms(it->first);
+      std::string tType = M.getType(it->first);
+      T.idx = it->first;
+      T.isVideo = (tType == "video");
+      T.isMeta = (tType == "meta");
+      T.partCount = keys.getTotalPartCount();
+      T.firstKey = keys.getFirstValid();
+      T.keyCount = keys.getEndValid() - T.firstKey;
+      T.firstPart = keys.getFirstPart(T.firstKey);
+
+      MP4::TKHD tkhdBox(M, it->first);
+      T.trakHead.assign(tkhdBox.asBox(), tkhdBox.boxedSize());
+
+      // This box is used for track durations as well as firstms synchronisation;
+      MP4::EDTS edtsBox;
+      MP4::ELST elstBox;
+      elstBox.setVersion(0);
+      elstBox.setFlags(0);
+      if (!M.getLive() && M.getFirstms(it->first) != firstms){
+        elstBox.setCount(2);
+
+        elstBox.setSegmentDuration(0, M.getFirstms(it->first) - firstms);
+        elstBox.setMediaTime(0, 0xFFFFFFFFull);
+        elstBox.setMediaRateInteger(0, 0);
+        elstBox.setMediaRateFraction(0, 0);
+
+        elstBox.setSegmentDuration(1, tDuration);
+        elstBox.setMediaTime(1, 0);
+        elstBox.setMediaRateInteger(1, 1);
+        elstBox.setMediaRateFraction(1, 0);
+      }else{
+        elstBox.setCount(1);
+        elstBox.setSegmentDuration(0, tDuration);
+        elstBox.setMediaTime(0, 0);
+        elstBox.setMediaRateInteger(0, 1);
+        elstBox.setMediaRateFraction(0, 0);
+      }
+      edtsBox.setContent(elstBox, 0);
+      T.trakHead.append(edtsBox.asBox(), edtsBox.boxedSize());
 
+      // Add the mandatory MDHD and HDLR boxes to the MDIA
+      MP4::MDHD mdhdBox(tDuration);
+      mdhdBox.setLanguage(M.getLang(it->first));
+      T.mdiaHead.assign(mdhdBox.asBox(), mdhdBox.boxedSize());
+      MP4::HDLR hdlrBox(tType, M.getTrackIdentifier(it->first));
+      T.mdiaHead.append(hdlrBox.asBox(), hdlrBox.boxedSize());
+
+      // Add a track-type specific box to the MINF box
+      if (tType == "video"){
+        MP4::VMHD vmhdBox(0, 1);
+        T.minfHead.assign(vmhdBox.asBox(), vmhdBox.boxedSize());
+      }else if (tType == "audio"){
+        MP4::SMHD smhdBox;
+        T.minfHead.assign(smhdBox.asBox(), smhdBox.boxedSize());
+      }else{
+        MP4::NMHD nmhdBox;
+        T.minfHead.assign(nmhdBox.asBox(), nmhdBox.boxedSize());
+      }
+
+      // Add the mandatory DREF (dataReference) box
+      MP4::DINF dinfBox;
+      MP4::DREF drefBox;
+      dinfBox.setContent(drefBox, 0);
+      T.minfHead.append(dinfBox.asBox(), dinfBox.boxedSize());
+
+      MP4::STSD stsdBox(0);
+      if (tType == "video"){
+        MP4::VisualSampleEntry sampleEntry(M, it->first);
+        if (M.getEncryption(it->first) != ""){
+          MP4::SINF sinfBox;
+
+          MP4::FRMA frmaBox(sampleEntry.getCodec());
+          sinfBox.setEntry(frmaBox, 0);
+
+          sampleEntry.setCodec("encv");
+
+          MP4::SCHM schmBox; // Defaults to CENC values
+          sinfBox.setEntry(schmBox, 1);
+
+          MP4::SCHI schiBox;
+
+          MP4::TENC tencBox;
+          std::string encryption = M.getEncryption(it->first);
+          std::string kid = encryption.substr(encryption.find('/') + 1,
+                                              encryption.find(':') - 1 - encryption.find('/'));
+          tencBox.setDefaultKID(Encodings::Hex::decode(kid));
+
+          schiBox.setContent(tencBox);
+          sinfBox.setEntry(schiBox, 2);
+          sampleEntry.setBoxEntry(2, sinfBox);
+        }
+        stsdBox.setEntry(sampleEntry, 0);
+      }else if (tType == "audio"){
+        MP4::AudioSampleEntry sampleEntry(M, it->first);
+        stsdBox.setEntry(sampleEntry, 0);
+      }else if (tType == "meta"){
+        MP4::TextSampleEntry sampleEntry(M, it->first);
+
+        MP4::FontTableBox ftab;
+        sampleEntry.setFontTableBox(ftab);
+        stsdBox.setEntry(sampleEntry, 0);
+      }
+      T.stsd.assign(stsdBox.asBox(), stsdBox.boxedSize());
+
+      // Count the entries of the STTS and CTTS boxes, and the size of the samples
+      T.sttsCount = 0;
+      T.cttsCount = 0;
+      uint32_t prevDur = 0;
+      int32_t prevOffset = 0;
+      for (size_t part = 0; part < T.partCount; ++part){
+        uint64_t partDur = parts.getDuration(T.firstPart + part);
+        int64_t partOffset = parts.getOffset(T.firstPart + part);
+        if (!part || partDur != prevDur){
+          ++T.sttsCount;
+          prevDur = partDur;
+        }
+        if (!part || partOffset != prevOffset){
+          ++T.cttsCount;
+          prevOffset = partOffset;
+        }
+        size += parts.getSize(T.firstPart + part) + (T.isMeta ? 2 : 0);
+      }
+      // Only add the CTTS box if any sample has a non-zero offset
+      if (T.cttsCount == 1 && !prevOffset){T.cttsCount = 0;}
+
+      T.stblSize = 8 + T.stsd.size();
+      if (T.cttsCount){T.stblSize += 16 + 8 * T.cttsCount;} // CTTS
+      T.stblSize += 16 + 8 * T.sttsCount;                    // STTS
+      T.stblSize += 20 + 4 * T.partCount;                    // STSZ
+      if (T.isVideo){T.stblSize += 16 + 4 * T.keyCount;}     // STSS
+      T.stblSize += 28;                                      // STSC, with a single entry
+      T.stblSize += 16 + T.partCount * (useLargeBoxes ? 8 : 4); // STCO or CO64
+      T.trakSize = 8 + T.trakHead.size() + 8 + T.mdiaHead.size() + 8 + T.minfHead.size() + T.stblSize;
+      moovSize += T.trakSize;
+    }
+
+    // initial offset length ftyp, length moov + 8
+    uint64_t dataOffset = ftypBox.boxedSize() + moovSize + 8;
+    size += dataOffset;
+
+    // Second pass: write everything
+    W.append(ftypBox.asBox(), ftypBox.boxedSize());
+    W.box(moovSize, "moov");
+    W.append(mvhdBox.asBox(), mvhdBox.boxedSize());
+    uint64_t dataSize = 0;
+    bool haveDataSize = false;
+    for (std::deque<vodTrack>::iterator it = tracks.begin(); it != tracks.end(); ++it){
+      vodTrack & T = *it;
+      if (W.done()){return true;}
+      if (!W.wants(T.trakSize)){
+        W.skip(T.trakSize);
+        continue;
+      }
+      W.box(T.trakSize, "trak");
+      W.append(T.trakHead.data(), T.trakHead.size());
+      W.box(T.trakSize - 8 - T.trakHead.size(), "mdia");
+      W.append(T.mdiaHead.data(), T.mdiaHead.size());
+      W.box(8 + T.minfHead.size() + T.stblSize, "minf");
+      W.append(T.minfHead.data(), T.minfHead.size());
+      W.box(T.stblSize, "stbl");
+      W.append(T.stsd.data(), T.stsd.size());
+
+      DTSC::Parts parts(M.parts(T.idx));
+      if (T.cttsCount){
+        uint64_t boxSize = 16 + 8 * T.cttsCount;
+        if (W.wants(boxSize)){
+          W.box(boxSize, "ctts");
+          W.u32(0);
+          W.u32(T.cttsCount);
+          uint32_t count = 0;
+          int32_t prevOffset = parts.getOffset(T.firstPart);
+          for (size_t part = 0; part < T.partCount; ++part){
+            int64_t partOffset = parts.getOffset(T.firstPart + part);
+            if (partOffset != prevOffset){
+              W.u32(count);
+              W.u32(prevOffset);
+              count = 0;
+              prevOffset = partOffset;
+            }
+            ++count;
+          }
+          W.u32(count);
+          W.u32(prevOffset);
+        }else{
+          W.skip(boxSize);
+        }
+      }
+
+      uint64_t boxSize = 16 + 8 * T.sttsCount;
+      if (W.wants(boxSize)){
+        W.box(boxSize, "stts");
+        W.u32(0);
+        W.u32(T.sttsCount);
+        uint32_t count = 0;
+        uint32_t prevDur = parts.getDuration(T.firstPart);
+        for (size_t part = 0; part < T.partCount; ++part){
+          uint64_t partDur = parts.getDuration(T.firstPart + part);
+          if (partDur != prevDur){
+            W.u32(count);
+            W.u32(prevDur);
+            count = 0;
+            prevDur = partDur;
+          }
+          ++count;
+        }
+        if (T.partCount){
+          W.u32(count);
+          W.u32(prevDur);
+        }
+      }else{
+        W.skip(boxSize);
+      }
+
+      boxSize = 20 + 4 * T.partCount;
+      if (W.wants(boxSize)){
+        W.box(boxSize, "stsz");
+        W.u32(0);
+        W.u32(0);
+        W.u32(T.partCount);
+        for (size_t part = 0; part < T.partCount; ++part){
+          W.u32(parts.getSize(T.firstPart + part) + (T.isMeta ? 2 : 0));
+        }
+      }else{
+        W.skip(boxSize);
+      }
+
+      if (T.isVideo){
+        boxSize = 16 + 4 * T.keyCount;
+        if (W.wants(boxSize)){
+          DTSC::Keys keys = M.getKeys(T.idx);
+          W.box(boxSize, "stss");
+          W.u32(0);
+          W.u32(T.keyCount);
+          size_t tmpCount = 0;
+          for (size_t i = T.firstKey; i < T.firstKey + T.keyCount; ++i){
+            W.u32(tmpCount + 1);
+            tmpCount += keys.getParts(i);
+          }
+        }else{
+          W.skip(boxSize);
+        }
+      }
+
+      // STSC box with a single entry: every chunk holds one sample
+      W.box(28, "stsc");
+      W.u32(0);
+      W.u32(1);
+      W.u32(1);
+      W.u32(1);
+      W.u32(1);
+
+      boxSize = 16 + T.partCount * (useLargeBoxes ? 8 : 4);
+      if (W.wants(boxSize)){
+        W.box(boxSize, useLargeBoxes ? "co64" : "stco");
+        W.u32(0);
+        W.u32(T.partCount);
+        dataSize = mdatOffsets(&W, T.idx, dataOffset, useLargeBoxes);
+        haveDataSize = true;
+      }else{
+        W.skip(boxSize);
+      }
+    }
+
+    if (W.wants(8)){
+      if (!haveDataSize){dataSize = mdatOffsets(0, 0, dataOffset, useLargeBoxes);}
+      ///\todo Update for when mdat box exceeds 4GB
+      uint64_t mdatSize = dataSize + 8; //+8 for mp4 header
+      W.box(mdatSize < 0xFFFFFFFF ? mdatSize : 0, "mdat");
+    }else{
+      W.skip(8);
+    }
+    return true;
+  }
 
   bool OutMP4::mp4Header(Util::ResizeablePointer & headOut, uint64_t &size, int fragmented){
+    if (!fragmented){
+      HeaderWriter W([&headOut](const char *data, size_t len){headOut.append(data, len);});
+      if (!vodHeader(W, size)){return false;}
+      W.flush();
+      return true;
+    }
     uint32_t mainTrack = M.mainTrack();
     if (mainTrack == INVALID_TRACK_ID){return false;}
     // Clear size if it was set before the function was called, just in case
     size = 0;
-    // Determines whether the outputfile is larger than 4GB, in which case we need to use 64-bit
-    // boxes for offsets
-    bool useLargeBoxes = !fragmented && (estimateFileSize() > 0xFFFFFFFFull);
-    // Keeps track of the total size of the mdat box
-    uint64_t mdatSize = 0;
 
     // MP4 Files always start with an FTYP box. Constructor sets default values
     MP4::FTYP ftypBox;
@@ -430,9 +1015,6 @@ namespace Mist{
 
     for (std::map<size_t, Comms::Users>::const_iterator it = userSelect.begin(); it != userSelect.end(); it++){
       if (prevVidTrack != INVALID_TRACK_ID && it->first == prevVidTrack){continue;}
-      DTSC::Parts parts(M.parts(it->first));
-      DTSC::Keys keys = M.getKeys(it->first);
-      size_t partCount = keys.getTotalPartCount();
       uint64_t tDuration = M.getLastms(it->first) - M.getFirstms(it->first);
       std::string tType = M.getType(it->first);
 
@@ -462,7 +1044,7 @@ namespace Mist{
         elstBox.setMediaRateFraction(1, 0);
       }else{
         elstBox.setCount(1);
-        elstBox.setSegmentDuration(0, fragmented ? 0 : tDuration);
+        elstBox.setSegmentDuration(0, 0);
         elstBox.setMediaTime(0, 0);
         elstBox.setMediaRateInteger(0, 1);
         elstBox.setMediaRateFraction(0, 0);
@@ -474,8 +1056,7 @@ namespace Mist{
       size_t mdiaOffset = 0;
 
       // Add the mandatory MDHD and HDLR boxes to the MDIA
-      MP4::MDHD mdhdBox(tDuration);
-      if (fragmented){mdhdBox.setDuration(0);}
+      MP4::MDHD mdhdBox(0);
       mdhdBox.setLanguage(M.getLang(it->first));
       mdiaBox.setContent(mdhdBox, mdiaOffset++);
       MP4::HDLR hdlrBox(tType, M.getTrackIdentifier(it->first));
@@ -546,141 +1127,16 @@ namespace Mist{
       size_t stblOffset = 0;
       stblBox.setContent(stsdBox, stblOffset++);
 
-      // Add STTS Box
-      // note: STTS is empty when fragmented
+      // The sample tables are empty, as all samples are described by the fragments
       MP4::STTS sttsBox(0);
-      // Add STSZ Box
-      // note: STSZ is empty when fragmented
-      MP4::STSZ stszBox(0);
-      if (!fragmented){
-
-        MP4::CTTS cttsBox;
-        cttsBox.setVersion(0);
-
-        size_t firstPart = keys.getFirstPart(keys.getFirstValid());
-
-        size_t totalEntries = 0;
-        MP4::CTTSEntry tmpEntry;
-        tmpEntry.sampleCount = 0;
-        tmpEntry.sampleOffset = parts.getOffset(firstPart);
-
-        size_t sttsCounter = 0;
-        MP4::STTSEntry sttsEntry;
-        sttsEntry.sampleCount = 0;
-        sttsEntry.sampleDelta = parts.getSize(firstPart);
-
-        //Calculate amount of entries for CTTS/STTS boxes so we can set the last entry first
-        //Our MP4 box implementations dynamically reallocate to fit the data you put inside them,
-        //Which means setting the last entry first prevents constant reallocs and slowness.
-        for (size_t part = 0; part < partCount; ++part){
-          uint64_t partOffset = parts.getOffset(firstPart + part);
-          if (partOffset != tmpEntry.sampleOffset){
-            ++totalEntries;
-            tmpEntry.sampleOffset = partOffset;
-          }
-          uint64_t partDur = parts.getDuration(firstPart + part);
-          if (partDur != sttsEntry.sampleDelta){
-            ++sttsCounter;
-            sttsEntry.sampleDelta = partDur;
-          }
-        }
-
-        //Set temporary last entry for CTTS box
-        bool hasCTTS = (totalEntries || tmpEntry.sampleOffset);
-        if (hasCTTS){
-          cttsBox.setCTTSEntry(tmpEntry, totalEntries);
-        }
-        //Set temporary last entry for STTS box
-        sttsBox.setSTTSEntry(sttsEntry, sttsCounter-1);
-        //Set temporary last entry for STSZ box
-        stszBox.setEntrySize(0, partCount - 1);
-
-        //All set! Now we can do everything for real.
-        //Reset the values we just used, first.
-        totalEntries = 0;
-        tmpEntry.sampleCount = 0;
-        tmpEntry.sampleOffset = parts.getOffset(firstPart);
-        sttsCounter = 0;
-        sttsEntry.sampleCount = 0;
-        sttsEntry.sampleDelta = parts.getDuration(firstPart);
-        
-        bool isMeta = (tType == "meta");
-        for (size_t part = 0; part < partCount; ++part){
-          uint64_t partDur = parts.getDuration(firstPart + part);
-          if (sttsEntry.sampleDelta != partDur){
-            // If the duration of this and previous part differ, write current values and reset
-            sttsBox.setSTTSEntry(sttsEntry, sttsCounter++);
-            sttsEntry.sampleCount = 0;
-            sttsEntry.sampleDelta = partDur;
-          }
-          sttsEntry.sampleCount++;
-
-          uint64_t partSize = parts.getSize(firstPart + part)+(isMeta?2:0);
-          stszBox.setEntrySize(partSize, part);
-          size += partSize;
-          
-          if (hasCTTS){
-            uint64_t partOffset = parts.getOffset(firstPart + part);
-            if (partOffset != tmpEntry.sampleOffset){
-              // If the offset of this and previous part differ, write current values and reset
-              cttsBox.setCTTSEntry(tmpEntry, totalEntries++);
-              tmpEntry.sampleCount = 0;
-              tmpEntry.sampleOffset = partOffset;
-            }
-            tmpEntry.sampleCount++;
-          }
-        }
-        //Write last entry for STTS
-        sttsBox.setSTTSEntry(sttsEntry, sttsCounter);
-
-        //Only add the CTTS box to the STBL box if we had any entries in it
-        if (hasCTTS){
-          //Write last entry for CTTS
-          cttsBox.setCTTSEntry(tmpEntry, totalEntries);
-          stblBox.setContent(cttsBox, stblOffset++);
-        }
-      }
       stblBox.setContent(sttsBox, stblOffset++);
+      MP4::STSZ stszBox(0);
       stblBox.setContent(stszBox, stblOffset++);
-
-      // Add STSS Box IF type is video and we are not fragmented
-      if (tType == "video" && !fragmented){
-        MP4::STSS stssBox(0);
-        size_t tmpCount = 0;
-        size_t firstKey = keys.getFirstValid();
-        size_t endKey = keys.getEndValid();
-        for (size_t i = firstKey; i < endKey; ++i){
-          stssBox.setSampleNumber(tmpCount + 1, i-firstKey);
-          tmpCount += keys.getParts(i);
-        }
-        stblBox.setContent(stssBox, stblOffset++);
-      }
-
-      // Add STSC Box
-      // note: STSC is empty when fragmented
       MP4::STSC stscBox(0);
-      if (!fragmented){
-        MP4::STSCEntry stscEntry(1, 1, 1);
-        stscBox.setSTSCEntry(stscEntry, 0);
-      }
       stblBox.setContent(stscBox, stblOffset++);
-
-      // Create STCO Box (either stco or co64)
-      // note: 64bit boxes will never be used in fragmented
-      // note: Inserting empty values on purpose here, will be fixed later.
-      if (useLargeBoxes){
-        MP4::CO64 CO64Box;
-        CO64Box.setChunkOffset(0, partCount - 1);
-        stblBox.setContent(CO64Box, stblOffset++);
-      }else{
-        MP4::STCO stcoBox(0);
-        if (fragmented){
-          stcoBox.setEntryCount(0);
-        }else{
-          stcoBox.setChunkOffset(0, partCount - 1);
-        }
-        stblBox.setContent(stcoBox, stblOffset++);
-      }
+      MP4::STCO stcoBox(0);
+      stcoBox.setEntryCount(0);
+      stblBox.setContent(stcoBox, stblOffset++);
 
       minfBox.setContent(stblBox, minfOffset++);
 
@@ -691,109 +1147,38 @@ namespace Mist{
       moovBox.setContent(trakBox, moovOffset++);
     }
 
-    if (fragmented){
-      MP4::MVEX mvexBox;
-      size_t curBox = 0;
-      MP4::MEHD mehdBox;
-      mehdBox.setFragmentDuration(0);
-
-      mvexBox.setContent(mehdBox, curBox++);
-      for (std::map<size_t, Comms::Users>::const_iterator it = userSelect.begin();
-           it != userSelect.end(); it++){
-        if (prevVidTrack != INVALID_TRACK_ID && it->first == prevVidTrack){continue;}
-        MP4::TREX trexBox(it->first + 1);
-        trexBox.setDefaultSampleDuration(1000);
-        mvexBox.setContent(trexBox, curBox++);
-      }
-      moovBox.setContent(mvexBox, moovOffset++);
-      for (std::map<size_t, Comms::Users>::const_iterator it = userSelect.begin();
-           it != userSelect.end(); it++){
-        if (prevVidTrack != INVALID_TRACK_ID && it->first == prevVidTrack){continue;}
-        if (M.getEncryption(it->first) != ""){
-          MP4::PSSH psshBox;
-          psshBox.setSystemIDHex(Encodings::Hex::decode("9a04f07998404286ab92e65be0885f95"));
-          psshBox.setData(Encodings::Base64::decode(protectionHeader(it->first)));
-          moovBox.setContent(psshBox, moovOffset++);
-          MP4::PSSH widevineBox;
-          widevineBox.setSystemIDHex(Encodings::Hex::decode("edef8ba979d64acea3c827dcd51d21ed"));
-          widevineBox.setData(Encodings::Base64::decode(M.getWidevine(it->first)));
-          moovBox.setContent(widevineBox, moovOffset++);
-        }
-      }
-    }else{// if we are making a non fragmented MP4 and there are parts
-      // initial offset length ftyp, length moov + 8
-      uint64_t dataOffset = ftypBox.boxedSize() + moovBox.boxedSize() + 8;
-
-
-      QuickMap<trackLookup> trackMap;
-
-      std::deque<MP4::TRAK> trak = moovBox.getChildren<MP4::TRAK>();
-      for (std::deque<MP4::TRAK>::iterator trakIt = trak.begin(); trakIt != trak.end(); trakIt++){
-        size_t idx = trakIt->getChild<MP4::TKHD>().getTrackID() - 1;
-        MP4::STBL stblBox = trakIt->getChild<MP4::MDIA>().getChild<MP4::MINF>().getChild<MP4::STBL>();
-        trackMap.insert(idx, trackLookup());
-        if (useLargeBoxes){
-          trackMap.get(idx).init(M.parts(idx), stblBox.getChild<MP4::CO64>());
-        }else{
-          trackMap.get(idx).init(M.parts(idx), stblBox.getChild<MP4::STCO>());
-        }
-      }
+    MP4::MVEX mvexBox;
+    size_t curBox = 0;
+    MP4::MEHD mehdBox;
+    mehdBox.setFragmentDuration(0);
 
-      // inserting right values in the STCO box header
-      // total = 0;
-      // Keep track of the current size of the data within the mdat
-      uint64_t dataSize = 0;
-      // Current values are actual byte offset without header-sized offset
-      SortSet sortSet; // filling sortset for interleaving parts
-      for (std::map<size_t, Comms::Users>::const_iterator subIt = userSelect.begin();
-           subIt != userSelect.end(); subIt++){
-        if (prevVidTrack != INVALID_TRACK_ID && subIt->first == prevVidTrack){continue;}
-        keyPart temp;
-        temp.trackID = subIt->first;
-
-        DTSC::Keys keys = M.getKeys(subIt->first);
-        temp.time = keys.getTime(keys.getFirstValid());
-        temp.index = keys.getFirstPart(keys.getFirstValid());
-        temp.firstIndex = temp.index;
-        sortSet.insert(temp);
-      }
-      while (!sortSet.empty()){
-        stats();
-        keyPart temp = sortSet.begin();
-        trackLookup & tL = trackMap.get(temp.trackID);
-        sortSet.erase();
-
-        DTSC::Parts & parts = *tL.parts;
-        // setting the right STCO size in the STCO box
-        if (useLargeBoxes){// Re-using the previously defined boolean for speedup
-          tL.co64Box.setChunkOffset(dataOffset + dataSize, temp.index - temp.firstIndex);
-        }else{
-          tL.stcoBox.setChunkOffset(dataOffset + dataSize, temp.index - temp.firstIndex);
-        }
-        dataSize += parts.getSize(temp.index);
-
-        if (M.getType(temp.trackID) == "meta"){dataSize += 2;}
-        // add next keyPart to sortSet, if we have not yet reached the end time
-        if (temp.time + parts.getDuration(temp.index) < M.getLastms(temp.trackID)){
-          temp.time += parts.getDuration(temp.index);
-          ++temp.index;
-          sortSet.insert(temp);
-        }
+    mvexBox.setContent(mehdBox, curBox++);
+    for (std::map<size_t, Comms::Users>::const_iterator it = userSelect.begin();
+         it != userSelect.end(); it++){
+      if (prevVidTrack != INVALID_TRACK_ID && it->first == prevVidTrack){continue;}
+      MP4::TREX trexBox(it->first + 1);
+      trexBox.setDefaultSampleDuration(1000);
+      mvexBox.setContent(trexBox, curBox++);
+    }
+    moovBox.setContent(mvexBox, moovOffset++);
+    for (std::map<size_t, Comms::Users>::const_iterator it = userSelect.begin();
+         it != userSelect.end(); it++){
+      if (prevVidTrack != INVALID_TRACK_ID && it->first == prevVidTrack){continue;}
+      if (M.getEncryption(it->first) != ""){
+        MP4::PSSH psshBox;
+        psshBox.setSystemIDHex(Encodings::Hex::decode("9a04f07998404286ab92e65be0885f95"));
+        psshBox.setData(Encodings::Base64::decode(protectionHeader(it->first)));
+        moovBox.setContent(psshBox, moovOffset++);
+        MP4::PSSH widevineBox;
+        widevineBox.setSystemIDHex(Encodings::Hex::decode("edef8ba979d64acea3c827dcd51d21ed"));
+        widevineBox.setData(Encodings::Base64::decode(M.getWidevine(it->first)));
+        moovBox.setContent(widevineBox, moovOffset++);
       }
-
-      ///\todo Update for when mdat box exceeds 4GB
-      mdatSize = dataSize + 8; //+8 for mp4 header
     }
-    headOut.append(moovBox.asBox(), moovBox.boxedSize());
-
-    if (!fragmented){// if we are making a non fragmented MP4 and there are parts
-      char mdatHeader[8] ={0x00, 0x00, 0x00, 0x00, 'm', 'd', 'a', 't'};
 
-      if (mdatSize < 0xFFFFFFFF){Bit::htobl(mdatHeader, mdatSize);}
-      headOut.append(mdatHeader, 8);
-    }
+    headOut.append(moovBox.asBox(), moovBox.boxedSize());
     size += headOut.size();
-    if (fragmented){realBaseOffset = headOut.size();}
+    realBaseOffset = headOut.size();
     return true;
   }
 
@@ -813,7 +1198,7 @@ namespace Mist{
       uint64_t partSize = parts.getSize(temp.index);
 
       // add 2 bytes in front of the subtitle that contains the length of the subtitle.
-      if (M.getCodec(temp.trackID) == "subtitle"){partSize += 2;}
+      if (trackDesc(temp.trackID).codec == CODEC_SUBTITLE){partSize += 2;}
 
       // record where we are
       seekPoint = temp.time;
@@ -892,7 +1277,7 @@ namespace Mist{
     tfhdBox.setTrackID(track + 1);
     tfhdBox.setDefaultSampleDuration(444);
     tfhdBox.setDefaultSampleSize(444);
-    tfhdBox.setDefaultSampleFlags((M.getType(track) == "video") ? (MP4::noIPicture | MP4::noKeySample)
+    tfhdBox.setDefaultSampleFlags((trackDesc(track).type == TRACK_VIDEO) ? (MP4::noIPicture | MP4::noKeySample)
                                   : (MP4::isIPicture | MP4::isKeySample));
     tfhdBox.setSampleDescriptionIndex(1);
     trafBox.setContent(tfhdBox, 0);
@@ -1006,10 +1391,11 @@ namespace Mist{
       // Fun fact! Firefox cares about the ordering here.
       // It doesn't care about the order or track IDs in the header.
       // But - the first TRAF must be a video TRAF, if video is present.
-      if (M.getType(subIt->first) == "video"){
+      TrackType type = trackDesc(subIt->first).type;
+      if (type == TRACK_VIDEO){
         sortedTracks.push_front(subIt->first);
       }else{
-        if (!hasAudio && M.getType(subIt->first) == "audio"){hasAudio = true;}
+        if (!hasAudio && type == TRACK_AUDIO){hasAudio = true;}
         sortedTracks.push_back(subIt->first);
       }
     }
@@ -1073,7 +1459,7 @@ namespace Mist{
           trunBox.setDataOffset(trunIt->byteOffset);
 
           bool isKeyFrame = keyParts.count(trunIt->index);
-          if (M.getType(trunIt->trackID) != "video"){
+          if (trackDesc(trunIt->trackID).type != TRACK_VIDEO){
             isKeyFrame = true;
           }
           trunBox.setFirstSampleFlags(isKeyFrame ? (MP4::isKeySample | MP4::isIPicture) : (MP4::noKeySample | MP4::noIPicture));
@@ -1109,11 +1495,12 @@ namespace Mist{
 
     realBaseOffset += (moofBox.boxedSize() + mdatSize);
 
-    H.Chunkify(moofBox.asBox(), moofBox.boxedSize(), myConn);
+    // Kept until sendNext sends it together with the first sample of this fragment
+    fragHeader.assign(moofBox.asBox(), moofBox.boxedSize());
 
     char mdatHeader[8] ={0x00, 0x00, 0x00, 0x00, 'm', 'd', 'a', 't'};
     Bit::htobl(mdatHeader, mdatSize);
-    H.Chunkify(mdatHeader, 8, myConn);
+    fragHeader.append(mdatHeader, 8);
   }
 
   void OutMP4::respondHTTP(const HTTP::Parser & req, bool headersOnly){
@@ -1138,7 +1525,7 @@ namespace Mist{
     sending3GP = (req.url.find(".3gp") != std::string::npos);
 
     fileSize = 0;
-    headerSize = mp4HeaderSize(fileSize, M.getLive());
+    if (!openHeaderCache()){headerSize = mp4HeaderSize(fileSize, M.getLive());}
 
     seekPoint = Output::startTime();
     // for live we use fragmented mode
@@ -1199,16 +1586,32 @@ namespace Mist{
     if (byteStart < headerSize){
       // For storing the header.
       if ((!startTime && endTime == 0xffffffffffffffffull) || (endTime == 0)){
-        Util::ResizeablePointer headerData;
-        if (!mp4Header(headerData, fileSize, M.getLive())){
-          FAIL_MSG("Could not generate MP4 header!");
-          H.SetBody("Error while generating MP4 header");
-          H.SendResponse("500", "Error generating MP4 header", myConn);
-          return;
+        uint64_t headerEnd = std::min(headerSize, byteEnd);
+        if (hdrFd != -1){
+          H.ChunkifyFile(hdrFd, byteStart, headerEnd - byteStart, myConn);
+        }else if (!M.getLive()){
+          // Not cached; generate only the requested part of the header, straight into the socket
+          HeaderWriter W([&](const char *data, size_t len){H.Chunkify(data, len, myConn);}, byteStart, headerEnd);
+          uint64_t size = 0;
+          if (!vodHeader(W, size)){
+            FAIL_MSG("Could not generate MP4 header!");
+            H.SetBody("Error while generating MP4 header");
+            H.SendResponse("500", "Error generating MP4 header", myConn);
+            return;
+          }
+          W.flush();
+        }else{
+          Util::ResizeablePointer headerData;
+          if (!mp4Header(headerData, fileSize, M.getLive())){
+            FAIL_MSG("Could not generate MP4 header!");
+            H.SetBody("Error while generating MP4 header");
+            H.SendResponse("500", "Error generating MP4 header", myConn);
+            return;
+          }
+          H.Chunkify(headerData + byteStart, headerEnd - byteStart, myConn);
         }
-        INFO_MSG("Have %zu bytes, sending %" PRIu64 " bytes", headerData.size(), std::min(headerSize, byteEnd) - byteStart);
-        H.Chunkify(headerData + byteStart, std::min(headerSize, byteEnd) - byteStart, myConn);
-        leftOver -= std::min(headerSize, byteEnd) - byteStart;
+        HIGH_MSG("Sent %" PRIu64 " of %" PRIu64 " header bytes", headerEnd - byteStart, headerSize);
+        leftOver -= headerEnd - byteStart;
       }
     }
     currPos += headerSize; // we're now guaranteed to be past the header point, no matter what
@@ -1282,6 +1685,10 @@ namespace Mist{
       if (webSock) {
         /* create packet */
         webBuf.append(dataPointer, len);
+      }else if (fragHeader.size()){
+        struct iovec vec[2] = {{fragHeader, fragHeader.size()}, {dataPointer, len}};
+        H.ChunkifyVec(vec, 2, myConn);
+        fragHeader.truncate(0);
       }else{
         H.Chunkify(dataPointer, len, myConn);
       }
@@ -1322,7 +1729,7 @@ namespace Mist{
     }
 
     // prepend subtitle text with 2 bytes datalength
-    if (M.getCodec(firstKeyPart.trackID) == "subtitle"){
+    if (trackDesc(firstKeyPart.trackID).codec == CODEC_SUBTITLE){
       char pre[2];
       Bit::htobs(pre, len);
       subtitle.assign(pre, 2);
@@ -1331,17 +1738,37 @@ namespace Mist{
       len += 2;
     }
 
+    // Samples that are stored as-is in the source file are sent from there, without copying
+    uint64_t bpos = 0;
+    if (!subtitle.size()){
+      bpos = thisPacket.getInt("bpos");
+      if (!canSendFromSource(dataPointer, len, bpos)){bpos = 0;}
+    }
+
     if (isRecording()){
-      myConn.SendNow(dataPointer, len);
+      if (bpos){
+        myConn.SendFile(srcFd, bpos, len);
+      }else{
+        myConn.SendNow(dataPointer, len);
+      }
     }else{
       if (currPos >= byteStart){
-        H.Chunkify(dataPointer, std::min(leftOver, (int64_t)len), myConn);
+        if (bpos){
+          H.ChunkifyFile(srcFd, bpos, std::min(leftOver, (int64_t)len), myConn);
+        }else{
+          H.Chunkify(dataPointer, std::min(leftOver, (int64_t)len), myConn);
+        }
 
         leftOver -= len;
       }else{
         if (currPos + len > byteStart){
-          H.Chunkify(dataPointer + (byteStart - currPos),
-                     std::min((uint64_t)leftOver, (len - (byteStart - currPos))), myConn);
+          if (bpos){
+            H.ChunkifyFile(srcFd, bpos + (byteStart - currPos),
+                           std::min((uint64_t)leftOver, (len - (byteStart - currPos))), myConn);
+          }else{
+            H.Chunkify(dataPointer + (byteStart - currPos),
+                       std::min((uint64_t)leftOver, (len - (byteStart - currPos))), myConn);
+          }
           leftOver -= len - (byteStart - currPos);
         }
       }
@@ -1396,11 +1823,20 @@ namespace Mist{
 
     // If we're doing piped output or output to file, we still need to write the actual header here...
     if (!streamName.size() || isFileTarget()){
-      Util::ResizeablePointer headerData;
-      if (!mp4Header(headerData, fileSize, M.getLive())){
-        FAIL_MSG("Could not generate MP4 header!");
+      if (!M.getLive()){
+        HeaderWriter W([&](const char *data, size_t len){myConn.SendNow(data, len);});
+        if (!vodHeader(W, fileSize)){
+          FAIL_MSG("Could not generate MP4 header!");
+        }else{
+          W.flush();
+        }
       }else{
-        myConn.SendNow(headerData, headerData.size());
+        Util::ResizeablePointer headerData;
+        if (!mp4Header(headerData, fileSize, M.getLive())){
+          FAIL_MSG("Could not generate MP4 header!");
+        }else{
+          myConn.SendNow(headerData, headerData.size());
+        }
       }
       seekPoint = Output::startTime();
     }
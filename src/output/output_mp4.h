@@ -2,6 +2,8 @@
 
 #include <mist/http_parser.h>
 
+#include <functional>
+
 namespace Mist{
   class keyPart{
   public:
@@ -37,45 +39,30 @@ namespace Mist{
     void insert(const keyPart & part);
   };
 
-  /// Class that implements a tiny subset of std::map, optimized for speed for our type of usage.
-  template <class T> class QuickMap{
-  private:
-    Util::ResizeablePointer ptr;
-    size_t entries;
+  /// Collects the bytes of a generated MP4 header and passes them on to a sink in large blocks.
+  /// Only the bytes within the window [start, end) of the complete header are kept, so a header
+  /// can be streamed straight to its destination, also for range requests, without building it
+  /// in memory first.
+  class HeaderWriter{
   public:
-    QuickMap(){
-      entries = 0;
-    }
-    ~QuickMap(){
-      size_t len = 8 + sizeof(T*);
-      for (size_t i = 0; i < entries; ++i){
-        delete *(T**)(void*)(ptr+len*i+8);
-      }
-    }
-    T & get(uint64_t idx){
-      static T blank;
-      size_t len = 8 + sizeof(T*);
-      for (size_t i = 0; i < entries; ++i){
-        if (*((uint64_t*)(void*)(ptr+len*i)) == idx){
-          return **(T**)(void*)(ptr+len*i+8);
-        }
-      }
-      return blank;
-    }
-    void insert(uint64_t idx, T elem){
-      size_t i = 0;
-      size_t len = 8 + sizeof(T*);
-      for (i = 0; i < entries; ++i){
-        if (*((uint64_t*)(void*)(ptr+len*i)) == idx){
-          *(T**)(void*)(ptr+len*i+8) = new T(elem);
-          return;
-        }
-      }
-      entries = i+1;
-      ptr.allocate(len*entries);
-      *(T**)(void*)(ptr+len*i+8) = new T(elem);
-      *((uint64_t*)(void*)(ptr+len*i)) = idx;
-    }
+    HeaderWriter(std::function<void(const char *, size_t)> _sink, uint64_t _start = 0,
+                 uint64_t _end = 0xFFFFFFFFFFFFFFFFull);
+    void append(const char *data, size_t len);
+    void box(uint32_t size, const char *type);
+    void u32(uint32_t val);
+    void u64(uint64_t val);
+    bool wants(uint64_t len) const;
+    void skip(uint64_t len);
+    bool done() const;
+    uint64_t size() const;
+    void flush();
+
+  private:
+    std::function<void(const char *, size_t)> sink;
+    Util::ResizeablePointer buf;
+    uint64_t start;
+    uint64_t end;
+    uint64_t pos;
   };
 
   class OutMP4 : public HTTPOutput{
@@ -87,6 +74,7 @@ namespace Mist{
 
     uint64_t mp4HeaderSize(uint64_t &fileSize, int fragmented = 0) const;
     bool mp4Header(Util::ResizeablePointer & headOut, uint64_t &size, int fragmented = 0);
+    bool vodHeader(HeaderWriter & W, uint64_t &size);
 
     uint64_t mp4moofSize(uint64_t startFragmentTime, uint64_t endFragmentTime, uint64_t &mdatSize, std::map<size_t, DTSC::Keys *> & keysCache) const;
     virtual void sendFragmentHeaderTime(uint64_t startFragmentTime,
@@ -126,6 +114,7 @@ namespace Mist{
                              // fragmented MP4's
     size_t vidTrack;         // the video track we use as fragmenting base
     uint64_t realBaseOffset; // base offset for every moof packet
+    Util::ResizeablePointer fragHeader; // moof box and mdat header, sent along with the first sample of the fragment
     // from sendnext
 
     bool sending3GP;
@@ -136,8 +125,17 @@ namespace Mist{
     bool chromeWorkaround;
     int keysOnly;
     uint64_t estimateFileSize() const;
+    uint64_t mdatOffsets(HeaderWriter *W, size_t trackIdx, uint64_t dataOffset, bool useLargeBoxes);
+
+    std::string headerCacheFile(uint32_t &fingerprint);
+    bool openHeaderCache();
+    int hdrFd; ///< Cached progressive header of the current request, or -1 if not cached
 
     std::string protectionHeader(size_t idx);
+
+    bool canSendFromSource(const char *dataPointer, size_t len, uint64_t bpos);
+    int srcFd; ///< Source file descriptor for sending samples directly; -1 if unusable, -2 if not opened yet
+    std::set<size_t> srcChecked; ///< Tracks that have been verified to match the source file
     Util::ResizeablePointer webBuf;
   };
 }// namespace Mist
@@ -729,9 +729,9 @@ namespace Mist {
     }
 
     // send the packet
+    struct iovec vec[2] = {{rtmpheader, header_len}, {(void *)tmpData, data_len}};
     myConn.setBlocking(true);
-    myConn.SendNow(rtmpheader, header_len);
-    myConn.SendNow(tmpData, data_len);
+    myConn.sendv(vec, 2);
     RTMPStream::snd_cnt += header_len+data_len; // update the sent data counter
     myConn.setBlocking(false);
   }
@@ -871,19 +871,11 @@ namespace Mist {
         rtmpheader[3] = rtmpTimestamp & 0xff;
       }
 
-      // Send RTMP packet containing header only
+      // Send RTMP header, FLV Audio tag (always 10101111 00000001) and raw AAC in one go
+      char audioTag[2] = {'\257', '\001'};
+      struct iovec vec[3] = {{rtmpheader, header_len}, {audioTag, 2}, {(void *)currentFrameInfo.getPayload(), (size_t)aacPacketSize - 2}};
       myConn.setBlocking(true);
-      myConn.SendNow(rtmpheader, header_len);
-      // Prepend FLV AAC audio tag
-      char *tmpData = (char*)malloc(aacPacketSize);
-      const char *tmpBuf = currentFrameInfo.getPayload();
-      // Prepend FLV Audio tag: always 10101111 00000001 + raw AAC
-      tmpData[0] = '\257';
-      tmpData[1] = '\001';
-      for (int i = 2; i < aacPacketSize; i++)
-        tmpData[i] = tmpBuf[i-2];
-
-      myConn.SendNow(tmpData, aacPacketSize);
+      myConn.sendv(vec, 3);
       // Update internal variables
       RTMPStream::snd_cnt += header_len+aacPacketSize;
       myConn.setBlocking(false);
@@ -955,8 +947,8 @@ namespace Mist {
     }
 
     if (!M.trackLoaded(thisIdx)) { return; }
-    std::string type = M.getType(thisIdx);
-    std::string codec = M.getCodec(thisIdx);
+    const TrackDesc &desc = trackDesc(thisIdx);
+    TrackCodec codec = desc.codec;
 
     // byte 0 = cs_id | ch_type
     // bytes 1-3 = timestamp
@@ -973,7 +965,7 @@ namespace Mist {
     thisPacket.getString("data", tmpData, data_len);
 
     // set msg_type_id
-    if (type == "video"){
+    if (desc.type == TRACK_VIDEO){
       dheader_len = 1; // 4 bits frame type, 4 bits codec ID
       rtmpheader[7] = 0x09;
       int64_t offset = thisPacket.getInt("offset");
@@ -984,11 +976,11 @@ namespace Mist {
         dataheader[0] = 0x86; // 0x80 = VideoHeaderEx present, multitrack
         // 0x00 = OneTrack, plus either CodedFrames or CodedFramesx:
         dataheader[1] = offset ? 1 : 3; // 1 = CodedFrames, 3 = CodedFramesx (implied zero offset)
-        if (codec == "AV1") { memcpy(dataheader + 2, "av01", 4); }
-        if (codec == "VP8") { memcpy(dataheader + 2, "vp08", 4); }
-        if (codec == "VP9") { memcpy(dataheader + 2, "vp09", 4); }
-        if (codec == "HEVC") { memcpy(dataheader + 2, "hvc1", 4); }
-        if (codec == "H264") { memcpy(dataheader + 2, "avc1", 4); }
+        if (codec == CODEC_AV1) { memcpy(dataheader + 2, "av01", 4); }
+        if (codec == CODEC_VP8) { memcpy(dataheader + 2, "vp08", 4); }
+        if (codec == CODEC_VP9) { memcpy(dataheader + 2, "vp09", 4); }
+        if (codec == CODEC_HEVC) { memcpy(dataheader + 2, "hvc1", 4); }
+        if (codec == CODEC_H264) { memcpy(dataheader + 2, "avc1", 4); }
         dataheader[6] = mapped->second; // trackId
         if (offset){
           // 3 bytes int24 offset
@@ -997,7 +989,7 @@ namespace Mist {
           dataheader[9] = offset & 0xFF;
         }
       } else {
-        if (codec == "H264") {
+        if (codec == CODEC_H264) {
           dheader_len = 5;
           dataheader[0] = 7; // codec ID 7 = H264
           dataheader[1] = 1; // AVCPacketType 1 = NALU
@@ -1008,14 +1000,14 @@ namespace Mist {
             dataheader[4] = offset & 0xFF;
           }
         }
-        if (codec == "AV1" || codec == "VP8" || codec == "VP9" || codec == "HEVC") {
+        if (codec == CODEC_AV1 || codec == CODEC_VP8 || codec == CODEC_VP9 || codec == CODEC_HEVC) {
           dheader_len = offset ? 8 : 5; // add fourcc, and optionally 3 bytes 24-bit offset
           dataheader[0] = 0x80; // 0x80 = VideoHeaderEx present,
           dataheader[0] |= offset ? 1 : 3; // 1 = CodedFrames, 3 = CodedFramesx (implied zero offset)
-          if (codec == "AV1") { memcpy(dataheader + 1, "av01", 4); }
-          if (codec == "VP8") { memcpy(dataheader + 1, "vp08", 4); }
-          if (codec == "VP9") { memcpy(dataheader + 1, "vp09", 4); }
-          if (codec == "HEVC") { memcpy(dataheader + 1, "hvc1", 4); }
+          if (codec == CODEC_AV1) { memcpy(dataheader + 1, "av01", 4); }
+          if (codec == CODEC_VP8) { memcpy(dataheader + 1, "vp08", 4); }
+          if (codec == CODEC_VP9) { memcpy(dataheader + 1, "vp09", 4); }
+          if (codec == CODEC_HEVC) { memcpy(dataheader + 1, "hvc1", 4); }
           if (offset) {
             // 3 bytes int24 offset
             dataheader[5] = (offset >> 16) & 0xFF;
@@ -1023,7 +1015,7 @@ namespace Mist {
             dataheader[7] = offset & 0xFF;
           }
         }
-        if (codec == "H263") {
+        if (codec == CODEC_H263) {
           dataheader[0] = 2; // codec ID 2 = H263
         }
       }
@@ -1033,47 +1025,47 @@ namespace Mist {
       if (thisPacket.getFlag("disposableframe")) { dataheader[0] |= 0x30; }
     }
 
-    if (type == "audio") {
+    if (desc.type == TRACK_AUDIO) {
       rtmpheader[7] = 0x08;
       auto mapped = audMultiMap.find(thisIdx);
       if (mapped != audMultiMap.end()) {
         dheader_len = 7; // add fourcc
         dataheader[0] = 0x95; // 0x90 = AudioHeaderEx present, 5 = Multitrack
         dataheader[1] = 5; // OneTrack, CodedFrames
-        if (codec == "opus") { memcpy(dataheader + 2, "Opus", 4); }
-        if (codec == "AC3") { memcpy(dataheader + 2, "ac-3", 4); }
-        if (codec == "FLAC") { memcpy(dataheader + 2, "fLaC", 4); }
-        if (codec == "AAC") { memcpy(dataheader + 2, "mp4a", 4); }
+        if (codec == CODEC_OPUS) { memcpy(dataheader + 2, "Opus", 4); }
+        if (codec == CODEC_AC3) { memcpy(dataheader + 2, "ac-3", 4); }
+        if (codec == CODEC_FLAC) { memcpy(dataheader + 2, "fLaC", 4); }
+        if (codec == CODEC_AAC) { memcpy(dataheader + 2, "mp4a", 4); }
         dataheader[6] = mapped->second; // trackId
       } else {
         dheader_len = 1; // 4 bits sound format, 2 bits rate, 1 bit size, 1 bit channels
-        uint32_t rate = M.getRate(thisIdx);
+        uint32_t rate = desc.rate;
         bool useLowerNibble = true;
-        if (codec == "AAC") {
+        if (codec == CODEC_AAC) {
           dheader_len = 2; // AAC has an extra byte of header signalling media data vs init data
           dataheader[0] = 0xA0; // Format 10 = AAC
           dataheader[1] = 1; // raw AAC data, not sequence header
         }
-        if (codec == "opus" || codec == "AC3" || codec == "FLAC") {
+        if (codec == CODEC_OPUS || codec == CODEC_AC3 || codec == CODEC_FLAC) {
           useLowerNibble = false; // Disable filling of the lower nibble - it carries the frame type instead
           dheader_len = 5; // add fourcc
           dataheader[0] = 0x91; // 0x90 = AudioHeaderEx present, 1 = Coded frames
-          if (codec == "opus") { memcpy(dataheader + 1, "Opus", 4); }
-          if (codec == "AC3") { memcpy(dataheader + 1, "ac-3", 4); }
-          if (codec == "FLAC") { memcpy(dataheader + 1, "fLaC", 4); }
+          if (codec == CODEC_OPUS) { memcpy(dataheader + 1, "Opus", 4); }
+          if (codec == CODEC_AC3) { memcpy(dataheader + 1, "ac-3", 4); }
+          if (codec == CODEC_FLAC) { memcpy(dataheader + 1, "fLaC", 4); }
         }
-        if (codec == "MP3") {
+        if (codec == CODEC_MP3) {
           if (rate == 8000) {
             dataheader[0] = 0xE0; // Format 14 = 8kHz MP3
           } else {
             dataheader[0] = 0x20; // Format 2 = MP3
           }
         }
-        if (codec == "ADPCM") { dataheader[0] = 0x10; } // Format 1 = ADPCM
-        if (codec == "PCM") {
+        if (codec == CODEC_ADPCM) { dataheader[0] = 0x10; } // Format 1 = ADPCM
+        if (codec == CODEC_PCM) {
           // We store PCM big-endian, but FLV wants it little-endian or platform-endian.
           // Since platform-endian is the path of insanity, we always send big-endian.
-          if (M.getSize(thisIdx) == 16 && swappy.allocate(data_len)) {
+          if (desc.size == 16 && swappy.allocate(data_len)) {
             for (uint32_t i = 0; i < data_len; i += 2) {
               swappy[i] = tmpData[i + 1];
               swappy[i + 1] = tmpData[i];
@@ -1082,15 +1074,15 @@ namespace Mist {
           }
           dataheader[0] = 0x30; // Format 3 = Little-endian PCM
         }
-        if (codec == "Nellymoser") {
+        if (codec == CODEC_NELLYMOSER) {
           // Format 4 = Nellymoser 16kHz
           // Format 5 = Nellymoser 8kHz
           // Format 6 = Nellymoser
           dataheader[0] |= (rate == 8000 ? 0x50 : (rate == 16000 ? 0x40 : 0x60));
         }
-        if (codec == "ALAW") { dataheader[0] |= 0x70; } // Format 7 = ALAW
-        if (codec == "ULAW") { dataheader[0] |= 0x80; } // Format 8 = ULAW
-        if (codec == "Speex") { dataheader[0] |= 0xB0; } // Format 11 = Speex
+        if (codec == CODEC_ALAW) { dataheader[0] |= 0x70; } // Format 7 = ALAW
+        if (codec == CODEC_ULAW) { dataheader[0] |= 0x80; } // Format 8 = ULAW
+        if (codec == CODEC_SPEEX) { dataheader[0] |= 0xB0; } // Format 11 = Speex
 
         if (useLowerNibble) {
           // 2 bits rate: 0 = 5.5Khz, 1 = 11Khz, 2 = 22Khz, 3 = 44Khz (according to spec, anyway)
@@ -1107,14 +1099,14 @@ namespace Mist {
             dataheader[0] |= 0x04;
           }
           // 1 bit size: 0 = 8-bit, 1 = 16-bit (we transmit anything that isn't 8 as 16)
-          if (M.getSize(thisIdx) != 8) { dataheader[0] |= 0x02; }
+          if (desc.size != 8) { dataheader[0] |= 0x02; }
           // 1 bit channel: 0 = mono, 1 = stereo (we transmit anything > 1 as stereo)
-          if (M.getChannels(thisIdx) > 1) { dataheader[0] |= 0x01; }
+          if (desc.channels > 1) { dataheader[0] |= 0x01; }
         }
       }
     }
 
-    if (type == "meta") {
+    if (desc.type == TRACK_META) {
       rtmpheader[7] = 0x12;
 
       static std::string amfData;
@@ -1190,42 +1182,42 @@ namespace Mist {
       rtmpheader[3] = timestamp & 0xff;
     }
 
-    // send the header
-    myConn.setBlocking(true);
-    myConn.SendNow(rtmpheader, header_len);
-    RTMPStream::snd_cnt += header_len; // update the sent data counter
-    // set the header's first byte to the "continue" type chunk, for later use
-    rtmpheader[0] = 0xC4;
+    // the "continue" type chunk header, sent in front of every chunk after the first
+    char contheader[5] = {(char)0xC4, 0, 0, 0, 0};
+    size_t contheader_len = 1;
     if (timestamp >= 0x00ffffff){
-      rtmpheader[1] = (timestamp >> 24) & 0xff;
-      rtmpheader[2] = (timestamp >> 16) & 0xff;
-      rtmpheader[3] = (timestamp >> 8) & 0xff;
-      rtmpheader[4] = timestamp & 0xff;
+      contheader[1] = (timestamp >> 24) & 0xff;
+      contheader[2] = (timestamp >> 16) & 0xff;
+      contheader[3] = (timestamp >> 8) & 0xff;
+      contheader[4] = timestamp & 0xff;
+      contheader_len = 5;
     }
 
-    // sent actual data - never send more than chunk_snd_max at a time
+    // gather the headers and the actual data - never more than chunk_snd_max data bytes per chunk
     // interleave blocks of max chunk_snd_max bytes with 0xC4 bytes to indicate continue
-    size_t len_sent = 0;
+    static std::vector<struct iovec> vec;
+    vec.clear();
+    auto addPiece = [](const char *data, size_t len){
+      vec.push_back(iovec());
+      vec.back().iov_base = (void *)data;
+      vec.back().iov_len = len;
+    };
+    addPiece(rtmpheader, header_len);
+    addPiece(dataheader, dheader_len);
+    RTMPStream::snd_cnt += header_len + dheader_len; // update the sent data counter
+    size_t len_sent = dheader_len;
     while (len_sent < data_len){
-      size_t to_send = std::min(data_len - len_sent, RTMPStream::chunk_snd_max);
-      if (!len_sent){
-        myConn.SendNow(dataheader, dheader_len);
-        RTMPStream::snd_cnt += dheader_len; // update the sent data counter
-        to_send -= dheader_len;
-        len_sent += dheader_len;
-      }
-      myConn.SendNow(tmpData + len_sent - dheader_len, to_send);
+      size_t to_send = std::min(data_len - len_sent, RTMPStream::chunk_snd_max - (len_sent == dheader_len ? dheader_len : 0));
+      addPiece(tmpData + len_sent - dheader_len, to_send);
       len_sent += to_send;
       if (len_sent < data_len){
-        if (timestamp >= 0x00ffffff){
-          myConn.SendNow(rtmpheader, 5);
-          RTMPStream::snd_cnt += 5; // update the sent data counter
-        }else{
-          myConn.SendNow(rtmpheader, 1);
-          RTMPStream::snd_cnt += 1; // update the sent data counter
-        }
+        addPiece(contheader, contheader_len);
+        RTMPStream::snd_cnt += contheader_len; // update the sent data counter
       }
     }
+    // send it all at once
+    myConn.setBlocking(true);
+    myConn.sendv(vec.data(), vec.size());
     myConn.setBlocking(false);
     lastSend = Util::bootMS();
   }
@@ -97,6 +97,9 @@ namespace Mist{
       setBlocking(true);
     }
 
+    // TCP connections get the TS packets for a single frame in one write
+    coalesceTS = !pushOut;
+
     //set the correct mode depending on pushing yes/no
     wantRequest = pushing;
     parseData = !pushing;
@@ -188,6 +191,13 @@ namespace Mist{
     Output::initialSeek(dryRun);
   }
 
+  void OutTS::sendNext(){
+    TSOutput::sendNext();
+    // Datagrams or TCP writes for a single frame are queued up, and sent out together here
+    if (pushOut && !wrapRTP){pushSock.flushBatch();}
+    if (coalesceTS){flushTS();}
+  }
+
   void OutTS::sendTS(const char *tsData, size_t len){
     if (pushOut){
       static size_t curFilled = 0;
@@ -209,7 +219,7 @@ namespace Mist{
             myConn.addUp(bytesSent);
           }
         }else{
-          pushSock.SendNow(packetBuffer, packetBuffer.size());
+          pushSock.batchSend(packetBuffer, packetBuffer.size());
           myConn.addUp(packetBuffer.size());
         }
         packetBuffer.truncate(0);
@@ -8,6 +8,7 @@ namespace Mist{
     ~OutTS();
     static void init(Util::Config *cfg, JSON::Value & capa);
     void sendTS(const char *tsData, size_t len = 188);
+    virtual void sendNext();
     static bool listenMode(Util::Config *config);
     virtual void initialSeek(bool dryRun = false);
     bool isReadyForPlay();
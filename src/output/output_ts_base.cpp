@@ -10,6 +10,32 @@ namespace Mist{
     sendRepeatingHeaders = 0;
     lastHeaderTime = 0;
     maxSkipAhead = 0;
+    coalesceTS = false;
+  }
+
+  /// Passes TS data on to sendTS.
+  /// If coalesceTS is set, data is collected first and passed on in blocks of TS_COALESCE_SIZE
+  /// bytes; flushTS() must then be called to pass on whatever is left at a suitable moment.
+  void TSOutput::queueTS(const char *tsData, size_t len){
+    if (!coalesceTS){
+      sendTS(tsData, len);
+      return;
+    }
+    tsQueue.append(tsData, len);
+    if (tsQueue.size() >= TS_COALESCE_SIZE){flushTS();}
+  }
+
+  /// Passes all TS data collected by queueTS on to sendTS.
+  void TSOutput::flushTS(){
+    if (!tsQueue.size()){return;}
+    sendTS(tsQueue, tsQueue.size());
+    tsQueue.truncate(0);
+  }
+
+  /// Makes sure collected TS data is not lost when the stream ends.
+  bool TSOutput::onFinish(){
+    flushTS();
+    return TS_BASECLASS::onFinish();
   }
 
   void TSOutput::fillPacket(char const *data, size_t dataLen, bool &firstPack, bool video,
@@ -27,12 +53,12 @@ namespace Mist{
           TS::Packet tmpPack;
           tmpPack.FromPointer(TS::PAT);
           tmpPack.setContinuityCounter(++contPAT);
-          sendTS(tmpPack.checkAndGetBuffer());
-          sendTS(TS::createPMT(selectedTracks, M, ++contPMT));
-          sendTS(TS::createSDT(streamName, ++contSDT));
+          queueTS(tmpPack.checkAndGetBuffer());
+          queueTS(TS::createPMT(selectedTracks, M, ++contPMT));
+          queueTS(TS::createSDT(streamName, ++contSDT));
           packCounter += 3;
         }
-        sendTS(packData.checkAndGetBuffer());
+        queueTS(packData.checkAndGetBuffer());
         packCounter++;
         packData.clear();
       }
@@ -75,9 +101,9 @@ namespace Mist{
     if (liveSeek(true)){return;}
     if (!M.trackLoaded(thisIdx)){return;}
     // Get ready some data to speed up accesses
-    std::string type = M.getType(thisIdx);
-    std::string codec = M.getCodec(thisIdx);
-    bool video = (type == "video");
+    const TrackDesc &desc = trackDesc(thisIdx);
+    TrackCodec codec = desc.codec;
+    bool video = (desc.type == TRACK_VIDEO);
     size_t pkgPid = TS::getUniqTrackID(M, thisIdx);
     bool &firstPack = first[thisIdx];
     uint16_t &contPkg = contCounters[pkgPid];
@@ -88,8 +114,8 @@ namespace Mist{
     size_t dataLen = 0;
     thisPacket.getString("data", dataPointer, dataLen); // data
 
-    if (codec == "rawts"){
-      for (size_t i = 0; i+188 <= dataLen; i+=188){sendTS(dataPointer+i, 188);}
+    if (codec == CODEC_RAWTS){
+      for (size_t i = 0; i+188 <= dataLen; i+=188){queueTS(dataPointer+i, 188);}
       return;
     }
 
@@ -99,10 +125,10 @@ namespace Mist{
     if (video){
       bool addInit = keyframe;
       bool addEndNal = true;
-      if (codec == "H264" || codec == "HEVC"){
+      if (codec == CODEC_H264 || codec == CODEC_HEVC){
         uint32_t extraSize = 0;
         //Check if we need to skip sending some things
-        if (codec == "H264"){
+        if (codec == CODEC_H264){
           size_t ctr = 0;
           char * ptr = dataPointer;
           while (ptr+4 < dataPointer+dataLen && ++ctr <= 5){
@@ -120,21 +146,8 @@ namespace Mist{
           }
         }
 
-        if (addEndNal && codec == "H264"){extraSize += 6;}
-        if (addInit){
-          if (codec == "H264"){
-            MP4::AVCC avccbox;
-            avccbox.setPayload(M.getInit(thisIdx));
-            bs = avccbox.asAnnexB();
-            extraSize += bs.size();
-          }
-          if (codec == "HEVC"){
-            MP4::HVCC hvccbox;
-            hvccbox.setPayload(M.getInit(thisIdx));
-            bs = hvccbox.asAnnexB();
-            extraSize += bs.size();
-          }
-        }
+        if (addEndNal && codec == CODEC_H264){extraSize += 6;}
+        if (addInit){extraSize += desc.annexB.size();}
 
         const uint32_t MAX_PES_SIZE = 65490 - 13;
         uint32_t ThisNaluSize = 0;
@@ -148,31 +161,14 @@ namespace Mist{
         fillPacket(bs.data(), bs.size(), firstPack, video, keyframe, pkgPid, contPkg);
 
         // End of previous nal unit, if not already present
-        if (addEndNal && codec == "H264"){
+        if (addEndNal && codec == CODEC_H264){
           fillPacket("\000\000\000\001\011\360", 6, firstPack, video, keyframe, pkgPid, contPkg);
         }
         // Init data, if keyframe and not already present
-        if (addInit){
-          if (codec == "H264"){
-            MP4::AVCC avccbox;
-            avccbox.setPayload(M.getInit(thisIdx));
-            bs = avccbox.asAnnexB();
-            fillPacket(bs.data(), bs.size(), firstPack, video, keyframe, pkgPid, contPkg);
-          }
-          /*LTS-START*/
-          if (codec == "HEVC"){
-            MP4::HVCC hvccbox;
-            hvccbox.setPayload(M.getInit(thisIdx));
-            bs = hvccbox.asAnnexB();
-            fillPacket(bs.data(), bs.size(), firstPack, video, keyframe, pkgPid, contPkg);
-          }
-          /*LTS-END*/
-        }
-        size_t lenSize = 4;
-        if (codec == "H264"){
-          std::string init = M.getInit(thisIdx);
-          if (init.size() > 4){lenSize = (init[4] & 3) + 1;}
+        if (addInit && desc.annexB.size()){
+          fillPacket(desc.annexB.data(), desc.annexB.size(), firstPack, video, keyframe, pkgPid, contPkg);
         }
+        size_t lenSize = desc.nalLenSize;
         while (i + lenSize < (unsigned int)dataLen){
           if (lenSize == 4){
             ThisNaluSize = Bit::btohl(dataPointer + i);
@@ -198,12 +194,12 @@ namespace Mist{
 
         fillPacket(dataPointer, dataLen, firstPack, video, keyframe, pkgPid, contPkg);
       }
-    }else if (type == "audio"){
+    }else if (desc.type == TRACK_AUDIO){
       size_t tempLen = dataLen;
-      if (codec == "AAC"){
+      if (codec == CODEC_AAC){
         tempLen += 7;
         // Make sure TS timestamp is sample-aligned, if possible
-        uint32_t freq = M.getRate(thisIdx);
+        uint32_t freq = desc.rate;
         if (freq){
           uint64_t aacSamples = packTime * freq / 90000;
           //round to nearest packet, assuming all 1024 samples (probably wrong, but meh)
@@ -213,7 +209,7 @@ namespace Mist{
           packTime = aacSamples * 90000 / freq;
         }
       }
-      if (codec == "opus"){
+      if (codec == CODEC_OPUS){
         tempLen += 3 + (dataLen/255);
         bs = TS::Packet::getPESPS1LeadIn(tempLen, packTime, M.getBps(thisIdx));
         fillPacket(bs.data(), bs.size(), firstPack, video, keyframe, pkgPid, contPkg);
@@ -225,14 +221,14 @@ namespace Mist{
         bs.clear();
         TS::Packet::getPESAudioLeadIn(bs, tempLen, packTime, M.getBps(thisIdx));
         fillPacket(bs.data(), bs.size(), firstPack, video, keyframe, pkgPid, contPkg);
-        if (codec == "AAC"){
-          bs = TS::getAudioHeader(dataLen, M.getInit(thisIdx));
+        if (codec == CODEC_AAC){
+          bs = TS::getAudioHeader(dataLen, desc.init);
           fillPacket(bs.data(), bs.size(), firstPack, video, keyframe, pkgPid, contPkg);
         }
       }
       fillPacket(dataPointer, dataLen, firstPack, video, keyframe, pkgPid, contPkg);
-    }else if (type == "meta"){
-      if (codec == "SCTE35") {
+    }else if (desc.type == TRACK_META){
+      if (codec == CODEC_SCTE35) {
         if (dataLen && dataPointer[0] == '{') {
           uint64_t duration = 30000;
           JSON::Value cmd = JSON::fromString(dataPointer, dataLen);
@@ -245,10 +241,10 @@ namespace Mist{
         }
       } else {
         long unsigned int tempLen = dataLen;
-        if (codec == "JSON") { tempLen += 2; }
+        if (codec == CODEC_JSON) { tempLen += 2; }
         bs = TS::Packet::getPESMetaLeadIn(tempLen, packTime, M.getBps(thisIdx));
         fillPacket(bs.data(), bs.size(), firstPack, video, keyframe, pkgPid, contPkg);
-        if (codec == "JSON") {
+        if (codec == CODEC_JSON) {
           char dLen[2];
           Bit::htobs(dLen, dataLen);
           fillPacket(dLen, 2, firstPack, video, keyframe, pkgPid, contPkg);
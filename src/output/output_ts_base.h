@@ -8,6 +8,10 @@
 #define TS_BASECLASS Output
 #endif
 
+/// Amount of TS data collected before it is passed to sendTS in one go, when coalescing is enabled.
+/// 348 whole TS packets, just under 64KiB.
+#define TS_COALESCE_SIZE (348 * 188)
+
 namespace Mist{
 
   class TSOutput : public TS_BASECLASS{
@@ -16,6 +20,7 @@ namespace Mist{
     virtual ~TSOutput(){};
     virtual void sendNext();
     virtual void sendTS(const char *tsData, size_t len = 188){};
+    virtual bool onFinish();
     void fillPacket(char const *data, size_t dataLen, bool &firstPack, bool video, bool keyframe,
                     size_t pkgPid, uint16_t &contPkg);
     virtual void sendHeader(){
@@ -25,6 +30,10 @@ namespace Mist{
 
   protected:
     virtual bool inlineRestartCapable() const{return true;}
+    void queueTS(const char *tsData, size_t len = 188);
+    void flushTS();
+    bool coalesceTS;                ///< If true, collect TS packets and pass them to sendTS in larger blocks
+    Util::ResizeablePointer tsQueue; ///< TS packets collected but not yet passed to sendTS
     std::map<size_t, bool> first;
     std::map<size_t, uint16_t> contCounters;
     uint16_t contPAT;
@@ -2583,7 +2583,7 @@ namespace Mist{
     if(doDTLS && !rtpSockets.size()){return;}
 
     // Handle nice move-over to new track ID
-    if (prevVidTrack != INVALID_TRACK_ID && thisIdx != prevVidTrack && M.getType(thisIdx) == "video"){
+    if (prevVidTrack != INVALID_TRACK_ID && thisIdx != prevVidTrack && trackDesc(thisIdx).type == TRACK_VIDEO){
       if (!thisPacket.getFlag("keyframe")){
         // Ignore the packet if not a keyframe
         return;
@@ -2604,16 +2604,17 @@ namespace Mist{
     size_t dataLen = 0;
     thisPacket.getString("data", dataPointer, dataLen);
 
+    const TrackDesc &desc = trackDesc(thisIdx);
 
-    if (M.getType(thisIdx) == "meta"){
+    if (desc.type == TRACK_META){
 #ifdef WITH_DATACHANNELS
       JSON::Value jPack;
-      if (M.getCodec(thisIdx) == "JSON"){
+      if (desc.codec == CODEC_JSON){
         if (dataLen == 0 || (dataLen == 1 && dataPointer[0] == ' ')){return;}
         jPack["data"] = JSON::fromString(dataPointer, dataLen);
         jPack["time"] = thisTime;
         jPack["track"] = (uint64_t)thisIdx;
-      }else if (M.getCodec(thisIdx) == "subtitle"){
+      }else if (desc.codec == CODEC_SUBTITLE){
         //Ignore blank subtitles
         if (dataLen == 0 || (dataLen == 1 && dataPointer[0] == ' ')){return;}
 
@@ -2636,9 +2637,9 @@ namespace Mist{
       bool handledNative = false;
       for (auto sSock : sctpSockets){
         WebRTCSocket & wSock = sockets[sSock];
-        if (!wSock.dataChannels.count(M.getCodec(thisIdx))){continue;}
+        if (!wSock.dataChannels.count(desc.codecName)){continue;}
         sctp_sndinfo sndinfo;
-        sndinfo.snd_sid = wSock.dataChannels[M.getCodec(thisIdx)];
+        sndinfo.snd_sid = wSock.dataChannels[desc.codecName];
         sndinfo.snd_flags = SCTP_EOR;
         sndinfo.snd_ppid = htonl(51);
         sndinfo.snd_context = 0;
@@ -2652,10 +2653,10 @@ namespace Mist{
         }
       }
       if (!handledNative){
-        if (M.getCodec(thisIdx) == "JSON"){
+        if (desc.codec == CODEC_JSON){
           queuedJSON.push_back(packed);
         }else{
-          WARN_MSG("I don't have a data channel for %s data!", M.getCodec(thisIdx).c_str());
+          WARN_MSG("I don't have a data channel for %s data!", desc.codecName.c_str());
         }
       }
 #endif
@@ -2668,7 +2669,7 @@ namespace Mist{
     WebRTCTrack *trackPointer = 0;
 
     // If we see this is audio or video, use the webrtc track we negotiated
-    if (M.getType(tid) == "video" && webrtcTracks.count(vidTrack)){
+    if (desc.type == TRACK_VIDEO && webrtcTracks.count(vidTrack)){
       trackPointer = &webrtcTracks[vidTrack];
 
       if (lastPackMs){
@@ -2679,7 +2680,7 @@ namespace Mist{
 
 
     }
-    if (M.getType(tid) == "audio" && webrtcTracks.count(audTrack)){
+    if (desc.type == TRACK_AUDIO && webrtcTracks.count(audTrack)){
       trackPointer = &webrtcTracks[audTrack];
     }
 
@@ -2704,9 +2705,9 @@ namespace Mist{
 
     bool isKeyFrame = thisPacket.getFlag("keyframe");
     didReceiveKeyFrame = isKeyFrame;
-    const std::string cdc = M.getCodec(thisIdx);
+    const std::string &cdc = desc.codecName;
     auto rtpSndr = [this](const char *d, size_t l) { sendRTPPacket(d, l); };
-    if (cdc == "H264") {
+    if (desc.codec == CODEC_H264) {
       if (isKeyFrame && firstKey){
         size_t offset = 0;
         while (offset + 4 < dataLen){
@@ -2721,9 +2722,9 @@ namespace Mist{
         }
         firstKey = false;
       }
-      if (repeatInit && isKeyFrame && M.getInit(thisIdx).size()) {
+      if (repeatInit && isKeyFrame && desc.init.size()) {
         MP4::AVCC avcc;
-        avcc.setPayload(M.getInit(thisIdx));
+        avcc.setPayload(desc.init);
 
         for (uint32_t i = 0; i < avcc.getSPSCount(); ++i) {
           uint32_t len = avcc.getSPSLen(i);
@@ -1,15 +1,24 @@
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <mist/config.h>
 #include <mist/defines.h>
-#include <mist/downloader.h>
+#include <mist/ev.h>
+#include <mist/http_parser.h>
+#include <mist/json_doc.h>
+#include <mist/load_push.h>
 #include <mist/timing.h>
+#include <mist/url.h>
 #include <mist/util.h>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
 #include <thread>
 #include <mutex>
+#include <unordered_map>
 
 Util::Config *cfg = 0;
 std::string passphrase;
@@ -101,6 +110,160 @@ int32_t applyAdjustment(const std::set<std::string> & tags, const std::string &
   return 0;
 }
 
+/// Atomically sets bw to (bw + add) * factor.
+/// Routes add viewers to bw concurrently with fetch_add, so a plain read followed by a store could
+/// lose those additions.
+static void scaleBandwidth(std::atomic<uint64_t> &bw, double factor, uint64_t add = 0){
+  uint64_t prev = bw.load();
+  while (!bw.compare_exchange_weak(prev, (uint64_t)((prev + add) * factor))){}
+}
+
+/// Immutable snapshot of everything needed to send viewers to a single host.
+/// Rebuilt by hostDetails whenever new load information arrives, and shared with the routing index,
+/// so balancing never needs to lock the host.
+class hostRoute{
+public:
+  std::string host;
+  std::map<std::string, outUrl> outputs;
+  std::map<std::string, uint64_t> streamBandwidth; ///< Bandwidth per viewer of streams active on the host
+  std::set<std::string> confStreams;
+  std::set<std::string> tags;
+  std::shared_ptr<std::atomic<uint64_t> > addBandwidth; ///< Bandwidth estimate of recently added viewers
+  uint64_t cpu;
+  uint64_t ramMax;
+  uint64_t ramCurr;
+  uint64_t upSpeed;
+  uint64_t downSpeed;
+  uint64_t total;
+  uint64_t availBandwidth;
+  bool hasGeo;
+  double geoX, geoY, geoZ; ///< Location as unit vector, so distances need no trigonometry per request
+
+  std::string getUrl(const std::string &s, const std::string &proto) const{
+    std::map<std::string, outUrl>::const_iterator it = outputs.find(proto);
+    if (it == outputs.end()){return "";}
+    return it->second.pre + s + it->second.post;
+  }
+  /// Adds the expected bandwidth of a new viewer of the given stream to the host.
+  void addViewer(const std::string &s) const{
+    uint64_t toAdd = 0;
+    std::map<std::string, uint64_t>::const_iterator it = streamBandwidth.find(s);
+    if (it != streamBandwidth.end()){
+      toAdd = it->second;
+    }else{
+      if (total){
+        toAdd = (upSpeed + downSpeed) / total;
+      }else{
+        toAdd = 131072; // assume 1mbps
+      }
+    }
+    // ensure reasonable limits of bandwidth guesses
+    if (toAdd < 64 * 1024){toAdd = 64 * 1024;}// minimum of 0.5 mbps
+    if (toAdd > 1024 * 1024){toAdd = 1024 * 1024;}// maximum of 8 mbps
+    addBandwidth->fetch_add(toAdd);
+  }
+};
+
+/// Sets the given unit vector to the location on the globe at the given coordinates.
+static void geoVector(double lat, double lon, double &x, double &y, double &z){
+  x = cos(toRad(lat)) * cos(toRad(lon));
+  y = cos(toRad(lat)) * sin(toRad(lon));
+  z = sin(toRad(lat));
+}
+
+/// Snapshot of all online hosts, for balancing viewers without locking anything.
+/// Hosts are sorted on the highest score they can get before per-request adjustments, so balancing
+/// can stop as soon as no remaining host can beat the best one found so far.
+class routeIndex{
+public:
+  struct entry{
+    std::shared_ptr<const hostRoute> route;
+    uint64_t baseScore; ///< CPU and RAM score
+    uint64_t maxScore;  ///< Base score plus bandwidth score without recently added viewers
+    size_t tagSet;      ///< Index in tagSets
+  };
+  std::vector<entry> hosts;
+  std::vector<std::set<std::string> > tagSets; ///< All distinct tag sets of the hosts
+  std::unordered_map<std::string, std::vector<bool> > streams;     ///< Per stream, hosts that have it active
+  std::unordered_map<std::string, std::vector<bool> > confStreams; ///< Per stream, hosts that have it configured
+  std::vector<bool> anyStream; ///< Hosts without a list of configured streams
+
+  /// Returns the best host for a new viewer of stream s, or null if none is available.
+  const hostRoute *balance(const std::string &s, double lati, double longi,
+                           const std::map<std::string, int32_t> &tagAdjust, uint64_t &bestScore) const{
+    bestScore = 0;
+    const hostRoute *best = 0;
+    bool geo = lati && longi;
+    double cX = 0, cY = 0, cZ = 0;
+    if (geo){geoVector(lati, longi, cX, cY, cZ);}
+    // Tag adjustments only depend on the tags, so they are calculated once per distinct tag set
+    std::vector<int64_t> adjustments(tagSets.size(), 0);
+    int64_t maxAdjust = 0;
+    if (tagAdjust.size()){
+      for (size_t i = 0; i < tagSets.size(); ++i){
+        for (std::map<std::string, int32_t>::const_iterator it = tagAdjust.begin(); it != tagAdjust.end(); ++it){
+          adjustments[i] += applyAdjustment(tagSets[i], it->first, it->second);
+        }
+        if (adjustments[i] > maxAdjust){maxAdjust = adjustments[i];}
+      }
+    }
+    const std::vector<bool> *active = 0, *conf = 0, *confBase = 0;
+    std::unordered_map<std::string, std::vector<bool> >::const_iterator it = streams.find(s);
+    if (it != streams.end()){active = &(it->second);}
+    it = confStreams.find(s);
+    if (it != confStreams.end()){conf = &(it->second);}
+    it = confStreams.find(s.substr(0, s.find_first_of("+ ")));
+    if (it != confStreams.end()){confBase = &(it->second);}
+    uint64_t maxExtra = weight_bonus + (geo ? weight_geo : 0) + maxAdjust;
+
+    for (size_t i = 0; i < hosts.size(); ++i){
+      const entry &E = hosts[i];
+      if (E.maxScore + maxExtra <= bestScore){break;}
+      const hostRoute &R = *E.route;
+      if (!anyStream[i] && !(conf && (*conf)[i]) && !(confBase && (*confBase)[i])){
+        MEDIUM_MSG("Stream %s not available from %s", s.c_str(), R.host.c_str());
+        continue;
+      }
+      uint64_t addBandwidth = *R.addBandwidth;
+      if ((R.upSpeed + addBandwidth) >= R.availBandwidth){
+        INFO_MSG("Host %s over bandwidth: %" PRIu64 "+%" PRIu64 " >= %" PRIu64, R.host.c_str(), R.upSpeed,
+                 addBandwidth, R.availBandwidth);
+        continue;
+      }
+      // Calculate score
+      uint64_t bw_score = (weight_bw - (((R.upSpeed + addBandwidth) * weight_bw) / R.availBandwidth));
+      uint64_t geo_score = 0;
+      if (geo && R.hasGeo){
+        double dot = R.geoX * cX + R.geoY * cY + R.geoZ * cZ;
+        if (dot > 1){dot = 1;}
+        if (dot < -1){dot = -1;}
+        geo_score = weight_geo - weight_geo * (.31830988618379067153 * acos(dot));
+      }
+      bool hasStream = active && (*active)[i];
+      uint64_t score = E.baseScore + bw_score + geo_score + (hasStream ? weight_bonus : 0);
+      int64_t adjustment = adjustments[E.tagSet];
+      if (adjustment >= 0 || -adjustment < score){
+        score += adjustment;
+      }else{
+        score = 0;
+      }
+      // Print info on host
+      MEDIUM_MSG("%s: CPU+RAM %" PRIu64 ", Stream %" PRIu64 ", BW %" PRIu64 " (max %" PRIu64
+                 " MB/s), Geo %" PRIu64 ", tag adjustment %" PRId64 " -> %" PRIu64,
+                 R.host.c_str(), E.baseScore, hasStream ? weight_bonus : 0, bw_score,
+                 R.availBandwidth / 1024 / 1024, geo_score, adjustment, score);
+      if (score > bestScore){
+        best = &R;
+        bestScore = score;
+      }
+    }
+    return best;
+  }
+};
+
+std::shared_ptr<const routeIndex> routes; ///< Current routing index; only accessed through std::atomic_load/store
+std::atomic<bool> routesDirty(false);     ///< Set when the routing index needs to be rebuilt
+
 class hostDetails{
 private:
   std::mutex *hostMutex;
@@ -117,7 +280,73 @@ private:
   uint64_t upPrev;
   uint64_t downPrev;
   uint64_t prevTime;
-  uint64_t addBandwidth;
+  std::shared_ptr<std::atomic<uint64_t> > addBandwidth; ///< Shared with the routes, which add viewers to it
+  std::shared_ptr<const hostRoute> route;
+  uint64_t prevPushMs;  ///< Time of the last bandwidth rate calculation from pushed data
+  uint64_t prevDecayMs; ///< Time of the last decay of addBandwidth from pushed data
+
+  /// Sets the RAM usage fields, using either system-wide memory or shared memory, whichever is fuller.
+  void setRam(int64_t nRamMax, int64_t nRamCur, int64_t nShmMax, int64_t nShmCur){
+    if (!nRamMax){nRamMax = 1;}
+    if (!nShmMax){nShmMax = 1;}
+    if (((nRamCur + nShmCur) * 1000) / nRamMax > (nShmCur * 1000) / nShmMax){
+      ramMax = nRamMax;
+      ramCurr = nRamCur + nShmCur;
+    }else{
+      ramMax = nShmMax;
+      ramCurr = nShmCur;
+    }
+  }
+
+  /// Returns the pushed counter with the given name, or zero if it is not set.
+  static uint64_t counter(const LoadPush::State &S, const std::string &name){
+    std::map<std::string, uint64_t>::const_iterator it = S.counters.find(name);
+    return it == S.counters.end() ? 0 : it->second;
+  }
+
+  /// Returns the pushed text with the given name, or an empty string if it is not set.
+  static const std::string &text(const LoadPush::State &S, const std::string &name){
+    static const std::string empty;
+    std::map<std::string, std::string>::const_iterator it = S.texts.find(name);
+    return it == S.texts.end() ? empty : it->second;
+  }
+
+  /// Fills the given set with all non-empty lines in the given text.
+  static void splitLines(const std::string &txt, std::set<std::string> &out){
+    out.clear();
+    size_t prev = 0;
+    while (prev < txt.size()){
+      size_t nl = txt.find('\n', prev);
+      if (nl == std::string::npos){nl = txt.size();}
+      if (nl > prev){out.insert(txt.substr(prev, nl - prev));}
+      prev = nl + 1;
+    }
+  }
+
+  /// Replaces the route of this host with one reflecting the current details.
+  /// Assumes hostMutex is held.
+  void buildRoute(){
+    std::shared_ptr<hostRoute> R(new hostRoute());
+    R->host = host;
+    R->outputs = outputs;
+    for (std::map<std::string, struct streamDetails>::iterator it = streams.begin(); it != streams.end(); ++it){
+      R->streamBandwidth[it->first] = it->second.bandwidth;
+    }
+    R->confStreams = conf_streams;
+    R->tags = tags;
+    R->addBandwidth = addBandwidth;
+    R->cpu = cpu;
+    R->ramMax = ramMax;
+    R->ramCurr = ramCurr;
+    R->upSpeed = upSpeed;
+    R->downSpeed = downSpeed;
+    R->total = total;
+    R->availBandwidth = availBandwidth;
+    R->hasGeo = servLati && servLongi;
+    geoVector(servLati, servLongi, R->geoX, R->geoY, R->geoZ);
+    route = R;
+    routesDirty = true;
+  }
 
 public:
   std::string host;
@@ -137,7 +366,9 @@ public:
     downPrev = 0;
     prevTime = 0;
     total = 0;
-    addBandwidth = 0;
+    addBandwidth.reset(new std::atomic<uint64_t>(0));
+    prevPushMs = 0;
+    prevDecayMs = 0;
     servLati = 0;
     servLongi = 0;
     availBandwidth = 128 * 1024 * 1024; // assume 1G connections
@@ -151,8 +382,7 @@ public:
   void badNess(){
     if (!hostMutex){hostMutex = new std::mutex();}
     std::lock_guard<std::mutex> guard(*hostMutex);
-    addBandwidth += 1 * 1024 * 1024;
-    addBandwidth *= 1.2;
+    scaleBandwidth(*addBandwidth, 1.2, 1 * 1024 * 1024);
   }
   /// Returns the count of viewers for a given stream s.
   size_t count(std::string &s){
@@ -168,7 +398,7 @@ public:
     r["cpu"] = (uint64_t)(cpu / 10);
     if (ramMax){r["ram"] = (uint64_t)((ramCurr * 100) / ramMax);}
     r["up"] = upSpeed;
-    r["up_add"] = addBandwidth;
+    r["up_add"] = (uint64_t)*addBandwidth;
     r["down"] = downSpeed;
     r["streams"] = streams.size();
     r["viewers"] = total;
@@ -186,7 +416,7 @@ public:
     if (ramMax && availBandwidth){
       r["score"]["cpu"] = (uint64_t)(weight_cpu - (cpu * weight_cpu) / 1000);
       r["score"]["ram"] = (uint64_t)(weight_ram - ((ramCurr * weight_ram) / ramMax));
-      r["score"]["bw"] = (uint64_t)(weight_bw - (((upSpeed + addBandwidth) * weight_bw) / availBandwidth));
+      r["score"]["bw"] = (uint64_t)(weight_bw - (((upSpeed + *addBandwidth) * weight_bw) / availBandwidth));
     }
   }
   /// Fills out a by reference given JSON::Value with current streams viewer count.
@@ -225,51 +455,11 @@ public:
     if (!streams.count(strm)){return 0;}
     return streams[strm].total;
   }
-  /// Scores a potential new connection to this server
-  /// 0 means not possible, the higher the better.
-  uint64_t rate(std::string &s, double lati = 0, double longi = 0, const std::map<std::string, int32_t> &tagAdjust = blankTags){
+  /// Returns the current routing snapshot of this host, or null if no load information arrived yet.
+  std::shared_ptr<const hostRoute> getRoute(){
     if (!hostMutex){hostMutex = new std::mutex();}
     std::lock_guard<std::mutex> guard(*hostMutex);
-    if (!ramMax || !availBandwidth){
-      WARN_MSG("Host %s invalid: RAM %" PRIu64 ", BW %" PRIu64, host.c_str(), ramMax, availBandwidth);
-      return 0;
-    }
-    if (upSpeed >= availBandwidth || (upSpeed + addBandwidth) >= availBandwidth){
-      INFO_MSG("Host %s over bandwidth: %" PRIu64 "+%" PRIu64 " >= %" PRIu64, host.c_str(), upSpeed,
-               addBandwidth, availBandwidth);
-      return 0;
-    }
-    if (conf_streams.size() && !conf_streams.count(s) &&
-        !conf_streams.count(s.substr(0, s.find_first_of("+ ")))){
-      MEDIUM_MSG("Stream %s not available from %s", s.c_str(), host.c_str());
-      return 0;
-    }
-    // Calculate score
-    uint64_t cpu_score = (weight_cpu - (cpu * weight_cpu) / 1000);
-    uint64_t ram_score = (weight_ram - ((ramCurr * weight_ram) / ramMax));
-    uint64_t bw_score = (weight_bw - (((upSpeed + addBandwidth) * weight_bw) / availBandwidth));
-    uint64_t geo_score = 0;
-    if (servLati && servLongi && lati && longi){
-      geo_score = weight_geo - weight_geo * geoDist(servLati, servLongi, lati, longi);
-    }
-    uint64_t score = cpu_score + ram_score + bw_score + geo_score + (streams.count(s) ? weight_bonus : 0);
-    int64_t adjustment = 0;
-    if (tagAdjust.size()){
-      for (std::map<std::string, int32_t>::const_iterator it = tagAdjust.begin(); it != tagAdjust.end(); ++it){
-        adjustment += applyAdjustment(tags, it->first, it->second);
-      }
-    }
-    if (adjustment >= 0 || -adjustment < score){
-      score += adjustment;
-    }else{
-      score = 0;
-    }
-    // Print info on host
-    MEDIUM_MSG("%s: CPU %" PRIu64 ", RAM %" PRIu64 ", Stream %" PRIu64 ", BW %" PRIu64
-               " (max %" PRIu64 " MB/s), Geo %" PRIu64 ", tag adjustment %" PRId64 " -> %" PRIu64,
-               host.c_str(), cpu_score, ram_score, streams.count(s) ? weight_bonus : 0, bw_score,
-               availBandwidth / 1024 / 1024, geo_score, adjustment, score);
-    return score;
+    return route;
   }
   /// Scores this server as a source
   /// 0 means not possible, the higher the better.
@@ -277,6 +467,7 @@ public:
     if (!hostMutex){hostMutex = new std::mutex();}
     std::lock_guard<std::mutex> guard(*hostMutex);
     if (s.size() && (!streams.count(s) || !streams[s].inputs || streams[s].rep)) { return 0; }
+    uint64_t addBandwidth = *this->addBandwidth;
     if (!ramMax || !availBandwidth){
       WARN_MSG("Host %s invalid: RAM %" PRIu64 ", BW %" PRIu64, host.c_str(), ramMax, availBandwidth);
       return 1;
@@ -314,32 +505,7 @@ public:
                availBandwidth / 1024 / 1024, geo_score, adjustment, score);
     return score;
   }
-  std::string getUrl(std::string &s, std::string &proto){
-    if (!hostMutex){hostMutex = new std::mutex();}
-    std::lock_guard<std::mutex> guard(*hostMutex);
-    if (!outputs.count(proto)){return "";}
-    const outUrl &o = outputs[proto];
-    return o.pre + s + o.post;
-  }
-  void addViewer(std::string &s){
-    if (!hostMutex){hostMutex = new std::mutex();}
-    std::lock_guard<std::mutex> guard(*hostMutex);
-    uint64_t toAdd = 0;
-    if (streams.count(s)){
-      toAdd = streams[s].bandwidth;
-    }else{
-      if (total){
-        toAdd = (upSpeed + downSpeed) / total;
-      }else{
-        toAdd = 131072; // assume 1mbps
-      }
-    }
-    // ensure reasonable limits of bandwidth guesses
-    if (toAdd < 64 * 1024){toAdd = 64 * 1024;}// minimum of 0.5 mbps
-    if (toAdd > 1024 * 1024){toAdd = 1024 * 1024;}// maximum of 8 mbps
-    addBandwidth += toAdd;
-  }
-  void update(JSON::Value &d){
+  void update(const JSON::Node &d){
     if (!hostMutex){hostMutex = new std::mutex();}
     std::lock_guard<std::mutex> guard(*hostMutex);
     cpu = d["cpu"].asInt();
@@ -347,7 +513,7 @@ public:
     if (d.isMember("loc")){
       if (d["loc"]["lat"].asDouble() != servLati){servLati = d["loc"]["lat"].asDouble();}
       if (d["loc"]["lon"].asDouble() != servLongi){servLongi = d["loc"]["lon"].asDouble();}
-      if (d["loc"]["name"].asStringRef() != servLoc){servLoc = d["loc"]["name"].asStringRef();}
+      if (d["loc"]["name"].asString() != servLoc){servLoc = d["loc"]["name"].asString();}
     }
     int64_t nRamMax = d["mem_total"].asInt();
     int64_t nRamCur = d["mem_used"].asInt();
@@ -355,21 +521,13 @@ public:
     int64_t nShmCur = d["shm_used"].asInt();
     if (d.isMember("tags") && d["tags"].isArray()){
       std::set<std::string> newTags;
-      jsonForEach(d["tags"], tag){
+      docForEach(d["tags"], tag){
         std::string t = tag->asString();
         if (t.size()){newTags.insert(t);}
       }
       if (newTags != tags){tags = newTags;}
     }
-    if (!nRamMax){nRamMax = 1;}
-    if (!nShmMax){nShmMax = 1;}
-    if (((nRamCur + nShmCur) * 1000) / nRamMax > (nShmCur * 1000) / nShmMax){
-      ramMax = nRamMax;
-      ramCurr = nRamCur + nShmCur;
-    }else{
-      ramMax = nShmMax;
-      ramCurr = nShmCur;
-    }
+    setRam(nRamMax, nRamCur, nShmMax, nShmCur);
     total = d["curr"][0u].asInt();
     uint64_t currUp = d["bw"][0u].asInt(), currDown = d["bw"][1u].asInt();
     uint64_t timeDiff = 0;
@@ -385,7 +543,7 @@ public:
     downPrev = currDown;
 
     if (d.isMember("streams") && d["streams"].size()){
-      jsonForEach(d["streams"], it){
+      docForEach(d["streams"], it){
         uint64_t count = (*it)["curr"][0u].asInt() + (*it)["curr"][1u].asInt() + (*it)["curr"][2u].asInt();
         if (!count){
           if (streams.count(it.key())){streams.erase(it.key());}
@@ -424,26 +582,142 @@ public:
     }
     conf_streams.clear();
     if (d.isMember("conf_streams") && d["conf_streams"].size()){
-      jsonForEach(d["conf_streams"], it){conf_streams.insert(it->asStringRef());}
+      docForEach(d["conf_streams"], it){conf_streams.insert(it->asString());}
     }
     outputs.clear();
     if (d.isMember("outputs") && d["outputs"].size()){
-      jsonForEach(d["outputs"], op){outputs[op.key()] = outUrl(op->asStringRef(), host);}
+      docForEach(d["outputs"], op){outputs[op.key()] = outUrl(op->asString(), host);}
     }
-    addBandwidth *= 0.75;
+    scaleBandwidth(*addBandwidth, 0.75);
+    buildRoute();
+  }
+  /// Updates the host details from pushed load telemetry.
+  /// Text values are only parsed again when they changed; bandwidth rates are recalculated at most
+  /// once per second, all other values apply immediately.
+  void update(const LoadPush::State &S, const std::set<std::string> &changed){
+    if (!hostMutex){hostMutex = new std::mutex();}
+    std::lock_guard<std::mutex> guard(*hostMutex);
+    uint64_t now = Util::bootMS();
+    cpu = counter(S, "cpu");
+    if (counter(S, "bwlimit")){availBandwidth = counter(S, "bwlimit");}
+    setRam(counter(S, "mem_total"), counter(S, "mem_used"), counter(S, "shm_total"), counter(S, "shm_used"));
+    total = counter(S, "viewers");
+    if (changed.count("lat") || changed.count("lon") || changed.count("loc")){
+      servLati = atof(text(S, "lat").c_str());
+      servLongi = atof(text(S, "lon").c_str());
+      servLoc = text(S, "loc");
+    }
+    if (changed.count("tags")){splitLines(text(S, "tags"), tags);}
+    if (changed.count("conf_streams")){splitLines(text(S, "conf_streams"), conf_streams);}
+    for (std::set<std::string>::const_iterator it = changed.lower_bound("out:");
+         it != changed.end() && it->compare(0, 4, "out:") == 0; ++it){
+      const std::string &url = text(S, *it);
+      if (url.size()){
+        outputs[it->substr(4)] = outUrl(url, host);
+      }else{
+        outputs.erase(it->substr(4));
+      }
+    }
+
+    uint64_t timeDiff = prevPushMs ? now - prevPushMs : 0;
+    bool newRates = !prevPushMs || timeDiff >= 1000;
+    uint64_t currUp = counter(S, "up"), currDown = counter(S, "down");
+    if (newRates){
+      if (timeDiff){
+        upSpeed = (currUp - upPrev) * 1000 / timeDiff;
+        downSpeed = (currDown - downPrev) * 1000 / timeDiff;
+      }
+      prevPushMs = now;
+      upPrev = currUp;
+      downPrev = currDown;
+    }
+
+    // Streams are only pushed while they have sessions, all other streams are gone
+    std::set<std::string> seen;
+    for (std::map<std::string, uint64_t>::const_iterator it = S.counters.lower_bound("viewers:");
+         it != S.counters.end() && it->first.compare(0, 8, "viewers:") == 0; ++it){
+      std::string name = it->first.substr(8);
+      uint64_t count = it->second + counter(S, "inputs:" + name) + counter(S, "outputs:" + name);
+      if (!count){continue;}
+      seen.insert(name);
+      bool isNew = !streams.count(name);
+      struct streamDetails &strm = streams[name];
+      strm.rep = counter(S, "rep:" + name);
+      strm.total = it->second;
+      strm.inputs = counter(S, "inputs:" + name);
+      strm.bytesUp = counter(S, "up:" + name);
+      strm.bytesDown = counter(S, "down:" + name);
+      uint64_t currTotal = strm.bytesUp + strm.bytesDown;
+      if (isNew || !timeDiff){
+        if (total){
+          strm.bandwidth = (upSpeed + downSpeed) / total;
+        }else{
+          strm.bandwidth = (upSpeed + downSpeed) + 100000;
+        }
+        strm.prevTotal = currTotal;
+      }else if (newRates){
+        strm.bandwidth = ((currTotal - strm.prevTotal) * 1000 / timeDiff) / count;
+        strm.prevTotal = currTotal;
+      }
+    }
+    if (seen.size() != streams.size()){
+      std::map<std::string, struct streamDetails>::iterator it = streams.begin();
+      while (it != streams.end()){
+        if (seen.count(it->first)){
+          ++it;
+        }else{
+          streams.erase(it++);
+        }
+      }
+    }
+
+    // Decay the bandwidth estimate of newly added viewers at the same pace as when polling every 5 seconds
+    if (prevDecayMs){scaleBandwidth(*addBandwidth, pow(0.75, (now - prevDecayMs) / 5000.0));}
+    prevDecayMs = now;
+    buildRoute();
   }
 };
 
+struct hostEntry;
+
+/// Connection state for monitoring a single host.
+/// Only used by the monitoring thread, except while connecting is set: then it belongs to the
+/// connecting thread. The connecting field itself is protected by connectMutex.
+class hostMonitor{
+public:
+  hostEntry *entry;
+  HTTP::URL url;
+  Socket::Connection C;
+  HTTP::Parser H;
+  std::string buffer;        ///< Received data that was not parsed yet
+  LoadPush::Decoder decoder; ///< Pushed load state, valid for the current connection only
+  JSON::Doc doc;             ///< Last polled load information, reused between polls
+  int sock;                  ///< Socket registered with the event loop, or -1 if none
+  bool connecting;           ///< Set while the connecting thread is opening C
+  bool attempted;            ///< Set if a connection attempt was made that was not handled yet
+  bool polling;              ///< Set if the host does not support pushing, and is polled for JSON instead
+  bool gotHeader;            ///< Set once the response header for a push connection was received
+  bool pending;              ///< Set while a poll request is awaiting its response
+  bool down;                 ///< Set while no load information is coming in
+  uint64_t lastData;         ///< Time any data was last received
+  uint64_t nextAttempt;      ///< Earliest time to attempt (re)connecting
+  uint64_t nextPoll;         ///< Earliest time to send the next poll request
+};
+
 /// Fixed-size struct for holding a host's name and details pointer
 struct hostEntry{
   uint8_t state; // 0 = off, 1 = booting, 2 = running, 3 = requesting shutdown, 4 = requesting clean
   char name[HOSTNAMELEN];          // host+port for server
   hostDetails *details;    /// hostDetails pointer
-  std::thread *thread; /// thread pointer
+  hostMonitor *monitor; /// monitoring state pointer, cleared by the monitoring thread when done
 };
 
 hostEntry hosts[MAXHOSTS]; /// Fixed-size array holding all hosts
 
+std::mutex connectMutex;                ///< Protects connectQueue and hostMonitor::connecting
+std::deque<hostMonitor *> connectQueue; ///< Hosts waiting for the connecting thread
+bool monitorActive = false;             ///< True while the monitoring thread runs
+
 void initHost(hostEntry &H, const std::string &N);
 void cleanupHost(hostEntry &H);
 
@@ -490,6 +764,7 @@ int handleRequest(Socket::Connection &conn){
           if (newVals.isMember("bw")){weight_bw = newVals["bw"].asInt();}
           if (newVals.isMember("geo")){weight_geo = newVals["geo"].asInt();}
           if (newVals.isMember("bonus")){weight_bonus = newVals["bonus"].asInt();}
+          routesDirty = true;
           ret["cpu"] = weight_cpu;
           ret["ram"] = weight_ram;
           ret["bw"] = weight_bw;
@@ -760,28 +1035,23 @@ int handleRequest(Socket::Connection &conn){
       H.Clean();
       H.SetHeader("Content-Type", "text/plain");
       H.setCORSHeaders();
-      hostEntry *bestHost = 0;
+      // Keep a reference to the routing index, so it stays valid while it is replaced
+      std::shared_ptr<const routeIndex> idx = std::atomic_load(&routes);
+      const hostRoute *bestHost = 0;
       uint64_t bestScore = 0;
-      for (HOSTLOOP){
-        HOSTCHECK;
-        uint64_t score = HOST(i).details->rate(stream, lat, lon, tagAdjust);
-        if (score > bestScore){
-          bestHost = &HOST(i);
-          bestScore = score;
-        }
-      }
+      if (idx){bestHost = idx->balance(stream, lat, lon, tagAdjust, bestScore);}
       if (!bestScore || !bestHost){
         H.SetBody(fallback);
         FAIL_MSG("All servers seem to be out of bandwidth!");
       }else{
-        INFO_MSG("Winner: %s scores %" PRIu64, bestHost->details->host.c_str(), bestScore);
-        bestHost->details->addViewer(stream);
-        H.SetBody(bestHost->details->host);
+        INFO_MSG("Winner: %s scores %" PRIu64, bestHost->host.c_str(), bestScore);
+        bestHost->addViewer(stream);
+        H.SetBody(bestHost->host);
       }
       if (proto != "" && bestHost && bestScore){
         H.Clean();
         H.setCORSHeaders();
-        H.SetHeader("Location", bestHost->details->getUrl(stream, proto) + vars);
+        H.SetHeader("Location", bestHost->getUrl(stream, proto) + vars);
         H.SetBody(H.GetHeader("Location"));
         H.SendResponse("307", "Redirecting", conn);
         H.Clean();
@@ -795,59 +1065,273 @@ int handleRequest(Socket::Connection &conn){
   return 0;
 }
 
-void handleServer(void *hostEntryPointer){
-  hostEntry *entry = (hostEntry *)hostEntryPointer;
-  JSON::Value bandwidth = 128 * 1024 * 1024u; // assume 1G connection
-  HTTP::URL url(entry->name);
-  if (!url.protocol.size()){url.protocol = "http";}
-  if (!url.port.size()){url.port = "4242";}
-  if (url.path.size()){
-    bandwidth = url.path;
-    bandwidth = bandwidth.asInt() * 1024 * 1024;
-    url.path.clear();
-  }
-  url.path = passphrase + ".json";
-
-  INFO_MSG("Monitoring %s", url.getUrl().c_str());
-  entry->details->availBandwidth = bandwidth.asInt();
-  entry->details->host = url.host;
-  entry->state = STATE_BOOT;
-  bool down = true;
-
-  HTTP::Downloader DL;
-
-  while (cfg->is_active && (entry->state != STATE_GODOWN)){
-    if (DL.get(url) && DL.isOk()){
-      JSON::Value servData = JSON::fromString(DL.data());
-      if (!servData){
-        FAIL_MSG("Can't decode server %s load information", url.host.c_str());
-        entry->details->badNess();
-        DL.getSocket().close();
-        down = true;
-        entry->state = STATE_ERROR;
-      }else{
-        if (down){
-          std::string ipStr;
-          Socket::hostBytesToStr(DL.getSocket().getBinHost().data(), 16, ipStr);
-          WARN_MSG("Connection established with %s (%s)", url.host.c_str(), ipStr.c_str());
-          memcpy(entry->details->binHost, DL.getSocket().getBinHost().data(), 16);
-          entry->state = STATE_ONLINE;
-          down = false;
+/// Sets the state of a host, unless it is being removed.
+static void setHostState(hostEntry &H, uint8_t state){
+  if (H.state == STATE_GODOWN || H.state == STATE_REQCLEAN){return;}
+  if (H.state != state){routesDirty = true;}
+  H.state = state;
+}
+
+/// Replaces the routing index with one built from the current routes of all online hosts.
+/// Only called from the monitoring thread, which guarantees the host details stay around.
+static void rebuildRoutes(){
+  routesDirty = false;
+  std::shared_ptr<routeIndex> idx(new routeIndex());
+  std::map<std::set<std::string>, size_t> tagSetIds;
+  for (HOSTLOOP){
+    HOSTCHECK;
+    if (!HOST(i).details){continue;}
+    std::shared_ptr<const hostRoute> R = HOST(i).details->getRoute();
+    if (!R){continue;}
+    if (!R->ramMax || !R->availBandwidth){
+      MEDIUM_MSG("Host %s invalid: RAM %" PRIu64 ", BW %" PRIu64, R->host.c_str(), R->ramMax, R->availBandwidth);
+      continue;
+    }
+    if (R->upSpeed >= R->availBandwidth){
+      MEDIUM_MSG("Host %s over bandwidth: %" PRIu64 " >= %" PRIu64, R->host.c_str(), R->upSpeed, R->availBandwidth);
+      continue;
+    }
+    routeIndex::entry E;
+    E.route = R;
+    E.baseScore = (weight_cpu - (R->cpu * weight_cpu) / 1000) + (weight_ram - ((R->ramCurr * weight_ram) / R->ramMax));
+    E.maxScore = E.baseScore + (weight_bw - ((R->upSpeed * weight_bw) / R->availBandwidth));
+    if (!tagSetIds.count(R->tags)){
+      tagSetIds[R->tags] = idx->tagSets.size();
+      idx->tagSets.push_back(R->tags);
+    }
+    E.tagSet = tagSetIds[R->tags];
+    idx->hosts.push_back(E);
+  }
+  std::stable_sort(idx->hosts.begin(), idx->hosts.end(),
+                   [](const routeIndex::entry &a, const routeIndex::entry &b){return a.maxScore > b.maxScore;});
+  size_t count = idx->hosts.size();
+  idx->anyStream.resize(count, false);
+  for (size_t i = 0; i < count; ++i){
+    const hostRoute &R = *idx->hosts[i].route;
+    for (std::map<std::string, uint64_t>::const_iterator it = R.streamBandwidth.begin(); it != R.streamBandwidth.end(); ++it){
+      std::vector<bool> &hasIt = idx->streams[it->first];
+      hasIt.resize(count, false);
+      hasIt[i] = true;
+    }
+    if (!R.confStreams.size()){
+      idx->anyStream[i] = true;
+      continue;
+    }
+    for (std::set<std::string>::const_iterator it = R.confStreams.begin(); it != R.confStreams.end(); ++it){
+      std::vector<bool> &hasIt = idx->confStreams[*it];
+      hasIt.resize(count, false);
+      hasIt[i] = true;
+    }
+  }
+  std::atomic_store(&routes, std::shared_ptr<const routeIndex>(idx));
+}
+
+/// Opens connections to hosts on request of the monitoring thread.
+/// Connecting blocks for up to several seconds for unreachable hosts, so it is kept out of the event loop.
+void connectHosts(){
+  while (cfg->is_active){
+    hostMonitor *M = 0;
+    {
+      std::lock_guard<std::mutex> guard(connectMutex);
+      if (connectQueue.size()){
+        M = connectQueue.front();
+        connectQueue.pop_front();
+      }
+    }
+    if (!M){
+      Util::sleep(50);
+      continue;
+    }
+    M->C.open(M->url.host, M->url.getPort(), true, M->url.protocol == "https");
+    std::lock_guard<std::mutex> guard(connectMutex);
+    M->connecting = false;
+  }
+}
+
+/// Sends the request for load information over a freshly opened or idle connection.
+static void sendLoadRequest(hostMonitor &M){
+  HTTP::Parser req;
+  req.url = "/" + passphrase + (M.polling ? ".json" : ".push");
+  req.SetHeader("Host", M.url.host);
+  req.SendRequest(M.C);
+  M.H.Clean();
+  M.H.headerOnly = !M.polling;
+}
+
+/// Marks a host as having working load information, logging it if it was not working before.
+static void hostUp(hostMonitor &M){
+  M.lastData = Util::bootMS();
+  if (!M.down){return;}
+  std::string ipStr;
+  Socket::hostBytesToStr(M.C.getBinHost().data(), 16, ipStr);
+  WARN_MSG("Connection established with %s (%s)%s", M.url.host.c_str(), ipStr.c_str(), M.polling ? ", polling" : "");
+  memcpy(M.entry->details->binHost, M.C.getBinHost().data(), 16);
+  setHostState(*M.entry, STATE_ONLINE);
+  M.down = false;
+}
+
+/// Closes the connection to a host, and schedules reconnecting after the given delay.
+/// Unless the disconnect was expected, the host is marked as being in error.
+static void hostDisconnect(Event::Loop &E, hostMonitor &M, uint64_t retryMs, bool error){
+  if (M.sock != -1){
+    E.remove(M.sock);
+    M.sock = -1;
+  }
+  M.C.close();
+  M.buffer.clear();
+  M.attempted = false;
+  M.nextAttempt = Util::bootMS() + retryMs;
+  if (!error){return;}
+  M.entry->details->badNess();
+  M.down = true;
+  setHostState(*M.entry, STATE_ERROR);
+}
+
+/// Handles incoming data on a host connection: either pushed load frames or poll responses.
+static void hostData(Event::Loop &E, hostMonitor &M){
+  M.C.spool();
+  while (M.C.Received().size()){
+    M.buffer.append(M.C.Received().get());
+    M.C.Received().get().clear();
+  }
+  if (M.polling){
+    while (M.H.Read(M.buffer)){
+      bool parsed = M.doc.parse(M.H.body);
+      M.H.Clean();
+      M.pending = false;
+      if (!parsed || !M.doc.root()){
+        FAIL_MSG("Can't decode server %s load information", M.url.host.c_str());
+        hostDisconnect(E, M, 5000, true);
+        return;
+      }
+      hostUp(M);
+      M.entry->details->update(M.doc.root());
+    }
+  }else{
+    if (!M.gotHeader){
+      if (!M.H.Read(M.buffer)){
+        if (!M.C){
+          FAIL_MSG("Lost connection to server %s", M.url.host.c_str());
+          hostDisconnect(E, M, 5000, true);
         }
-        entry->details->update(servData);
+        return;
       }
-    }else{
-      FAIL_MSG("Can't retrieve server %s load information", url.host.c_str());
-      entry->details->badNess();
-      DL.getSocket().close();
-      down = true;
-      entry->state = STATE_ERROR;
+      if (M.H.url != "200" || M.H.GetHeader("Content-Type") != LoadPush::contentType){
+        INFO_MSG("Server %s does not push load information; polling it instead", M.url.host.c_str());
+        M.polling = true;
+        hostDisconnect(E, M, 0, false);
+        return;
+      }
+      M.gotHeader = true;
+      hostUp(M);
+    }
+    uint64_t frames = M.decoder.frames;
+    M.buffer.erase(0, M.decoder.parse(M.buffer.data(), M.buffer.size()));
+    if (M.decoder.error()){
+      FAIL_MSG("Can't decode server %s load information", M.url.host.c_str());
+      hostDisconnect(E, M, 5000, true);
+      return;
+    }
+    if (M.decoder.frames != frames){
+      M.lastData = Util::bootMS();
+      if (M.decoder.changed.size()){
+        M.entry->details->update(M.decoder.state, M.decoder.changed);
+        M.decoder.changed.clear();
+      }
+    }
+  }
+  if (!M.C){
+    FAIL_MSG("Lost connection to server %s", M.url.host.c_str());
+    hostDisconnect(E, M, 5000, true);
+  }
+}
+
+/// Lets go of a host that is being removed. Returns false if it cannot be released yet.
+static bool releaseHost(Event::Loop &E, hostMonitor &M){
+  {
+    std::lock_guard<std::mutex> guard(connectMutex);
+    if (M.connecting){
+      std::deque<hostMonitor *>::iterator it = std::find(connectQueue.begin(), connectQueue.end(), &M);
+      if (it == connectQueue.end()){return false;}
+      connectQueue.erase(it);
+      M.connecting = false;
     }
-    Util::wait(5000);
   }
-  WARN_MSG("Monitoring thread for %s stopping", url.host.c_str());
-  DL.getSocket().close();
+  WARN_MSG("Monitoring of %s stopping", M.url.host.c_str());
+  hostDisconnect(E, M, 0, false);
+  hostEntry *entry = M.entry;
+  delete entry->monitor;
+  entry->monitor = 0;
   entry->state = STATE_REQCLEAN;
+  return true;
+}
+
+/// Progresses connection attempts, poll requests and timeouts for all hosts.
+static void checkHosts(Event::Loop &E){
+  uint64_t now = Util::bootMS();
+  if (routesDirty){rebuildRoutes();}
+  for (HOSTLOOP){
+    hostEntry &entry = HOST(i);
+    if (entry.state == STATE_OFF || entry.state == STATE_REQCLEAN || !entry.monitor){continue;}
+    hostMonitor &M = *entry.monitor;
+    if (entry.state == STATE_GODOWN){
+      releaseHost(E, M);
+      continue;
+    }
+    if (M.sock == -1){
+      {
+        std::lock_guard<std::mutex> guard(connectMutex);
+        if (M.connecting){continue;}
+        if (!M.attempted){
+          if (now >= M.nextAttempt){
+            M.attempted = true;
+            M.connecting = true;
+            connectQueue.push_back(&M);
+          }
+          continue;
+        }
+      }
+      if (!M.C){
+        FAIL_MSG("Can't retrieve server %s load information", M.url.host.c_str());
+        hostDisconnect(E, M, 5000, true);
+        continue;
+      }
+      M.sock = M.C.getSocket();
+      E.addSocket(M.sock, [&E](void *m){hostData(E, *(hostMonitor *)m);}, &M);
+      M.buffer.clear();
+      M.decoder = LoadPush::Decoder();
+      M.gotHeader = false;
+      M.pending = false;
+      M.nextPoll = now;
+      M.lastData = now;
+      if (!M.polling){sendLoadRequest(M);}
+    }
+    if (M.polling && !M.pending && now >= M.nextPoll){
+      sendLoadRequest(M);
+      M.pending = true;
+      M.nextPoll = now + 5000;
+    }
+    if (now > M.lastData + 15000){
+      FAIL_MSG("Server %s load information timed out", M.url.host.c_str());
+      hostDisconnect(E, M, 0, true);
+    }
+  }
+}
+
+/// Monitors all hosts from a single event loop, with a helper thread for opening connections.
+void monitorHosts(){
+  Event::Loop E;
+  E.addInterval([&E](){
+    checkHosts(E);
+    return 100;
+  }, 100);
+  std::thread connector(connectHosts);
+  while (cfg->is_active){E.await(1000);}
+  connector.join();
+  for (HOSTLOOP){
+    if (HOST(i).monitor){releaseHost(E, *HOST(i).monitor);}
+  }
+  monitorActive = false;
 }
 
 int main(int argc, char **argv){
@@ -954,7 +1438,6 @@ int main(int argc, char **argv){
   JSON::Value &nodes = conf.getOption("server", true);
   conf.activate();
 
-  std::map<std::string, std::thread *> threads;
   jsonForEach(nodes, it){
     if (it->asStringRef().size() > 199){
       FAIL_MSG("Host length too long for monitoring, skipped: %s", it->asStringRef().c_str());
@@ -965,6 +1448,8 @@ int main(int argc, char **argv){
   }
   WARN_MSG("Load balancer activating. Balancing between %lu nodes.", hostsCounter);
 
+  monitorActive = true;
+  std::thread monitor(monitorHosts);
   conf.serveThreadedSocket(handleRequest);
   if (!conf.is_active){
     WARN_MSG("Load balancer shutting down; received shutdown signal");
@@ -973,23 +1458,49 @@ int main(int argc, char **argv){
   }
   conf.is_active = false;
 
-  // Join all threads
+  // Stop monitoring and clean up all hosts
   for (HOSTLOOP){
     if (!HOST(i).name[0]){continue;}
     HOST(i).state = STATE_GODOWN;
   }
+  monitor.join();
   for (HOSTLOOP){cleanupHost(HOST(i));}
 }
 
 void initHost(hostEntry &H, const std::string &N){
   // Cancel if this host has no name set
   if (!N.size()){return;}
-  H.state = STATE_BOOT;
   H.details = new hostDetails();
   memset(H.name, 0, HOSTNAMELEN);
   memcpy(H.name, N.data(), N.size());
-  H.thread = new std::thread(handleServer, (void *)&H);
-  INFO_MSG("Starting monitoring %s", H.name);
+
+  hostMonitor *M = new hostMonitor();
+  M->entry = &H;
+  M->url = HTTP::URL(H.name);
+  if (!M->url.protocol.size()){M->url.protocol = "http";}
+  if (!M->url.port.size()){M->url.port = "4242";}
+  JSON::Value bandwidth = 128 * 1024 * 1024u; // assume 1G connection
+  if (M->url.path.size()){
+    bandwidth = M->url.path;
+    bandwidth = bandwidth.asInt() * 1024 * 1024;
+    M->url.path.clear();
+  }
+  M->sock = -1;
+  M->connecting = false;
+  M->attempted = false;
+  M->polling = false;
+  M->gotHeader = false;
+  M->pending = false;
+  M->down = true;
+  M->lastData = 0;
+  M->nextAttempt = 0;
+  M->nextPoll = 0;
+  H.details->availBandwidth = bandwidth.asInt();
+  H.details->host = M->url.host;
+  H.monitor = M;
+  // Set the state last, the monitoring thread picks the host up as soon as it is not off
+  H.state = STATE_BOOT;
+  INFO_MSG("Starting monitoring %s", M->url.getUrl().c_str());
 }
 
 void cleanupHost(hostEntry &H){
@@ -997,10 +1508,13 @@ void cleanupHost(hostEntry &H){
   if (!H.name[0]){return;}
   H.state = STATE_GODOWN;
   INFO_MSG("Stopping monitoring %s", H.name);
-  // Clean up thread
-  H.thread->join();
-  delete H.thread;
-  H.thread = 0;
+  // Wait for the monitoring thread to let go of this host
+  while (H.monitor && monitorActive){Util::sleep(10);}
+  if (H.monitor){
+    delete H.monitor;
+    H.monitor = 0;
+  }
+  routesDirty = true;
   // Clean up details
   delete H.details;
   H.details = 0;
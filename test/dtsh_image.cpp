@@ -0,0 +1,151 @@
+#include <mist/dtsc.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+
+/// Fills the given metadata with a video and an audio track of the given duration in seconds,
+/// with a keyframe every 2 seconds, 25 video frames and 50 audio frames per second.
+static void fillMeta(DTSC::Meta &M, size_t seconds){
+  size_t vid = M.addTrack(seconds / 10 + 1, seconds / 2 + 1, seconds * 25 + 1);
+  M.setType(vid, "video");
+  M.setCodec(vid, "VP8");
+  M.setInit(vid, "testinit");
+  M.setWidth(vid, 1920);
+  M.setHeight(vid, 1080);
+  M.setFpks(vid, 25000);
+  M.setID(vid, 1);
+  size_t aud = M.addTrack(seconds / 10 + 1, seconds * 50 / 100 + 1, seconds * 50 + 1);
+  M.setType(aud, "audio");
+  M.setCodec(aud, "AAC");
+  M.setInit(aud, std::string("\022\020", 2));
+  M.setRate(aud, 48000);
+  M.setChannels(aud, 2);
+  M.setSize(aud, 16);
+  M.setLang(aud, "eng");
+  M.setID(aud, 2);
+  uint64_t bpos = 1;
+  for (uint64_t ms = 0; ms < seconds * 1000; ms += 20){
+    if (ms % 40 == 0){
+      M.update(ms, 40, vid, 5000 + ms % 777, bpos, ms % 2000 == 0);
+      bpos += 5000 + ms % 777;
+    }
+    M.update(ms, 0, aud, 300, bpos, ms % 2000 == 0);
+    bpos += 300;
+  }
+  M.inputLocalVars["test"] = "banana";
+}
+
+/// Compares all track metadata, keys and parts of the given tracks in a and b.
+static bool sameMeta(const DTSC::Meta &a, const DTSC::Meta &b){
+  std::set<size_t> aTracks = a.getValidTracks(), bTracks = b.getValidTracks();
+  if (aTracks != bTracks || !aTracks.size()){
+    std::cerr << "Track lists differ: " << aTracks.size() << " != " << bTracks.size() << std::endl;
+    return false;
+  }
+  for (std::set<size_t>::iterator it = aTracks.begin(); it != aTracks.end(); ++it){
+    size_t i = *it;
+    if (a.getType(i) != b.getType(i) || a.getCodec(i) != b.getCodec(i) || a.getInit(i) != b.getInit(i) ||
+        a.getID(i) != b.getID(i) || a.getLang(i) != b.getLang(i) || a.getFirstms(i) != b.getFirstms(i) ||
+        a.getLastms(i) != b.getLastms(i) || a.getWidth(i) != b.getWidth(i) || a.getRate(i) != b.getRate(i)){
+      std::cerr << "Track " << i << " differs" << std::endl;
+      return false;
+    }
+    DTSC::Keys aKeys(a.keys(i)), bKeys(b.keys(i));
+    if (aKeys.getEndValid() != bKeys.getEndValid() || aKeys.getEndValid() < 2){
+      std::cerr << "Track " << i << " key count differs" << std::endl;
+      return false;
+    }
+    for (size_t k = aKeys.getFirstValid(); k < aKeys.getEndValid(); ++k){
+      if (aKeys.getTime(k) != bKeys.getTime(k) || aKeys.getSize(k) != bKeys.getSize(k) ||
+          aKeys.getParts(k) != bKeys.getParts(k) || aKeys.getBpos(k) != bKeys.getBpos(k)){
+        std::cerr << "Track " << i << " key " << k << " differs" << std::endl;
+        return false;
+      }
+    }
+    DTSC::Parts aParts(a.parts(i)), bParts(b.parts(i));
+    if (aParts.getEndValid() != bParts.getEndValid()){
+      std::cerr << "Track " << i << " part count differs" << std::endl;
+      return false;
+    }
+    for (size_t p = aParts.getFirstValid(); p < aParts.getEndValid(); ++p){
+      if (aParts.getSize(p) != bParts.getSize(p) || aParts.getDuration(p) != bParts.getDuration(p) ||
+          aParts.getOffset(p) != bParts.getOffset(p)){
+        std::cerr << "Track " << i << " part " << p << " differs" << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/// Writes a metadata image, loads it back under another stream name and verifies both the loading
+/// process and a separate reader see the same metadata as the original.
+static int checkRoundTrip(const std::string &fileName){
+  std::string srcName = "dtsmtest_src" + JSON::Value(getpid()).asString();
+  std::string dstName = "dtsmtest_dst" + JSON::Value(getpid()).asString();
+  DTSC::Meta src(srcName, true);
+  fillMeta(src, 120);
+  if (!src.toImage(fileName)){
+    std::cerr << "Could not write image" << std::endl;
+    return 1;
+  }
+  DTSC::Meta dst;
+  if (!dst.fromImage(dstName, fileName)){
+    std::cerr << "Could not load image" << std::endl;
+    return 2;
+  }
+  if (!sameMeta(src, dst)){return 3;}
+  if (dst.inputLocalVars["test"].asStringRef() != "banana"){
+    std::cerr << "Input local variables were not restored" << std::endl;
+    return 4;
+  }
+  DTSC::Meta reader(dstName, false);
+  if (!reader || !sameMeta(src, reader)){
+    std::cerr << "Reader does not see the loaded metadata" << std::endl;
+    return 5;
+  }
+  return 0;
+}
+
+/// Writes a metadata image with a different layout version and verifies it is rejected.
+static int checkVersion(const std::string &fileName){
+  std::string srcName = "dtsmtest_src" + JSON::Value(getpid()).asString();
+  std::string dstName = "dtsmtest_dst" + JSON::Value(getpid()).asString();
+  DTSC::Meta src(srcName, true);
+  fillMeta(src, 10);
+  if (!src.toImage(fileName)){
+    std::cerr << "Could not write image" << std::endl;
+    return 1;
+  }
+  FILE *f = fopen(fileName.c_str(), "r+");
+  uint32_t badVersion = DTSM_VERSION + 1;
+  fseek(f, 8, SEEK_SET);
+  fwrite(&badVersion, 4, 1, f);
+  fclose(f);
+  DTSC::Meta bad;
+  if (bad.fromImage(dstName, fileName)){
+    std::cerr << "Loaded image with wrong layout version" << std::endl;
+    return 2;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv){
+  if (argc < 2){
+    std::cerr << "Usage: " << argv[0] << " roundtrip|version" << std::endl;
+    return 1;
+  }
+  std::string test = argv[1];
+  std::string fileName = "/tmp/dtsmtest" + JSON::Value(getpid()).asString() + ".dtsm";
+  int ret = 1;
+  if (test == "roundtrip"){
+    ret = checkRoundTrip(fileName);
+  }else if (test == "version"){
+    ret = checkVersion(fileName);
+  }else{
+    std::cerr << "Unknown test: " << test << std::endl;
+  }
+  unlink(fileName.c_str());
+  return ret;
+}
@@ -2,6 +2,24 @@
 #include <mist/http_parser.h>
 #include <mist/timing.h>
 
+/// If the T_HEADER environment variable is set to "Name: value", checks that every message read
+/// has that header, both through headerView and through GetHeader.
+static bool checkHeader(const HTTP::Parser &p){
+  if (!getenv("T_HEADER")){return true;}
+  std::string hdr = getenv("T_HEADER");
+  std::string name = hdr.substr(0, hdr.find(':'));
+  std::string val = hdr.substr(name.size() + 2);
+  if (p.headerView(name.c_str()) != val.c_str() || !p.hasHeader(name)){
+    FAIL_MSG("Header view of %s is '%s', expected '%s'", name.c_str(), p.headerView(name.c_str()).str().c_str(), val.c_str());
+    return false;
+  }
+  if (p.GetHeader(name) != val || p.headerView(name.c_str()) != val.c_str()){
+    FAIL_MSG("Header %s is '%s', expected '%s'", name.c_str(), p.GetHeader(name).c_str(), val.c_str());
+    return false;
+  }
+  return true;
+}
+
 int main(int argc, char ** argv){
   bool preMade = false;
   Socket::Connection C(1, 0); // Open stdio by default
@@ -33,6 +51,7 @@ int main(int argc, char ** argv){
       while (p.Read(C)){
         INFO_MSG("Read a HTTP message: %s %s %s (%zu bytes)", p.method.c_str(), p.url.c_str(), p.protocol.c_str(), p.body.size());
         ++counter;
+        if (!checkHeader(p)){return 1;}
         p.Clean();
       }
     }else{
@@ -48,6 +67,7 @@ int main(int argc, char ** argv){
   while (p.Read(C)){
     INFO_MSG("Read a HTTP message: %s %s %s (%zu bytes)", p.method.c_str(), p.url.c_str(), p.protocol.c_str(), p.body.size());
     ++counter;
+    if (!checkHeader(p)){return 1;}
     p.Clean();
   }
 
@@ -0,0 +1,183 @@
+#include <mist/json.h>
+#include <mist/json_doc.h>
+#include <iostream>
+#include <string>
+
+/// Returns a pseudo-random number below max.
+static uint32_t rnd(unsigned int &seed, uint32_t max){
+  seed = seed * 1103515245 + 12345;
+  return ((seed >> 8) & 0xFFFFFF) % max;
+}
+
+/// Returns a short string with printable ASCII, characters that need escaping, control
+/// characters and UTF-8 sequences of every length mixed in.
+static std::string rndString(unsigned int &seed){
+  static const char *parts[] ={"a", "b", "stream", "\"", "\\", "\n", "\t", "\001", "\177", "/",
+                               "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "'", " ", "Z"};
+  std::string ret;
+  uint32_t len = rnd(seed, 8);
+  for (uint32_t i = 0; i < len; ++i){ret += parts[rnd(seed, 16)];}
+  return ret;
+}
+
+/// Returns a random JSON::Value, nested at most depth levels deep.
+static JSON::Value rndValue(unsigned int &seed, int depth){
+  JSON::Value ret;
+  switch (rnd(seed, depth > 0 ? 9 : 6)){
+  case 0: ret.null(); break;
+  case 1: ret = (bool)rnd(seed, 2); break;
+  case 2: ret = (int64_t)rnd(seed, 1000) - 500; break;
+  case 3: ret = (int64_t)rnd(seed, 0xFFFFFF) * (int64_t)0x7FFFFFFF; break;
+  case 4: ret = (double)rnd(seed, 100000) / 64.0 - 700; break;
+  case 5: ret = rndString(seed); break;
+  case 6:
+  case 7:{
+    ret[""];
+    ret.shrink(0);
+    uint32_t len = rnd(seed, 7);
+    for (uint32_t i = 0; i < len; ++i){ret[rndString(seed)] = rndValue(seed, depth - 1);}
+    break;
+  }
+  default:{
+    ret.append();
+    ret.shrink(0);
+    uint32_t len = rnd(seed, 7);
+    for (uint32_t i = 0; i < len; ++i){ret.append(rndValue(seed, depth - 1));}
+    break;
+  }
+  }
+  return ret;
+}
+
+/// Compares everything the read API of a Node returns with what a const JSON::Value returns.
+static bool same(const JSON::Value &V, const JSON::Node &N){
+  if (V.isInt() != N.isInt() || V.isDouble() != N.isDouble() || V.isString() != N.isString() ||
+      V.isBool() != N.isBool() || V.isObject() != N.isObject() || V.isArray() != N.isArray() ||
+      V.isNull() != N.isNull()){
+    return false;
+  }
+  if ((bool)V != (bool)N || V.asInt() != N.asInt() || V.asDouble() != N.asDouble() ||
+      V.asString() != N.asString() || std::string(V.c_str()) != N.c_str() || V.size() != N.size()){
+    return false;
+  }
+  JSON::DocIter it(N);
+  jsonForEachConst(V, i){
+    if (!it || i.num() != it.num() || !same(*i, *it)){return false;}
+    if (V.isObject() && (i.key() != it.key() || !N.isMember(i.key()) || !same(*i, N[i.key()]) || !same(*i, N[i.key().c_str()]))){
+      return false;
+    }
+    if (V.isArray() && (it.key() != "" || !same(*i, N[i.num()]))){return false;}
+    ++it;
+  }
+  if (it || N["missing"] || !N["missing"].isNull() || N[N.size()]){return false;}
+  return true;
+}
+
+/// Parses generated documents with JSON::Value, JSON::Doc and JSON::Writer, and verifies that all
+/// of them read and serialise them exactly the same.
+static int checkGenerated(){
+  unsigned int seed = 7;
+  JSON::Doc D;
+  for (size_t round = 0; round < 3000; ++round){
+    std::string text = rndValue(seed, 1 + round % 6).toString();
+    if (round % 3 == 1){text = JSON::fromString(text).toPrettyString();}
+    JSON::Value V = JSON::fromString(text);
+    std::string expect = V.toString();
+    if (!D.parse(text)){
+      std::cerr << "Could not parse " << text << std::endl;
+      return 1;
+    }
+    if (D.root().toString() != expect){
+      std::cerr << "Serialised differently: " << D.root().toString() << " != " << expect << std::endl;
+      return 2;
+    }
+    if (!same(V, D.root()) || D.root().toValue() != V){
+      std::cerr << "Read differently: " << expect << std::endl;
+      return 3;
+    }
+    JSON::Writer W;
+    W.write(V);
+    JSON::Writer P;
+    if (W.str() != expect || !JSON::parse(text, P) || P.str() != expect){
+      std::cerr << "Writer output differs for " << expect << std::endl;
+      return 4;
+    }
+  }
+  return 0;
+}
+
+/// Verifies that for duplicate keys the last one wins.
+static int checkDuplicates(){
+  JSON::Doc D;
+  if (!D.parse("{\"b\":1, \"a\":[], 'b':3}") || D.root().size() != 2 || D.root()["b"].asInt() != 3 ||
+      D.root().toString() != "{\"a\":[],\"b\":3}"){
+    std::cerr << "Duplicate keys handled wrong" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+/// Verifies escapes, surrogate pairs and lone surrogates decode the same as JSON::Value does.
+static int checkEscapes(){
+  JSON::Doc D;
+  const char *escaped[] ={"\"a\\u00e9\\u20ac\\ud83d\\ude00\\x41\\/\\n\"", "\"\\ud83d\"", "\"\\ud83dx\"",
+                          "\"\\ude00\\ud83d\\u0041\"", "[TRUE, False, null, -0.25, -12, 1.5e3]"};
+  for (size_t i = 0; i < sizeof(escaped) / sizeof(escaped[0]); ++i){
+    JSON::Value V = JSON::fromString(escaped[i]);
+    if (!D.parse(escaped[i]) || (i < 4 && D.root().asString() != V.asString()) ||
+        (i == 4 && D.root().toString() != "[true,false,null,-0.25,-12,1500]")){
+      std::cerr << "Decoded " << escaped[i] << " differently" << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Verifies invalid input is rejected and leaves an empty document.
+static int checkInvalid(){
+  JSON::Doc D;
+  const char *broken[] ={"", " ", "{", "[1,", "{\"a\" 1}", "\"abc", "[1 2]", "{\"a\":1,}", "[,1]", "-", "x"};
+  for (size_t i = 0; i < sizeof(broken) / sizeof(broken[0]); ++i){
+    if (D.parse(broken[i]) || D.root()){
+      std::cerr << "Accepted invalid input " << broken[i] << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Verifies a Writer with a sink hands over the same text in pieces.
+static int checkSink(){
+  unsigned int seed = 7;
+  JSON::Value big;
+  for (size_t i = 0; i < 20000; ++i){big.append(rndValue(seed, 3));}
+  std::string pieces;
+  size_t count = 0;
+  {
+    JSON::Writer W([&](const char *data, size_t len){
+      pieces.append(data, len);
+      ++count;
+    });
+    W.write(big);
+  }
+  if (pieces != big.toString() || count < 2){
+    std::cerr << "Writer with sink wrote differently, in " << count << " pieces" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv){
+  if (argc < 2){
+    std::cerr << "Usage: " << argv[0] << " generated|duplicates|escapes|invalid|sink" << std::endl;
+    return 1;
+  }
+  std::string test = argv[1];
+  if (test == "generated"){return checkGenerated();}
+  if (test == "duplicates"){return checkDuplicates();}
+  if (test == "escapes"){return checkEscapes();}
+  if (test == "invalid"){return checkInvalid();}
+  if (test == "sink"){return checkSink();}
+  std::cerr << "Unknown test: " << test << std::endl;
+  return 1;
+}
@@ -0,0 +1,98 @@
+#include <mist/http_parser.h>
+#include <mist/socket.h>
+#include <mist/timing.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <thread>
+#include <vector>
+
+std::atomic<bool> running(true);
+std::atomic<uint64_t> failures(0);
+std::mutex latencyMutex;
+std::vector<uint64_t> latencies; ///< Microseconds per request, of all threads combined
+
+/// Sends requests for the given path over a single keep-alive connection until stopped.
+/// Reconnects whenever the connection is lost.
+static void requester(const std::string &host, int port, const std::string &path){
+  std::vector<uint64_t> local;
+  Socket::Connection C;
+  HTTP::Parser H;
+  while (running){
+    if (!C){
+      C.open(host, port, false);
+      if (!C){
+        ++failures;
+        Util::sleep(100);
+        continue;
+      }
+      int one = 1;
+      setsockopt(C.getSocket(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    H.Clean();
+    H.url = path;
+    H.SetHeader("Host", host);
+    uint64_t start = Util::getMicros();
+    H.SendRequest(C);
+    H.Clean();
+#ifdef TCP_QUICKACK
+    // Servers that write header and body separately would otherwise stall on delayed ACKs
+    int one = 1;
+    setsockopt(C.getSocket(), IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+#endif
+    bool done = false;
+    while (C && !done){
+      if (C.spool() || C.Received().size()){
+        done = H.Read(C);
+      }else{
+        Util::sleep(1);
+      }
+    }
+    if (!done){
+      ++failures;
+      continue;
+    }
+    local.push_back(Util::getMicros(start));
+    if (H.url != "200" && H.url != "307"){++failures;}
+  }
+  std::lock_guard<std::mutex> guard(latencyMutex);
+  latencies.insert(latencies.end(), local.begin(), local.end());
+}
+
+/// Generates load on an HTTP server such as the load balancer, and prints the throughput and latency.
+/// Usage: loadgentest HOST PORT [PATH [THREADS [SECONDS]]]
+int main(int argc, char **argv){
+  if (argc < 3){
+    std::cerr << "Usage: " << argv[0] << " HOST PORT [PATH [THREADS [SECONDS]]]" << std::endl;
+    return 1;
+  }
+  std::string host = argv[1];
+  int port = atoi(argv[2]);
+  std::string path = (argc > 3) ? argv[3] : "/live";
+  size_t threadCount = (argc > 4) ? atoi(argv[4]) : 8;
+  size_t seconds = (argc > 5) ? atoi(argv[5]) : 10;
+
+  std::vector<std::thread> threads;
+  uint64_t start = Util::getMicros();
+  for (size_t i = 0; i < threadCount; ++i){threads.push_back(std::thread(requester, host, port, path));}
+  Util::sleep(seconds * 1000);
+  running = false;
+  for (size_t i = 0; i < threadCount; ++i){threads[i].join();}
+  uint64_t taken = Util::getMicros(start);
+
+  if (!latencies.size()){
+    std::cerr << "No requests completed" << std::endl;
+    return 2;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << latencies.size() << " requests in " << taken / 1000000.0 << "s over " << threadCount
+            << " connections: " << latencies.size() * 1000000.0 / taken << " req/s, " << failures << " failures"
+            << std::endl;
+  std::cout << "Latency: p50 " << latencies[latencies.size() / 2] << "us, p99 "
+            << latencies[latencies.size() * 99 / 100] << "us, max " << latencies.back() << "us" << std::endl;
+  return 0;
+}
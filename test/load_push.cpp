@@ -0,0 +1,103 @@
+#include <mist/json.h>
+#include <mist/load_push.h>
+#include <iostream>
+
+/// Fills the given state with the load of a server with the given amount of active streams.
+/// The round number determines which streams are active and how busy they are.
+static void fillState(LoadPush::State &S, size_t streams, size_t round){
+  S.clear();
+  S.counters["cpu"] = 100 + round % 7;
+  S.counters["mem_total"] = 16ull * 1024 * 1024 * 1024;
+  S.counters["mem_used"] = 4ull * 1024 * 1024 * 1024 + round * 4096;
+  S.counters["up"] = round * 1000000;
+  S.counters["down"] = round * 10000;
+  S.texts["tags"] = (round % 3) ? "edge\neu" : "edge";
+  S.texts["out:HLS"] = "http://HOST:8080/hls/$/index.m3u8";
+  for (size_t i = 0; i < streams; ++i){
+    // Every 5th stream drops out in odd rounds, to test removing and re-adding values
+    if (i % 5 == 0 && (round & 1)){continue;}
+    std::string name = "live+stream" + JSON::Value(i).asString();
+    S.counters["viewers:" + name] = (i * 3 + round) % 50;
+    S.counters["inputs:" + name] = 1;
+    S.counters["up:" + name] = round * (i + 1) * 1000;
+  }
+}
+
+/// Encodes rounds of changing state, and verifies the decoder ends up with identical state after
+/// every frame, also when the data arrives in small pieces.
+static int checkRounds(size_t streams, size_t rounds){
+  LoadPush::Encoder enc;
+  LoadPush::Decoder dec;
+  LoadPush::State S;
+  std::string pending;
+  for (size_t round = 0; round < rounds; ++round){
+    fillState(S, streams, round);
+    std::string frame;
+    if (!enc.encode(S, frame)){
+      std::cerr << "Round " << round << " produced no frame" << std::endl;
+      return 1;
+    }
+    // Nothing changed, so a second encode must not produce anything
+    if (enc.encode(S, frame)){
+      std::cerr << "Round " << round << " produced a frame without changes" << std::endl;
+      return 2;
+    }
+    enc.heartbeat(frame);
+    pending += frame;
+    // Feed the data in pieces of varying size, keeping the unparsed remainder around
+    size_t pieceLen = 1 + round % 13, fed = 0;
+    while (fed < pending.size()){
+      fed += pieceLen;
+      if (fed > pending.size()){fed = pending.size();}
+      size_t used = dec.parse(pending.data(), fed);
+      pending.erase(0, used);
+      fed -= used;
+    }
+    if (dec.error() || pending.size()){
+      std::cerr << "Round " << round << " could not be decoded" << std::endl;
+      return 3;
+    }
+    if (dec.state.counters != S.counters || dec.state.texts != S.texts){
+      std::cerr << "Round " << round << " decoded to a different state" << std::endl;
+      return 4;
+    }
+    if (!dec.changed.count("cpu") || (round && dec.changed.count("mem_total"))){
+      std::cerr << "Round " << round << " reported wrong changes" << std::endl;
+      return 5;
+    }
+    dec.changed.clear();
+  }
+  if (dec.frames != rounds * 2){
+    std::cerr << "Expected " << rounds * 2 << " frames, got " << dec.frames << std::endl;
+    return 6;
+  }
+  return 0;
+}
+
+/// Verifies garbage is detected as an error instead of being applied.
+static int checkGarbage(){
+  LoadPush::Decoder bad;
+  std::string garbage("\003\011\000\001", 4);
+  bad.parse(garbage.data(), garbage.size());
+  if (!bad.error()){
+    std::cerr << "Garbage frame was not detected" << std::endl;
+    return 1;
+  }
+  if (bad.state.counters.size() || bad.state.texts.size()){
+    std::cerr << "Garbage frame was applied" << std::endl;
+    return 2;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv){
+  if (argc < 2){
+    std::cerr << "Usage: " << argv[0] << " rounds|garbage" << std::endl;
+    return 1;
+  }
+  std::string test = argv[1];
+  if (test == "rounds"){return checkRounds(100, 200);}
+  if (test == "garbage"){return checkGarbage();}
+  std::cerr << "Unknown test: " << test << std::endl;
+  return 1;
+}
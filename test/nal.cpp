@@ -0,0 +1,156 @@
+#include <mist/nal.h>
+#include <iostream>
+#include <string>
+
+/// The byte-by-byte start code scanner, as it was before it was vectorised.
+static const char *refScanAnnexB(const char *data, uint32_t dataSize){
+  const char *offset = data;
+  const char *maxData = data + dataSize - 2;
+  while (offset < maxData){
+    if (offset[2] > 1){
+      offset += 3;
+      continue;
+    }
+    if (!offset[2]){
+      ++offset;
+      continue;
+    }
+    if (!offset[0] && !offset[1]){return offset;}
+    offset += 3;
+  }
+  return 0;
+}
+
+/// The byte-by-byte emulation prevention remover, as it was before it was vectorised.
+static std::string refRemoveEmulationPrevention(const std::string &data){
+  if (data.size() <= 2){return data;}
+  std::string result;
+  result.resize(data.size());
+  result[0] = data[0];
+  result[1] = data[1];
+  size_t dataPtr = 2;
+  size_t dataLen = data.size();
+  size_t resPtr = 2;
+  while (dataPtr + 2 < dataLen){
+    if (!data[dataPtr] && !data[dataPtr + 1] && data[dataPtr + 2] == 3){
+      result[resPtr++] = data[dataPtr++];
+      result[resPtr++] = data[dataPtr++];
+      dataPtr++;
+    }else{
+      result[resPtr++] = data[dataPtr++];
+    }
+  }
+  while (dataPtr < dataLen){result[resPtr++] = data[dataPtr++];}
+  return result.substr(0, resPtr);
+}
+
+/// Returns len pseudo-random bytes where zeroes, ones and threes are very common, so that start
+/// codes and emulation prevention sequences show up at every possible position.
+static std::string nastyData(size_t len, unsigned int &seed){
+  std::string ret(len, 0);
+  for (size_t i = 0; i < len; ++i){
+    seed = seed * 1103515245 + 12345;
+    unsigned int r = (seed >> 16) % 10;
+    ret[i] = (r < 5) ? 0 : (r < 7 ? 1 : (r < 9 ? 3 : (char)(seed >> 8)));
+  }
+  return ret;
+}
+
+/// Returns an Annex B bitstream resembling compressed video: high-entropy NAL units of varying
+/// size with emulation prevention applied, separated by 3- and 4-byte start codes.
+static std::string videoData(size_t len){
+  std::string ret;
+  unsigned int seed = 42;
+  while (ret.size() < len){
+    ret.append((ret.size() % 3) ? "\000\000\001" : "\000\000\000\001", (ret.size() % 3) ? 3 : 4);
+    size_t nalLen = 200 + (ret.size() * 7919) % 60000;
+    size_t zeroes = 0;
+    for (size_t i = 0; i < nalLen; ++i){
+      seed = seed * 1103515245 + 12345;
+      char c = (char)(seed >> 16);
+      if (zeroes >= 2 && (uint8_t)c <= 3){
+        ret += (char)3;
+        zeroes = 0;
+      }
+      ret += c;
+      zeroes = c ? 0 : zeroes + 1;
+    }
+  }
+  return ret;
+}
+
+/// Compares the vectorised functions with the byte-by-byte versions for all lengths up to a few
+/// hundred bytes at every alignment. Everything must match exactly.
+static int checkSmall(){
+  unsigned int seed = 1;
+  for (size_t len = 0; len < 300; ++len){
+    for (size_t align = 0; align < 40; ++align){
+      std::string buf = nastyData(len + align, seed).substr(align);
+      // Scan every suffix, so matches are found at every distance from the start
+      for (size_t start = 0; start <= buf.size(); start += 1 + start / 8){
+        const char *p = buf.data() + start;
+        uint32_t size = buf.size() - start;
+        if (nalu::scanAnnexB(p, size) != refScanAnnexB(p, size)){
+          std::cerr << "scanAnnexB mismatch at length " << size << ", alignment " << align << std::endl;
+          return 1;
+        }
+      }
+      if (nalu::removeEmulationPrevention(buf) != refRemoveEmulationPrevention(buf)){
+        std::cerr << "removeEmulationPrevention mismatch at length " << len << ", alignment " << align << std::endl;
+        return 2;
+      }
+    }
+  }
+  return 0;
+}
+
+/// Compares the vectorised functions with the byte-by-byte versions on large buffers where matches
+/// are rare, so the vectorised loops run for a while before finding one.
+static int checkLarge(){
+  unsigned int seed = 1;
+  for (size_t round = 0; round < 20; ++round){
+    std::string buf = nastyData(100000 + round * 4097, seed);
+    // Make matches rare
+    for (size_t i = 0; i < buf.size(); ++i){
+      if (buf[i] != 0 || (i % (1000 + round * 300))){buf[i] = (char)(0x40 | (i & 0x3F));}
+    }
+    buf.replace(buf.size() / 2 + round, 3, round % 2 ? std::string("\000\000\001", 3) : std::string("\000\000\003", 3));
+    const char *p = buf.data();
+    while (p){
+      const char *ref = refScanAnnexB(p, buf.data() + buf.size() - p);
+      if (nalu::scanAnnexB(p, buf.data() + buf.size() - p) != ref){
+        std::cerr << "scanAnnexB mismatch in large buffer round " << round << std::endl;
+        return 1;
+      }
+      p = ref ? ref + 1 : 0;
+    }
+    if (nalu::removeEmulationPrevention(buf) != refRemoveEmulationPrevention(buf)){
+      std::cerr << "removeEmulationPrevention mismatch in large buffer round " << round << std::endl;
+      return 2;
+    }
+  }
+  return 0;
+}
+
+/// Compares emulation prevention removal on a bitstream resembling compressed video.
+static int checkVideo(){
+  std::string video = videoData(1000000);
+  if (nalu::removeEmulationPrevention(video) != refRemoveEmulationPrevention(video)){
+    std::cerr << "removeEmulationPrevention mismatch in video data" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv){
+  if (argc < 2){
+    std::cerr << "Usage: " << argv[0] << " small|large|video" << std::endl;
+    return 1;
+  }
+  std::string test = argv[1];
+  if (test == "small"){return checkSmall();}
+  if (test == "large"){return checkLarge();}
+  if (test == "video"){return checkVideo();}
+  std::cerr << "Unknown test: " << test << std::endl;
+  return 1;
+}
@@ -0,0 +1,105 @@
+#include <mist/stream.h>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+
+/// Returns the next packet for the same track, simulating a track with a fixed packet interval.
+/// Every 7th track gets a ghost packet now and then, to make nonGhost() do some work.
+static Util::sortedPageInfo nextPacket(const Util::sortedPageInfo &prev){
+  Util::sortedPageInfo nxt = prev;
+  nxt.time += 10 + (prev.tid % 13) * 3;
+  nxt.offset += 1000 + prev.tid;
+  nxt.partIndex++;
+  nxt.ghostPacket = (prev.tid % 7 == 0) && (nxt.partIndex % 5 == 0);
+  return nxt;
+}
+
+static Util::sortedPageInfo firstPacket(size_t tid){
+  Util::sortedPageInfo pInfo;
+  pInfo.tid = tid;
+  pInfo.time = tid % 5;
+  pInfo.offset = 0;
+  pInfo.partIndex = 0;
+  pInfo.ghostPacket = false;
+  pInfo.unavailable = false;
+  return pInfo;
+}
+
+/// Runs the same sequence of operations against packetSorter and a plain std::set, which is what
+/// packetSorter used to be built on in sync mode, and checks both agree on every step.
+static int check(size_t tracks, size_t iterations){
+  Util::packetSorter sorter;
+  std::set<Util::sortedPageInfo> reference;
+  for (size_t i = 0; i < tracks; ++i){
+    sorter.insert(firstPacket(i + 1));
+    reference.insert(firstPacket(i + 1));
+  }
+  // Duplicates must be ignored, like std::set does
+  sorter.insert(firstPacket(1));
+  reference.insert(firstPacket(1));
+  for (size_t i = 0; i < iterations; ++i){
+    if (sorter.size() != reference.size()){
+      std::cerr << "Size mismatch at iteration " << i << ": " << sorter.size() << " != " << reference.size() << std::endl;
+      return 1;
+    }
+    const Util::sortedPageInfo &a = *sorter.begin();
+    const Util::sortedPageInfo &b = *reference.begin();
+    if (a.tid != b.tid || a.time != b.time || a.offset != b.offset){
+      std::cerr << "Order mismatch at iteration " << i << ": track " << a.tid << "@" << a.time
+                << " != track " << b.tid << "@" << b.time << std::endl;
+      return 2;
+    }
+    uint64_t refGhost = 0;
+    for (std::set<Util::sortedPageInfo>::iterator it = reference.begin(); it != reference.end(); ++it){
+      if (!it->ghostPacket && !it->unavailable){
+        refGhost = it->time;
+        break;
+      }
+    }
+    if (sorter.nonGhost() != refGhost){
+      std::cerr << "nonGhost mismatch at iteration " << i << std::endl;
+      return 3;
+    }
+    Util::sortedPageInfo nxt = nextPacket(b);
+    // Now and then, drop a track and add it back in, as happens on track selection changes
+    if (tracks > 1 && i % 1000 == 999){
+      size_t tid = 1 + (i / 1000) % tracks;
+      sorter.dropTrack(tid);
+      for (std::set<Util::sortedPageInfo>::iterator it = reference.begin(); it != reference.end(); ++it){
+        if (it->tid == tid){
+          reference.erase(it);
+          break;
+        }
+      }
+      if (sorter.hasEntry(tid)){
+        std::cerr << "Track " << tid << " still present after dropTrack" << std::endl;
+        return 4;
+      }
+      Util::sortedPageInfo back = firstPacket(tid);
+      back.time = b.time + 1;
+      sorter.insert(back);
+      reference.insert(back);
+      continue;
+    }
+    sorter.replaceFirst(nxt);
+    reference.erase(reference.begin());
+    reference.insert(nxt);
+  }
+  std::map<size_t, uint64_t> sorterList, referenceList;
+  sorter.getTrackList(sorterList);
+  for (std::set<Util::sortedPageInfo>::iterator it = reference.begin(); it != reference.end(); ++it){
+    referenceList[it->tid] = it->time;
+  }
+  if (sorterList != referenceList){
+    std::cerr << "Track list mismatch" << std::endl;
+    return 5;
+  }
+  std::cout << "Success: " << tracks << " tracks, " << iterations << " packets" << std::endl;
+  return 0;
+}
+
+/// Runs the comparison with as many tracks as given as the only argument.
+int main(int argc, char **argv){
+  size_t tracks = (argc > 1) ? atoi(argv[1]) : 8;
+  return check(tracks, 100000);
+}
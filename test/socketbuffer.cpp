@@ -2,8 +2,182 @@
 #include <iostream>
 #include <unistd.h>
 
+/// Performs random operations on a buffer, and compares the results with those on a plain string
+/// holding the same data. frontLen tracks the size of the part handed out by get().
+static int check(){
+  Socket::Buffer B;
+  std::string model;
+  size_t frontLen = 0;
+  unsigned int seed = 1;
+  for (size_t round = 0; round < 200000; ++round){
+    seed = seed * 1103515245 + 12345;
+    unsigned int r = seed >> 16;
+    size_t n = (r >> 4) % ((r & 0x100) ? 9000 : 40);
+    if (!(round % 5000)){B.splitter = (round % 10000) ? "\r\n" : "\n";}
+    switch (r % 11){
+    case 0:
+    case 1:
+    case 2:{
+      std::string data;
+      for (size_t i = 0; i < n; ++i){
+        seed = seed * 1103515245 + 12345;
+        data += "ab\r\ncd"[(seed >> 16) % 7];
+      }
+      B.append(data);
+      model += data;
+      break;
+    }
+    case 3:
+      B.skip(n);
+      model.erase(0, n);
+      frontLen = (n < frontLen) ? frontLen - n : 0;
+      break;
+    case 4:{
+      std::string ret = B.remove(n);
+      if (n <= model.size() ? ret != model.substr(0, n) : ret.size()){
+        std::cerr << "Failure: remove mismatch in round " << round << std::endl;
+        return 1;
+      }
+      if (n <= model.size()){
+        model.erase(0, n);
+        frontLen = (n < frontLen) ? frontLen - n : 0;
+      }
+      break;
+    }
+    case 5:{
+      Util::ResizeablePointer ptr;
+      size_t len = B.copy(ptr, n);
+      if (len != std::min(n, model.size()) || model.compare(0, len, ptr, len)){
+        std::cerr << "Failure: copy mismatch in round " << round << std::endl;
+        return 2;
+      }
+      break;
+    }
+    case 6:{
+      const char *v = B.view(n);
+      if ((n <= model.size()) != (v != 0) || (v && model.compare(0, n, v, n))){
+        std::cerr << "Failure: view mismatch in round " << round << std::endl;
+        return 3;
+      }
+      if (v && n > frontLen){frontLen = 0;}
+      break;
+    }
+    case 7:
+    case 8:{
+      if (!frontLen && model.size()){
+        frontLen = model.find(B.splitter);
+        frontLen = (frontLen == std::string::npos) ? model.size() : frontLen + B.splitter.size();
+      }
+      std::string &part = B.get();
+      if (part != model.substr(0, frontLen)){
+        std::cerr << "Failure: get mismatch in round " << round << std::endl;
+        return 4;
+      }
+      if (r & 0x10){
+        part.clear();
+        model.erase(0, frontLen);
+        frontLen = 0;
+      }
+      break;
+    }
+    case 9:{
+      size_t split = model.find(B.splitter);
+      split = (split == std::string::npos) ? 0 : split + B.splitter.size();
+      if (B.bytesToSplit() != split){
+        std::cerr << "Failure: bytesToSplit mismatch in round " << round << std::endl;
+        return 5;
+      }
+      break;
+    }
+    case 10:
+      if (r & 0x20){
+        B.prepend(std::string(n, 'p'));
+        model.insert(0, n, 'p');
+        frontLen = n;
+      }else{
+        if (B.getAll() != model){
+          std::cerr << "Failure: getAll mismatch in round " << round << std::endl;
+          return 6;
+        }
+        frontLen = model.size();
+      }
+      break;
+    }
+    if (B.bytes(0xFFFFFFFFul) != model.size() || !B.size() != !model.size()){
+      std::cerr << "Failure: size mismatch in round " << round << std::endl;
+      return 7;
+    }
+  }
+  std::cout << "Success!" << std::endl;
+  return 0;
+}
+
+/// Sends random sets of pieces through sendv on a non-blocking pipe that is only read from now
+/// and then, so that pieces get partially written and buffered, and compares what comes out of
+/// the pipe with the concatenated pieces. Part of the rounds are sent in chunked mode.
+static int sendvCheck(){
+  int p[2];
+  if (pipe(p)){
+    std::cerr << "Failure: Could not create pipe!" << std::endl;
+    return 1;
+  }
+  Socket::Connection C(p[1], p[1]);
+  C.setBlocking(false);
+  setFDBlocking(p[0], false);
+  C.skipBytes(5);
+  std::string expect, received;
+  unsigned int seed = 1;
+  char buf[65536];
+  for (size_t round = 0; round < 2000; ++round){
+    seed = seed * 1103515245 + 12345;
+    size_t count = (seed >> 16) % 8;
+    if (round % 10 == 9){count = 100;}
+    std::vector<struct iovec> vec(count);
+    std::vector<std::string> pieces(count);
+    std::string all;
+    for (size_t i = 0; i < count; ++i){
+      seed = seed * 1103515245 + 12345;
+      size_t len = (seed >> 16) % ((seed & 0x100) ? 20000 : 20);
+      for (size_t j = 0; j < len; ++j){pieces[i] += (char)('a' + (round + i + j) % 26);}
+      vec[i].iov_base = (void *)pieces[i].data();
+      vec[i].iov_len = len;
+      all += pieces[i];
+    }
+    bool chunked = (round % 7) == 3;
+    C.setChunkedMode(chunked);
+    C.sendv(vec.data(), count);
+    if (chunked){
+      if (all.size()){
+        snprintf(buf, sizeof(buf), "%zx\r\n", all.size());
+        expect += buf + all + "\r\n";
+      }else{
+        expect += "0\r\n\r\n";
+      }
+    }else{
+      expect += all;
+    }
+    if (round % 2 == 0){
+      ssize_t r = read(p[0], buf, sizeof(buf));
+      if (r > 0){received.append(buf, r);}
+    }
+  }
+  while (C.connected() && (C.sendingBlocked(1) || received.size() + 5 < expect.size())){
+    ssize_t r = read(p[0], buf, sizeof(buf));
+    if (r > 0){received.append(buf, r);}
+    C.send("", 0);
+  }
+  if (received != expect.substr(5)){
+    std::cerr << "Failure: received " << received.size() << " bytes, expected " << expect.size() - 5 << std::endl;
+    return 2;
+  }
+  std::cout << "Success: " << received.size() << " bytes" << std::endl;
+  return 0;
+}
+
 int main(int argc, char **argv){
   Util::printDebugLevel = 10;
+  if (argc > 1 && std::string(argv[1]) == "operations"){return check();}
+  if (argc > 1 && std::string(argv[1]) == "sendv"){return sendvCheck();}
   size_t testSize = 4*1024*1024;
   if (argc > 1){
     testSize = atoi(argv[1]);
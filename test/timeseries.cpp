@@ -0,0 +1,137 @@
+#include <mist/timeseries.h>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#define COLUMNS 8
+
+/// Fills values with the counters of a session at the given second, the way the controller sees them:
+/// mostly slowly growing counters, some constant, and an occasional reset to zero.
+static void fillSample(uint64_t *values, uint64_t sec){
+  bool reset = (sec % 97 == 0);
+  values[0] = reset ? 0 : sec;
+  values[1] = reset ? 0 : 1000;
+  values[2] = reset ? 0 : sec * 1000 + sec % 7;
+  values[3] = reset ? 0 : sec * 312500 + (sec * 7919) % 4096;
+  values[4] = reset ? 0 : sec * 1200;
+  values[5] = reset ? 0 : sec * 300;
+  values[6] = reset ? 0 : sec / 10;
+  values[7] = reset ? 0 : 0xFFFFFFFFFFFFull - sec;
+}
+
+typedef std::map<uint64_t, std::vector<uint64_t> > RefMap;
+
+/// Stores samples with gaps and replacements in both a Series and a std::map, trimming as it goes,
+/// and verifies both hold the same time range after every round.
+/// Returns the time of the last sample through sec.
+static int fill(TimeSeries::Series &S, RefMap &ref, size_t rounds, uint64_t &sec){
+  uint64_t vals[COLUMNS];
+  sec = 1000;
+  for (size_t round = 0; round < rounds; ++round){
+    // Skip some seconds now and then, and write some seconds twice
+    sec += (round % 11 == 0) ? 3 : 1;
+    fillSample(vals, sec);
+    S.append(sec, vals);
+    ref[sec].assign(vals, vals + COLUMNS);
+    if (round % 5 == 0){
+      vals[3] += 1;
+      S.append(sec, vals);
+      ref[sec].assign(vals, vals + COLUMNS);
+    }
+    if (S.append(sec - 1, vals)){
+      std::cerr << "Accepted an older sample in round " << round << std::endl;
+      return 1;
+    }
+    if (round % 50 == 49){
+      uint64_t cutOff = sec - 300;
+      S.trim(cutOff);
+      // The store may keep a few extra samples; drop the same ones from the reference
+      while (ref.size() && ref.begin()->first < S.firstTime()){ref.erase(ref.begin());}
+      if (ref.begin()->first > cutOff && ref.begin()->first != S.firstTime()){
+        std::cerr << "Trimmed too much in round " << round << std::endl;
+        return 2;
+      }
+    }
+    if (S.size() != ref.size() || S.firstTime() != ref.begin()->first || S.lastTime() != sec){
+      std::cerr << "Size or time range mismatch in round " << round << ": " << S.size() << " != " << ref.size() << std::endl;
+      return 3;
+    }
+  }
+  return 0;
+}
+
+/// Verifies point lookups return the most recent sample at or before the requested time.
+static int checkLookup(size_t rounds){
+  TimeSeries::Series S(COLUMNS);
+  RefMap ref;
+  uint64_t sec, got[COLUMNS];
+  if (int ret = fill(S, ref, rounds, sec)){return ret;}
+  for (uint64_t t = ref.begin()->first - 2; t <= sec + 2; ++t){
+    RefMap::iterator it = ref.upper_bound(t);
+    bool expect = (it != ref.begin());
+    if (S.get(t, got) != expect){
+      std::cerr << "Lookup presence mismatch at " << t << std::endl;
+      return 4;
+    }
+    if (!expect){continue;}
+    --it;
+    for (size_t i = 0; i < COLUMNS; ++i){
+      if (got[i] != it->second[i]){
+        std::cerr << "Lookup value mismatch at " << t << ", column " << i << std::endl;
+        return 5;
+      }
+    }
+  }
+  return 0;
+}
+
+/// Verifies range queries return exactly the samples within the range, in order.
+static int checkRange(size_t rounds){
+  TimeSeries::Series S(COLUMNS);
+  RefMap ref;
+  uint64_t sec;
+  if (int ret = fill(S, ref, rounds, sec)){return ret;}
+  for (uint64_t start = ref.begin()->first - 1; start <= sec + 1; start += 13){
+    uint64_t end = start + (start % 90);
+    RefMap::iterator it = ref.lower_bound(start);
+    for (TimeSeries::Cursor C(S, start, end); C; C.next()){
+      if (it == ref.end() || it->first != C.time() || it->second != std::vector<uint64_t>(C.values(), C.values() + COLUMNS)){
+        std::cerr << "Range mismatch in [" << start << ", " << end << "] at " << C.time() << std::endl;
+        return 6;
+      }
+      ++it;
+    }
+    if (it != ref.end() && it->first <= end){
+      std::cerr << "Range [" << start << ", " << end << "] ended early" << std::endl;
+      return 7;
+    }
+  }
+  return 0;
+}
+
+/// Verifies nothing is left after trimming past the last sample.
+static int checkTrim(size_t rounds){
+  TimeSeries::Series S(COLUMNS);
+  RefMap ref;
+  uint64_t sec, got[COLUMNS];
+  if (int ret = fill(S, ref, rounds, sec)){return ret;}
+  S.trim(sec + 1);
+  if (!S.empty() || S.get(sec, got) || TimeSeries::Cursor(S, 0, sec)){
+    std::cerr << "Series not empty after trimming everything" << std::endl;
+    return 8;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv){
+  if (argc < 2){
+    std::cerr << "Usage: " << argv[0] << " lookup|range|trim" << std::endl;
+    return 1;
+  }
+  std::string test = argv[1];
+  if (test == "lookup"){return checkLookup(2000);}
+  if (test == "range"){return checkRange(2000);}
+  if (test == "trim"){return checkTrim(2000);}
+  std::cerr << "Unknown test: " << test << std::endl;
+  return 1;
+}
@@ -0,0 +1,132 @@
+#include "../src/output/output_ts_base.h"
+#include <mist/http_parser.h>
+#include <mist/socket.h>
+#include <cstring>
+#include <iostream>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+/// Minimal TS output that emits through the real TSOutput::queueTS/flushTS path.
+/// If chunked is set, sendTS wraps every block in a HTTP chunk like OutHTTPTS does; otherwise
+/// it writes the blocks as-is, like a recording does.
+class TestTSOutput : public Mist::TSOutput{
+public:
+  TestTSOutput(Socket::Connection &conn, Util::Config &cfg, JSON::Value &capa, bool coalesce, bool chunked)
+    : TSOutput(conn, cfg, capa), chunked(chunked), sendCount(0){
+    coalesceTS = coalesce;
+    H.sendingChunks = chunked;
+  }
+  void sendTS(const char *tsData, size_t len = 188){
+    ++sendCount;
+    if (chunked){
+      H.Chunkify(tsData, len, myConn);
+    }else{
+      myConn.SendNow(tsData, len);
+    }
+  }
+  /// Queues a whole segment packet by packet, then flushes it as the end of a segment would.
+  void sendSegment(const std::string &seg){
+    for (size_t i = 0; i < seg.size(); i += 188){queueTS(seg.data() + i, 188);}
+    flushTS();
+    if (chunked){H.Chunkify(0, 0, myConn);}
+  }
+  HTTP::Parser H;
+  bool chunked;
+  size_t sendCount;
+};
+
+/// Builds a segment of the given amount of TS packets, each with a unique payload.
+static std::string makeSegment(size_t packets){
+  std::string seg(packets * 188, 0);
+  for (size_t i = 0; i < packets; ++i){
+    char *pkt = (char *)seg.data() + i * 188;
+    pkt[0] = 0x47;
+    for (size_t j = 4; j < 188; ++j){pkt[j] = (i + j) & 0xFF;}
+  }
+  return seg;
+}
+
+/// Reads everything from fd until it closes, and returns it.
+static std::string readAll(int fd){
+  std::string ret;
+  char buf[65536];
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0){ret.append(buf, r);}
+  return ret;
+}
+
+/// Decodes a chunked HTTP body, returning the amount of chunks through chunkCount.
+static std::string dechunk(const std::string &in, size_t &chunkCount){
+  std::string ret;
+  size_t pos = 0;
+  chunkCount = 0;
+  while (pos < in.size()){
+    size_t len = strtoul(in.c_str() + pos, 0, 16);
+    pos = in.find("\r\n", pos) + 2;
+    if (!len){break;}
+    ret.append(in, pos, len);
+    pos += len + 2;
+    ++chunkCount;
+  }
+  return ret;
+}
+
+/// Sends a segment through TestTSOutput, and verifies both the amount of blocks passed to sendTS
+/// and that the receiving side gets the segment back byte for byte.
+static int check(size_t packets, bool coalesce, bool chunked){
+  std::string seg = makeSegment(packets);
+  Util::Config cfg;
+  JSON::Value capa;
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)){
+    std::cerr << "Could not create socket pair" << std::endl;
+    return 1;
+  }
+  std::string received;
+  std::thread reader([&](){received = readAll(sv[1]);});
+  size_t sent;
+  {
+    Socket::Connection conn(sv[0], -1);
+    TestTSOutput out(conn, cfg, capa, coalesce, chunked);
+    out.sendSegment(seg);
+    sent = out.sendCount;
+    conn.close();
+  }
+  reader.join();
+  close(sv[1]);
+  size_t expectSends = coalesce ? (seg.size() + TS_COALESCE_SIZE - 1) / TS_COALESCE_SIZE : packets;
+  if (sent != expectSends){
+    std::cerr << "Expected " << expectSends << " calls to sendTS, got " << sent << std::endl;
+    return 2;
+  }
+  if (chunked){
+    size_t chunks = 0;
+    received = dechunk(received, chunks);
+    if (chunks != expectSends){
+      std::cerr << "Expected " << expectSends << " chunks, got " << chunks << std::endl;
+      return 3;
+    }
+  }
+  if (received != seg){
+    std::cerr << "Segment mismatch, " << received.size() << " != " << seg.size() << " bytes" << std::endl;
+    return 4;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv){
+  if (argc < 2){
+    std::cerr << "Usage: " << argv[0] << " plain|coalesced|chunked|coalesced_chunked" << std::endl;
+    return 1;
+  }
+  std::string test = argv[1];
+  // 2MiB worth of TS packets, a typical HLS segment
+  size_t packets = 2 * 1024 * 1024 / 188;
+  if (test == "plain"){return check(packets, false, false);}
+  if (test == "coalesced"){return check(packets, true, false);}
+  if (test == "chunked"){return check(packets, false, true);}
+  if (test == "coalesced_chunked"){return check(packets, true, true);}
+  std::cerr << "Unknown test: " << test << std::endl;
+  return 1;
+}
@@ -0,0 +1,224 @@
+#include <mist/socket.h>
+#include <mist/timing.h>
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/// Opens a plain UDP socket on a random loopback port, writing the port number to port.
+static int openReceiver(uint16_t &port){
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s == -1){return -1;}
+  int bufSize = 8 * 1024 * 1024;
+  setsockopt(s, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (bind(s, (sockaddr *)&addr, len) || getsockname(s, (sockaddr *)&addr, &len)){
+    close(s);
+    return -1;
+  }
+  port = ntohs(addr.sin_port);
+  return s;
+}
+
+/// Opens a plain UDP socket that sends to the given loopback port.
+static int openSender(uint16_t port){
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s == -1){return -1;}
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (connect(s, (sockaddr *)&addr, sizeof(addr))){
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+/// Size of test datagram number i: mostly 1316 bytes (7 TS packets), with some odd ones in between.
+static size_t datagramSize(size_t i){
+  if (i % 50 == 49){return 188;}
+  if (i % 97 == 0){return 1400;}
+  return 1316;
+}
+
+/// Queues datagrams of varying sizes with batchSend and verifies they all arrive, intact and in order.
+static int checkSend(size_t count){
+  uint16_t port;
+  int rx = openReceiver(port);
+  if (rx == -1){
+    std::cerr << "Could not open receiving socket" << std::endl;
+    return 1;
+  }
+  Socket::UDPConnection tx;
+  tx.SetDestination("127.0.0.1", port);
+  char buf[2048];
+  size_t received = 0;
+  for (size_t i = 0; i < count; ++i){
+    size_t len = datagramSize(i);
+    memset(buf, i & 0xFF, len);
+    memcpy(buf, &i, sizeof(i));
+    tx.batchSend(buf, len);
+    if (i % 100 == 99 || i + 1 == count){
+      tx.flushBatch();
+      while (received <= i){
+        int r = recv(rx, buf, sizeof(buf), MSG_DONTWAIT);
+        if (r < 0){
+          std::cerr << "Datagram " << received << " went missing" << std::endl;
+          return 2;
+        }
+        size_t seq;
+        memcpy(&seq, buf, sizeof(seq));
+        if (seq != received || (size_t)r != datagramSize(received) || (unsigned char)buf[r - 1] != (received & 0xFF)){
+          std::cerr << "Datagram " << received << " mismatch: got #" << seq << " of " << r << " bytes" << std::endl;
+          return 3;
+        }
+        ++received;
+      }
+    }
+  }
+  close(rx);
+  std::cout << "Success: " << received << " datagrams" << std::endl;
+  return 0;
+}
+
+/// Receives a datagram sent to 127.0.0.5 on a socket bound to all addresses, then queues replies
+/// with batchSend. The replies go out through the pktinfo path, so they must all arrive in order
+/// and come from 127.0.0.5 instead of the default 127.0.0.1.
+static int checkReply(size_t count){
+  Socket::UDPConnection srv;
+  uint16_t port = srv.bind(0);
+  if (!port){
+    std::cerr << "Could not bind reply socket" << std::endl;
+    return 1;
+  }
+  srv.allocateDestination();
+  int cl = socket(AF_INET, SOCK_DGRAM, 0);
+  int bufSize = 8 * 1024 * 1024;
+  setsockopt(cl, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, "127.0.0.5", &addr.sin_addr);
+  if (sendto(cl, "hi", 2, 0, (sockaddr *)&addr, sizeof(addr)) != 2){
+    std::cerr << "Could not send request" << std::endl;
+    return 1;
+  }
+  uint64_t start = Util::bootMS();
+  while (!srv.Receive()){
+    if (Util::bootMS() > start + 5000){
+      std::cerr << "Request did not arrive" << std::endl;
+      return 1;
+    }
+    Util::sleep(1);
+  }
+  char buf[2048];
+  for (size_t i = 0; i < count; ++i){
+    size_t len = datagramSize(i);
+    memset(buf, i & 0xFF, len);
+    memcpy(buf, &i, sizeof(i));
+    srv.batchSend(buf, len);
+  }
+  srv.flushBatch();
+  for (size_t received = 0; received < count; ++received){
+    sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    int r = recvfrom(cl, buf, sizeof(buf), MSG_DONTWAIT, (sockaddr *)&from, &fromLen);
+    if (r < 0){
+      std::cerr << "Reply " << received << " went missing" << std::endl;
+      return 2;
+    }
+    size_t seq;
+    memcpy(&seq, buf, sizeof(seq));
+    if (seq != received || (size_t)r != datagramSize(received)){
+      std::cerr << "Reply " << received << " mismatch: got #" << seq << " of " << r << " bytes" << std::endl;
+      return 3;
+    }
+    char src[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from.sin_addr, src, sizeof(src));
+    if (std::string(src) != "127.0.0.5"){
+      std::cerr << "Reply " << received << " came from " << src << " instead of 127.0.0.5" << std::endl;
+      return 4;
+    }
+  }
+  close(cl);
+  std::cout << "Success: " << count << " replies" << std::endl;
+  return 0;
+}
+
+/// Sends rounds of datagrams of varying sizes, and verifies batchReceive returns all of them, intact and in order.
+static int checkReceive(size_t count){
+  Socket::UDPConnection rx(true);
+  uint16_t port = rx.bind(0, "127.0.0.1");
+  int tx = openSender(port);
+  if (!port || tx == -1){
+    std::cerr << "Could not open sockets" << std::endl;
+    return 1;
+  }
+  char buf[2048];
+  size_t sent = 0, received = 0;
+  while (sent < count){
+    // Send a round of 100 datagrams, which is more than a single batch
+    for (size_t j = 0; j < 100 && sent < count; ++j, ++sent){
+      size_t len = datagramSize(sent);
+      memset(buf, sent & 0xFF, len);
+      memcpy(buf, &sent, sizeof(sent));
+      if (send(tx, buf, len, 0) != (int)len){
+        std::cerr << "Could not send datagram " << sent << std::endl;
+        return 2;
+      }
+    }
+    while (received < sent){
+      size_t num = rx.batchReceive();
+      if (!num){
+        std::cerr << "Datagram " << received << " went missing" << std::endl;
+        return 3;
+      }
+      if (rx.receivedSizes().size() != num){
+        std::cerr << "Batch of " << num << " datagrams came with " << rx.receivedSizes().size() << " sizes" << std::endl;
+        return 4;
+      }
+      const char *ptr = rx.data;
+      for (size_t j = 0; j < num; ++j){
+        size_t len = rx.receivedSizes()[j];
+        size_t seq;
+        memcpy(&seq, ptr, sizeof(seq));
+        if (seq != received || len != datagramSize(received) || (unsigned char)ptr[len - 1] != (received & 0xFF)){
+          std::cerr << "Datagram " << received << " mismatch: got #" << seq << " of " << len << " bytes" << std::endl;
+          return 5;
+        }
+        ptr += len;
+        ++received;
+      }
+      if (ptr != rx.data + rx.data.size()){
+        std::cerr << "Datagram sizes do not add up to received data size" << std::endl;
+        return 6;
+      }
+    }
+  }
+  close(tx);
+  std::cout << "Success: " << received << " datagrams" << std::endl;
+  return 0;
+}
+
+int main(int argc, char **argv){
+  if (argc < 2){
+    std::cerr << "Usage: " << argv[0] << " send|reply|receive" << std::endl;
+    return 1;
+  }
+  std::string test = argv[1];
+  if (test == "send"){return checkSend(10000);}
+  if (test == "reply"){return checkReply(1000);}
+  if (test == "receive"){return checkReceive(10000);}
+  std::cerr << "Unknown test: " << test << std::endl;
+  return 1;
+}